@@ -0,0 +1,419 @@
+//--------------------------------------------------------------------
+// Diagnostics
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>         // write()
+#include <time.h>           // clock_gettime()
+#include <pthread.h>
+#include <sys/syscall.h>    // SYS_futex
+#include <linux/futex.h>
+
+#include "diag.h"
+
+diag_policy diag_config = {
+	DIAG_INFO,             // level
+	DIAG_TEXT,             // format
+	10,                    // rate
+};
+
+static const char *diag_level_names[] = { "error", "warn", "info", "debug" };
+static const char *diag_format_names[] = { "text", "kv" };
+
+// One message in the ring (256 bytes)
+typedef struct diag_slot
+{
+	uint64_t         seq;        // pos+1 filled, pos+DIAG_SLOTS free again
+	int64_t          time_ns;    // CLOCK_MONOTONIC
+	const diag_site *site;
+	uint32_t         suppressed;
+	uint16_t         level;
+	uint16_t         reserved;
+	char             text[DIAG_TEXT_SIZE];
+} diag_slot;
+
+// Longest output line: kv escapes can double the text
+#define DIAG_LINE_SIZE  (2 * DIAG_TEXT_SIZE + 128)
+
+typedef enum {
+	DIAG_DIRECT,           // not opened: printed by the caller, text only
+	DIAG_SYNC,             // printed by the caller, formatted
+	DIAG_ASYNC,            // through the ring
+} diag_mode;
+
+//--------------------------------------------------------------------
+// Diagnostics state
+//--------------------------------------------------------------------
+// Bounded multi-producer ring (after D. Vyukov).  A producer claims
+// position pos by moving diag_head on with a compare-and-swap, fills
+// slot pos % DIAG_SLOTS and publishes it by setting its seq to pos+1.
+// The drain thread is the only consumer; it hands the slot back by
+// setting seq to pos+DIAG_SLOTS.  A producer that finds its slot not
+// yet handed back has found the ring full.
+static diag_slot  diag_ring[DIAG_SLOTS];
+static uint64_t   diag_head;        // next position to claim
+static uint64_t   diag_tail;        // next position to drain
+static uint32_t   diag_futex;       // changes on every message
+static uint32_t   diag_waiting;     // drain thread is asleep
+static int        diag_stop;
+static int        diag_mode_now = DIAG_DIRECT;
+static pthread_t  diag_thread;
+static diag_stats diag_counters;
+static char       diag_out[8192];   // drain thread output buffer
+static int        diag_out_len;
+
+//--------------------------------------------------------------------
+//  diag_level_name()
+//--------------------------------------------------------------------
+const char *diag_level_name( int level )
+{
+	if( (level < DIAG_ERROR) || (level > DIAG_DEBUG) ) {
+		return "?";
+	}
+	return diag_level_names[level];
+}
+
+//--------------------------------------------------------------------
+//  diag_level_lookup()
+//  returns:
+//      diag_level for name, -1 if unknown
+//--------------------------------------------------------------------
+int diag_level_lookup( const char *name )
+{
+	for( int i = DIAG_ERROR; i <= DIAG_DEBUG; i++ ) {
+		if( !strcmp( name, diag_level_names[i] ) ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  diag_format_lookup()
+//  returns:
+//      diag_format for name, -1 if unknown
+//--------------------------------------------------------------------
+int diag_format_lookup( const char *name )
+{
+	for( int i = DIAG_TEXT; i <= DIAG_KV; i++ ) {
+		if( !strcmp( name, diag_format_names[i] ) ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  diag_now_ns()
+//--------------------------------------------------------------------
+static int64_t diag_now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//--------------------------------------------------------------------
+//  diag_count()
+//--------------------------------------------------------------------
+static void diag_count( uint64_t *counter )
+{
+	__atomic_fetch_add( counter, 1, __ATOMIC_RELAXED );
+}
+
+//--------------------------------------------------------------------
+//  diag_format_line()
+//      One output line, newline included, truncated to fit
+//  returns:
+//      bytes in out
+//--------------------------------------------------------------------
+static int diag_format_line( char *out, int size, int level, int64_t time_ns,
+							 const diag_site *site, uint32_t suppressed, const char *text )
+{
+	unsigned long long sec = time_ns / 1000000000;
+	unsigned long long usec = (time_ns % 1000000000) / 1000;
+	const char *file = strrchr( site->file, '/' );
+	int n;
+
+	file = (file != NULL) ? file + 1 : site->file;
+	if( diag_config.format == DIAG_KV )
+	{
+		n = snprintf( out, size, "ts=%llu.%06llu level=%s src=%s:%d msg=\"",
+					  sec, usec, diag_level_name( level ), file, site->line );
+		for( const char *c = text; *c && (n < size - 2); c++ ) {
+			if( (*c == '"') || (*c == '\\') ) {
+				out[n++] = '\\';
+			}
+			if( n < size - 2 ) {
+				out[n++] = ((unsigned char)*c < ' ') ? ' ' : *c;
+			}
+		}
+		if( n < size ) {
+			n += snprintf( out + n, size - n, "\"" );
+		}
+		if( suppressed && (n < size) ) {
+			n += snprintf( out + n, size - n, " suppressed=%u", suppressed );
+		}
+	}
+	else
+	{
+		n = snprintf( out, size, "%llu.%06llu %-5s %s", sec, usec, diag_level_name( level ), text );
+		if( suppressed && (n < size) ) {
+			n += snprintf( out + n, size - n, " (%u more suppressed)", suppressed );
+		}
+	}
+	if( n > size - 1 ) {
+		n = size - 1;
+	}
+	out[n++] = '\n';
+	return n;
+}
+
+//--------------------------------------------------------------------
+//  diag_write_out()
+//      Drain thread: the only place that may block on the output
+//--------------------------------------------------------------------
+static void diag_write_out( const char *data, int len )
+{
+	while( len > 0 )
+	{
+		ssize_t n = write( STDOUT_FILENO, data, len );
+		if( n == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			diag_count( &diag_counters.write_errors );
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+//--------------------------------------------------------------------
+//  diag_out_line()
+//      Drain thread: add a line to the output buffer, writing the
+//      buffer out first when the line might not fit
+//--------------------------------------------------------------------
+static void diag_out_line( int level, int64_t time_ns, const diag_site *site,
+						   uint32_t suppressed, const char *text )
+{
+	if( diag_out_len > (int)sizeof(diag_out) - DIAG_LINE_SIZE ) {
+		diag_write_out( diag_out, diag_out_len );
+		diag_out_len = 0;
+	}
+	diag_out_len += diag_format_line( diag_out + diag_out_len, DIAG_LINE_SIZE, level,
+									  time_ns, site, suppressed, text );
+}
+
+//--------------------------------------------------------------------
+//  diag_msg()
+//      Made by DIAG().  Never waits in async mode, and leaves errno as
+//      it found it.
+//--------------------------------------------------------------------
+void diag_msg( diag_site *site, int level, const char *fmt, ... )
+{
+	int saved_errno = errno;
+	int64_t now = diag_now_ns();
+	int64_t second = now / 1000000000;
+	uint32_t suppressed;
+	char text[DIAG_TEXT_SIZE];
+	char line[DIAG_LINE_SIZE];
+	va_list ap;
+
+	if( diag_config.rate > 0 )
+	{
+		if( site->second != second ) {
+			site->second = second;
+			site->count = 0;
+		}
+		if( ++site->count > diag_config.rate ) {
+			++site->suppressed;
+			diag_count( &diag_counters.suppressed );
+			errno = saved_errno;
+			return;
+		}
+	}
+	suppressed = site->suppressed;
+	site->suppressed = 0;
+
+	if( __atomic_load_n( &diag_mode_now, __ATOMIC_ACQUIRE ) != DIAG_ASYNC )
+	{
+		va_start( ap, fmt );
+		vsnprintf( text, sizeof(text), fmt, ap );
+		va_end( ap );
+		diag_count( &diag_counters.messages );
+		if( diag_mode_now == DIAG_SYNC ) {
+			int n = diag_format_line( line, sizeof(line), level, now, site, suppressed, text );
+			fwrite( line, 1, n, stdout );
+		} else if( suppressed ) {
+			fprintf( (level == DIAG_ERROR) ? stderr : stdout, "%s (%u more suppressed)\n", text, suppressed );
+		} else {
+			fprintf( (level == DIAG_ERROR) ? stderr : stdout, "%s\n", text );
+		}
+		errno = saved_errno;
+		return;
+	}
+
+	// Claim a slot
+	uint64_t pos = __atomic_load_n( &diag_head, __ATOMIC_RELAXED );
+	diag_slot *slot;
+	for( ;; )
+	{
+		slot = &diag_ring[pos % DIAG_SLOTS];
+		int64_t dif = (int64_t)(__atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) - pos);
+		if( dif == 0 ) {
+			if( __atomic_compare_exchange_n( &diag_head, &pos, pos + 1, 0,
+											 __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+				break;
+			}
+		} else if( dif < 0 ) {
+			diag_count( &diag_counters.dropped );    // full
+			errno = saved_errno;
+			return;
+		} else {
+			pos = __atomic_load_n( &diag_head, __ATOMIC_RELAXED );
+		}
+	}
+
+	slot->time_ns = now;
+	slot->site = site;
+	slot->suppressed = suppressed;
+	slot->level = level;
+	va_start( ap, fmt );
+	vsnprintf( slot->text, sizeof(slot->text), fmt, ap );
+	va_end( ap );
+	__atomic_store_n( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+	diag_count( &diag_counters.messages );
+
+	__atomic_fetch_add( &diag_futex, 1, __ATOMIC_RELEASE );
+	if( __atomic_load_n( &diag_waiting, __ATOMIC_ACQUIRE ) ) {
+		syscall( SYS_futex, &diag_futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+	}
+	errno = saved_errno;
+}
+
+//--------------------------------------------------------------------
+//  diag_ready()
+//      Drain thread: the next slot is filled
+//--------------------------------------------------------------------
+static int diag_ready( void )
+{
+	diag_slot *slot = &diag_ring[diag_tail % DIAG_SLOTS];
+	return __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) == diag_tail + 1;
+}
+
+//--------------------------------------------------------------------
+//  diag_main()
+//      Drain thread.  Everything ready goes out in as few writes as
+//      the buffer allows, then it sleeps until a message is made.  The
+//      nap only bounds how late the stop is noticed.
+//--------------------------------------------------------------------
+static void *diag_main( void *arg )
+{
+	uint64_t dropped_seen = 0;
+	struct timespec nap = { 0, 200000000 };
+	static const diag_site self = { __FILE__, __LINE__ };
+
+	for( ;; )
+	{
+		while( diag_ready() )
+		{
+			diag_slot *slot = &diag_ring[diag_tail % DIAG_SLOTS];
+			diag_out_line( slot->level, slot->time_ns, slot->site, slot->suppressed, slot->text );
+			__atomic_store_n( &slot->seq, diag_tail + DIAG_SLOTS, __ATOMIC_RELEASE );
+			++diag_tail;
+		}
+
+		uint64_t dropped = __atomic_load_n( &diag_counters.dropped, __ATOMIC_RELAXED );
+		if( dropped != dropped_seen ) {
+			char text[64];
+			snprintf( text, sizeof(text), "%llu messages dropped, ring full",
+					  (unsigned long long)(dropped - dropped_seen) );
+			diag_out_line( DIAG_WARN, diag_now_ns(), &self, 0, text );
+			dropped_seen = dropped;
+		}
+		if( diag_out_len > 0 ) {
+			diag_write_out( diag_out, diag_out_len );
+			diag_out_len = 0;
+		}
+
+		// Sleep unless a message came in since the ring was last checked
+		uint32_t v = __atomic_load_n( &diag_futex, __ATOMIC_ACQUIRE );
+		__atomic_store_n( &diag_waiting, 1, __ATOMIC_SEQ_CST );
+		if( !diag_ready() ) {
+			if( __atomic_load_n( &diag_stop, __ATOMIC_ACQUIRE ) ) {
+				break;
+			}
+			syscall( SYS_futex, &diag_futex, FUTEX_WAIT_PRIVATE, v, &nap, NULL, 0 );
+		}
+		__atomic_store_n( &diag_waiting, 0, __ATOMIC_RELAXED );
+	}
+	return NULL;
+}
+
+//--------------------------------------------------------------------
+//  diag_open()
+//      Start writing messages with level and timestamp.  sync prints
+//      them from the caller, otherwise they go through the ring.
+//  returns:
+//       0  success
+//      -1  drain thread could not be started (sync from now on)
+//--------------------------------------------------------------------
+int diag_open( int sync )
+{
+	// What stdio holds goes out before the first message
+	fflush( stdout );
+	memset( &diag_counters, 0, sizeof(diag_counters) );
+	if( sync ) {
+		diag_mode_now = DIAG_SYNC;
+		return 0;
+	}
+
+	for( int i = 0; i < DIAG_SLOTS; i++ ) {
+		diag_ring[i].seq = i;
+	}
+	diag_head = 0;
+	diag_tail = 0;
+	diag_out_len = 0;
+	diag_stop = 0;
+	if( pthread_create( &diag_thread, NULL, diag_main, NULL ) != 0 ) {
+		diag_mode_now = DIAG_SYNC;
+		return -1;
+	}
+	__atomic_store_n( &diag_mode_now, DIAG_ASYNC, __ATOMIC_RELEASE );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  diag_close()
+//      Write out what is queued and stop the thread.  Messages made
+//      after this are printed directly.
+//--------------------------------------------------------------------
+void diag_close( void )
+{
+	if( diag_mode_now != DIAG_ASYNC ) {
+		diag_mode_now = DIAG_DIRECT;
+		fflush( stdout );
+		return;
+	}
+	__atomic_store_n( &diag_mode_now, DIAG_DIRECT, __ATOMIC_RELEASE );
+	__atomic_store_n( &diag_stop, 1, __ATOMIC_RELEASE );
+	__atomic_fetch_add( &diag_futex, 1, __ATOMIC_RELEASE );
+	syscall( SYS_futex, &diag_futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+	pthread_join( diag_thread, NULL );
+}
+
+//--------------------------------------------------------------------
+//  diag_get_stats()
+//--------------------------------------------------------------------
+void diag_get_stats( diag_stats *s )
+{
+	s->messages = __atomic_load_n( &diag_counters.messages, __ATOMIC_RELAXED );
+	s->suppressed = __atomic_load_n( &diag_counters.suppressed, __ATOMIC_RELAXED );
+	s->dropped = __atomic_load_n( &diag_counters.dropped, __ATOMIC_RELAXED );
+	s->write_errors = __atomic_load_n( &diag_counters.write_errors, __ATOMIC_RELAXED );
+}
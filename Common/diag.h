@@ -0,0 +1,98 @@
+
+//--------------------------------------------------------------------
+// Diagnostics
+//--------------------------------------------------------------------
+// Leveled diagnostic messages that never block the caller.  printem's
+// output goes to a pipe (journald under systemd); a printf() into a
+// full pipe stalls whoever calls it, and most messages are made on the
+// serial reply path.  DIAG() formats the message into a slot of a
+// lock-free ring and returns; a background thread drains the ring to
+// stdout.  With the ring full the message is dropped and counted, the
+// caller never waits.
+//
+// Every message carries its level, the monotonic time it was made and
+// its call site.  Each call site is rate limited on its own: past
+// diag_config.rate messages in one second the rest of that second are
+// suppressed, and the next one through says how many were.  Output is
+// plain text, or key=value pairs for log collectors:
+//
+//     12.345678 warn  Client Report Request 7 timed out
+//     ts=12.345678 level=warn src=requests.c:255 msg="Client ..."
+//
+// A program that never calls diag_open() (the client tools) gets each
+// message printed straight away as before, errors on stderr.  printem
+// under -d opens in sync mode so messages stay in order with its dumps.
+//--------------------------------------------------------------------
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdint.h>
+#include <string.h>     // strerror() for DIAG_ERRNO
+#include <errno.h>
+
+#define DIAG_SLOTS      256      // power of 2
+#define DIAG_TEXT_SIZE  224      // message text, slot is 256 bytes
+
+typedef enum {
+	DIAG_ERROR,
+	DIAG_WARN,
+	DIAG_INFO,
+	DIAG_DEBUG,
+} diag_level;
+
+typedef enum {
+	DIAG_TEXT,
+	DIAG_KV,
+} diag_format;
+
+typedef struct diag_policy
+{
+	int level;             // diag_level, messages above it are discarded
+	int format;            // diag_format
+	int rate;              // messages per second per call site (0 = no limit)
+} diag_policy;
+
+// One call site, made by DIAG().  A site is normally only reached from
+// one thread; two racing on it can only miscount the rate.
+typedef struct diag_site
+{
+	const char *file;
+	int         line;
+	int64_t     second;      // monotonic second of the current count
+	int         count;       // messages in that second
+	uint32_t    suppressed;  // not yet reported
+} diag_site;
+
+// Counters since diag_open()
+typedef struct diag_stats
+{
+	uint64_t messages;       // put in the ring or printed
+	uint64_t suppressed;     // rate limited
+	uint64_t dropped;        // ring full
+	uint64_t write_errors;   // output lost by the drain thread
+} diag_stats;
+
+extern diag_policy diag_config;
+
+#define DIAG( lvl, ... ) \
+	do { \
+		static diag_site diag_site_ = { __FILE__, __LINE__ }; \
+		if( (lvl) <= diag_config.level ) { \
+			diag_msg( &diag_site_, (lvl), __VA_ARGS__ ); \
+		} \
+	} while( 0 )
+
+// perror() replacement: "what: strerror(errno)"
+#define DIAG_ERRNO( lvl, what )  DIAG( (lvl), "%s: %s", (what), strerror( errno ) )
+
+const char *diag_level_name( int level );
+int diag_level_lookup( const char *name );
+int diag_format_lookup( const char *name );
+
+void diag_msg( diag_site *site, int level, const char *fmt, ... )
+	__attribute__(( format( printf, 3, 4 ) ));
+int diag_open( int sync );
+void diag_close( void );
+void diag_get_stats( diag_stats *s );
+
+#endif
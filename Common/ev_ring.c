@@ -0,0 +1,275 @@
+
+//--------------------------------------------------------------------
+// Event Ring
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>          // O_* constants
+#include <unistd.h>         // ftruncate(), close(), getpid()
+#include <time.h>           // struct timespec
+#include <sys/mman.h>       // shm_open(), mmap()
+#include <sys/stat.h>       // fstat()
+#include <sys/syscall.h>    // SYS_futex
+#include <linux/futex.h>
+
+#include "ev_ring.h"
+
+#define EVR_SIZE (sizeof(evr_header) + EVR_SLOTS * sizeof(evr_slot))
+
+//--------------------------------------------------------------------
+//  evr_map()
+//  returns:
+//      mapping of the whole ring
+//      NULL  failure
+//--------------------------------------------------------------------
+static void *evr_map( int fd, size_t size )
+{
+	void *p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+//                            W r i t e r
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+
+//--------------------------------------------------------------------
+//  evw_open()
+//      Create the ring.  A ring left by an earlier run is replaced;
+//      readers still mapping it notice with evr_replaced().
+//  returns:
+//       0  success
+//      -1  failure (with errno set)
+//--------------------------------------------------------------------
+int evw_open( evr_writer *w, const char *name )
+{
+	memset( w, 0, sizeof(*w) );
+	w->size = EVR_SIZE;
+
+	shm_unlink( name );
+	w->fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666 );
+	if( w->fd == -1 ) {
+		return -1;
+	}
+	// Readers register as waiters, so they need write access too
+	fchmod( w->fd, 0666 );
+	if(    (ftruncate( w->fd, w->size ) == -1)
+		|| ((w->hdr = (evr_header *)evr_map( w->fd, w->size )) == NULL) ) {
+		close( w->fd );
+		shm_unlink( name );
+		w->fd = -1;
+		return -1;
+	}
+	w->slots = (evr_slot *)(w->hdr + 1);
+
+	// ftruncate() zero filled it: every lock is 0, no event yet
+	w->hdr->version = EVR_VERSION;
+	w->hdr->slot_size = sizeof(evr_slot);
+	w->hdr->n_slots = EVR_SLOTS;
+	w->hdr->writer_pid = getpid();
+	__atomic_store_n( &w->hdr->magic, EVR_MAGIC, __ATOMIC_RELEASE );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  evw_begin()
+//      Slot for the next event, locked for writing.  The caller fills
+//      it in and calls evw_commit().
+//--------------------------------------------------------------------
+evr_slot *evw_begin( evr_writer *w )
+{
+	uint64_t seq = w->hdr->write_seq;    // only the writer changes it
+	evr_slot *slot = &w->slots[seq & (EVR_SLOTS - 1)];
+
+	__atomic_store_n( &slot->lock, 2 * seq + 1, __ATOMIC_RELAXED );
+	// The odd lock must be visible before any of the new contents
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	return slot;
+}
+
+//--------------------------------------------------------------------
+//  evw_commit()
+//      Publish the slot from evw_begin()
+//--------------------------------------------------------------------
+void evw_commit( evr_writer *w )
+{
+	uint64_t seq = w->hdr->write_seq;
+	evr_slot *slot = &w->slots[seq & (EVR_SLOTS - 1)];
+
+	__atomic_store_n( &slot->lock, 2 * seq + 2, __ATOMIC_RELEASE );
+	__atomic_store_n( &w->hdr->write_seq, seq + 1, __ATOMIC_SEQ_CST );
+
+	// Pairs with evr_wait(): a reader registers, then checks write_seq
+	if( __atomic_load_n( &w->hdr->waiters, __ATOMIC_SEQ_CST ) != 0 ) {
+		__atomic_add_fetch( &w->hdr->futex, 1, __ATOMIC_SEQ_CST );
+		syscall( SYS_futex, &w->hdr->futex, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0 );
+	}
+}
+
+//--------------------------------------------------------------------
+//  evw_close()
+//--------------------------------------------------------------------
+void evw_close( evr_writer *w, const char *name )
+{
+	if( w->hdr == NULL ) {
+		return;
+	}
+	munmap( w->hdr, w->size );
+	close( w->fd );
+	shm_unlink( name );
+	w->hdr = NULL;
+	w->fd = -1;
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+//                            R e a d e r
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+
+//--------------------------------------------------------------------
+//  evr_open()
+//      Attach to the ring.  Reading starts with the next event written.
+//  returns:
+//       0  success
+//      -1  no ring (printem not running) or not a ring of this version
+//--------------------------------------------------------------------
+int evr_open( evr_reader *r, const char *name )
+{
+	struct stat sb;
+
+	memset( r, 0, sizeof(*r) );
+	r->hdr = NULL;
+	r->fd = shm_open( name, O_RDWR | O_CLOEXEC, 0 );
+	if( r->fd == -1 ) {
+		return -1;
+	}
+	if(    (fstat( r->fd, &sb ) == -1) || ((size_t)sb.st_size < sizeof(evr_header))
+		|| ((r->hdr = (evr_header *)evr_map( r->fd, sb.st_size )) == NULL) ) {
+		close( r->fd );
+		r->fd = -1;
+		return -1;
+	}
+	r->size = sb.st_size;
+	if(    (__atomic_load_n( &r->hdr->magic, __ATOMIC_ACQUIRE ) != EVR_MAGIC)
+		|| (r->hdr->version != EVR_VERSION) || (r->hdr->slot_size != sizeof(evr_slot))
+		|| (r->hdr->n_slots != EVR_SLOTS) || (r->size < EVR_SIZE) ) {
+		evr_close( r );
+		return -1;
+	}
+	r->slots = (evr_slot *)(r->hdr + 1);
+	r->next = __atomic_load_n( &r->hdr->write_seq, __ATOMIC_ACQUIRE );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  evr_next()
+//      Copy out the next event
+//  returns:
+//       1  event in *ev
+//       0  none yet
+//--------------------------------------------------------------------
+int evr_next( evr_reader *r, evr_event *ev )
+{
+	for( ;; )
+	{
+		uint64_t w = __atomic_load_n( &r->hdr->write_seq, __ATOMIC_ACQUIRE );
+		if( r->next >= w ) {
+			return 0;
+		}
+
+		// Overrun: the writer has lapped us.  Move up to the oldest event
+		// still in the ring.
+		if( w - r->next > EVR_SLOTS ) {
+			r->lost += w - EVR_SLOTS - r->next;
+			r->next = w - EVR_SLOTS;
+		}
+
+		evr_slot *slot = &r->slots[r->next & (EVR_SLOTS - 1)];
+		uint64_t want = 2 * r->next + 2;
+		uint64_t lock = __atomic_load_n( &slot->lock, __ATOMIC_ACQUIRE );
+		if( lock == want ) {
+			memcpy( &ev->slot, slot, sizeof(*slot) );
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &slot->lock, __ATOMIC_RELAXED ) == want ) {
+				ev->seq = r->next++;
+				ev->lost = r->lost;
+				r->lost = 0;
+				return 1;
+			}
+		}
+		// Overwritten before or while we copied it
+		++r->lost;
+		++r->next;
+	}
+}
+
+//--------------------------------------------------------------------
+//  evr_wait()
+//      Sleep until an event is written or timeout_ms passes (-1 no
+//      timeout).  Returns at once if one is already there.
+//  returns:
+//       1  event ready
+//       0  timed out
+//--------------------------------------------------------------------
+int evr_wait( evr_reader *r, int timeout_ms )
+{
+	struct timespec ts, *tsp = NULL;
+	uint32_t f;
+
+	if( __atomic_load_n( &r->hdr->write_seq, __ATOMIC_ACQUIRE ) > r->next ) {
+		return 1;
+	}
+	if( timeout_ms >= 0 ) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	__atomic_add_fetch( &r->hdr->waiters, 1, __ATOMIC_SEQ_CST );
+	f = __atomic_load_n( &r->hdr->futex, __ATOMIC_SEQ_CST );
+	if( __atomic_load_n( &r->hdr->write_seq, __ATOMIC_SEQ_CST ) <= r->next ) {
+		syscall( SYS_futex, &r->hdr->futex, FUTEX_WAIT, f, tsp, NULL, 0 );
+	}
+	__atomic_sub_fetch( &r->hdr->waiters, 1, __ATOMIC_SEQ_CST );
+
+	return (__atomic_load_n( &r->hdr->write_seq, __ATOMIC_ACQUIRE ) > r->next) ? 1 : 0;
+}
+
+//--------------------------------------------------------------------
+//  evr_replaced()
+//      A restarted printem makes a new ring; the one mapped stays valid
+//      but is never written again.  Worth asking after a quiet spell.
+//  returns:
+//       1  the ring under name is another one (or gone): reopen
+//       0  still the current ring
+//--------------------------------------------------------------------
+int evr_replaced( evr_reader *r, const char *name )
+{
+	struct stat now, ours;
+	int fd, rv = 1;
+
+	fd = shm_open( name, O_RDONLY | O_CLOEXEC, 0 );
+	if( fd == -1 ) {
+		return 1;
+	}
+	if(    (fstat( fd, &now ) == 0) && (fstat( r->fd, &ours ) == 0)
+		&& (now.st_ino == ours.st_ino) ) {
+		rv = 0;
+	}
+	close( fd );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  evr_close()
+//--------------------------------------------------------------------
+void evr_close( evr_reader *r )
+{
+	if( r->hdr != NULL ) {
+		munmap( r->hdr, r->size );
+		r->hdr = NULL;
+	}
+	if( r->fd != -1 ) {
+		close( r->fd );
+		r->fd = -1;
+	}
+}
@@ -0,0 +1,103 @@
+
+//--------------------------------------------------------------------
+// Event Ring
+//--------------------------------------------------------------------
+// printem's parser events in POSIX shared memory, for local consumers
+// that want every event at a rate message-per-event IPC can't carry.
+//
+//   /dev/shm/printem-events      evr_header, then n_slots evr_slot
+//
+// There is one writer (the parser) and any number of readers, none of
+// which the writer knows about.  Every event gets the next sequence
+// number and goes into slot seq % n_slots, overwriting what was there.
+// A slot's lock is 2*seq+1 while it is written and 2*seq+2 once it is
+// complete, so a reader that copies a slot and then finds its lock
+// unchanged knows the copy is whole and is the event it wanted.  A
+// reader that falls more than n_slots behind is moved up to the oldest
+// event still in the ring; the events it missed are counted in the
+// next event it gets (lost).  The writer never waits for a reader.
+//
+// Reading costs no system call while there are events to read.  A
+// reader with nothing to do may sleep in evr_wait(); it registers in
+// waiters so the writer only makes the wake-up call when someone is
+// asleep.
+//--------------------------------------------------------------------
+#include <stdint.h>
+
+#define EVR_NAME        "/printem-events"
+#define EVR_MAGIC       0x56455250   // "PREV"
+#define EVR_VERSION     1
+#define EVR_SLOTS       1024         // power of 2
+#define EVR_DATA_SIZE   256
+
+// Decoded reading not present
+#define EVR_NO_READING  INT16_MIN
+
+typedef struct evr_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;      // sizeof(evr_slot)
+	uint32_t n_slots;
+	uint32_t writer_pid;
+	uint64_t write_seq;      // next sequence number to be written
+	uint32_t futex;          // changes on every event while waiters
+	uint32_t waiters;        // readers asleep in evr_wait()
+	uint8_t  reserved[32];   // header is one cache line
+} evr_header;
+
+// One event (320 bytes)
+typedef struct evr_slot
+{
+	uint64_t lock;           // 2*seq+1 writing, 2*seq+2 complete
+	int64_t  time_us;        // when the parser saw it, us since the epoch
+	int64_t  record_time;    // log records: the record's own timestamp, else 0
+	uint16_t event;          // PP_EV_* (pe_proto.h)
+	uint16_t kind;           // log records: hs_event_type (hist_store.h)
+	uint16_t len;            // data bytes
+	int16_t  reading_a;      // readings: refractometer A in 0.1%, or
+	int16_t  reading_b;      //   EVR_NO_READING
+	uint16_t reserved1;
+	uint32_t reserved2;
+	uint8_t  data[EVR_DATA_SIZE];  // raw frame as seen on the bus
+	uint8_t  reserved3[24];
+} evr_slot;
+
+// A reader's copy of an event
+typedef struct evr_event
+{
+	uint64_t seq;
+	uint64_t lost;           // events skipped just before this one
+	evr_slot slot;
+} evr_event;
+
+typedef struct evr_writer
+{
+	int         fd;
+	evr_header *hdr;
+	evr_slot   *slots;
+	size_t      size;
+} evr_writer;
+
+typedef struct evr_reader
+{
+	int         fd;
+	evr_header *hdr;
+	evr_slot   *slots;
+	size_t      size;
+	uint64_t    next;        // sequence number of the next event to read
+	uint64_t    lost;        // skipped, not yet reported
+} evr_reader;
+
+// Writer (printem)
+int evw_open( evr_writer *w, const char *name );
+evr_slot *evw_begin( evr_writer *w );
+void evw_commit( evr_writer *w );
+void evw_close( evr_writer *w, const char *name );
+
+// Readers
+int evr_open( evr_reader *r, const char *name );
+int evr_next( evr_reader *r, evr_event *ev );
+int evr_wait( evr_reader *r, int timeout_ms );
+int evr_replaced( evr_reader *r, const char *name );
+void evr_close( evr_reader *r );
@@ -0,0 +1,527 @@
+
+//--------------------------------------------------------------------
+// History Store
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>     // malloc(), qsort()
+#include <string.h>
+#include <fcntl.h>      // open()
+#include <unistd.h>     // pread(), pwrite(), close()
+#include <sys/stat.h>   // fstat()
+#include <sys/mman.h>   // mmap()
+
+#include "hist_store.h"
+
+//--------------------------------------------------------------------
+// Event type table
+//     Searched in order, first keyword found in the event text wins.
+//     DIVERT comes first so every diverting event is found under it,
+//     and "LO/DIF: Details" must be tested before "DIF:".
+//--------------------------------------------------------------------
+typedef struct hs_event_def
+{
+	int         type;
+	const char *name;
+	const char *keyword;
+} hs_event_def;
+
+static const hs_event_def hs_events[] = {
+	{ HS_EVT_DIVERT,     "DIVERT",     "DIVERT"        },
+	{ HS_EVT_POWER_FAIL, "POWER_FAIL", "POWER FAILING" },
+	{ HS_EVT_POWER_ON,   "POWER_ON",   "Power ON"      },
+	{ HS_EVT_RESET,      "RESET",      ": RESET"       },
+	{ HS_EVT_DV_FAILURE, "DV_FAILURE", "D-V:"          },
+	{ HS_EVT_CONSOLE,    "CONSOLE",    "CONSOLE:"      },
+	{ HS_EVT_SUPPLY,     "SUPPLY",     "PS1:"          },
+	{ HS_EVT_DETAILS,    "DETAILS",    "Details"       },
+	{ HS_EVT_DIFFERENCE, "DIFFERENCE", "DIF:"          },
+	{ HS_EVT_MALFUNC,    "MALFUNC",    "MALFUNC:"      },
+	{ HS_EVT_OUTPUT,     "OUTPUT",     "AOP:"          },
+	{ HS_EVT_OUTPUT,     "OUTPUT",     "BOP:"          },
+	{ HS_EVT_LOW,        "LOW",        "LO%:"          },
+	{ HS_EVT_GATE,       "GATE",       "Gat"           },
+	{ HS_EVT_SM,         "SM",         "S/M:"          },
+};
+#define HS_NUM_EVENTS (sizeof(hs_events) / sizeof(hs_events[0]))
+
+//--------------------------------------------------------------------
+//  hs_event_classify()
+//      text is the whole record text, timestamp included
+//--------------------------------------------------------------------
+hs_event_type hs_event_classify( const char *text )
+{
+	for( size_t i = 0; i < HS_NUM_EVENTS; i++ ) {
+		if( strstr( text, hs_events[i].keyword ) != NULL ) {
+			return (hs_event_type)hs_events[i].type;
+		}
+	}
+	return HS_EVT_OTHER;
+}
+
+//--------------------------------------------------------------------
+//  hs_event_name()
+//--------------------------------------------------------------------
+const char *hs_event_name( int type )
+{
+	for( size_t i = 0; i < HS_NUM_EVENTS; i++ ) {
+		if( hs_events[i].type == type ) {
+			return hs_events[i].name;
+		}
+	}
+	return "OTHER";
+}
+
+//--------------------------------------------------------------------
+//  hs_event_lookup()
+//  returns:
+//      event type for name
+//      -1 unknown name
+//--------------------------------------------------------------------
+int hs_event_lookup( const char *name )
+{
+	if( !strcasecmp( name, "OTHER" ) ) {
+		return HS_EVT_OTHER;
+	}
+	for( size_t i = 0; i < HS_NUM_EVENTS; i++ ) {
+		if( !strcasecmp( hs_events[i].name, name ) ) {
+			return hs_events[i].type;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  hs_make_record()
+//--------------------------------------------------------------------
+void hs_make_record( hs_record *r, int64_t time, uint64_t hash, const char *text )
+{
+	size_t len = strlen( text );
+
+	memset( r, 0, sizeof(*r) );
+	if( len > HS_TEXT_SIZE ) {
+		len = HS_TEXT_SIZE;
+	}
+	r->time = time;
+	r->hash = hash;
+	r->type = hs_event_classify( text );
+	r->text_len = len;
+	memcpy( r->text, text, len );
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+//                         W r i t e r
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+
+//--------------------------------------------------------------------
+//  hs_entry_compare()
+//      qsort() order for index entries: time, then record number
+//--------------------------------------------------------------------
+static int hs_entry_compare( const void *a, const void *b )
+{
+	const hs_index_entry *ea = (const hs_index_entry *)a;
+	const hs_index_entry *eb = (const hs_index_entry *)b;
+
+	if( ea->time != eb->time ) {
+		return (ea->time < eb->time) ? -1 : 1;
+	}
+	return (ea->rec < eb->rec) ? -1 : (ea->rec > eb->rec);
+}
+
+//--------------------------------------------------------------------
+//  hs_header_read()
+//      Read the header of fd, initializing a new file if empty
+//  returns:
+//       0  success
+//      -1  failure or foreign file
+//--------------------------------------------------------------------
+static int hs_header_read( int fd, hs_header *h, uint32_t magic, uint16_t entry_size )
+{
+	ssize_t n = pread( fd, h, sizeof(*h), 0 );
+
+	if( n == 0 ) {
+		memset( h, 0, sizeof(*h) );
+		h->magic = magic;
+		h->version = HS_VERSION;
+		h->entry_size = entry_size;
+		return (pwrite( fd, h, sizeof(*h), 0 ) == sizeof(*h)) ? 0 : -1;
+	}
+	if(    (n != sizeof(*h)) || (h->magic != magic)
+		|| (h->version != HS_VERSION) || (h->entry_size != entry_size) ) {
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  hs_index_write()
+//      Replace an index file with a sorted set of entries
+//--------------------------------------------------------------------
+static int hs_index_write( const char *path, hs_index_entry *e, uint32_t n, uint32_t covered )
+{
+	char tmp_path[HS_PATH_SIZE + 4];
+	hs_header h;
+	int fd, rv = 0;
+
+	qsort( e, n, sizeof(*e), hs_entry_compare );
+
+	snprintf( tmp_path, sizeof(tmp_path), "%s.tmp", path );
+	fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd == -1 ) {
+		return -1;
+	}
+	memset( &h, 0, sizeof(h) );
+	h.magic = HS_INDEX_MAGIC;
+	h.version = HS_VERSION;
+	h.entry_size = sizeof(hs_index_entry);
+	h.count = n;
+	h.covered = covered;
+	if(    (write( fd, &h, sizeof(h) ) != sizeof(h))
+		|| (write( fd, e, n * sizeof(*e) ) != (ssize_t)(n * sizeof(*e))) ) {
+		rv = -1;
+	}
+	if( close( fd ) == -1 ) {
+		rv = -1;
+	}
+	if( rv == 0 ) {
+		rv = rename( tmp_path, path );
+	}
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  hs_index_add()
+//      Append entries (in time order) to an index.  The common case is
+//      a plain append; an entry older than the index tail means the whole
+//      index is loaded and re-sorted.
+//  returns:
+//       0  success
+//      -1  failure
+//      -2  index does not cover covered_before records, rebuild needed
+//--------------------------------------------------------------------
+static int hs_index_add( const char *path, hs_index_entry *e, uint32_t n,
+						 uint32_t covered_before, uint32_t covered_after )
+{
+	hs_header h;
+	hs_index_entry last;
+	int fd, rv = 0;
+
+	fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( fd == -1 ) {
+		return -1;
+	}
+	if( (hs_header_read( fd, &h, HS_INDEX_MAGIC, sizeof(hs_index_entry) ) == -1)
+		|| (h.covered != covered_before) ) {
+		close( fd );
+		return -2;
+	}
+
+	qsort( e, n, sizeof(*e), hs_entry_compare );
+
+	if(    (h.count > 0)
+		&& (pread( fd, &last, sizeof(last), sizeof(h) + (h.count - 1) * sizeof(last) ) == sizeof(last))
+		&& (hs_entry_compare( &e[0], &last ) < 0) )
+	{
+		// Out of order: merge the whole index
+		hs_index_entry *all = (hs_index_entry *)malloc( (h.count + n) * sizeof(*all) );
+		if( all == NULL ) {
+			close( fd );
+			return -1;
+		}
+		if( pread( fd, all, h.count * sizeof(*all), sizeof(h) ) != (ssize_t)(h.count * sizeof(*all)) ) {
+			free( all );
+			close( fd );
+			return -1;
+		}
+		close( fd );
+		memcpy( all + h.count, e, n * sizeof(*e) );
+		rv = hs_index_write( path, all, h.count + n, covered_after );
+		free( all );
+		return rv;
+	}
+
+	// In order: append then publish the new count
+	if( pwrite( fd, e, n * sizeof(*e), sizeof(h) + h.count * sizeof(*e) ) != (ssize_t)(n * sizeof(*e)) ) {
+		rv = -1;
+	} else {
+		h.count += n;
+		h.covered = covered_after;
+		if( pwrite( fd, &h, sizeof(h), 0 ) != sizeof(h) ) {
+			rv = -1;
+		}
+	}
+	close( fd );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  hs_index_path()
+//      type -1 is the time index
+//--------------------------------------------------------------------
+static void hs_index_path( char *path, const char *dir, int type )
+{
+	char name[32];
+
+	if( type < 0 ) {
+		snprintf( name, sizeof(name), HS_TIME_INDEX );
+	} else {
+		snprintf( name, sizeof(name), HS_TYPE_INDEX, type );
+	}
+	snprintf( path, HS_PATH_SIZE, "%s/%s", dir, name );
+}
+
+//--------------------------------------------------------------------
+//  hs_index_records()
+//      Add store records [base, base + n) to the time and type indexes
+//--------------------------------------------------------------------
+static int hs_index_records( const char *dir, const hs_record *recs, uint32_t n, uint32_t base )
+{
+	char path[HS_PATH_SIZE];
+	hs_index_entry *e;
+	uint32_t k;
+	int rv = 0, r;
+
+	e = (hs_index_entry *)malloc( n * sizeof(*e) );
+	if( e == NULL ) {
+		return -1;
+	}
+
+	// Time index takes every record
+	for( k = 0; k < n; k++ ) {
+		e[k].time = recs[k].time;
+		e[k].rec = base + k;
+		e[k].reserved = 0;
+	}
+	hs_index_path( path, dir, -1 );
+	r = hs_index_add( path, e, n, base, base + n );
+	if( r != 0 )  rv = r;
+
+	// Each type index takes only its own records, but all of them move
+	// their coverage forward so they stay in step with the store
+	for( int type = 0; type < HS_EVT_LAST; type++ )
+	{
+		uint32_t cnt = 0;
+		for( k = 0; k < n; k++ ) {
+			if( recs[k].type == type ) {
+				e[cnt].time = recs[k].time;
+				e[cnt].rec = base + k;
+				e[cnt].reserved = 0;
+				++cnt;
+			}
+		}
+		hs_index_path( path, dir, type );
+		if( cnt == 0 ) {
+			// Nothing to add, just bump coverage if the file exists
+			int fd = open( path, O_RDWR );
+			hs_header h;
+			if( fd == -1 ) {
+				// First append creates every type index
+				if( base != 0 ) {
+					rv = -2;
+				} else if( hs_index_write( path, e, 0, n ) == -1 ) {
+					rv = -1;
+				}
+				continue;
+			}
+			if(    (pread( fd, &h, sizeof(h), 0 ) != sizeof(h))
+				|| (h.magic != HS_INDEX_MAGIC) || (h.covered != base) ) {
+				rv = -2;
+			} else {
+				h.covered = base + n;
+				if( pwrite( fd, &h, sizeof(h), 0 ) != sizeof(h) )  rv = -1;
+			}
+			close( fd );
+			continue;
+		}
+		r = hs_index_add( path, e, cnt, base, base + n );
+		if( r != 0 )  rv = r;
+	}
+
+	free( e );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  hs_rebuild_indexes()
+//      Recreate every index from the store
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int hs_rebuild_indexes( const char *dir )
+{
+	char path[HS_PATH_SIZE];
+	hs_map m;
+	hs_index_entry *e;
+	const hs_record *recs;
+	uint32_t n, k, cnt;
+	int rv = 0;
+
+	snprintf( path, sizeof(path), "%s/%s", dir, HS_STORE_FILE );
+	if( hs_map_open( &m, path, HS_STORE_MAGIC ) == -1 ) {
+		return -1;
+	}
+	n = m.hdr->count;
+	recs = (const hs_record *)m.entries;
+
+	e = (hs_index_entry *)malloc( (n ? n : 1) * sizeof(*e) );
+	if( e == NULL ) {
+		hs_map_close( &m );
+		return -1;
+	}
+
+	for( k = 0; k < n; k++ ) {
+		e[k].time = recs[k].time;
+		e[k].rec = k;
+		e[k].reserved = 0;
+	}
+	hs_index_path( path, dir, -1 );
+	if( hs_index_write( path, e, n, n ) == -1 )  rv = -1;
+
+	for( int type = 0; type < HS_EVT_LAST; type++ )
+	{
+		cnt = 0;
+		for( k = 0; k < n; k++ ) {
+			if( recs[k].type == type ) {
+				e[cnt].time = recs[k].time;
+				e[cnt].rec = k;
+				e[cnt].reserved = 0;
+				++cnt;
+			}
+		}
+		hs_index_path( path, dir, type );
+		if( hs_index_write( path, e, cnt, n ) == -1 )  rv = -1;
+	}
+
+	free( e );
+	hs_map_close( &m );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  hs_append()
+//      Append records to the store and index them
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int hs_append( const char *dir, const hs_record *recs, int n )
+{
+	char path[HS_PATH_SIZE];
+	hs_header h;
+	uint32_t base;
+	int fd, rv;
+
+	if( n <= 0 ) {
+		return 0;
+	}
+
+	snprintf( path, sizeof(path), "%s/%s", dir, HS_STORE_FILE );
+	fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( fd == -1 ) {
+		return -1;
+	}
+	if( hs_header_read( fd, &h, HS_STORE_MAGIC, sizeof(hs_record) ) == -1 ) {
+		close( fd );
+		return -1;
+	}
+
+	// Records first, then the count that makes them visible to readers
+	base = h.count;
+	if( pwrite( fd, recs, n * sizeof(*recs), sizeof(h) + base * sizeof(*recs) ) != (ssize_t)(n * sizeof(*recs)) ) {
+		close( fd );
+		return -1;
+	}
+	h.count += n;
+	rv = (pwrite( fd, &h, sizeof(h), 0 ) == sizeof(h)) ? 0 : -1;
+	close( fd );
+	if( rv == -1 ) {
+		return -1;
+	}
+
+	rv = hs_index_records( dir, recs, n, base );
+	if( rv == -2 ) {
+		// An index missed an earlier append (crash, deleted file)
+		rv = hs_rebuild_indexes( dir );
+	}
+	return rv;
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+//                         R e a d e r
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+
+//--------------------------------------------------------------------
+//  hs_map_open()
+//      Map a store or index file read-only
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int hs_map_open( hs_map *m, const char *path, uint32_t magic )
+{
+	struct stat sb;
+	void *p;
+
+	memset( m, 0, sizeof(*m) );
+	m->fd = open( path, O_RDONLY );
+	if( m->fd == -1 ) {
+		return -1;
+	}
+	if( (fstat( m->fd, &sb ) == -1) || (sb.st_size < (off_t)sizeof(hs_header)) ) {
+		close( m->fd );
+		return -1;
+	}
+	p = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, m->fd, 0 );
+	if( p == MAP_FAILED ) {
+		close( m->fd );
+		return -1;
+	}
+	m->size = sb.st_size;
+	m->hdr = (hs_header *)p;
+	m->entries = (char *)p + sizeof(hs_header);
+
+	// Never trust a count the file cannot hold
+	if(    (m->hdr->magic != magic) || (m->hdr->version != HS_VERSION)
+		|| (m->hdr->entry_size == 0)
+		|| ((size_t)m->hdr->count * m->hdr->entry_size > m->size - sizeof(hs_header)) ) {
+		hs_map_close( m );
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  hs_map_close()
+//--------------------------------------------------------------------
+void hs_map_close( hs_map *m )
+{
+	if( m->hdr != NULL ) {
+		munmap( m->hdr, m->size );
+		m->hdr = NULL;
+	}
+	if( m->fd != -1 ) {
+		close( m->fd );
+		m->fd = -1;
+	}
+}
+
+//--------------------------------------------------------------------
+//  hs_index_lower_bound()
+//      Binary search for the first index entry at or after time
+//--------------------------------------------------------------------
+uint32_t hs_index_lower_bound( const hs_map *idx, int64_t time )
+{
+	const hs_index_entry *e = (const hs_index_entry *)idx->entries;
+	uint32_t lo = 0, hi = idx->hdr->count;
+
+	while( lo < hi ) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if( e[mid].time < time ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
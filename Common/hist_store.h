@@ -0,0 +1,101 @@
+
+//--------------------------------------------------------------------
+// History Store
+//--------------------------------------------------------------------
+// Binary store of decoded 1022 history records with a time index and
+// one index per event type.  Written by printem at the end of each
+// History harvest and read (mmap) by pehist.
+//
+//   hist-store.dat       header + fixed size records, in arrival order
+//   hist-time.idx        header + {time, rec} sorted by time
+//   hist-type-NN.idx     header + {time, rec} of event type NN, by time
+//
+// Records are appended and normally arrive in time order, so indexes
+// are appended too.  An index is only re-sorted when an older record
+// arrives (1022 clock set back).
+//--------------------------------------------------------------------
+#include <stdint.h>
+#include <time.h>
+
+#define HS_STORE_FILE   "hist-store.dat"
+#define HS_TIME_INDEX   "hist-time.idx"
+#define HS_TYPE_INDEX   "hist-type-%02d.idx"
+
+#define HS_STORE_MAGIC  0x54534850   // "PHST"
+#define HS_INDEX_MAGIC  0x58494850   // "PHIX"
+#define HS_VERSION      1
+
+#define HS_TEXT_SIZE    56
+#define HS_PATH_SIZE    256
+
+// Event types decoded from the record text
+typedef enum {
+	HS_EVT_OTHER,
+	HS_EVT_DIVERT,        // "... DIVERT"
+	HS_EVT_POWER_FAIL,    // "CPU POWER FAILING.."
+	HS_EVT_POWER_ON,      // "Power ON,  CPUSTART"
+	HS_EVT_RESET,         // "66.7%:66.6% : RESET"
+	HS_EVT_DV_FAILURE,    // "D-V:30s failure:SET"
+	HS_EVT_CONSOLE,       // "CONSOLE:NG  S/M:SET"
+	HS_EVT_SUPPLY,        // " PS1: PS2: @CPU: NG"
+	HS_EVT_DIFFERENCE,    // "66.7%:63.3% DIF:SET"
+	HS_EVT_MALFUNC,       // "B:+15NG MALFUNC:SET"
+	HS_EVT_OUTPUT,        // "... AOP:SET", "... BOP:CLR"
+	HS_EVT_LOW,           // " --- :+15NG LO%:SET"
+	HS_EVT_GATE,          // "66.8%:66.6% B GatCl"
+	HS_EVT_DETAILS,       // "LO/DIF: Details OFF"
+	HS_EVT_SM,            // " 9.1  8.9   S/M:SET"
+	HS_EVT_LAST
+} hs_event_type;
+
+// On-disk header, shared by the store and the index files
+typedef struct hs_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;    // sizeof(hs_record) or sizeof(hs_index_entry)
+	uint32_t count;         // number of entries following the header
+	uint32_t covered;       // index files: store records indexed so far
+} hs_header;
+
+// One history record (80 bytes)
+typedef struct hs_record
+{
+	int64_t  time;                // record timestamp (local time as epoch)
+	uint64_t hash;                // record identity (FNV-1a of text)
+	uint16_t type;                // hs_event_type
+	uint16_t text_len;
+	uint32_t reserved;
+	char     text[HS_TEXT_SIZE];  // "MM/DD/YY HH:MM:SS    event", not terminated
+} hs_record;
+
+// Time index entry
+typedef struct hs_index_entry
+{
+	int64_t  time;
+	uint32_t rec;                 // record number in the store
+	uint32_t reserved;
+} hs_index_entry;
+
+// Read-only view of a mapped file
+typedef struct hs_map
+{
+	int          fd;
+	size_t       size;
+	hs_header   *hdr;
+	void        *entries;
+} hs_map;
+
+hs_event_type hs_event_classify( const char *text );
+const char *hs_event_name( int type );
+int hs_event_lookup( const char *name );
+void hs_make_record( hs_record *r, int64_t time, uint64_t hash, const char *text );
+
+// Writer side (printem)
+int hs_append( const char *dir, const hs_record *recs, int n );
+int hs_rebuild_indexes( const char *dir );
+
+// Reader side (pehist)
+int hs_map_open( hs_map *m, const char *path, uint32_t magic );
+void hs_map_close( hs_map *m );
+uint32_t hs_index_lower_bound( const hs_map *idx, int64_t time );
@@ -0,0 +1,511 @@
+
+//--------------------------------------------------------------------
+// Logmode Record Stream
+//--------------------------------------------------------------------
+
+#include <stdlib.h>     // strtol()
+#include <string.h>
+#include <fcntl.h>      // open()
+#include <unistd.h>     // access()
+#include <time.h>       // localtime_r()
+#include <sys/time.h>   // gettimeofday()
+#include <sys/stat.h>   // fstat()
+#include <dirent.h>     // opendir()
+#include <ctype.h>      // isdigit()
+
+#include "log_stream.h"
+
+//--------------------------------------------------------------------
+//  ls_now_us()
+//      Wall clock time in microseconds since the epoch
+//--------------------------------------------------------------------
+int64_t ls_now_us( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+//--------------------------------------------------------------------
+//  ls_segment_name()
+//      Segment 0 is the session name itself, later ones get -NNN
+//--------------------------------------------------------------------
+void ls_segment_name( const char *base, int segment, char *out, int size )
+{
+	if( segment == 0 ) {
+		snprintf( out, size, "%s", base );
+	} else {
+		snprintf( out, size, "%s-%03d", base, segment );
+	}
+}
+
+//--------------------------------------------------------------------
+//  ls_index_name()
+//      Index of a segment, whether or not the segment is compressed
+//--------------------------------------------------------------------
+static void ls_index_name( const char *path, char *out, int size )
+{
+	int len = strlen( path );
+	int gz = strlen( LS_GZ_EXT );
+
+	if( (len > gz) && !strcmp( path + len - gz, LS_GZ_EXT ) ) {
+		len -= gz;
+	}
+	snprintf( out, size, "%.*s%s", len, path, LS_INDEX_EXT );
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+//                         W r i t e r
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+
+//--------------------------------------------------------------------
+//  ls_slot()
+//      Wall clock slot used for time based rotation.  Local time so
+//      that a day boundary is local midnight.
+//--------------------------------------------------------------------
+static int64_t ls_slot( const ls_writer *w, int64_t time_us )
+{
+	time_t t;
+	struct tm tm;
+
+	if( w->rotate_seconds <= 0 ) {
+		return 0;
+	}
+	t = time_us / 1000000;
+	localtime_r( &t, &tm );
+	return ((int64_t)t + tm.tm_gmtoff) / w->rotate_seconds;
+}
+
+//--------------------------------------------------------------------
+//  ls_open_segment()
+//      Create the current segment and its side index
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+static int ls_open_segment( ls_writer *w )
+{
+	char idx_path[LS_SEGMENT_SIZE + 8];
+	ls_file_hdr h;
+
+	ls_segment_name( w->base, w->segment, w->path, sizeof(w->path) );
+	if( stg_open( &w->f, w->path ) == -1 ) {
+		return -1;
+	}
+	ls_index_name( w->path, idx_path, sizeof(idx_path) );
+	if( stg_open( &w->f_idx, idx_path ) == -1 ) {
+		stg_close( &w->f );
+		return -1;
+	}
+
+	memset( &h, 0, sizeof(h) );
+	h.magic = LS_FILE_MAGIC;
+	h.version = LS_VERSION;
+	h.created_us = ls_now_us();
+	stg_write( &w->f, &h, sizeof(h) );
+	h.magic = LS_INDEX_MAGIC;
+	stg_write( &w->f_idx, &h, sizeof(h) );
+
+	w->offset = sizeof(h);
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  ls_close_segment()
+//--------------------------------------------------------------------
+static void ls_close_segment( ls_writer *w )
+{
+	int fd, idx_fd;
+
+	if( w->closed != NULL ) {
+		// Stream first so the index never points past its data
+		fd = stg_detach( &w->f );
+		idx_fd = stg_detach( &w->f_idx );
+		w->closed( w->path, fd, idx_fd );
+	} else {
+		stg_close( &w->f );
+		stg_close( &w->f_idx );
+	}
+}
+
+//--------------------------------------------------------------------
+//  ls_open()
+//      Start a session: create its first segment
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int ls_open( ls_writer *w, const char *path, int index_every, int index_seconds )
+{
+	memset( w, 0, sizeof(*w) );
+	w->index_every = (index_every > 0) ? index_every : 1;
+	w->index_seconds = index_seconds;
+	snprintf( w->base, sizeof(w->base), "%s", path );
+	return ls_open_segment( w );
+}
+
+//--------------------------------------------------------------------
+//  ls_set_rotation()
+//      Roll to a new segment when the current one would exceed
+//      rotate_bytes or a rotate_seconds wall clock boundary is crossed.
+//      Closed segments are passed to closed(), if given.
+//--------------------------------------------------------------------
+void ls_set_rotation( ls_writer *w, uint64_t rotate_bytes, int rotate_seconds, ls_closed_fn closed )
+{
+	w->rotate_bytes = rotate_bytes;
+	w->rotate_seconds = rotate_seconds;
+	w->rotate_slot = ls_slot( w, ls_now_us() );
+	w->closed = closed;
+}
+
+//--------------------------------------------------------------------
+//  ls_is_open()
+//--------------------------------------------------------------------
+int ls_is_open( const ls_writer *w )
+{
+	return stg_is_open( &w->f );
+}
+
+//--------------------------------------------------------------------
+//  ls_write()
+//      Append one record.  The frame is handed to storage in one piece so
+//      a reader tailing the file never sees a header without its payload
+//      for long.
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int ls_write( ls_writer *w, const void *data, int len, int64_t time_us )
+{
+	unsigned char frame[sizeof(ls_frame_hdr) + LS_MAX_RECORD];
+	ls_frame_hdr fh;
+	int rv = 0;
+
+	if( !stg_is_open( &w->f ) || (len < 0) || (len > LS_MAX_RECORD) ) {
+		return -1;
+	}
+
+	// Rotate, never leaving a segment empty
+	if(    (w->offset > sizeof(ls_file_hdr))
+		&& (   ((w->rotate_bytes > 0) && (w->offset + sizeof(fh) + len > w->rotate_bytes))
+			|| ((w->rotate_seconds > 0) && (ls_slot( w, time_us ) != w->rotate_slot)) ) )
+	{
+		ls_close_segment( w );
+		++w->segment;
+		w->rotate_slot = ls_slot( w, time_us );
+		if( ls_open_segment( w ) == -1 ) {
+			return -1;
+		}
+	}
+
+	// Sparse index: the first frame of a segment, then every N frames or
+	// whenever the interval has passed
+	if(    (w->offset == sizeof(ls_file_hdr))
+		|| (w->since_index >= (uint32_t)w->index_every)
+		|| ((w->index_seconds > 0)
+			&& (time_us - w->last_index_us >= (int64_t)w->index_seconds * 1000000)) )
+	{
+		ls_index_entry e;
+		memset( &e, 0, sizeof(e) );
+		e.time_us = time_us;
+		e.offset = w->offset;
+		e.seq = w->seq;
+		if( stg_write( &w->f_idx, &e, sizeof(e) ) == -1 ) {
+			rv = -1;
+		}
+		w->since_index = 0;
+		w->last_index_us = time_us;
+	}
+
+	fh.sync = LS_FRAME_SYNC;
+	fh.len = len;
+	fh.seq = w->seq;
+	fh.time_us = time_us;
+	memcpy( frame, &fh, sizeof(fh) );
+	memcpy( frame + sizeof(fh), data, len );
+	if( stg_write( &w->f, frame, sizeof(fh) + len ) == -1 ) {
+		rv = -1;
+	}
+
+	w->offset += sizeof(fh) + len;
+	++w->seq;
+	++w->since_index;
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  ls_close()
+//      End the session
+//--------------------------------------------------------------------
+void ls_close( ls_writer *w )
+{
+	if( stg_is_open( &w->f ) ) {
+		ls_close_segment( w );
+	}
+}
+
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+//                         R e a d e r
+// = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
+
+//--------------------------------------------------------------------
+//  ls_segment_find()
+//      Path of a session segment, plain or compressed
+//  returns:
+//       0  found
+//      -1  no such segment
+//--------------------------------------------------------------------
+int ls_segment_find( const char *base, int segment, char *out, int size )
+{
+	char name[LS_SEGMENT_SIZE];
+
+	ls_segment_name( base, segment, name, sizeof(name) );
+	// Compression renames the .gz into place before removing the plain
+	// file, so one of the two is always there
+	snprintf( out, size, "%s", name );
+	if( access( out, F_OK ) == 0 ) {
+		return 0;
+	}
+	snprintf( out, size, "%s%s", name, LS_GZ_EXT );
+	if( access( out, F_OK ) == 0 ) {
+		return 0;
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  ls_first_segment()
+//      Lowest segment of a session still on disk.  A disk budget removes
+//      a session's segments from the first up, so the rest follow it
+//      without a gap.
+//  returns:
+//      segment number
+//      -1  no segment of the session
+//--------------------------------------------------------------------
+int ls_first_segment( const char *base )
+{
+	char dir[LS_PATH_SIZE];
+	const char *name = strrchr( base, '/' );
+	int name_len, first = -1;
+	DIR *d;
+	struct dirent *de;
+
+	if( name == NULL ) {
+		snprintf( dir, sizeof(dir), "." );
+		name = base;
+	} else {
+		snprintf( dir, sizeof(dir), "%.*s", (int)(name - base), base );
+		if( dir[0] == '\0' ) {
+			snprintf( dir, sizeof(dir), "/" );
+		}
+		++name;
+	}
+	name_len = strlen( name );
+
+	d = opendir( dir );
+	if( d == NULL ) {
+		return -1;
+	}
+	while( (de = readdir( d )) != NULL )
+	{
+		const char *p = de->d_name + name_len;
+		int segment = 0;
+
+		if( strncmp( de->d_name, name, name_len ) ) {
+			continue;
+		}
+		if( *p == '-' ) {
+			if( !isdigit( (unsigned char)p[1] ) ) {
+				continue;
+			}
+			segment = (int)strtol( p + 1, (char **)&p, 10 );
+		}
+		if( (*p != '\0') && strcmp( p, LS_GZ_EXT ) ) {
+			continue;    // index, temporary or another session
+		}
+		if( (first == -1) || (segment < first) ) {
+			first = segment;
+		}
+	}
+	closedir( d );
+	return first;
+}
+
+//--------------------------------------------------------------------
+//  ls_first_time()
+//      Time of the first indexed frame of a segment
+//  returns:
+//       0  success
+//      -1  no index or empty
+//--------------------------------------------------------------------
+int ls_first_time( const char *path, int64_t *time_us )
+{
+	char idx_path[LS_SEGMENT_SIZE + 8];
+	ls_file_hdr h;
+	ls_index_entry e;
+	FILE *fi;
+	int rv = -1;
+
+	ls_index_name( path, idx_path, sizeof(idx_path) );
+	fi = fopen( idx_path, "r" );
+	if( fi == NULL ) {
+		return -1;
+	}
+	if(    (fread( &h, sizeof(h), 1, fi ) == 1) && (h.magic == LS_INDEX_MAGIC)
+		&& (fread( &e, sizeof(e), 1, fi ) == 1) ) {
+		*time_us = e.time_us;
+		rv = 0;
+	}
+	fclose( fi );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  ls_reader_open()
+//      zlib reads plain segments directly, so one reader covers both
+//  returns:
+//       0  success
+//      -1  failure or not a record stream
+//--------------------------------------------------------------------
+int ls_reader_open( ls_reader *r, const char *path )
+{
+	ls_file_hdr h;
+
+	memset( r, 0, sizeof(*r) );
+	r->fd = open( path, O_RDONLY );
+	if( r->fd == -1 ) {
+		return -1;
+	}
+	r->f = gzdopen( r->fd, "rb" );
+	if( r->f == NULL ) {
+		close( r->fd );
+		return -1;
+	}
+	if(    (gzread( r->f, &h, sizeof(h) ) != sizeof(h))
+		|| (h.magic != LS_FILE_MAGIC) || (h.version != LS_VERSION) ) {
+		gzclose( r->f );
+		r->f = NULL;
+		return -1;
+	}
+	ls_index_name( path, r->idx_path, sizeof(r->idx_path) );
+	r->offset = sizeof(h);
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  ls_reader_close()
+//--------------------------------------------------------------------
+void ls_reader_close( ls_reader *r )
+{
+	if( r->f != NULL ) {
+		gzclose( r->f );
+		r->f = NULL;
+	}
+}
+
+//--------------------------------------------------------------------
+//  ls_seek_time()
+//      Position the reader at the first frame at or after time_us.
+//      Binary search of the side index finds the last indexed frame
+//      before time_us; at most one index interval is then scanned.
+//      (A compressed segment is decompressed up to that point.)
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int ls_seek_time( ls_reader *r, int64_t time_us )
+{
+	FILE *fi;
+	ls_file_hdr h;
+	ls_index_entry e;
+	long n, lo, hi;
+	uint64_t size = UINT64_MAX;
+	uint64_t start = sizeof(ls_file_hdr);
+	unsigned char buf[LS_MAX_RECORD];
+	ls_frame_hdr fh;
+	struct stat sb;
+
+	fi = fopen( r->idx_path, "r" );
+	if( fi != NULL )
+	{
+		if( (fread( &h, sizeof(h), 1, fi ) == 1) && (h.magic == LS_INDEX_MAGIC) )
+		{
+			fseek( fi, 0, SEEK_END );
+			n = (ftell( fi ) - (long)sizeof(h)) / (long)sizeof(e);
+
+			// Find the last entry with time < time_us
+			lo = 0;
+			hi = n;
+			while( lo < hi ) {
+				long mid = lo + (hi - lo) / 2;
+				fseek( fi, sizeof(h) + mid * sizeof(e), SEEK_SET );
+				if( fread( &e, sizeof(e), 1, fi ) != 1 ) {
+					break;
+				}
+				if( e.time_us < time_us ) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+
+			// The index is batched separately from the stream, so while a
+			// session is live its newest entries may point past the data
+			if( gzdirect( r->f ) && (fstat( r->fd, &sb ) == 0) ) {
+				size = sb.st_size;
+			}
+			for( lo = lo - 1; lo >= 0; lo-- ) {
+				fseek( fi, sizeof(h) + lo * sizeof(e), SEEK_SET );
+				if( (fread( &e, sizeof(e), 1, fi ) == 1) && (e.offset <= size) ) {
+					start = e.offset;
+					break;
+				}
+			}
+		}
+		fclose( fi );
+	}
+
+	// Scan forward from the indexed frame
+	r->offset = start;
+	for( ;; )
+	{
+		uint64_t here = r->offset;
+		int rv = ls_next( r, &fh, buf, sizeof(buf) );
+		if( rv <= 0 ) {
+			return rv;
+		}
+		if( fh.time_us >= time_us ) {
+			r->offset = here;
+			return 0;
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  ls_next()
+//      Read the next frame.  At the end of the stream the reader stays
+//      put so it can be called again once the writer has added more.
+//  returns:
+//       1  frame read, payload in buf (fh->len bytes)
+//       0  no complete frame yet
+//      -1  corrupt stream or buf too small
+//--------------------------------------------------------------------
+int ls_next( ls_reader *r, ls_frame_hdr *fh, unsigned char *buf, int size )
+{
+	if( gzseek( r->f, r->offset, SEEK_SET ) == -1 ) {
+		return -1;
+	}
+	if( gzread( r->f, fh, sizeof(*fh) ) != sizeof(*fh) ) {
+		gzclearerr( r->f );
+		return 0;
+	}
+	if( (fh->sync != LS_FRAME_SYNC) || (fh->len > size) ) {
+		return -1;
+	}
+	if( gzread( r->f, buf, fh->len ) != fh->len ) {
+		gzclearerr( r->f );
+		return 0;
+	}
+	r->offset += sizeof(*fh) + fh->len;
+	return 1;
+}
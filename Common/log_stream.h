@@ -0,0 +1,113 @@
+
+//--------------------------------------------------------------------
+// Logmode Record Stream
+//--------------------------------------------------------------------
+// Logmode output is a stream of framed records, each stamped with its
+// arrival time, plus a sparse side index so a long session can be
+// searched by time with a binary search instead of a full scan.
+//
+//   logmode-YYYYMMDDhhmmss       ls_file_hdr, then frames:
+//                                ls_frame_hdr + payload (record bytes)
+//   logmode-YYYYMMDDhhmmss.idx   ls_file_hdr, then ls_index_entry
+//                                every N records or every interval
+//
+// A session may be rotated by size or at a wall clock boundary.  Each
+// segment is a complete stream with its own index; segments after the
+// first are named logmode-YYYYMMDDhhmmss-NNN.  Closed segments may be
+// compressed to <segment>.gz (index left as is, offsets are those of the
+// uncompressed stream).
+//
+// Frames are written whole and in order (one stg_write each), so a reader
+// that finds a short frame at the end of the file has simply caught up
+// with the writer.
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "storage.h"
+
+#define LS_FILE_MAGIC   0x474F4C50   // "PLOG"
+#define LS_INDEX_MAGIC  0x58444950   // "PIDX"
+#define LS_VERSION      1
+#define LS_FRAME_SYNC   0x4652       // "RF"
+#define LS_INDEX_EXT    ".idx"
+#define LS_GZ_EXT       ".gz"
+#define LS_PATH_SIZE    256
+#define LS_SEGMENT_SIZE (LS_PATH_SIZE + 12)   // session name and "-%03d"
+
+// Longest payload a frame may carry
+#define LS_MAX_RECORD   1024
+
+typedef struct ls_file_hdr
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	int64_t  created_us;     // stream creation time
+} ls_file_hdr;
+
+typedef struct ls_frame_hdr
+{
+	uint16_t sync;           // LS_FRAME_SYNC
+	uint16_t len;            // payload bytes following
+	uint32_t seq;            // record number within the session
+	int64_t  time_us;        // arrival time, microseconds since the epoch
+} ls_frame_hdr;
+
+typedef struct ls_index_entry
+{
+	int64_t  time_us;        // arrival time of the indexed frame
+	uint64_t offset;         // file offset of its ls_frame_hdr
+	uint32_t seq;
+	uint32_t reserved;
+} ls_index_entry;
+
+// Called with a segment that has been closed, its stream and index
+// descriptors still open (flushed, not synced).  The callee owns them.
+typedef void (*ls_closed_fn)( const char *path, int fd, int idx_fd );
+
+// Writer side (printem)
+typedef struct ls_writer
+{
+	stg_file f;              // record stream
+	stg_file f_idx;          // side index
+	char     base[LS_PATH_SIZE];   // session name (first segment)
+	char     path[LS_SEGMENT_SIZE];   // current segment
+	int      segment;        // current segment number
+	uint64_t offset;         // next frame offset
+	uint32_t seq;            // next record number
+	uint32_t since_index;    // frames since last index entry
+	int64_t  last_index_us;  // time of last index entry
+	int      index_every;    // index every N records
+	int      index_seconds;  // ... or when this many seconds have passed
+	uint64_t rotate_bytes;   // roll to a new segment at this size (0 = off)
+	int      rotate_seconds; // ... or at each multiple of this in local time
+	int64_t  rotate_slot;    // wall clock slot of the current segment
+	ls_closed_fn closed;     // segment hand-off (NULL = close here)
+} ls_writer;
+
+int ls_open( ls_writer *w, const char *path, int index_every, int index_seconds );
+void ls_set_rotation( ls_writer *w, uint64_t rotate_bytes, int rotate_seconds, ls_closed_fn closed );
+int ls_is_open( const ls_writer *w );
+int ls_write( ls_writer *w, const void *data, int len, int64_t time_us );
+void ls_close( ls_writer *w );
+int64_t ls_now_us( void );
+void ls_segment_name( const char *base, int segment, char *out, int size );
+
+// Reader side (pelog), plain or compressed segments
+typedef struct ls_reader
+{
+	int      fd;             // kept for fstat(), owned by f
+	gzFile   f;
+	char     idx_path[LS_SEGMENT_SIZE + 8];
+	uint64_t offset;         // offset of the next frame to read
+} ls_reader;
+
+int ls_segment_find( const char *base, int segment, char *out, int size );
+int ls_first_segment( const char *base );
+int ls_first_time( const char *path, int64_t *time_us );
+int ls_reader_open( ls_reader *r, const char *path );
+void ls_reader_close( ls_reader *r );
+int ls_seek_time( ls_reader *r, int64_t time_us );
+int ls_next( ls_reader *r, ls_frame_hdr *fh, unsigned char *buf, int size );
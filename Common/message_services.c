@@ -3,17 +3,36 @@
 // Message Services
 //--------------------------------------------------------------------
 
+#include <string.h>
+#include <unistd.h>      // close(), unlink()
+#include <fcntl.h>       // fcntl()
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "message_services.h"
+#include "pe_probes.h"
+#include "diag.h"
 
 // Private to Message Services
 
 // Server side data
 int server_mq;         // server obtained server_mq
-int client_mq_server;  // client_mq received on server side
+
+// Server side socket transport
+static int server_sock = -1;                       // listening socket
+static int sock_clients[MSG_SOCK_MAX_CLIENTS];    // connections, -1 unused
+static int sock_next;                             // round robin receive
+static void (*sock_hangup)( int client_id );      // told as a client goes
+
+// Socket connection slot <-> client_id.  Starts at -2 so that -1 (the
+// usual failure value) never names a connection.
+#define MSG_SOCK_ID(slot)    (-2 - (slot))
+#define MSG_SOCK_SLOT(id)    (-2 - (id))
 
 // Client side data
 int client_mq;         // client_mq created by client side
 int server_mq_client;  // client obtained server_mq
+static int client_sock = -1;  // connection when using the socket transport
 
 
 // = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
@@ -37,19 +56,129 @@ int msg_create_server_mq( void )
     return (server_mq == -1) ? -1 : 0;
 }	
 
+//--------------------------------------------------------------------
+//  msg_sock_accept()
+//      Take every pending connection on the listening socket
+//--------------------------------------------------------------------
+static void msg_sock_accept( void )
+{
+	int fd, slot;
+
+	while( (fd = accept4( server_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC )) != -1 )
+	{
+		for( slot = 0; slot < MSG_SOCK_MAX_CLIENTS; slot++ ) {
+			if( sock_clients[slot] == -1 )  break;
+		}
+		if( slot == MSG_SOCK_MAX_CLIENTS ) {
+			DIAG( DIAG_WARN, "msg: too many socket clients, connection refused" );
+			close( fd );
+			continue;
+		}
+		sock_clients[slot] = fd;
+	}
+}
+
+//--------------------------------------------------------------------
+//  msg_sock_rcv()
+//      non-blocking receive of one request from the socket clients,
+//      taken round robin so a busy client cannot starve the others.
+//      A client that hangs up or sends a malformed packet is dropped.
+//  returns:
+//      encoded message length (if message present)
+//      0 if no message present
+//--------------------------------------------------------------------
+static ssize_t msg_sock_rcv( pp_msg *c_msg )
+{
+	unsigned char data[PP_MAX_MSG];
+	ssize_t count;
+
+	if( server_sock == -1 ) {
+		return 0;
+	}
+	msg_sock_accept();
+
+	for( int k = 0; k < MSG_SOCK_MAX_CLIENTS; k++ )
+	{
+		int slot = (sock_next + k) % MSG_SOCK_MAX_CLIENTS;
+		if( sock_clients[slot] == -1 ) {
+			continue;
+		}
+		count = recv( sock_clients[slot], data, sizeof(data), MSG_DONTWAIT );
+		if( (count > 0) && (pp_decode( c_msg, data, count ) == 0) ) {
+			sock_next = (slot + 1) % MSG_SOCK_MAX_CLIENTS;
+			c_msg->client_id = MSG_SOCK_ID(slot);
+			return count;
+		}
+		if( (count == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+			continue;
+		}
+		if( count > 0 ) {
+			DIAG( DIAG_WARN, "msg: malformed request from socket client, dropped" );
+		}
+		// Its id is the next client's on this slot: forget it first
+		if( sock_hangup != NULL ) {
+			sock_hangup( MSG_SOCK_ID(slot) );
+		}
+		close( sock_clients[slot] );
+		sock_clients[slot] = -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  msg_sock_send()
+//      One encoded message, with pass_fd attached unless it is -1
+//  returns:
+//       0  success
+//      -1  failure (with errno set)
+//--------------------------------------------------------------------
+static int msg_sock_send( int fd, const unsigned char *data, int len, int pass_fd )
+{
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+
+	memset( &mh, 0, sizeof(mh) );
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if( pass_fd >= 0 ) {
+		memset( &ctl, 0, sizeof(ctl) );
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof(ctl.buf);
+		struct cmsghdr *cm = CMSG_FIRSTHDR( &mh );
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy( CMSG_DATA(cm), &pass_fd, sizeof(int) );
+	}
+	return (sendmsg( fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL ) == -1) ? -1 : 0;
+}
+
 //--------------------------------------------------------------------
 //  msg_rcv_from_client()
-//      non-blocking receive on server_mq
-//      the entire cmd field is copied by msgrcv().
-//      Must be a null terminated string
+//      non-blocking receive on server_mq, then on the socket clients.
+//      A request that does not decode is dropped.  c_msg->client_id
+//      says where responses to this request go.
 //  returns:
-//      num bytes in cmd field (if message present)
+//      encoded message length (if message present)
 //      0 if no message present
 //      -1 failure (with errno set)
 //--------------------------------------------------------------------
-ssize_t msg_rcv_from_client( client_req* c_msg )
+ssize_t msg_rcv_from_client( pp_msg *c_msg )
 {
-	ssize_t count = msgrcv(server_mq, c_msg, sizeof(c_msg->cmd), 0, IPC_NOWAIT);
+	msg_buf mb;
+
+	// MSG_NOERROR: an oversized message must not stay stuck in the queue
+	ssize_t count = msgrcv(server_mq, &mb, sizeof(mb.data), 0, IPC_NOWAIT | MSG_NOERROR);
+	if( (count > 0) && (pp_decode( c_msg, mb.data, count ) == -1) ) {
+		DIAG( DIAG_WARN, "msgrcv: malformed request dropped" );
+		count = 0;
+	}
 	if( count == -1 )
 	{
 		switch( errno )
@@ -61,74 +190,140 @@ ssize_t msg_rcv_from_client( client_req* c_msg )
 			break;
 		case EIDRM:
 			// message queue removed.  Have not seen this yet.
-			printf("msgrcv: Message queue removed EIDRM\n");
+			DIAG( DIAG_ERROR, "msgrcv: Message queue removed EIDRM" );
 			break;
 		case EINVAL:
 			// msgid is invalid (queue removed?)
-			printf("msgrcv: Message queue removed EINVAL\n");
+			DIAG( DIAG_ERROR, "msgrcv: Message queue removed EINVAL" );
 			break;
 		case EACCES:
 			// calling process, no read permission on message queue
-			printf("msgrcv: No read permission\n");				
+			DIAG( DIAG_ERROR, "msgrcv: No read permission" );
 			break;
 		default:
-			perror("msgrcv");
+			DIAG_ERRNO( DIAG_ERROR, "msgrcv" );
 			break;
 		}
-	} else {
-		if( c_msg->mtype == CLIENT_INIT )
-		{
-			// Capture the server mq id
-			client_mq_server = c_msg->client_id;
-		}
-		else
-		{
-			// If printem server restarts then we need to update the
-			// server copy of the client mqid.  printem will not be receiving
-			// a CLIENT_INIT
-			if( client_mq_server != c_msg->client_id ) {
-				client_mq_server = c_msg->client_id;
-			}
-		}
+	}
+	if( count == 0 ) {
+		count = msg_sock_rcv( c_msg );
+	}
+	if( count > 0 ) {
+		PE_PROBE3( msg_recv, c_msg->op, c_msg->corr_id, c_msg->client_id );
 	}
 	
 	return count;
 }
 
 //--------------------------------------------------------------------
-//  msg_send_to_client()
-//      Send a message to the client
+//  msg_send_to_client_mq()
+//      Send a message to a specific client message queue.  s_msg->fd
+//      is passed to socket clients; a SysV client gets the message
+//      without it.
 //  returns:
 //       0  success
 //      -1  failure (with errno set)
 //--------------------------------------------------------------------
-int msg_send_to_client( server_rsp *s_msg )
+int msg_send_to_client_mq( int client_mq_id, const pp_msg *s_msg )
 {
-	int rv = msgsnd(client_mq_server, s_msg, sizeof(s_msg->rsp), 0);
+	msg_buf mb;
+	int len;
+
+	if( (client_mq_id >= 0) && (s_msg->fd >= 0) ) {
+		pp_msg no_fd = *s_msg;
+		no_fd.fd = -1;
+		len = pp_encode( &no_fd, mb.data, sizeof(mb.data) );
+	} else {
+		len = pp_encode( s_msg, mb.data, sizeof(mb.data) );
+	}
+
+	if( len == -1 ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	mb.mtype = s_msg->status;
+
+	if( client_mq_id < 0 )
+	{
+		// Socket client.  Never wait on a client that stopped reading.
+		int slot = MSG_SOCK_SLOT(client_mq_id);
+		if( (slot >= MSG_SOCK_MAX_CLIENTS) || (sock_clients[slot] == -1) ) {
+			errno = ENOTCONN;
+			return -1;
+		}
+		int rv = msg_sock_send( sock_clients[slot], mb.data, len, s_msg->fd );
+		PE_PROBE4( msg_send, s_msg->op, s_msg->status, s_msg->corr_id, rv );
+		return rv;
+	}
+
+	int rv = msgsnd(client_mq_id, &mb, len, 0);
+	PE_PROBE4( msg_send, s_msg->op, s_msg->status, s_msg->corr_id, rv );
 	if( rv == -1 )
 	{
 		switch( errno )
 		{
 		case EACCES:
 			// calling process, no write permission on message queue
-			printf("msgsnd: No write permission on message queue\n");
+			DIAG( DIAG_ERROR, "msgsnd: No write permission on message queue" );
 			break;
 		case EINVAL:
-			printf("msgsnd: Invalid msgid value\n");
+			DIAG( DIAG_ERROR, "msgsnd: Invalid msgid value" );
 			break;
 		case EAGAIN:
 			// if msgflg parm was set for IPC_NOWAIT and queue was full
 			// it would not block and throw this error
-			printf("msgsnd: EAGAIN error\n");
+			DIAG( DIAG_WARN, "msgsnd: EAGAIN error" );
 			break;
 		default:
-	        perror("msgsnd");
+			DIAG_ERRNO( DIAG_ERROR, "msgsnd" );
 			break;
 		}
 	}
 	return rv;
 }
 
+//--------------------------------------------------------------------
+//  msg_sock_dup()
+//      A descriptor of its own for a socket client's connection, so a
+//      thread other than the one receiving requests can send to it
+//      with msg_send_to_sock() and close it when done
+//  returns:
+//      descriptor
+//      -1  not a connected socket client (with errno set)
+//--------------------------------------------------------------------
+int msg_sock_dup( int client_id )
+{
+	int slot = MSG_SOCK_SLOT(client_id);
+
+	if( (client_id >= 0) || (slot >= MSG_SOCK_MAX_CLIENTS) || (sock_clients[slot] == -1) ) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	return fcntl( sock_clients[slot], F_DUPFD_CLOEXEC, 0 );
+}
+
+//--------------------------------------------------------------------
+//  msg_send_to_sock()
+//      Send a message on a descriptor from msg_sock_dup().  Never
+//      waits: EAGAIN means the client is not keeping up.
+//  returns:
+//       0  success
+//      -1  failure (with errno set)
+//--------------------------------------------------------------------
+int msg_send_to_sock( int fd, const pp_msg *s_msg )
+{
+	unsigned char data[PP_MAX_MSG];
+	int len = pp_encode( s_msg, data, sizeof(data) );
+
+	if( len == -1 ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	int rv = msg_sock_send( fd, data, len, s_msg->fd );
+	PE_PROBE4( msg_send, s_msg->op, s_msg->status, s_msg->corr_id, rv );
+	return rv;
+}
+
 //--------------------------------------------------------------------
 //  msg_remove_server_mq()
 //  returns:
@@ -141,6 +336,96 @@ int msg_remove_server_mq( void )
 	return rv;
 }
 
+//--------------------------------------------------------------------
+//  msg_create_server_sock()
+//      Listen on MSG_SOCK_PATH.  A socket left behind by a previous
+//      run is replaced.
+//  returns:
+//       0  success
+//      -1  failure (with errno set)
+//--------------------------------------------------------------------
+int msg_create_server_sock( void )
+{
+	struct sockaddr_un addr;
+
+	for( int i = 0; i < MSG_SOCK_MAX_CLIENTS; i++ ) {
+		sock_clients[i] = -1;
+	}
+	sock_next = 0;
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, MSG_SOCK_PATH, sizeof(addr.sun_path) - 1 );
+
+	server_sock = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if( server_sock == -1 ) {
+		return -1;
+	}
+	unlink( MSG_SOCK_PATH );
+	if(    (bind( server_sock, (struct sockaddr *)&addr, sizeof(addr) ) == -1)
+		|| (chmod( MSG_SOCK_PATH, 0666 ) == -1)     // same access as the queue
+		|| (listen( server_sock, MSG_SOCK_MAX_CLIENTS ) == -1) ) {
+		close( server_sock );
+		server_sock = -1;
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  msg_server_pollfds()
+//      Fill fds with the descriptors that become readable when a
+//      socket client connects or sends a request
+//  returns:
+//      number of entries used
+//--------------------------------------------------------------------
+int msg_server_pollfds( struct pollfd *fds, int max_fds )
+{
+	int n = 0;
+
+	if( (server_sock == -1) || (max_fds < 1) ) {
+		return 0;
+	}
+	fds[n].fd = server_sock;
+	fds[n++].events = POLLIN;
+	for( int i = 0; (i < MSG_SOCK_MAX_CLIENTS) && (n < max_fds); i++ ) {
+		if( sock_clients[i] != -1 ) {
+			fds[n].fd = sock_clients[i];
+			fds[n++].events = POLLIN;
+		}
+	}
+	return n;
+}
+
+//--------------------------------------------------------------------
+//  msg_sock_on_hangup()
+//      hook is called with a socket client's id when it is dropped,
+//      before a new connection can be given the same id
+//--------------------------------------------------------------------
+void msg_sock_on_hangup( void (*hook)( int client_id ) )
+{
+	sock_hangup = hook;
+}
+
+//--------------------------------------------------------------------
+//  msg_remove_server_sock()
+//--------------------------------------------------------------------
+void msg_remove_server_sock( void )
+{
+	if( server_sock == -1 ) {
+		return;
+	}
+	for( int i = 0; i < MSG_SOCK_MAX_CLIENTS; i++ ) {
+		if( sock_clients[i] != -1 ) {
+			close( sock_clients[i] );
+			sock_clients[i] = -1;
+		}
+	}
+	close( server_sock );
+	server_sock = -1;
+	unlink( MSG_SOCK_PATH );
+}
+
 // = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
 //                     C L I E N T  S i d e
 // = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = = =
@@ -211,10 +496,27 @@ int msg_get_server_mq( void )
 //       0  success
 //      -1  failure (with errno set)
 //--------------------------------------------------------------------
-int msg_send_to_server( client_req *c_msg )
+int msg_send_to_server( const pp_msg *c_msg )
 {
+	msg_buf mb;
+	int len = pp_encode( c_msg, mb.data, sizeof(mb.data) );
+
+	if( len == -1 ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	mb.mtype = c_msg->op;
+
+	if( client_sock != -1 ) {
+		if( send( client_sock, mb.data, len, MSG_NOSIGNAL ) == -1 ) {
+			perror("send");
+			return -1;
+		}
+		return 0;
+	}
+
 	// Send the message
-	int rv = msgsnd(server_mq_client, c_msg, sizeof(c_msg->cmd), 0);
+	int rv = msgsnd(server_mq_client, &mb, len, 0);
 	if( rv == -1 )
 	{
 		switch( errno )
@@ -241,20 +543,77 @@ int msg_send_to_server( client_req *c_msg )
 
 //--------------------------------------------------------------------
 //  msg_rcv_from_server()
-//      blocking or non-blocking receive on client_mq
-//      The entire cmd field is copied by msgrcv().
-//      Must be a null terminated string
+//      blocking or non-blocking receive on client_mq (or the socket).
+//      s_msg->fd is a descriptor printem passed with the response
+//      (PP_FLAG_FD), which the caller must close, or -1.
 //  returns:
-//      num bytes in cmd field (if message present)
+//      encoded message length (if message present)
 //      0 if no message present
 //      -1 failure (with errno set)
 //--------------------------------------------------------------------
-ssize_t msg_rcv_from_server( server_rsp* s_msg, int is_blocking )
+ssize_t msg_rcv_from_server( pp_msg *s_msg, int is_blocking )
 {
 	int msg_flags;
+	msg_buf mb;
+
+	if( client_sock != -1 )
+	{
+		struct msghdr mh;
+		struct iovec iov;
+		struct cmsghdr *cm;
+		int pass_fd = -1;
+		union {
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} ctl;
+
+		memset( &mh, 0, sizeof(mh) );
+		iov.iov_base = mb.data;
+		iov.iov_len = sizeof(mb.data);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof(ctl.buf);
+
+		ssize_t n = recvmsg( client_sock, &mh, MSG_CMSG_CLOEXEC | (is_blocking ? 0 : MSG_DONTWAIT) );
+		if( n > 0 ) {
+			for( cm = CMSG_FIRSTHDR( &mh ); cm != NULL; cm = CMSG_NXTHDR( &mh, cm ) ) {
+				if( (cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_RIGHTS) ) {
+					memcpy( &pass_fd, CMSG_DATA(cm), sizeof(int) );
+				}
+			}
+		}
+		if( n == -1 ) {
+			if( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) {
+				return 0;
+			}
+			if( errno != EINTR ) {    // a signal is the caller's to handle
+				perror("recv");
+			}
+			return -1;
+		}
+		if( n == 0 ) {
+			errno = ENOTCONN;    // printem closed the connection
+			return -1;
+		}
+		if( pp_decode( s_msg, mb.data, n ) == -1 ) {
+			printf("Malformed response from printem\n");
+			if( pass_fd != -1 )  close( pass_fd );
+			errno = EBADMSG;
+			return -1;
+		}
+		s_msg->fd = pass_fd;    // the caller closes it
+		return n;
+	}
+
 	is_blocking ? msg_flags = 0 : msg_flags = IPC_NOWAIT;
 
-	ssize_t count = msgrcv(client_mq, s_msg, sizeof(s_msg->rsp), 0, msg_flags);
+	ssize_t count = msgrcv(client_mq, &mb, sizeof(mb.data), 0, msg_flags | MSG_NOERROR);
+	if( (count > 0) && (pp_decode( s_msg, mb.data, count ) == -1) ) {
+		printf("Malformed response from printem\n");
+		errno = EBADMSG;
+		return -1;
+	}
 	if( count == -1 )
 	{
 		switch( errno )
@@ -287,16 +646,62 @@ ssize_t msg_rcv_from_server( server_rsp* s_msg, int is_blocking )
 
 //--------------------------------------------------------------------
 //  msg_remove_clientt_mq()
+//      A client on the socket transport has no queue; its connection
+//      is closed instead.
 //  returns:
 //       0  success
 //      -1  failure (with errno set)
 //--------------------------------------------------------------------
 int msg_remove_client_mq( void )
 {
+	if( client_sock != -1 ) {
+		close( client_sock );
+		client_sock = -1;
+		return 0;
+	}
     int rv = msgctl(client_mq, IPC_RMID, NULL);
 	return rv;
 }
 
+//--------------------------------------------------------------------
+//  msg_connect_server_sock()
+//      Called by client side instead of msg_get_server_mq() and
+//      msg_create_client_mq().  Once connected, requests and responses
+//      use the socket.
+//  returns:
+//       0  success
+//      -1  printem is not listening (with errno set)
+//--------------------------------------------------------------------
+int msg_connect_server_sock( void )
+{
+	struct sockaddr_un addr;
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, MSG_SOCK_PATH, sizeof(addr.sun_path) - 1 );
+
+	client_sock = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+	if( client_sock == -1 ) {
+		return -1;
+	}
+	if( connect( client_sock, (struct sockaddr *)&addr, sizeof(addr) ) == -1 ) {
+		close( client_sock );
+		client_sock = -1;
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  msg_get_client_fd()
+//  returns:
+//      descriptor to poll() for responses, -1 on the SysV transport
+//--------------------------------------------------------------------
+int msg_get_client_fd( void )
+{
+	return client_sock;
+}
+
 //--------------------------------------------------------------------
 // Sample code for generating an ftok file and using it to create an MQ ID by calling
 // the ftok version of msg_create_client_mq()
@@ -8,51 +8,54 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <errno.h>    // Error integer and strerror() function
+#include <poll.h>     // struct pollfd
 
 #define MSG_QUEUE_KEY 0x1aaaaaa1
 
-#define MSG_MAX_PAYLOAD 256
-
-typedef struct client_req
-{
-	long mtype;
-	int client_id;
-	char cmd[MSG_MAX_PAYLOAD];
-} client_req;
-
-typedef struct server_rsp
+#include "pe_proto.h"
+
+// Socket transport.  printem also listens on a Unix SOCK_SEQPACKET
+// socket.  Each packet is one encoded message as on the SysV queue, but
+// the connection is a descriptor poll() can wait on, so neither side
+// has to wake up to look for messages.  Server side, a request from a
+// socket client gets a negative client_id naming its connection;
+// responses sent to that id go back over the socket.
+#define MSG_SOCK_PATH         "/tmp/printem.sock"
+#define MSG_SOCK_MAX_CLIENTS  16
+
+// Requests and responses are pp_msg (pe_proto.h), encoded on the way
+// out and decoded on the way in.  Every request carries the client's
+// reply queue and a correlation id chosen by the client; every response
+// to it echoes the id and the request op.  On a SysV queue the encoded
+// message follows mtype, which is the request op or the response status.
+typedef struct msg_buf
 {
 	long mtype;
-	char rsp[MSG_MAX_PAYLOAD];
-} server_rsp;
-
-// mtype types (all non-zero)
-#define CLIENT_INIT         1
-#define CLIENT_REQ_REPORT   2
-#define CLIENT_REQ_HISTORY  3
-#define CLIENT_REQ_LOG      4
-#define CLIENT_REQ_EXIT     5
-
-#define SERVER_REQUEST_SUCCESS  1
-#define SERVER_REQUEST_FAILURE  2
-#define SERVER_ACTION_SUCCESS   3
-#define SERVER_ACTION_FAILURE   4
-#define SERVER_RESET            5
+	unsigned char data[PP_MAX_MSG];
+} msg_buf;
 
 // Server side message services
 int msg_create_server_mq( void );
-ssize_t msg_rcv_from_client( client_req* c_msg );
-int msg_send_to_client( server_rsp *s_msg );
+ssize_t msg_rcv_from_client( pp_msg *c_msg );
+int msg_send_to_client_mq( int client_mq_id, const pp_msg *s_msg );
 int msg_remove_server_mq( void );
+int msg_create_server_sock( void );
+int msg_server_pollfds( struct pollfd *fds, int max_fds );
+void msg_remove_server_sock( void );
+int msg_sock_dup( int client_id );
+void msg_sock_on_hangup( void (*hook)( int client_id ) );
+int msg_send_to_sock( int fd, const pp_msg *s_msg );
 
 // Client side message services
 int msg_create_client_mq( void );
 int msg_create_client_mq_ftok( const char *file );
 int msg_get_client_mq( void );
 int msg_get_server_mq( void );
-int msg_send_to_server( client_req *c_msg );
-ssize_t msg_rcv_from_server( server_rsp* s_msg, int is_blocking );
+int msg_send_to_server( const pp_msg *c_msg );
+ssize_t msg_rcv_from_server( pp_msg *s_msg, int is_blocking );
 int msg_remove_client_mq( void );
+int msg_connect_server_sock( void );
+int msg_get_client_fd( void );
 
 // msg_rcv_from_server, specify blocking or non-blocking
 #define RCV_BLOCKING     1
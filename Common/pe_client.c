@@ -0,0 +1,452 @@
+
+//--------------------------------------------------------------------
+// Printer Emulator Client Library
+//--------------------------------------------------------------------
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>      // close()
+#include <time.h>        // clock_gettime()
+
+#include "pe_client.h"
+
+// Private to the client library
+
+typedef struct pec_entry
+{
+	int          in_use;
+	int          done;       // final response in rsp (futures only)
+	unsigned int corr_id;
+	int          op;
+	pec_callback cb;         // NULL: a future, collected by pec_wait()
+	void        *arg;
+	int64_t      deadline;   // ms, CLOCK_MONOTONIC; 0 none
+	pp_msg       rsp;
+} pec_entry;
+
+static pec_entry    pec_pending[PEC_MAX_PENDING];
+static unsigned int pec_corr_last;
+static unsigned int pec_timeout_ms = PEC_TIMEOUT_MS;
+
+//--------------------------------------------------------------------
+//  pec_now_ms()
+//--------------------------------------------------------------------
+static int64_t pec_now_ms( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//--------------------------------------------------------------------
+//  pec_find()
+//  returns:
+//      entry for corr_id, NULL if none
+//--------------------------------------------------------------------
+static pec_entry *pec_find( unsigned int corr_id )
+{
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		if( pec_pending[i].in_use && (pec_pending[i].corr_id == corr_id) ) {
+			return &pec_pending[i];
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------------------------------
+//  pec_release()
+//--------------------------------------------------------------------
+static void pec_release( pec_entry *e )
+{
+	if( e->done && (e->rsp.fd != -1) ) {
+		close( e->rsp.fd );
+	}
+	e->in_use = 0;
+	e->done = 0;
+}
+
+//--------------------------------------------------------------------
+//  pec_send()
+//      Number, record and send a request
+//  returns:
+//      correlation id
+//      0  failure (with errno set)
+//--------------------------------------------------------------------
+static unsigned int pec_send( pp_msg *req, pec_callback cb, void *arg )
+{
+	pec_entry *e = NULL;
+
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		if( !pec_pending[i].in_use ) {
+			e = &pec_pending[i];
+			break;
+		}
+	}
+	if( e == NULL ) {
+		errno = EBUSY;
+		return 0;
+	}
+
+	// 0 is never a correlation id
+	if( ++pec_corr_last == 0 ) {
+		++pec_corr_last;
+	}
+	req->client_id = msg_get_client_mq();
+	req->corr_id = pec_corr_last;
+	e->deadline = 0;
+	if( (pec_timeout_ms > 0) && (req->op != CLIENT_SUBSCRIBE) ) {
+		req->timeout_ms = pec_timeout_ms;
+		req->fields |= PP_F_TIMEOUT;
+		e->deadline = pec_now_ms() + pec_timeout_ms + PEC_TIMEOUT_GRACE_MS;
+	}
+	if( msg_send_to_server( req ) == -1 ) {
+		return 0;
+	}
+	e->in_use = 1;
+	e->done = 0;
+	e->corr_id = req->corr_id;
+	e->op = req->op;
+	e->cb = cb;
+	e->arg = arg;
+	return req->corr_id;
+}
+
+//--------------------------------------------------------------------
+//  pec_connect()
+//      printem's socket, or its SysV queue with a private reply queue
+//  returns:
+//       0  success
+//      -1  printem not reachable (with errno set)
+//--------------------------------------------------------------------
+int pec_connect( void )
+{
+	memset( pec_pending, 0, sizeof(pec_pending) );
+	if( msg_connect_server_sock() == 0 ) {
+		return 0;
+	}
+	if( (msg_get_server_mq() == -1) || (msg_create_client_mq() == -1) ) {
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  pec_close()
+//      Requests still in flight are forgotten
+//--------------------------------------------------------------------
+void pec_close( void )
+{
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		if( pec_pending[i].in_use ) {
+			pec_release( &pec_pending[i] );
+		}
+	}
+	msg_remove_client_mq();
+}
+
+//--------------------------------------------------------------------
+//  pec_fd()
+//  returns:
+//      descriptor that is readable when printem has sent something
+//      -1  SysV transport, nothing to poll
+//--------------------------------------------------------------------
+int pec_fd( void )
+{
+	return msg_get_client_fd();
+}
+
+//--------------------------------------------------------------------
+//  pec_submit()
+//      Request op (CLIENT_*).  flags are request PP_FLAG_*.
+//  returns:
+//      correlation id
+//      0  failure (with errno set)
+//--------------------------------------------------------------------
+unsigned int pec_submit( int op, unsigned int flags, pec_callback cb, void *arg )
+{
+	pp_msg req;
+
+	pp_init( &req, op, 0 );
+	req.flags = flags;
+	return pec_send( &req, cb, arg );
+}
+
+//--------------------------------------------------------------------
+//  pec_subscribe()
+//      Replace the subscription to live events (PP_EV_*); no events
+//      ends it.  cb gets the acknowledgement and then every event.
+//  returns:
+//      correlation id
+//      0  failure (with errno set)
+//--------------------------------------------------------------------
+unsigned int pec_subscribe( unsigned int events, unsigned int rate_ms, pec_callback cb, void *arg )
+{
+	pp_msg req;
+
+	// printem keeps one subscription per client, so does the table
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		if( pec_pending[i].in_use && (pec_pending[i].op == CLIENT_SUBSCRIBE) ) {
+			pec_release( &pec_pending[i] );
+		}
+	}
+
+	pp_init( &req, CLIENT_SUBSCRIBE, 0 );
+	req.events = events;
+	req.rate_ms = rate_ms;
+	req.fields |= PP_F_EVENTS | PP_F_RATE;
+	return pec_send( &req, cb, arg );
+}
+
+//--------------------------------------------------------------------
+//  pec_cancel()
+//      Withdraw a request.  Its callback is not called again and a
+//      late answer is dropped; printem is told to forget it.
+//  returns:
+//       0  success
+//      -1  not a request in flight
+//--------------------------------------------------------------------
+int pec_cancel( unsigned int corr_id )
+{
+	pec_entry *e = pec_find( corr_id );
+	pp_msg req;
+
+	if( e == NULL ) {
+		errno = EINVAL;
+		return -1;
+	}
+	pec_release( e );
+
+	// The answer to the cancel carries the same id, so it is dropped too
+	pp_init( &req, CLIENT_CANCEL, 0 );
+	req.client_id = msg_get_client_mq();
+	req.corr_id = corr_id;
+	msg_send_to_server( &req );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  pec_set_timeout()
+//      Timeout (ms) for the requests submitted from now on, 0 for
+//      printem's own limit only.  Subscriptions have none.
+//--------------------------------------------------------------------
+void pec_set_timeout( unsigned int timeout_ms )
+{
+	pec_timeout_ms = timeout_ms;
+}
+
+//--------------------------------------------------------------------
+//  pec_next_ms()
+//      timeout_ms (-1 no limit) for a caller's own poll(), shortened to
+//      the next request deadline, and to PEC_SYSV_POLL_MS when there is
+//      no descriptor, so that pec_dispatch() is called in time
+//--------------------------------------------------------------------
+int pec_next_ms( int timeout_ms )
+{
+	int64_t now = pec_now_ms();
+
+	if( (pec_fd() == -1) && ((timeout_ms < 0) || (timeout_ms > PEC_SYSV_POLL_MS)) ) {
+		timeout_ms = PEC_SYSV_POLL_MS;
+	}
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		pec_entry *e = &pec_pending[i];
+		if( e->in_use && !e->done && e->deadline ) {
+			int64_t left = (e->deadline > now) ? e->deadline - now : 0;
+			if( (timeout_ms < 0) || (left < timeout_ms) ) {
+				timeout_ms = (int)left;
+			}
+		}
+	}
+	return timeout_ms;
+}
+
+//--------------------------------------------------------------------
+//  pec_deliver()
+//      Hand a message to the request it belongs to
+//--------------------------------------------------------------------
+static void pec_deliver( pec_entry *e, pp_msg *m )
+{
+	int is_final = pec_is_final( m );
+
+	if( e->cb != NULL ) {
+		e->cb( m, e->arg );
+		if( m->fd != -1 )  close( m->fd );
+		// A subscription lives on after its acknowledgement
+		if(    is_final
+			&& !((e->op == CLIENT_SUBSCRIBE) && (m->status == SERVER_REQUEST_SUCCESS) && m->events) ) {
+			pec_release( e );
+		}
+	} else if( is_final ) {
+		e->rsp = *m;         // descriptor goes with it to pec_wait()
+		e->done = 1;
+	} else if( m->fd != -1 ) {
+		close( m->fd );
+	}
+}
+
+//--------------------------------------------------------------------
+//  pec_expire()
+//      Complete the requests printem has not answered by their
+//      deadline with a SERVER_TIMEOUT of our own
+//  returns:
+//      number of requests timed out
+//--------------------------------------------------------------------
+static int pec_expire( void )
+{
+	int64_t now = pec_now_ms();
+	pp_msg m;
+	int n = 0;
+
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		pec_entry *e = &pec_pending[i];
+		if( e->in_use && !e->done && e->deadline && (now >= e->deadline) ) {
+			pp_init( &m, e->op, SERVER_TIMEOUT );
+			m.corr_id = e->corr_id;
+			pp_set_text( &m, "no answer" );
+			pec_deliver( e, &m );
+			++n;
+		}
+	}
+	return n;
+}
+
+//--------------------------------------------------------------------
+//  pec_is_final()
+//      Whether rsp is the last response to its request.  Report,
+//      History and Log toggle are acknowledged first and answered when
+//      the 1022 is done; the other requests are answered at once.
+//--------------------------------------------------------------------
+int pec_is_final( const pp_msg *rsp )
+{
+	switch( rsp->status )
+	{
+	case SERVER_REQUEST_SUCCESS:
+		return (rsp->op != CLIENT_REQ_REPORT) && (rsp->op != CLIENT_REQ_HISTORY)
+			&& (rsp->op != CLIENT_REQ_LOG);
+	case SERVER_RESET:
+	case SERVER_EVENT:
+		return 0;
+	}
+	return 1;
+}
+
+//--------------------------------------------------------------------
+//  pec_dispatch()
+//      Take every message waiting and hand each to its request.  A
+//      message for no request in flight (one given up on) is dropped.
+//      Then time out the requests past their deadline.
+//  returns:
+//      number of messages taken, and requests timed out
+//      -1  connection lost (errno ENOTCONN)
+//--------------------------------------------------------------------
+int pec_dispatch( void )
+{
+	pp_msg m;
+	pec_entry *e;
+	ssize_t rv;
+	int n = 0;
+
+	for( ;; )
+	{
+		rv = msg_rcv_from_server( &m, RCV_NON_BLOCKING );
+		if( rv == 0 ) {
+			break;
+		}
+		if( rv == -1 ) {
+			if( errno == EBADMSG ) {
+				continue;    // malformed, already reported
+			}
+			errno = ENOTCONN;
+			return -1;
+		}
+		++n;
+
+		e = pec_find( m.corr_id );
+		if( e == NULL ) {
+			if( m.fd != -1 )  close( m.fd );
+			continue;
+		}
+		pec_deliver( e, &m );
+	}
+	return n + pec_expire();
+}
+
+//--------------------------------------------------------------------
+//  pec_poll()
+//      Wait up to timeout_ms (-1 no limit) for printem, then dispatch
+//  returns:
+//      number of messages taken
+//       0  timed out
+//      -1  connection lost (ENOTCONN) or interrupted by a signal (EINTR)
+//--------------------------------------------------------------------
+int pec_poll( int timeout_ms )
+{
+	struct pollfd pfd;
+	int64_t deadline = pec_now_ms() + timeout_ms;
+	int n;
+
+	// Wakes for request deadlines, and every PEC_SYSV_POLL_MS on SysV
+	for( ;; )
+	{
+		pfd.fd = pec_fd();
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if( poll( &pfd, 1, pec_next_ms( timeout_ms ) ) == -1 ) {
+			return -1;
+		}
+		n = pec_dispatch();
+		if( n != 0 ) {
+			return n;
+		}
+		if( timeout_ms >= 0 ) {
+			timeout_ms = (int)(deadline - pec_now_ms());
+			if( timeout_ms <= 0 ) {
+				return 0;
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  pec_wait()
+//      Wait for the final response to a request submitted without a
+//      callback.  A request given up on (timeout or signal) is
+//      cancelled (pec_cancel()), so printem forgets it too and does not
+//      start a bus sequence for it; a late answer to it is dropped.
+//  returns:
+//       1  final response in *rsp, rsp->fd is the caller's
+//       0  timed out
+//      -1  not a request in flight, connection lost (ENOTCONN) or
+//          interrupted (EINTR)
+//--------------------------------------------------------------------
+int pec_wait( unsigned int corr_id, pp_msg *rsp, int timeout_ms )
+{
+	pec_entry *e = pec_find( corr_id );
+	int64_t deadline = pec_now_ms() + timeout_ms;
+	int64_t left = timeout_ms;
+
+	if( (e == NULL) || (e->cb != NULL) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	while( !e->done )
+	{
+		if( timeout_ms >= 0 ) {
+			left = deadline - pec_now_ms();
+			if( left <= 0 ) {
+				pec_cancel( corr_id );
+				return 0;
+			}
+		}
+		if( pec_poll( (int)left ) == -1 ) {
+			int err = errno;
+			pec_cancel( corr_id );
+			errno = err;
+			return -1;
+		}
+	}
+	*rsp = e->rsp;
+	e->rsp.fd = -1;
+	pec_release( e );
+	return 1;
+}
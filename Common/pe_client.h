@@ -0,0 +1,59 @@
+
+//--------------------------------------------------------------------
+// Printer Emulator Client Library
+//--------------------------------------------------------------------
+// The supported way for a program to talk to printem.  It connects over
+// printem's socket, or its SysV queue when the socket is not there, and
+// keeps track of the requests in flight by correlation id.
+//
+// Requests are submitted with an optional callback.  The callback gets
+// every message for its request: the acknowledgement, any SERVER_RESET,
+// the final result and, for a subscription, each event.  Submitting
+// returns the correlation id, which also serves as a future:
+// pec_wait() returns the request's final response.
+//
+// Nothing happens behind the caller's back.  Messages are read and
+// callbacks run only in pec_dispatch(), pec_poll() and pec_wait(), so a
+// program with its own event loop puts pec_fd() in its poll set and
+// calls pec_dispatch() when it is readable.  On the SysV fallback there
+// is no descriptor (pec_fd() is -1) and the queue has to be checked
+// every PEC_SYSV_POLL_MS instead.
+//
+// A response may carry a descriptor (PP_FLAG_FD).  A callback takes it
+// by setting rsp->fd to -1; otherwise it is closed when the callback
+// returns.  pec_wait() hands it to its caller.
+//
+// Every request carries the timeout set by pec_set_timeout(), and
+// printem answers SERVER_TIMEOUT if it cannot complete it in time.  In
+// case printem cannot answer at all, the library gives the request
+// PEC_TIMEOUT_GRACE_MS more and then completes it with a SERVER_TIMEOUT
+// of its own.  pec_cancel() withdraws a request at any time.
+//--------------------------------------------------------------------
+#include "message_services.h"
+
+// Requests in flight, subscription included
+#define PEC_MAX_PENDING   32
+
+// Queue check interval when there is no descriptor to poll
+#define PEC_SYSV_POLL_MS  10
+
+// Default request timeout, printem's own default limit
+#define PEC_TIMEOUT_MS        300000
+
+// Time printem has after a timeout to answer it
+#define PEC_TIMEOUT_GRACE_MS  2000
+
+typedef void (*pec_callback)( pp_msg *rsp, void *arg );
+
+int pec_connect( void );
+void pec_close( void );
+int pec_fd( void );
+unsigned int pec_submit( int op, unsigned int flags, pec_callback cb, void *arg );
+unsigned int pec_subscribe( unsigned int events, unsigned int rate_ms, pec_callback cb, void *arg );
+int pec_cancel( unsigned int corr_id );
+void pec_set_timeout( unsigned int timeout_ms );
+int pec_next_ms( int timeout_ms );
+int pec_dispatch( void );
+int pec_poll( int timeout_ms );
+int pec_wait( unsigned int corr_id, pp_msg *rsp, int timeout_ms );
+int pec_is_final( const pp_msg *rsp );
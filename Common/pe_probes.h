@@ -0,0 +1,41 @@
+
+//--------------------------------------------------------------------
+// Static tracepoints
+//--------------------------------------------------------------------
+// USDT probes in printem, provider "printem", for latency work on a
+// live unit without rebuilding with -d.  Built with <sys/sdt.h>
+// (systemtap-sdt-dev, headers only, no library) each probe is a nop
+// and an ELF note; bpftrace or perf attach to it on the running
+// process, and it costs nothing while nothing is attached:
+//
+//     bpftrace -e 'usdt:./printem:printem:tx { @bytes = hist(arg2); }'
+//     perf probe -x ./printem sdt_printem:state
+//
+// Without the header, or built with -DPE_NO_PROBES, the probes compile
+// to nothing.
+//
+//     state     before, after              parser state change (state_t)
+//     frame     state, buf, len            frame complete in the parser
+//     tx        buf, len, written          reply written to the 1022
+//     flush     fd, len, rv                storage batch written (storage.h)
+//     sync      fd, us                     storage fdatasync and its time
+//     msg_recv  op, corr_id, client_id     client request received
+//     msg_send  op, status, corr_id, rv    response or event sent
+//--------------------------------------------------------------------
+
+#if !defined(PE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PE_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PE_PROBES_ENABLED
+#define PE_PROBE2(name, a, b)        DTRACE_PROBE2( printem, name, a, b )
+#define PE_PROBE3(name, a, b, c)     DTRACE_PROBE3( printem, name, a, b, c )
+#define PE_PROBE4(name, a, b, c, d)  DTRACE_PROBE4( printem, name, a, b, c, d )
+#else
+#define PE_PROBE2(name, a, b)        do { } while( 0 )
+#define PE_PROBE3(name, a, b, c)     do { } while( 0 )
+#define PE_PROBE4(name, a, b, c, d)  do { } while( 0 )
+#endif
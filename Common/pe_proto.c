@@ -0,0 +1,484 @@
+
+//--------------------------------------------------------------------
+//  pe_proto.c
+//      Encode and decode Printer Emulator protocol messages
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "pe_proto.h"
+
+//--------------------------------------------------------------------
+//  pp_init()
+//      Empty message: header only
+//--------------------------------------------------------------------
+void pp_init( pp_msg *m, int op, int status )
+{
+	m->op = op;
+	m->status = status;
+	m->flags = 0;
+	m->corr_id = 0;
+	m->fields = 0;
+	m->client_id = 0;
+	m->unit = 0;
+	m->logmode = 0;
+	m->path[0] = '\0';
+	m->text[0] = '\0';
+	m->n_counters = 0;
+	m->events = 0;
+	m->rate_ms = 0;
+	m->event = 0;
+	m->time_us = 0;
+	m->data_len = 0;
+	m->timeout_ms = 0;
+	m->fd = -1;
+}
+
+//--------------------------------------------------------------------
+//  pp_set_path()
+//--------------------------------------------------------------------
+void pp_set_path( pp_msg *m, const char *path )
+{
+	snprintf( m->path, sizeof(m->path), "%s", path );
+	m->fields |= PP_F_PATH;
+}
+
+//--------------------------------------------------------------------
+//  pp_set_text()
+//--------------------------------------------------------------------
+void pp_set_text( pp_msg *m, const char *fmt, ... )
+{
+	va_list ap;
+
+	va_start( ap, fmt );
+	vsnprintf( m->text, sizeof(m->text), fmt, ap );
+	va_end( ap );
+	m->fields |= PP_F_TEXT;
+}
+
+//--------------------------------------------------------------------
+//  pp_set_logmode()
+//--------------------------------------------------------------------
+void pp_set_logmode( pp_msg *m, int logmode )
+{
+	m->logmode = logmode;
+	m->fields |= PP_F_LOGMODE;
+}
+
+//--------------------------------------------------------------------
+//  pp_set_data()
+//      Bytes beyond PP_DATA_SIZE are dropped
+//--------------------------------------------------------------------
+void pp_set_data( pp_msg *m, const unsigned char *data, int len )
+{
+	if( len > PP_DATA_SIZE ) {
+		len = PP_DATA_SIZE;
+	}
+	memcpy( m->data, data, len );
+	m->data_len = len;
+	m->fields |= PP_F_DATA;
+}
+
+//--------------------------------------------------------------------
+//  pp_add_counter()
+//      Extra counters beyond PP_MAX_COUNTERS are dropped
+//--------------------------------------------------------------------
+void pp_add_counter( pp_msg *m, int id, uint64_t value )
+{
+	if( m->n_counters < PP_MAX_COUNTERS ) {
+		m->counter_id[m->n_counters] = id;
+		m->counter[m->n_counters] = value;
+		++m->n_counters;
+	}
+}
+
+//--------------------------------------------------------------------
+//  pp_get_counter()
+//  returns:
+//       0  found, *value set
+//      -1  not in the message
+//--------------------------------------------------------------------
+int pp_get_counter( const pp_msg *m, int id, uint64_t *value )
+{
+	for( int i = 0; i < m->n_counters; i++ ) {
+		if( m->counter_id[i] == id ) {
+			*value = m->counter[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  pp_put_field()
+//  returns:
+//      new encoded length, -1 if the field does not fit
+//--------------------------------------------------------------------
+static int pp_put_field( unsigned char *buf, int pos, int size,
+						 int tag, const void *val, int val_len )
+{
+	uint16_t len = val_len;
+
+	if( pos + 3 + val_len > size ) {
+		return -1;
+	}
+	buf[pos] = tag;
+	memcpy( buf + pos + 1, &len, 2 );
+	memcpy( buf + pos + 3, val, val_len );
+	return pos + 3 + val_len;
+}
+
+//--------------------------------------------------------------------
+//  pp_encode()
+//      Requests (status 0) also carry the client's reply queue
+//  returns:
+//      encoded length
+//      -1  buf too small
+//--------------------------------------------------------------------
+int pp_encode( const pp_msg *m, unsigned char *buf, int size )
+{
+	int pos = PP_HDR_SIZE;
+	int32_t i32;
+	uint32_t u32;
+	uint16_t u16;
+	int64_t i64;
+	unsigned char u8, ctr[10];
+
+	if( size < PP_HDR_SIZE ) {
+		return -1;
+	}
+	if( m->status == 0 ) {
+		i32 = m->client_id;
+		pos = pp_put_field( buf, pos, size, PP_T_REPLY_MQ, &i32, 4 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_UNIT) ) {
+		u32 = m->unit;
+		pos = pp_put_field( buf, pos, size, PP_T_UNIT, &u32, 4 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_LOGMODE) ) {
+		u8 = m->logmode;
+		pos = pp_put_field( buf, pos, size, PP_T_LOGMODE, &u8, 1 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_PATH) ) {
+		pos = pp_put_field( buf, pos, size, PP_T_PATH, m->path, strlen( m->path ) );
+	}
+	if( (pos != -1) && (m->fields & PP_F_TEXT) ) {
+		pos = pp_put_field( buf, pos, size, PP_T_TEXT, m->text, strlen( m->text ) );
+	}
+	if( (pos != -1) && (m->fields & PP_F_EVENTS) ) {
+		u32 = m->events;
+		pos = pp_put_field( buf, pos, size, PP_T_EVENTS, &u32, 4 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_RATE) ) {
+		u32 = m->rate_ms;
+		pos = pp_put_field( buf, pos, size, PP_T_RATE, &u32, 4 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_EVENT) ) {
+		u8 = m->event;
+		pos = pp_put_field( buf, pos, size, PP_T_EVENT, &u8, 1 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_TIME) ) {
+		i64 = m->time_us;
+		pos = pp_put_field( buf, pos, size, PP_T_TIME, &i64, 8 );
+	}
+	if( (pos != -1) && (m->fields & PP_F_DATA) ) {
+		pos = pp_put_field( buf, pos, size, PP_T_DATA, m->data, m->data_len );
+	}
+	if( (pos != -1) && (m->fields & PP_F_TIMEOUT) ) {
+		u32 = m->timeout_ms;
+		pos = pp_put_field( buf, pos, size, PP_T_TIMEOUT, &u32, 4 );
+	}
+	for( int i = 0; (pos != -1) && (i < m->n_counters); i++ ) {
+		memcpy( ctr, &m->counter_id[i], 2 );
+		memcpy( ctr + 2, &m->counter[i], 8 );
+		pos = pp_put_field( buf, pos, size, PP_T_COUNTER, ctr, 10 );
+	}
+	if( pos == -1 ) {
+		return -1;
+	}
+
+	u16 = pos;
+	memcpy( buf, &u16, 2 );
+	buf[2] = PP_VERSION;
+	buf[3] = m->op;
+	buf[4] = m->status;
+	buf[5] = m->flags & ~PP_FLAG_FD;
+	if( m->fd >= 0 ) {
+		buf[5] |= PP_FLAG_FD;
+	}
+	buf[6] = buf[7] = 0;
+	memcpy( buf + 8, &m->corr_id, 4 );
+	return pos;
+}
+
+//--------------------------------------------------------------------
+//  pp_get_str()
+//      Field value to a NUL terminated string, truncated to fit
+//--------------------------------------------------------------------
+static void pp_get_str( char *dst, int dst_size, const unsigned char *val, int len )
+{
+	if( len > dst_size - 1 ) {
+		len = dst_size - 1;
+	}
+	memcpy( dst, val, len );
+	dst[len] = '\0';
+}
+
+//--------------------------------------------------------------------
+//  pp_decode()
+//  returns:
+//       0  success
+//      -1  malformed message or other version
+//--------------------------------------------------------------------
+int pp_decode( pp_msg *m, const unsigned char *buf, int len )
+{
+	uint16_t msg_len, f_len;
+	int pos = PP_HDR_SIZE;
+	int32_t i32;
+	uint32_t u32;
+
+	if( len < PP_HDR_SIZE ) {
+		return -1;
+	}
+	memcpy( &msg_len, buf, 2 );
+	if( (msg_len != len) || (buf[2] != PP_VERSION) ) {
+		return -1;
+	}
+	pp_init( m, buf[3], buf[4] );
+	m->flags = buf[5];
+	memcpy( &m->corr_id, buf + 8, 4 );
+
+	while( pos < len )
+	{
+		int tag = buf[pos];
+		const unsigned char *val = buf + pos + 3;
+
+		if( pos + 3 > len ) {
+			return -1;
+		}
+		memcpy( &f_len, buf + pos + 1, 2 );
+		if( pos + 3 + f_len > len ) {
+			return -1;
+		}
+		switch( tag )
+		{
+		case PP_T_REPLY_MQ:
+			if( f_len != 4 )  return -1;
+			memcpy( &i32, val, 4 );
+			m->client_id = i32;
+			break;
+		case PP_T_UNIT:
+			if( f_len != 4 )  return -1;
+			memcpy( &u32, val, 4 );
+			m->unit = u32;
+			break;
+		case PP_T_LOGMODE:
+			if( f_len != 1 )  return -1;
+			m->logmode = val[0];
+			break;
+		case PP_T_PATH:
+			pp_get_str( m->path, sizeof(m->path), val, f_len );
+			break;
+		case PP_T_TEXT:
+			pp_get_str( m->text, sizeof(m->text), val, f_len );
+			break;
+		case PP_T_COUNTER:
+			if( f_len != 10 )  return -1;
+			if( m->n_counters < PP_MAX_COUNTERS ) {
+				memcpy( &m->counter_id[m->n_counters], val, 2 );
+				memcpy( &m->counter[m->n_counters], val + 2, 8 );
+				++m->n_counters;
+			}
+			break;
+		case PP_T_EVENTS:
+			if( f_len != 4 )  return -1;
+			memcpy( &m->events, val, 4 );
+			break;
+		case PP_T_RATE:
+			if( f_len != 4 )  return -1;
+			memcpy( &m->rate_ms, val, 4 );
+			break;
+		case PP_T_EVENT:
+			if( f_len != 1 )  return -1;
+			m->event = val[0];
+			break;
+		case PP_T_TIME:
+			if( f_len != 8 )  return -1;
+			memcpy( &m->time_us, val, 8 );
+			break;
+		case PP_T_DATA:
+			m->data_len = (f_len > PP_DATA_SIZE) ? PP_DATA_SIZE : f_len;
+			memcpy( m->data, val, m->data_len );
+			break;
+		case PP_T_TIMEOUT:
+			if( f_len != 4 )  return -1;
+			memcpy( &m->timeout_ms, val, 4 );
+			break;
+		default:
+			// Newer field, skip it
+			break;
+		}
+		if( tag < 32 ) {
+			m->fields |= 1 << tag;
+		}
+		pos += 3 + f_len;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  pp_op_name()
+//--------------------------------------------------------------------
+const char *pp_op_name( int op )
+{
+	switch( op ) {
+	case CLIENT_INIT:         return "logmode";    // answered with the logmode state
+	case CLIENT_REQ_REPORT:   return "report";
+	case CLIENT_REQ_HISTORY:  return "history";
+	case CLIENT_REQ_LOG:      return "logmode";
+	case CLIENT_REQ_EXIT:     return "exit";
+	case CLIENT_SUBSCRIBE:    return "subscribe";
+	case CLIENT_CANCEL:       return "cancel";
+	case CLIENT_METRICS:      return "metrics";
+	}
+	return "request";
+}
+
+//--------------------------------------------------------------------
+//  pp_counter_name()
+//      NULL for an id this version does not know
+//--------------------------------------------------------------------
+const char *pp_counter_name( int id )
+{
+	switch( id ) {
+	case PP_C_NEW_RECORDS:  return "new_records";
+	case PP_C_RECORDS:      return "records";
+	case PP_C_DROPPED:      return "dropped";
+	case PP_C_DURATION_MS:  return "duration_ms";
+	case PP_C_WAIT_MS:      return "wait_ms";
+	case PP_C_DATA_MS:      return "data_ms";
+	case PP_C_ROUNDS:       return "rounds";
+	case PP_C_GAP_MAX_MS:   return "gap_max_ms";
+	case PP_C_REPLY_US:     return "reply_us";
+	}
+	return NULL;
+}
+
+//--------------------------------------------------------------------
+//  Event class names, as pp_event_parse() accepts them
+//--------------------------------------------------------------------
+static const struct {
+	int         event;
+	const char *name;
+} pp_events[] = {
+	{ PP_EV_READINGS, "readings" },
+	{ PP_EV_LOG,      "log"      },
+	{ PP_EV_DIVERT,   "divert"   },
+	{ PP_EV_STATE,    "state"    },
+};
+#define PP_NUM_EVENTS (sizeof(pp_events) / sizeof(pp_events[0]))
+
+//--------------------------------------------------------------------
+//  pp_event_name()
+//--------------------------------------------------------------------
+const char *pp_event_name( int event )
+{
+	for( size_t i = 0; i < PP_NUM_EVENTS; i++ ) {
+		if( pp_events[i].event == event ) {
+			return pp_events[i].name;
+		}
+	}
+	return "event";
+}
+
+//--------------------------------------------------------------------
+//  pp_event_parse()
+//      Comma separated class names, or "all"
+//  returns:
+//       0  success, *events set
+//      -1  unknown name
+//--------------------------------------------------------------------
+int pp_event_parse( const char *list, unsigned int *events )
+{
+	char name[32];
+	size_t n, i;
+
+	*events = 0;
+	while( *list )
+	{
+		n = strcspn( list, "," );
+		snprintf( name, sizeof(name), "%.*s", (int)n, list );
+		if( !strcmp( name, "all" ) ) {
+			*events |= PP_EV_ALL;
+		} else {
+			for( i = 0; i < PP_NUM_EVENTS; i++ ) {
+				if( !strcmp( name, pp_events[i].name ) ) {
+					*events |= pp_events[i].event;
+					break;
+				}
+			}
+			if( i == PP_NUM_EVENTS ) {
+				return -1;
+			}
+		}
+		list += n;
+		if( *list == ',' ) {
+			++list;
+		}
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  pp_describe()
+//      One line summary of a message for display, in the words the
+//      string responses used: "report <file>", "logmode 0 <file>",
+//      "history busy".  An event is its class and its data, with the
+//      bytes that are not printable escaped.
+//--------------------------------------------------------------------
+const char *pp_describe( const pp_msg *m, char *buf, int size )
+{
+	int n = 0;
+
+	buf[0] = '\0';
+	if( m->fields & PP_F_EVENT ) {
+		n += snprintf( buf + n, size - n, "%s ", pp_event_name( m->event ) );
+		for( int i = 0; (i < m->data_len) && (n < size - 5); i++ ) {
+			unsigned char c = m->data[i];
+			if( (c >= 0x20) && (c < 0x7F) ) {
+				buf[n++] = c;
+			} else {
+				n += snprintf( buf + n, size - n, "\\x%02X", c );
+			}
+		}
+		if( n < size - 1 ) {
+			buf[n++] = ' ';
+			buf[n] = '\0';
+		}
+	} else if( m->fields & PP_F_LOGMODE ) {
+		n += snprintf( buf + n, size - n, "logmode %d ", m->logmode );
+	} else {
+		n += snprintf( buf + n, size - n, "%s ", pp_op_name( m->op ) );
+	}
+	if( (m->fields & PP_F_PATH) && (n < size) ) {
+		n += snprintf( buf + n, size - n, "%s ", m->path );
+	}
+	if( (m->fields & PP_F_TEXT) && (n < size) ) {
+		n += snprintf( buf + n, size - n, "%s ", m->text );
+	}
+	for( int i = 0; (i < m->n_counters) && (n < size); i++ ) {
+		const char *name = pp_counter_name( m->counter_id[i] );
+		if( name != NULL ) {
+			n += snprintf( buf + n, size - n, "%s=%llu ", name, (unsigned long long)m->counter[i] );
+		} else {
+			n += snprintf( buf + n, size - n, "[%u]=%llu ", m->counter_id[i],
+						   (unsigned long long)m->counter[i] );
+		}
+	}
+	// Drop the trailing space
+	if( (n > 0) && (n < size) ) {
+		buf[n - 1] = '\0';
+	}
+	return buf;
+}
@@ -0,0 +1,173 @@
+
+//--------------------------------------------------------------------
+// Printer Emulator Protocol
+//--------------------------------------------------------------------
+// Wire format of the requests and responses exchanged between printem
+// and its clients, on either message transport.
+//
+// A message is a fixed header followed by typed fields:
+//
+//     header  len:u16  version:u8  op:u8  status:u8  flags:u8  pad:u16
+//             corr_id:u32                                    (12 bytes)
+//     field   tag:u8  size:u16  value[size]              (0 or more)
+//
+// len is the length of the whole message.  Numbers are in host byte
+// order; both ends are on the same host.  Only the fields a message
+// needs are sent, so the common replies are a few dozen bytes, and a
+// path is as long as the path.
+//
+// A socket message may carry a descriptor (SCM_RIGHTS) beside it: a
+// client that sets PP_FLAG_WANT_FD gets a report or history result as a
+// sealed memfd it can mmap, flagged PP_FLAG_FD, as well as the path.
+//
+// A socket client may also subscribe (CLIENT_SUBSCRIBE) to classes of
+// bus events.  printem then pushes each event as it is parsed, status
+// SERVER_EVENT with the subscription's corr_id, until the client
+// subscribes to no classes or disconnects.  With a rate (ms) a class is
+// sent at most once per interval; the events left out are counted in
+// PP_C_DROPPED on the next one delivered.
+//
+// A request may carry a timeout (ms).  printem answers SERVER_TIMEOUT
+// if it cannot complete the request in that time, or in its own limit
+// if that is shorter, or when the bus sequence serving it stalls.  A
+// client that stops waiting sends CLIENT_CANCEL with the corr_id of the
+// request; printem forgets the request and answers the cancel.
+//
+// A Report, History or logmode off completion carries the timing of the
+// sequence as counters: total, 1022 wait, data, records, largest gap
+// between records and printem's reply time (PP_C_DURATION_MS ...).
+//
+// CLIENT_METRICS is answered with the path of printem's metrics file
+// (Prometheus text format), written for the request, and with its
+// content as a memfd when PP_FLAG_WANT_FD is set.
+//
+// A request flagged PP_FLAG_BULK is background work, such as a scheduled
+// history pull: printem serves it after the interactive requests, and
+// may refuse it while the bus is busy with a history sequence.
+//
+// A decoder rejects a message whose header version differs from its
+// own.  Within a version new fields are added as new tags, and tags a
+// decoder does not know are skipped.
+//--------------------------------------------------------------------
+
+#include <stdint.h>
+
+#define PP_VERSION      1
+
+// Largest encoded message
+#define PP_MAX_MSG      2048
+#define PP_HDR_SIZE     12
+
+#define PP_PATH_SIZE    1024
+#define PP_TEXT_SIZE    256
+#define PP_MAX_COUNTERS 8
+#define PP_DATA_SIZE    256
+
+// Request ops and response status (also the SysV mtype, so non-zero)
+#define CLIENT_INIT         1
+#define CLIENT_REQ_REPORT   2
+#define CLIENT_REQ_HISTORY  3
+#define CLIENT_REQ_LOG      4
+#define CLIENT_REQ_EXIT     5
+#define CLIENT_SUBSCRIBE    6
+#define CLIENT_CANCEL       7   // corr_id names the request to cancel
+#define CLIENT_METRICS      8   // printem's metrics, answered at once
+
+#define SERVER_REQUEST_SUCCESS  1
+#define SERVER_REQUEST_FAILURE  2
+#define SERVER_ACTION_SUCCESS   3
+#define SERVER_ACTION_FAILURE   4
+#define SERVER_RESET            5
+#define SERVER_EVENT            6   // pushed to a subscriber
+#define SERVER_TIMEOUT          7   // not completed in time, request dropped
+
+// Header flags
+#define PP_FLAG_WANT_FD  0x01  // request: result content as a sealed memfd
+#define PP_FLAG_FD       0x02  // response: a memfd with the content is attached
+#define PP_FLAG_BULK     0x04  // request: background work, yields to interactive
+
+// Field tags
+#define PP_T_REPLY_MQ   1      // i32  client SysV queue for responses
+#define PP_T_UNIT       2      // u32  unit (1022) the message is about
+#define PP_T_LOGMODE    3      // u8   logmode state
+#define PP_T_PATH       4      // str  data file
+#define PP_T_TEXT       5      // str  human readable detail
+#define PP_T_COUNTER    6      // u16 id, u64 value (repeats)
+#define PP_T_EVENTS     7      // u32  PP_EV_* classes subscribed to
+#define PP_T_RATE       8      // u32  least ms between events of a class
+#define PP_T_EVENT      9      // u8   PP_EV_* class of this event
+#define PP_T_TIME       10     // i64  event time, us since the epoch
+#define PP_T_DATA       11     // raw  event bytes as seen on the bus
+#define PP_T_TIMEOUT    12     // u32  ms the client will wait for the result
+
+// pp_msg.fields bits, one per field present
+#define PP_F_REPLY_MQ   (1 << PP_T_REPLY_MQ)
+#define PP_F_UNIT       (1 << PP_T_UNIT)
+#define PP_F_LOGMODE    (1 << PP_T_LOGMODE)
+#define PP_F_PATH       (1 << PP_T_PATH)
+#define PP_F_TEXT       (1 << PP_T_TEXT)
+#define PP_F_EVENTS     (1 << PP_T_EVENTS)
+#define PP_F_RATE       (1 << PP_T_RATE)
+#define PP_F_EVENT      (1 << PP_T_EVENT)
+#define PP_F_TIME       (1 << PP_T_TIME)
+#define PP_F_DATA       (1 << PP_T_DATA)
+#define PP_F_TIMEOUT    (1 << PP_T_TIMEOUT)
+
+// Event classes
+#define PP_EV_READINGS  0x01   // refractometer display frame
+#define PP_EV_LOG       0x02   // logmode record
+#define PP_EV_DIVERT    0x04   // logmode record of a divert
+#define PP_EV_STATE     0x08   // bus sequence changed: data is its name
+#define PP_EV_ALL       0x0F
+
+// Counter ids
+#define PP_C_NEW_RECORDS  1    // history records new since last harvest
+#define PP_C_RECORDS      2    // records in a data file
+#define PP_C_DROPPED      3    // events not sent since the last one
+#define PP_C_DURATION_MS  4    // sequence timing, in completion messages
+#define PP_C_WAIT_MS      5    //   start to first data record
+#define PP_C_DATA_MS      6    //   receiving data records
+#define PP_C_ROUNDS       7    //   data (or logmode) records
+#define PP_C_GAP_MAX_MS   8    //   longest gap between records
+#define PP_C_REPLY_US     9    //   printem's time answering the 1022
+
+// Decoded message
+typedef struct pp_msg
+{
+	int          op;           // CLIENT_* request type (echoed in responses)
+	int          status;       // SERVER_* in responses, 0 in requests
+	unsigned int flags;        // PP_FLAG_*
+	unsigned int corr_id;      // client chosen, echoed in responses
+	unsigned int fields;       // PP_F_* present
+	int          client_id;    // reply queue, or socket client (server side)
+	unsigned int unit;
+	int          logmode;
+	char         path[PP_PATH_SIZE];
+	char         text[PP_TEXT_SIZE];
+	int          n_counters;
+	uint16_t     counter_id[PP_MAX_COUNTERS];
+	uint64_t     counter[PP_MAX_COUNTERS];
+	unsigned int events;       // PP_EV_* subscribed to
+	unsigned int rate_ms;
+	int          event;        // PP_EV_* of a SERVER_EVENT
+	int64_t      time_us;
+	int          data_len;
+	unsigned char data[PP_DATA_SIZE];
+	unsigned int timeout_ms;   // request deadline, from its receipt
+	int          fd;           // memfd passed beside the encoding, -1 none
+} pp_msg;
+
+void pp_init( pp_msg *m, int op, int status );
+void pp_set_path( pp_msg *m, const char *path );
+void pp_set_text( pp_msg *m, const char *fmt, ... );
+void pp_set_logmode( pp_msg *m, int logmode );
+void pp_set_data( pp_msg *m, const unsigned char *data, int len );
+void pp_add_counter( pp_msg *m, int id, uint64_t value );
+int pp_get_counter( const pp_msg *m, int id, uint64_t *value );
+int pp_encode( const pp_msg *m, unsigned char *buf, int size );
+int pp_decode( pp_msg *m, const unsigned char *buf, int len );
+const char *pp_op_name( int op );
+const char *pp_counter_name( int id );
+const char *pp_event_name( int event );
+int pp_event_parse( const char *list, unsigned int *events );
+const char *pp_describe( const pp_msg *m, char *buf, int size );
@@ -0,0 +1,322 @@
+
+//--------------------------------------------------------------------
+// Storage
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>      // open(), fallocate()
+#include <unistd.h>     // write(), fdatasync(), ftruncate(), close()
+#include <time.h>       // clock_gettime()
+
+#include "storage.h"
+#include "pe_probes.h"
+
+// Policy in force for every file, set from the configuration at startup
+stg_policy stg_config = { 4096, 1000, 256, STG_SYNC_SEQUENCE, 5 };
+
+stg_stats stg_counters;
+
+// Open files, for the time driven work in stg_poll()
+static stg_file *stg_open_list = NULL;
+
+// fallocate() is not supported where the files live: stop asking
+static int stg_no_fallocate = 0;
+
+static const char *stg_sync_names[] = { "none", "record", "interval", "sequence" };
+
+//--------------------------------------------------------------------
+//  stg_now_us()
+//      Monotonic time in microseconds
+//--------------------------------------------------------------------
+static int64_t stg_now_us( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//--------------------------------------------------------------------
+//  stg_sync_name()
+//--------------------------------------------------------------------
+const char *stg_sync_name( int mode )
+{
+	if( (mode < STG_SYNC_NONE) || (mode > STG_SYNC_SEQUENCE) ) {
+		return "?";
+	}
+	return stg_sync_names[mode];
+}
+
+//--------------------------------------------------------------------
+//  stg_sync_lookup()
+//  returns:
+//      stg_sync_mode for name, -1 if unknown
+//--------------------------------------------------------------------
+int stg_sync_lookup( const char *name )
+{
+	for( int i = STG_SYNC_NONE; i <= STG_SYNC_SEQUENCE; i++ ) {
+		if( !strcmp( name, stg_sync_names[i] ) ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  stg_open()
+//      Create (truncate) a file for appending
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int stg_open( stg_file *f, const char *path )
+{
+	memset( f, 0, sizeof(*f) - sizeof(f->buf) );
+	f->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( f->fd == -1 ) {
+		return -1;
+	}
+	f->is_open = 1;
+	f->synced_us = stg_now_us();
+
+	f->next = stg_open_list;
+	stg_open_list = f;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  stg_is_open()
+//--------------------------------------------------------------------
+int stg_is_open( const stg_file *f )
+{
+	return f->is_open;
+}
+
+//--------------------------------------------------------------------
+//  stg_write_out()
+//      Hand bytes to the kernel, growing the preallocation first.
+//      FALLOC_FL_KEEP_SIZE leaves the file size alone so readers only
+//      ever see written data; the unused tail is trimmed at close.
+//--------------------------------------------------------------------
+static int stg_write_out( stg_file *f, const char *data, int len )
+{
+	off_t step = (off_t)stg_config.prealloc_kb * 1024;
+	ssize_t n;
+
+	if( (step > 0) && !stg_no_fallocate && (f->size + len > f->alloc_end) ) {
+		off_t want = f->size + len + step;
+		if( fallocate( f->fd, FALLOC_FL_KEEP_SIZE, f->alloc_end, want - f->alloc_end ) == 0 ) {
+			f->alloc_end = want;
+		} else if( (errno == EOPNOTSUPP) || (errno == ENOSYS) ) {
+			// Not supported by every file system (tmpfs ramdisk is
+			// fine); that is not an error, just write unallocated
+			stg_no_fallocate = 1;
+		} else {
+			++stg_counters.errors;
+			f->alloc_end = f->size + len;
+		}
+	}
+
+	while( len > 0 )
+	{
+		n = write( f->fd, data, len );
+		if( n <= 0 ) {
+			++stg_counters.errors;
+			return -1;
+		}
+		++stg_counters.writes;
+		stg_counters.bytes_written += n;
+		f->size += n;
+		data += n;
+		len -= n;
+	}
+	f->dirty = 1;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  stg_flush()
+//      Write out the batch
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int stg_flush( stg_file *f )
+{
+	int rv = 0;
+
+	if( f->is_open && (f->buf_len > 0) ) {
+		rv = stg_write_out( f, f->buf, f->buf_len );
+		PE_PROBE3( flush, f->fd, f->buf_len, rv );
+		f->buf_len = 0;
+	}
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  stg_sync()
+//      Flush then fdatasync, timing the sync
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int stg_sync( stg_file *f )
+{
+	int64_t t0, us;
+	int rv;
+
+	rv = stg_flush( f );
+	if( !f->is_open || !f->dirty ) {
+		return rv;
+	}
+
+	t0 = stg_now_us();
+	if( fdatasync( f->fd ) == -1 ) {
+		++stg_counters.errors;
+		rv = -1;
+	}
+	f->synced_us = stg_now_us();
+	us = f->synced_us - t0;
+	PE_PROBE2( sync, f->fd, us );
+
+	++stg_counters.syncs;
+	stg_counters.sync_us_total += us;
+	if( (uint64_t)us > stg_counters.sync_us_max ) {
+		stg_counters.sync_us_max = us;
+	}
+	f->dirty = 0;
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  stg_write()
+//      Append len bytes.  The batch is flushed first if they don't fit,
+//      and a write larger than the batch goes straight to the kernel.
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int stg_write( stg_file *f, const void *data, int len )
+{
+	int batch = stg_config.batch_bytes;
+	int rv = 0;
+
+	if( !f->is_open ) {
+		return -1;
+	}
+	if( batch > STG_BUF_SIZE ) {
+		batch = STG_BUF_SIZE;
+	}
+
+	if( f->buf_len + len > batch ) {
+		rv = stg_flush( f );
+	}
+	if( len >= batch ) {
+		int wr = stg_write_out( f, (const char *)data, len );
+		PE_PROBE3( flush, f->fd, len, wr );
+		if( wr == -1 ) {
+			rv = -1;
+		}
+	} else {
+		if( f->buf_len == 0 ) {
+			f->pending_us = stg_now_us();
+		}
+		memcpy( f->buf + f->buf_len, data, len );
+		f->buf_len += len;
+	}
+
+	if( stg_config.sync_mode == STG_SYNC_RECORD ) {
+		if( stg_sync( f ) == -1 ) {
+			rv = -1;
+		}
+	}
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  stg_close()
+//      Closing a file ends its sequence: flush, sync unless the policy
+//      is none, and give back the unused preallocation.
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int stg_close( stg_file *f )
+{
+	int rv = 0, fd;
+
+	if( !f->is_open ) {
+		return 0;
+	}
+	if( stg_config.sync_mode != STG_SYNC_NONE ) {
+		rv = stg_sync( f );
+	}
+	fd = stg_detach( f );
+	if( fd == -1 ) {
+		rv = -1;
+	} else {
+		close( fd );
+	}
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  stg_detach()
+//      Flush and trim the file, then hand its descriptor to the caller
+//      without syncing or closing it.  Lets a background thread pay for
+//      the sync instead of the caller.
+//  returns:
+//      file descriptor, -1 on failure
+//--------------------------------------------------------------------
+int stg_detach( stg_file *f )
+{
+	stg_file **pp;
+	int fd;
+
+	if( !f->is_open ) {
+		return -1;
+	}
+	stg_flush( f );
+	if( f->alloc_end > f->size ) {
+		ftruncate( f->fd, f->size );
+	}
+	fd = f->fd;
+	f->fd = -1;
+	f->is_open = 0;
+
+	for( pp = &stg_open_list; *pp != NULL; pp = &(*pp)->next ) {
+		if( *pp == f ) {
+			*pp = f->next;
+			break;
+		}
+	}
+	return fd;
+}
+
+//--------------------------------------------------------------------
+//  stg_poll()
+//      Time driven flushes and interval syncs.  Called from the main
+//      loop; costs one clock read when nothing is due.
+//--------------------------------------------------------------------
+void stg_poll( void )
+{
+	stg_file *f;
+	int64_t now;
+
+	if( stg_open_list == NULL ) {
+		return;
+	}
+	now = stg_now_us();
+	for( f = stg_open_list; f != NULL; f = f->next )
+	{
+		if( (f->buf_len > 0)
+			&& (now - f->pending_us >= (int64_t)stg_config.batch_ms * 1000) ) {
+			stg_flush( f );
+		}
+		if(    (stg_config.sync_mode == STG_SYNC_INTERVAL) && f->dirty
+			&& (now - f->synced_us >= (int64_t)stg_config.sync_seconds * 1000000) ) {
+			stg_sync( f );
+		}
+	}
+}
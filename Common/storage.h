@@ -0,0 +1,81 @@
+
+//--------------------------------------------------------------------
+// Storage
+//--------------------------------------------------------------------
+// Append-only output files on flash (SD card on the target).  Writes are
+// batched in memory and handed to the kernel as one write(2) once enough
+// bytes are buffered or the oldest buffered byte is old enough.  Files
+// grow in preallocated (fallocate) steps, and fdatasync is issued only as
+// the configured policy asks for it.  This trades durability against
+// flash wear and reply-path jitter explicitly.
+//
+// A single stg_write() is never split across two batches, so a record
+// written in one call reaches the file whole.
+//--------------------------------------------------------------------
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Largest batch buffered per file
+#define STG_BUF_SIZE    16384
+
+// When fdatasync is issued
+typedef enum {
+	STG_SYNC_NONE,         // never, leave it to the kernel
+	STG_SYNC_RECORD,       // after every stg_write
+	STG_SYNC_INTERVAL,     // at most every sync_seconds while dirty
+	STG_SYNC_SEQUENCE,     // when the file is closed at the end of a sequence
+} stg_sync_mode;
+
+typedef struct stg_policy
+{
+	int batch_bytes;       // flush when this many bytes are buffered (0 = write through)
+	int batch_ms;          // ... or when the oldest buffered byte is this old
+	int prealloc_kb;       // grow files in steps of this size (0 = off)
+	int sync_mode;         // stg_sync_mode
+	int sync_seconds;      // STG_SYNC_INTERVAL period
+} stg_policy;
+
+// Counters over all files since startup
+typedef struct stg_stats
+{
+	uint64_t bytes_written;  // bytes handed to write(2)
+	uint64_t writes;         // write(2) calls
+	uint64_t syncs;          // fdatasync(2) calls
+	uint64_t sync_us_total;  // time spent in fdatasync
+	uint64_t sync_us_max;    // longest single fdatasync
+	uint64_t errors;         // failed write, fallocate or sync
+} stg_stats;
+
+typedef struct stg_file
+{
+	int      fd;
+	int      is_open;
+	int      buf_len;
+	int64_t  pending_us;     // when the oldest buffered byte arrived
+	int64_t  synced_us;      // last fdatasync (or open)
+	int      dirty;          // written since the last sync
+	off_t    size;           // bytes written to the file
+	off_t    alloc_end;      // end of the preallocated region
+	struct stg_file *next;   // open file list walked by stg_poll()
+	char     buf[STG_BUF_SIZE];
+} stg_file;
+
+extern stg_policy stg_config;
+extern stg_stats stg_counters;
+
+const char *stg_sync_name( int mode );
+int stg_sync_lookup( const char *name );
+
+int stg_open( stg_file *f, const char *path );
+int stg_is_open( const stg_file *f );
+int stg_write( stg_file *f, const void *data, int len );
+int stg_flush( stg_file *f );
+int stg_sync( stg_file *f );
+int stg_close( stg_file *f );
+int stg_detach( stg_file *f );
+void stg_poll( void );
+
+#endif  // STORAGE_H
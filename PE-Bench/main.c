@@ -0,0 +1,302 @@
+//--------------------------------------------------------------------
+// Printer Emulator Message Benchmark
+//     Measures the cost of a client request and its response in the
+//     pe_proto encoding against the fixed 256 byte string messages it
+//     replaced.  Each format is timed three ways: building and parsing
+//     the messages in memory, and a full round trip (request there,
+//     response back) over a SysV queue and over a SOCK_SEQPACKET pair.
+//     The round trips run in one process so the figures are copy and
+//     system call cost without scheduling.
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>   // EXIT_SUCCESS, atoi
+#include <string.h>
+#include <unistd.h>   // getopt
+#include <time.h>     // clock_gettime
+#include <sys/socket.h>
+
+#include "../Common/message_services.h"
+
+//--------------------------------------------------------------------
+// File scope variables
+//--------------------------------------------------------------------
+// Version String
+const char version_stg[] = {"v1.3.1"};
+
+const char * help_arr[] = {
+	"  Message format benchmark for the Printer Emulator",
+	"  Usage: pebench [options]",
+	"  Optional Arguments",
+	"    -n <count>  round trips per test (default: 100000)",
+	"    -h          display this help screen",
+};
+
+// The string format as it was before pe_proto
+#define LEGACY_PAYLOAD 256
+
+typedef struct legacy_req
+{
+	long mtype;
+	int client_id;
+	unsigned int corr_id;
+	char cmd[LEGACY_PAYLOAD];
+} legacy_req;
+
+typedef struct legacy_rsp
+{
+	long mtype;
+	unsigned int corr_id;
+	char rsp[LEGACY_PAYLOAD];
+} legacy_rsp;
+
+#define LEGACY_TEXT_SIZE(m) (sizeof(*(m)) - sizeof(long))
+
+// A typical answer: the Report file
+const char sample_path[] = "/home/lsc/Data/report-20250314081500";
+
+// Transport under test
+typedef enum {
+	BT_MEMORY,
+	BT_SYSV,
+	BT_SOCKET,
+} bench_transport;
+
+typedef struct bench_ctx
+{
+	int mq;              // SysV queue
+	int sv[2];           // socket pair: [0] client end, [1] server end
+} bench_ctx;
+
+volatile unsigned int sink;  // keeps parsed results live
+
+//--------------------------------------------------------------------
+// now_ns()
+//--------------------------------------------------------------------
+static int64_t now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//--------------------------------------------------------------------
+// legacy_round_trip()
+//     Client builds "report", server parses it and answers
+//     "report <file>", client parses the answer
+//  returns:
+//       0  success
+//      -1  transport failure
+//--------------------------------------------------------------------
+static int legacy_round_trip( bench_ctx *ctx, int transport, unsigned int id )
+{
+	legacy_req req, req_in;
+	legacy_rsp rsp, rsp_in;
+
+	memset( &req, 0, sizeof(req) );
+	req.mtype = CLIENT_REQ_REPORT;
+	req.client_id = ctx->mq;
+	req.corr_id = id;
+	strcpy( req.cmd, "report" );
+
+	if( transport == BT_SYSV ) {
+		if(    (msgsnd( ctx->mq, &req, LEGACY_TEXT_SIZE(&req), 0 ) == -1)
+			|| (msgrcv( ctx->mq, &req_in, LEGACY_TEXT_SIZE(&req_in), 0, 0 ) == -1) ) {
+			return -1;
+		}
+	} else if( transport == BT_SOCKET ) {
+		if(    (send( ctx->sv[0], &req, sizeof(req), 0 ) == -1)
+			|| (recv( ctx->sv[1], &req_in, sizeof(req_in), 0 ) == -1) ) {
+			return -1;
+		}
+	} else {
+		memcpy( &req_in, &req, sizeof(req) );
+	}
+
+	memset( &rsp, 0, sizeof(rsp) );
+	rsp.mtype = SERVER_ACTION_SUCCESS;
+	rsp.corr_id = req_in.corr_id;
+	sprintf( rsp.rsp, "%s %s", req_in.cmd, sample_path );
+
+	if( transport == BT_SYSV ) {
+		if(    (msgsnd( ctx->mq, &rsp, LEGACY_TEXT_SIZE(&rsp), 0 ) == -1)
+			|| (msgrcv( ctx->mq, &rsp_in, LEGACY_TEXT_SIZE(&rsp_in), 0, 0 ) == -1) ) {
+			return -1;
+		}
+	} else if( transport == BT_SOCKET ) {
+		if(    (send( ctx->sv[1], &rsp, sizeof(rsp), 0 ) == -1)
+			|| (recv( ctx->sv[0], &rsp_in, sizeof(rsp_in), 0 ) == -1) ) {
+			return -1;
+		}
+	} else {
+		memcpy( &rsp_in, &rsp, sizeof(rsp) );
+	}
+
+	// Client side parse, as the clients did it
+	if( !strncmp( rsp_in.rsp, "report ", 7 ) ) {
+		sink += strlen( &rsp_in.rsp[7] ) + rsp_in.corr_id;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// proto_round_trip()
+//     The same exchange in the pe_proto encoding
+//  returns:
+//       0  success
+//      -1  transport or decode failure
+//--------------------------------------------------------------------
+static int proto_round_trip( bench_ctx *ctx, int transport, unsigned int id )
+{
+	msg_buf mb;
+	pp_msg req, req_in, rsp, rsp_in;
+	ssize_t n;
+	int len;
+
+	pp_init( &req, CLIENT_REQ_REPORT, 0 );
+	req.client_id = ctx->mq;
+	req.corr_id = id;
+	len = pp_encode( &req, mb.data, sizeof(mb.data) );
+	mb.mtype = req.op;
+
+	if( transport == BT_SYSV ) {
+		if(    (msgsnd( ctx->mq, &mb, len, 0 ) == -1)
+			|| ((n = msgrcv( ctx->mq, &mb, sizeof(mb.data), 0, 0 )) == -1) ) {
+			return -1;
+		}
+	} else if( transport == BT_SOCKET ) {
+		if(    (send( ctx->sv[0], mb.data, len, 0 ) == -1)
+			|| ((n = recv( ctx->sv[1], mb.data, sizeof(mb.data), 0 )) == -1) ) {
+			return -1;
+		}
+	} else {
+		n = len;
+	}
+	if( pp_decode( &req_in, mb.data, n ) == -1 ) {
+		return -1;
+	}
+
+	pp_init( &rsp, req_in.op, SERVER_ACTION_SUCCESS );
+	rsp.corr_id = req_in.corr_id;
+	pp_set_path( &rsp, sample_path );
+	len = pp_encode( &rsp, mb.data, sizeof(mb.data) );
+	mb.mtype = rsp.status;
+
+	if( transport == BT_SYSV ) {
+		if(    (msgsnd( ctx->mq, &mb, len, 0 ) == -1)
+			|| ((n = msgrcv( ctx->mq, &mb, sizeof(mb.data), 0, 0 )) == -1) ) {
+			return -1;
+		}
+	} else if( transport == BT_SOCKET ) {
+		if(    (send( ctx->sv[1], mb.data, len, 0 ) == -1)
+			|| ((n = recv( ctx->sv[0], mb.data, sizeof(mb.data), 0 )) == -1) ) {
+			return -1;
+		}
+	} else {
+		n = len;
+	}
+	if( pp_decode( &rsp_in, mb.data, n ) == -1 ) {
+		return -1;
+	}
+
+	if( (rsp_in.op == CLIENT_REQ_REPORT) && (rsp_in.fields & PP_F_PATH) ) {
+		sink += strlen( rsp_in.path ) + rsp_in.corr_id;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// run()
+//     Time count round trips and print ns per round trip
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+static int run( bench_ctx *ctx, const char *name, int transport, int is_proto, int count )
+{
+	int64_t t0, t1;
+	int rv = 0;
+
+	t0 = now_ns();
+	for( int i = 0; (i < count) && (rv == 0); i++ ) {
+		rv = is_proto ? proto_round_trip( ctx, transport, i )
+					  : legacy_round_trip( ctx, transport, i );
+	}
+	t1 = now_ns();
+	if( rv == -1 ) {
+		perror( name );
+		return -1;
+	}
+	printf("  %-8s %-8s %8.0f ns\n", is_proto ? "pe_proto" : "string",
+		   name, (double)(t1 - t0) / count);
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// main()
+//--------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+	const char *names[] = { "memory", "sysv", "socket" };
+	bench_ctx ctx;
+	int count = 100000;
+	int c, rv = 0;
+	unsigned char buf[PP_MAX_MSG];
+	pp_msg m;
+
+	while( (c = getopt(argc, argv, "hn:")) != -1 )
+	{
+		switch( c ) {
+		case 'h':
+			for(int i = 0; i < sizeof(help_arr) / sizeof(char *); ++i) {
+				printf("%s\n", help_arr[i]);
+			}
+			return EXIT_SUCCESS;
+		case 'n':
+			count = atoi( optarg );
+			if( count <= 0 ) {
+				printf("Error - invalid count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+		case '?':
+			printf( "Unrecognized option encountered -%c\n", optopt );
+			return EXIT_FAILURE;
+		}
+	}
+
+	ctx.mq = msgget( IPC_PRIVATE, S_IRUSR | S_IWUSR );
+	if( ctx.mq == -1 ) {
+		perror("msgget");
+		return EXIT_FAILURE;
+	}
+	if( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, ctx.sv ) == -1 ) {
+		perror("socketpair");
+		msgctl( ctx.mq, IPC_RMID, NULL );
+		return EXIT_FAILURE;
+	}
+
+	printf("Message sizes (bytes following mtype)\n");
+	pp_init( &m, CLIENT_REQ_REPORT, 0 );
+	printf("  request   string %4zu  pe_proto %4d\n", LEGACY_TEXT_SIZE((legacy_req *)0),
+		   pp_encode( &m, buf, sizeof(buf) ));
+	pp_init( &m, CLIENT_REQ_REPORT, SERVER_ACTION_SUCCESS );
+	pp_set_path( &m, sample_path );
+	printf("  response  string %4zu  pe_proto %4d\n", LEGACY_TEXT_SIZE((legacy_rsp *)0),
+		   pp_encode( &m, buf, sizeof(buf) ));
+
+	printf("Round trip, %d iterations\n", count);
+	for( int t = BT_MEMORY; (t <= BT_SOCKET) && (rv == 0); t++ ) {
+		rv = run( &ctx, names[t], t, 0, count );
+		if( rv == 0 ) {
+			rv = run( &ctx, names[t], t, 1, count );
+		}
+	}
+
+	close( ctx.sv[0] );
+	close( ctx.sv[1] );
+	msgctl( ctx.mq, IPC_RMID, NULL );
+	return (rv == -1) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,7 +2,10 @@
 // Printer Emulator Console
 //     Console command line control of the Printer Emulator (printem).
 //     This program allows a user to request a Report, History or Log from
-//     the 1022.  It communicates with printem over a message queue.
+//     the 1022.  It communicates with printem over its Unix socket, or
+//     over a message queue when printem is not listening on the socket.
+//     Over the socket 'w' toggles watching the live bus events.
+//     'c' cancels the last request if it is still waiting.
 // 
 //--------------------------------------------------------------------
 
@@ -11,8 +14,9 @@
 #include <string.h>   // strcpy
 #include <signal.h>
 #include <errno.h>    // Error integer and strerror() function
+#include <poll.h>
 
-#include "../Common/message_services.h"
+#include "../Common/pe_client.h"
 #include "./client_utils.h"
 
 //--------------------------------------------------------------------
@@ -21,9 +25,10 @@
 // Version String
 const char version_stg[] = {"v1.3.1"};
 int isBreak = 0;
-client_req c_msg;
-server_rsp s_msg;
+char rsp_text[PP_PATH_SIZE + PP_TEXT_SIZE + 64];  // pp_describe() of a response
 int isLogMode = 0;
+int isWatching = 0;  // subscribed to the live events
+unsigned int corr_last = 0;  // correlation id of the last request sent
 
 //- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // Future Enhancement
@@ -35,59 +40,112 @@ int isLogMode = 0;
 //   server.
 //- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+//--------------------------------------------------------------------
+// response()
+//     Callback for every message from the Printer Emulator server
+//--------------------------------------------------------------------
+void response( pp_msg *rsp, void *arg )
+{
+	if( rsp->status == SERVER_EVENT ) {
+		printf("Event: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		return;
+	}
+
+	printf("Response to request %u\r\n", rsp->corr_id);
+	switch(rsp->status)
+	{
+	case SERVER_REQUEST_SUCCESS:
+		printf("SERVER_REQUEST_SUCCESS\r\n");
+		if( rsp->op == CLIENT_REQ_EXIT ) {
+			isBreak = 1;
+		}
+		break;
+	case SERVER_REQUEST_FAILURE:
+		printf("SERVER_REQUEST_FAILURE\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		if( rsp->op == CLIENT_SUBSCRIBE ) {
+			isWatching = 0;
+		}
+		break;
+	case SERVER_ACTION_SUCCESS:
+		printf("SERVER_ACTION_SUCCESS\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		if( rsp->fields & PP_F_LOGMODE ) {
+			isLogMode = rsp->logmode;
+			printf( "client logmode %d\r\n", isLogMode );
+		}
+		break;
+	case SERVER_ACTION_FAILURE:
+		printf("SERVER_ACTION_FAILURE\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		break;
+	case SERVER_TIMEOUT:
+		printf("SERVER_TIMEOUT\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		break;
+	case SERVER_RESET:
+		printf("SERVER_RESET\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		break;
+	}
+}
+
+//--------------------------------------------------------------------
+// request()
+//     Submit a request, its responses go to response()
+//--------------------------------------------------------------------
+void request( int op, const char *name )
+{
+	unsigned int corr_id = pec_submit( op, 0, response, NULL );
+
+	if( corr_id == 0 ) {
+		printf("%s request FAILED\r\n", name);
+	} else {
+		corr_last = corr_id;
+		printf("%s requested\r\n", name);
+	}
+}
+
 //--------------------------------------------------------------------
 // action()
 //     Receive stdin characters (as an int), validate, and dispatch messages
 //--------------------------------------------------------------------
 void action( int char_in )
 {
-	int rv;
-	
 	switch( char_in )
 	{
 	case 'h':
 	case 'H':
 		// Request History listing
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_HISTORY;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "history");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("History request FAILED\r\n");
-		} else {
-			printf("History requested\r\n");
-		}
+		request( CLIENT_REQ_HISTORY, "History" );
 		break;
 	case 'l':
 	case 'L':
 		// Toggle Log mode
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_LOG;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "log");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("Log toggle request FAILED\r\n");
-		} else {
-			printf("Log toggle requested\r\n");
-		}
+		request( CLIENT_REQ_LOG, "Log toggle" );
 		break;
 	case 'r':
 	case 'R':
-		// Request a Report, prepare the message
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_REPORT;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "report");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("Report request FAILED\r\n");
+		// Request a Report
+		request( CLIENT_REQ_REPORT, "Report" );
+		break;
+	case 'w':
+	case 'W':
+		// Toggle watching the live bus events (socket only)
+		if( pec_subscribe( isWatching ? 0 : PP_EV_ALL, 0, response, NULL ) == 0 ) {
+			printf("Watch request FAILED\r\n");
 		} else {
-			printf("Report requested\r\n");
+			isWatching = !isWatching;
+			printf("Watch %s requested\r\n", isWatching ? "on" : "off");
+		}
+		break;
+	case 'c':
+	case 'C':
+		// Cancel the last request
+		if( pec_cancel( corr_last ) == -1 ) {
+			printf("Nothing to cancel\r\n");
+		} else {
+			printf("Request %u cancelled\r\n", corr_last);
 		}
 		break;
 	case 'q':
@@ -100,18 +158,7 @@ void action( int char_in )
 	case 'X':
 		// eXit Printer Emulator: kill the server and quit the client
 		printf("\r\n");
-		// Send exit message
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_EXIT;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "exit");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("Exit request FAILED\r\n");
-		} else {
-			printf("Exit requested\r\n");
-		}
+		request( CLIENT_REQ_EXIT, "Exit" );
 		break;
 	case 27:
 		// ESC hit, quit the client
@@ -124,62 +171,6 @@ void action( int char_in )
 	}
 }
 
-//--------------------------------------------------------------------
-// response()
-//     Receive a response from the Printer Emulator server
-//  returns:
-//       0  no action
-//      -1  exit
-//--------------------------------------------------------------------
-int response( void )
-{
-	int rv;
-	int isExit = 0;
-	
-	memset( &s_msg, 0, sizeof(s_msg) );
-
-	// Receive any server responses.  Specify non-blocking
-	rv = msg_rcv_from_server( &s_msg, RCV_NON_BLOCKING );
-	if( rv == 0 ) {
-		// No messages on queue, do nothing
-	} else if( rv == -1 ) {
-		printf("Server response FAILED\r\n");
-	} else {
-		switch(s_msg.mtype)
-		{
-		case SERVER_REQUEST_SUCCESS:
-			printf("SERVER_REQUEST_SUCCESS\r\n");
-			if( !strcmp(s_msg.rsp, "exit") ) {
-				isBreak = 1;
-				isExit = -1;
-			}
-			break;
-		case SERVER_REQUEST_FAILURE:
-			printf("SERVER_REQUEST_FAILURE\r\n");
-			printf("Server response: %s\r\n", s_msg.rsp);
-			break;
-		case SERVER_ACTION_SUCCESS:
-			printf("SERVER_ACTION_SUCCESS\r\n");
-			printf("Server response: %s\r\n", s_msg.rsp);
-			if( !strcmp(s_msg.rsp, "logmode") ) {
-				isLogMode = atoi( &s_msg.rsp[8]);
-				printf("%s\r\n", s_msg.rsp);
-				printf( "client logmode %d\r\n", isLogMode );
-			}
-			break;
-		case SERVER_ACTION_FAILURE:
-			printf("SERVER_ACTION_FAILURE\r\n");
-			printf("Server response: %s\r\n", s_msg.rsp);
-			break;
-		case SERVER_RESET:
-			printf("SERVER_RESET\r\n");
-			printf("Server response: %s\r\n", s_msg.rsp);
-			break;
-		}
-	}
-	return isExit;
-}
-
 //--------------------------------------------------------------------
 // SIGINT handler
 //--------------------------------------------------------------------
@@ -193,7 +184,6 @@ void INThandler( int sig )
 //--------------------------------------------------------------------
 int main( int argc, char *argv[] )
 {
-	int rv;
 	int char_in;
 
 	printf("\nPrinter Emulator Console %s\n", version_stg);
@@ -202,72 +192,46 @@ int main( int argc, char *argv[] )
 	signal(SIGINT, INThandler);
 	set_conio_terminal_mode();
 	
-    // Open the Server message queue from well-known key
-	rv = msg_get_server_mq();
-    if (rv == -1) {	
-		//perror("server msgget");
-		printf("Unable to open printem message queue\r\n");
+	// Prefer printem's socket; fall back to the SysV queues when printem
+	// is not listening on it
+	if( pec_connect() == -1 ) {
+		printf("Unable to reach printem\r\n");
 		printf("Exiting\r\n");
 		exit(EXIT_FAILURE);
-    }
-	
-	// Create the Client message queue
-	rv = msg_create_client_mq();
-    if (rv == -1) {
-        //perror("client msgget");
-		printf("Unable to create peconsole message queue\r\n");
-		printf("Exiting\r\n");
-        exit(EXIT_FAILURE);
-    }
+	}
 
 	// Notify the Server of our message queue
-	memset( &c_msg, 0, sizeof(c_msg) );
-	c_msg.mtype = CLIENT_INIT;
-	c_msg.client_id = msg_get_client_mq();
-	strcpy(c_msg.cmd, "init");
-
-	rv = msg_send_to_server( &c_msg );
-	if( rv == -1 ) {
-		printf("CLIENT_INIT send FAILED!\r\n");
-        exit(EXIT_FAILURE);
-	} else {
-		printf("Client Init requested\r\n");
-	}
+	request( CLIENT_INIT, "Client Init" );
 	
 	// - - - - - - - - - M a i n   L o o p - - - - - - - - -
 	while( !isBreak )
 	{
-		// Non-blocking check if a key is hit.  If not we stay in
-		// this loop waiting
-		while( !kbhit() )
-		{
-			// Non-blocking code goes here
-			rv = response();
-			if( rv == -1 )  break;
-			
-			//printf("* ");  fflush(stdout);
-			
-			// Sleep 10 mS to let other threads run
-			// 1 mS is 1000 uS
-			usleep(10*1000);
+		// Sleep until a key is hit, printem answers or a request
+		// times out.  On SysV there is no descriptor, poll() skips it
+		// and the queue is checked every PEC_SYSV_POLL_MS instead.
+		struct pollfd fds[2];
+		fds[0].fd = 0;                    // stdin
+		fds[0].events = POLLIN;
+		fds[1].fd = pec_fd();
+		fds[1].events = POLLIN;
+		if( poll( fds, 2, pec_next_ms( -1 ) ) == -1 ) {
+			continue;    // interrupted (SIGINT)
+		}
+		if( pec_dispatch() == -1 ) {
+			printf("printem closed the connection\r\n");
+			break;
 		}
-
-		// Check if exiting
-		if( rv == -1 )  break;
 		
 		// Act on the typed character
-		char_in = getch();
-		action( char_in );
+		if( !isBreak && (fds[0].revents & POLLIN) ) {
+			char_in = getch();
+			action( char_in );
+		}
 	}
 	// - - - - - - - E N D  M a i n   L o o p - - - - - - - - -
 	
-    // Remove the client message queue
-	rv = msg_remove_client_mq();
-	if( rv == -1 ) {
-		perror("msgctl");
-	} else {
-		printf("Client message queue removed\r\n");
-	}
+	// Remove the client message queue
+	pec_close();
 	
-    return EXIT_SUCCESS;
+	return EXIT_SUCCESS;
 }
@@ -4,14 +4,40 @@
 //     the 1022 using the Printer Emulator protocol.  The request is passed
 //     as the first argument (arg1).  The return value indicates success
 //     or failure of the request.
+//     An optional second argument (arg2) names a file to receive the
+//     Report or History itself.  printem passes the content as a memfd
+//     which is mapped and written out, so there is no ramdisk file to
+//     open or clean up.
+//     Command 'm' asks for printem's metrics (counters, gauges and
+//     sequence timings in the Prometheus text format); arg2 again names
+//     a file to receive them.
+//     Command 'w' watches the live bus events instead: arg2 lists the
+//     classes (readings,log,divert,state; default all) and arg3 is the
+//     least number of ms between two events of a class.  Events are
+//     printed one per line until interrupted.
+//     Command 's' runs a session: commands are read one per line from
+//     arg2 (default stdin), sent over one connection as they are read
+//     without waiting for the previous ones, and each result is printed
+//     as a line when it arrives.
+//     Option -t gives each request a timeout in seconds (default 300).
+//     A request printem cannot complete in time, including one whose
+//     bus sequence stalls, exits with EXIT_TIMEOUT; an interrupted one
+//     is cancelled.
+//     Option -b marks the requests as bulk work, as for a scheduled
+//     history pull: printem serves interactive requests first and may
+//     refuse bulk ones while a history sequence is on the bus.
 //--------------------------------------------------------------------
 
 #include <stdio.h>
 #include <stdlib.h>   // atoi
 #include <string.h>   // strcpy
-#include <unistd.h>   // usleep
+#include <unistd.h>   // read, getopt
+#include <fcntl.h>    // open
+#include <signal.h>   // sigaction
+#include <sys/mman.h> // mmap
+#include <sys/stat.h>
 
-#include "../Common/message_services.h"
+#include "../Common/pe_client.h"
 
 //--------------------------------------------------------------------
 // File scope variables
@@ -19,20 +45,158 @@
 // Version String
 const char version_stg[] = {"v1.3.1"};
 
-client_req c_msg;
-server_rsp s_msg;
+// Exit status of a request that timed out, EXIT_FAILURE for the others
+#define EXIT_TIMEOUT  2
+
+char rsp_text[PP_PATH_SIZE + PP_TEXT_SIZE + 64];  // pp_describe() of a response
+int response_complete = 0;
+int exit_value = EXIT_SUCCESS;  // presumed unless a response fails
+unsigned int request_corr = 0;  // the request waited on
+unsigned int request_flags = 0; // -b: PP_FLAG_BULK
 int isLogMode = 0;
+const char *content_file = NULL;  // arg2, where the result content goes
+unsigned int watch_events = PP_EV_ALL;  // 'w': arg2, classes to watch
+unsigned int watch_rate_ms = 0;         // 'w': arg3, rate limit
+volatile sig_atomic_t isBreak = 0;
+
+// Session commands in flight, one per line read
+typedef struct session_cmd
+{
+	int          in_use;
+	unsigned int corr_id;
+	int          line_no;
+	char         code;
+	char         file[PP_PATH_SIZE];  // where the result content goes, or ""
+} session_cmd;
+
+#define SESSION_LINE_SIZE  (PP_PATH_SIZE + 8)
+
+session_cmd session_cmds[PEC_MAX_PENDING];
+int session_pending = 0;
+
+//--------------------------------------------------------------------
+// save_content()
+//     Write the result printem passed as a memfd to path
+//  returns:
+//      number of bytes written
+//      -1  failure
+//--------------------------------------------------------------------
+long long save_content( int fd, const char *path )
+{
+	struct stat sb;
+	void *p = NULL;
+	FILE *out;
+	int rv = 0;
+
+	if( fstat( fd, &sb ) == -1 ) {
+		perror("fstat");
+		return -1;
+	}
+	if( sb.st_size > 0 ) {
+		p = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( p == MAP_FAILED ) {
+			perror("mmap");
+			return -1;
+		}
+	}
+	out = fopen( path, "w" );
+	if( out == NULL ) {
+		perror( path );
+		rv = -1;
+	} else {
+		if( (sb.st_size > 0) && (fwrite( p, 1, sb.st_size, out ) != (size_t)sb.st_size) ) {
+			rv = -1;
+		}
+		if( fclose( out ) != 0 ) {
+			rv = -1;
+		}
+	}
+	if( p != NULL ) {
+		munmap( p, sb.st_size );
+	}
+	return (rv == 0) ? (long long)sb.st_size : -1;
+}
+
+//--------------------------------------------------------------------
+// response()
+//     Callback for every message answering the request.  Request
+//     success and reset are intermediary; the other statuses end it.
+//--------------------------------------------------------------------
+void response( pp_msg *rsp, void *arg )
+{
+	int is_saved = 0;
+
+	switch(rsp->status)
+	{
+	case SERVER_EVENT:
+		printf("%s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		fflush( stdout );
+		break;
+	case SERVER_REQUEST_SUCCESS:
+		printf("SERVER_REQUEST_SUCCESS\r\n");
+		// This is an intermediary response so remain in loop
+		break;
+	case SERVER_REQUEST_FAILURE:
+		printf("SERVER_REQUEST_FAILURE\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		exit_value = EXIT_FAILURE;
+		response_complete = 1;
+		break;
+	case SERVER_ACTION_SUCCESS:
+		printf("SERVER_ACTION_SUCCESS\r\n");
+		if( rsp->fd != -1 ) {
+			// Closed by the client library on return
+			long long size = save_content( rsp->fd, content_file );
+			if( size == -1 ) {
+				exit_value = EXIT_FAILURE;
+			} else {
+				printf("Content: %lld bytes to %s\r\n", size, content_file);
+			}
+			is_saved = 1;
+		}
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		if( rsp->fields & PP_F_LOGMODE ) {
+			isLogMode = rsp->logmode;
+			printf( "client logmode %d\r\n", isLogMode );
+		}
+		if( (content_file != NULL) && !is_saved ) {
+			// SysV transport, or printem could not pass it
+			printf("Content not passed, result is the file above\r\n");
+			exit_value = EXIT_FAILURE;
+		}
+		response_complete = 1;
+		break;
+	case SERVER_ACTION_FAILURE:
+		printf("SERVER_ACTION_FAILURE\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		exit_value = EXIT_FAILURE;
+		response_complete = 1;
+		break;
+	case SERVER_TIMEOUT:
+		printf("SERVER_TIMEOUT\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		exit_value = EXIT_TIMEOUT;
+		response_complete = 1;
+		break;
+	case SERVER_RESET:
+		printf("SERVER_RESET\r\n");
+		printf("Server response: %s\r\n", pp_describe( rsp, rsp_text, sizeof(rsp_text) ));
+		// This is an intermediary response so remain in loop
+		break;
+	}
+}
 
 //--------------------------------------------------------------------
 // action()
-//     Receive a command code character, validate, and dispatch messages
+//     Receive a command code character, validate, and submit the request
 //  returns:
 //       0  success
 //      -1  failure
 //--------------------------------------------------------------------
 int action( char char_in )
 {
-	int rv = 0;
+	unsigned int flags = request_flags | ((content_file != NULL) ? PP_FLAG_WANT_FD : 0);
+	unsigned int corr_id;
 
 	printf("Command code in: %c\n", char_in );
 
@@ -41,88 +205,252 @@ int action( char char_in )
 	case 'h':
 	case 'H':
 		// Request History listing
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_HISTORY;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "history");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("History request FAILED\r\n");
-		} else {
-			printf("History requested\r\n");
-		}
+		corr_id = pec_submit( CLIENT_REQ_HISTORY, flags, response, NULL );
+		printf("History request%s\r\n", corr_id ? "ed" : " FAILED");
 		break;
 	case 'l':
 	case 'L':
 		// Toggle Log mode
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_LOG;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "log");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("Log toggle request FAILED\r\n");
-		} else {
-			printf("Log toggle requested\r\n");
-		}
+		corr_id = pec_submit( CLIENT_REQ_LOG, request_flags, response, NULL );
+		printf("Log toggle request%s\r\n", corr_id ? "ed" : " FAILED");
 		break;
 	case 'r':
 	case 'R':
-		// Request a Report, prepare the message
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_REPORT;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "report");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("Report request FAILED\r\n");
-		} else {
-			printf("Report requested\r\n");
-		}
+		// Request a Report
+		corr_id = pec_submit( CLIENT_REQ_REPORT, flags, response, NULL );
+		printf("Report request%s\r\n", corr_id ? "ed" : " FAILED");
 		break;
-
-#if 0
-	// No support for quit, exit, or ESC character
-	case 'q':
-	case 'Q':
-		// Quit client
-		printf("\r\n");
-		isBreak = 1;
+	case 'm':
+	case 'M':
+		// Request printem's metrics, answered without the bus
+		corr_id = pec_submit( CLIENT_METRICS, flags, response, NULL );
+		printf("Metrics request%s\r\n", corr_id ? "ed" : " FAILED");
 		break;
-	case 'x':
-	case 'X':
-		// eXit Printer Emulator: kill the server and quit the client
-		printf("\r\n");
-		// Send exit message
-		memset( &c_msg, 0, sizeof(c_msg) );
-	    c_msg.mtype = CLIENT_REQ_EXIT;
-		c_msg.client_id = msg_get_client_mq();
-	    strcpy(c_msg.cmd, "exit");
-
-		rv = msg_send_to_server( &c_msg );
-		if( rv == -1 ) {
-			printf("Exit request FAILED\r\n");
+	case 'w':
+	case 'W':
+		// Subscribe to live bus events
+		// Runs until interrupted, nothing to cancel
+		corr_id = pec_subscribe( watch_events, watch_rate_ms, response, NULL );
+		printf("Watch request%s\r\n", corr_id ? "ed" : " FAILED");
+		return corr_id ? 0 : -1;
+	default:
+		printf("Unknown character %c received: IGNORED\r\n", char_in);
+		return -1;
+	}
+
+	request_corr = corr_id;
+	return corr_id ? 0 : -1;
+}
+
+//--------------------------------------------------------------------
+// session_response()
+//     Callback for the responses to one session command.  Only the
+//     final one is printed: line number, command, ok, failed or
+//     timeout, and printem's answer.
+//--------------------------------------------------------------------
+void session_response( pp_msg *rsp, void *arg )
+{
+	session_cmd *cmd = (session_cmd *)arg;
+	int is_ok = (rsp->status == SERVER_REQUEST_SUCCESS) || (rsp->status == SERVER_ACTION_SUCCESS);
+
+	if( !pec_is_final( rsp ) ) {
+		return;
+	}
+	pp_describe( rsp, rsp_text, sizeof(rsp_text) );
+	if( is_ok && (cmd->file[0] != '\0') ) {
+		if( rsp->fd == -1 ) {
+			// SysV transport, or printem could not pass it
+			is_ok = 0;
+			strcat( rsp_text, " (content not passed)" );
+		} else if( save_content( rsp->fd, cmd->file ) == -1 ) {
+			is_ok = 0;
 		} else {
-			printf("Exit requested\r\n");
+			snprintf( rsp_text, sizeof(rsp_text), "content %s", cmd->file );
+		}
+	}
+	if( rsp->status == SERVER_TIMEOUT ) {
+		printf("%d %c timeout %s\n", cmd->line_no, cmd->code, rsp_text);
+		if( exit_value == EXIT_SUCCESS ) {
+			exit_value = EXIT_TIMEOUT;
 		}
+	} else {
+		printf("%d %c %s %s\n", cmd->line_no, cmd->code, is_ok ? "ok" : "failed", rsp_text);
+		if( !is_ok ) {
+			exit_value = EXIT_FAILURE;
+		}
+	}
+	fflush( stdout );
+
+	cmd->in_use = 0;
+	--session_pending;
+}
+
+//--------------------------------------------------------------------
+// session_command()
+//     Submit the command on one session line: "<c> [file]" with c one
+//     of r, h, l or m.  Blank lines and lines starting with # are skipped.
+//  returns:
+//       0  submitted or skipped
+//      -1  not a command, or not sent (reported on stdout)
+//--------------------------------------------------------------------
+int session_command( char *line, int line_no )
+{
+	session_cmd *cmd = NULL;
+	char         code;
+	char file[PP_PATH_SIZE] = "";
+	int op;
+
+	if( sscanf( line, " %c %1023s", &code, file ) < 1 || (code == '#') ) {
+		return 0;
+	}
+	switch( code )
+	{
+	case 'r':
+	case 'R':
+		op = CLIENT_REQ_REPORT;
 		break;
-	case 27:
-		// ESC hit, quit the client
-		printf("\r\n");
-		isBreak = 1;
+	case 'h':
+	case 'H':
+		op = CLIENT_REQ_HISTORY;
 		break;
-#endif
-
-	default:
-		printf("Unknown character %c received: IGNORED\r\n", char_in);
-		rv = -1;
+	case 'l':
+	case 'L':
+		op = CLIENT_REQ_LOG;
 		break;
+	case 'm':
+	case 'M':
+		op = CLIENT_METRICS;
+		break;
+	default:
+		printf("%d %c failed unknown command\n", line_no, code);
+		return -1;
 	}
 
-	return rv;
+	// Free a slot first, the answers to earlier lines make room
+	while( (session_pending == PEC_MAX_PENDING) && !isBreak ) {
+		if( (pec_poll( -1 ) == -1) && (errno != EINTR) ) {
+			return -1;
+		}
+	}
+	for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+		if( !session_cmds[i].in_use ) {
+			cmd = &session_cmds[i];
+			break;
+		}
+	}
+	if( cmd == NULL ) {
+		return -1;    // interrupted
+	}
+	cmd->line_no = line_no;
+	cmd->code = code;
+	strcpy( cmd->file, file );
+	cmd->corr_id = pec_submit( op, request_flags | (file[0] ? PP_FLAG_WANT_FD : 0), session_response, cmd );
+	if( cmd->corr_id == 0 ) {
+		printf("%d %c failed not sent\n", line_no, code);
+		return -1;
+	}
+	cmd->in_use = 1;
+	++session_pending;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// session()
+//     Read commands from path (stdin when NULL or "-") and stream the
+//     results until every command read has been answered.  Lines are
+//     read with read() so poll() sees what is left of the input.
+//--------------------------------------------------------------------
+void session( const char *path )
+{
+	char line[SESSION_LINE_SIZE];
+	int len = 0;
+	int line_no = 0;
+	int in = 0;
+	int is_eof = 0;
+	struct pollfd fds[2];
+
+	if( (path != NULL) && strcmp( path, "-" ) ) {
+		in = open( path, O_RDONLY | O_CLOEXEC );
+		if( in == -1 ) {
+			perror( path );
+			exit_value = EXIT_FAILURE;
+			return;
+		}
+	}
+
+	while( !isBreak && (!is_eof || (session_pending > 0)) )
+	{
+		fds[0].fd = is_eof ? -1 : in;
+		fds[0].events = POLLIN;
+		fds[1].fd = pec_fd();
+		fds[1].events = POLLIN;
+		if( poll( fds, 2, pec_next_ms( -1 ) ) == -1 ) {
+			continue;    // interrupted
+		}
+		if( pec_dispatch() == -1 ) {
+			printf("printem closed the connection\n");
+			exit_value = EXIT_FAILURE;
+			break;
+		}
+		if( is_eof || !fds[0].revents ) {
+			continue;
+		}
+
+		ssize_t n = read( in, line + len, sizeof(line) - 1 - len );
+		if( n == -1 ) {
+			continue;    // interrupted
+		}
+		if( n == 0 ) {
+			is_eof = 1;
+			if( len == 0 ) {
+				continue;
+			}
+			line[len++] = '\n';    // last line without a newline
+		}
+		len += n;
+
+		// Submit each complete line, keep a partial one for the next read
+		char *start = line;
+		char *nl;
+		while( (nl = (char *)memchr( start, '\n', line + len - start )) != NULL ) {
+			*nl = '\0';
+			if( session_command( start, ++line_no ) == -1 ) {
+				exit_value = EXIT_FAILURE;
+			}
+			start = nl + 1;
+		}
+		len -= start - line;
+		memmove( line, start, len );
+		if( len == sizeof(line) - 1 ) {
+			printf("%d ? failed line too long\n", ++line_no);
+			exit_value = EXIT_FAILURE;
+			len = 0;
+		}
+	}
+
+	if( in != 0 ) {
+		close( in );
+	}
+	if( session_pending > 0 ) {
+		printf("%d commands not answered, cancelled\n", session_pending);
+		exit_value = EXIT_FAILURE;
+		for( int i = 0; i < PEC_MAX_PENDING; i++ ) {
+			if( session_cmds[i].in_use ) {
+				pec_cancel( session_cmds[i].corr_id );
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+// SIGINT handler
+//     Ends a watch or session, and a wait cut short by SIGTERM or
+//     SIGHUP still removes the client queue.  Installed without
+//     SA_RESTART so the wait for printem returns.
+//--------------------------------------------------------------------
+void INThandler( int sig )
+{
+	isBreak = 1;
 }
 
 //--------------------------------------------------------------------
@@ -130,17 +458,50 @@ int action( char char_in )
 //--------------------------------------------------------------------
 int main( int argc, char *argv[] )
 {
-	int rv, exit_value;
-	int response_complete = 0;
+	int rv, c;
 
 	printf("\nPrinter Emulator Control %s\n", version_stg);
 	printf("(c) 2025 Liquid Solids Control\n\n");
 
-	if( argc !=2 ) {
+	// "+": options only before the command code
+	while( (c = getopt(argc, argv, "+bt:")) != -1 )
+	{
+		switch( c ) {
+		case 'b':
+			request_flags |= PP_FLAG_BULK;
+			break;
+		case 't':
+			pec_set_timeout( atoi( optarg ) * 1000 );
+			break;
+		default:
+		case '?':
+			printf("Error - unrecognized option\n");
+			return EXIT_FAILURE;
+		}
+	}
+	// The command code and its arguments follow as argv[1] ...
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if( (argc < 2) || (argc > 4) ) {
 		// No command argument was specified
 		printf("Error - no command code provided\n");
 		return EXIT_FAILURE;
 	}
+	if( (argv[1][0] == 'w') || (argv[1][0] == 'W') ) {
+		if( (argc >= 3) && (pp_event_parse( argv[2], &watch_events ) == -1) ) {
+			printf("Error - unknown event class in %s\n", argv[2]);
+			return EXIT_FAILURE;
+		}
+		if( argc == 4 ) {
+			watch_rate_ms = atoi( argv[3] );
+		}
+	} else if( argc == 4 ) {
+		printf("Error - too many arguments\n");
+		return EXIT_FAILURE;
+	} else if( (argc == 3) && (argv[1][0] != 's') && (argv[1][0] != 'S') ) {
+		content_file = argv[2];
+	}
 
 	// argv[1] is a null terminated char string so verify there is only
 	// one character in it.  This is the command code.
@@ -149,127 +510,54 @@ int main( int argc, char *argv[] )
 		return EXIT_FAILURE;
 	}
 
-    // Open the Server message queue from well-known key
-	rv = msg_get_server_mq();
-    if (rv == -1) {	
-		//perror("server msgget");
-		printf("Unable to open printem message queue\r\n");
+	struct sigaction sa;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = INThandler;
+	sigaction( SIGINT, &sa, NULL );
+	sigaction( SIGTERM, &sa, NULL );
+	sigaction( SIGHUP, &sa, NULL );
+
+	// Prefer printem's socket; fall back to the SysV queues when printem
+	// is not listening on it.  There is no need to send a CLIENT_INIT
+	// message, each request carries the client's reply queue.
+	if( pec_connect() == -1 ) {
+		printf("Unable to reach printem\r\n");
 		printf("Exiting\r\n");
 		exit(EXIT_FAILURE);
-    }
-	
-	// Create the Client message queue
-	rv = msg_create_client_mq();
-    if (rv == -1) {
-        //perror("client msgget");
-		printf("Unable to create peconsole message queue\r\n");
-		printf("Exiting\r\n");
-        exit(EXIT_FAILURE);
-    }
-
-#if 1
-	// NOTE: there is no need to send a CLIENT_INIT message.  Each
-	// client request has the current client mqid so the server always
-	// knows where to respond to
-#else
-	// Notify the Server of our message queue
-	memset( &c_msg, 0, sizeof(c_msg) );
-	c_msg.mtype = CLIENT_INIT;
-	c_msg.client_id = msg_get_client_mq();
-	strcpy(c_msg.cmd, "init");
-
-	rv = msg_send_to_server( &c_msg );
-	if( rv == -1 ) {
-		printf("CLIENT_INIT send FAILED!\r\n");
-        exit(EXIT_FAILURE);
-	} else {
-		printf("Client Init requested\r\n");
 	}
-#endif
+
+	if( (argv[1][0] == 's') || (argv[1][0] == 'S') ) {
+		session( (argc == 3) ? argv[2] : NULL );
+		pec_close();
+		return exit_value;
+	}
 
 	// Take action on the specified command code
 	rv = action( argv[1][0] );
 	if( rv == -1 ) {
 		printf("Error - invalid command code or sending error\n");
+		pec_close();
 		return EXIT_FAILURE;
 	}	
 
-	// Having sent our request we now wait for multiple responses
-	// We presume success unless there is a subsequent failure
-	exit_value = EXIT_SUCCESS;
-	
-	while( !response_complete )
+	// Having sent our request we now wait for its responses, which
+	// response() handles until one completes it
+	while( !response_complete && !isBreak )
 	{
-		// Loop until all responses are received or we encounter failure
-		memset( &s_msg, 0, sizeof(s_msg) );
-
-		// Receive any server responses.  Specify blocking
-		rv = msg_rcv_from_server( &s_msg, RCV_BLOCKING );
-		if( rv == 0 ) {
-			// No messages on queue, do nothing
-		} else if( rv == -1 ) {
+		rv = pec_poll( -1 );
+		if( (rv == -1) && (errno != EINTR) ) {
 			printf("Server response FAILED\r\n");
 			exit_value = EXIT_FAILURE;
-			response_complete = 1;
-		} else {
-			switch(s_msg.mtype)
-			{
-			case SERVER_REQUEST_SUCCESS:
-				printf("SERVER_REQUEST_SUCCESS\r\n");
-#if 0
-				if( !strcmp(s_msg.rsp, "exit") ) {
-				response_complete = 1;
-				isExit = -1;
-				}
-#endif
-				// This is an intermediary response so remain in loop
-				break;
-			case SERVER_REQUEST_FAILURE:
-				printf("SERVER_REQUEST_FAILURE\r\n");
-				printf("Server response: %s\r\n", s_msg.rsp);
-				exit_value = EXIT_FAILURE;
-				// Server Request Failure is not yet coded on Printer-Emulator
-				response_complete = 1;
-				break;
-			case SERVER_ACTION_SUCCESS:
-				printf("SERVER_ACTION_SUCCESS\r\n");
-				printf("Server response: %s\r\n", s_msg.rsp);
-				if( !strcmp(s_msg.rsp, "logmode") ) {
-					isLogMode = atoi( &s_msg.rsp[8]);
-					printf("%s\r\n", s_msg.rsp);
-					printf( "client logmode %d\r\n", isLogMode );
-				}
-				response_complete = 1;
-				break;
-			case SERVER_ACTION_FAILURE:
-				printf("SERVER_ACTION_FAILURE\r\n");
-				printf("Server response: %s\r\n", s_msg.rsp);
-				exit_value = EXIT_FAILURE;
-				// Server Action Failure is not yet coded on Printer-Emulator
-				response_complete = 1;
-				break;
-			case SERVER_RESET:
-				printf("SERVER_RESET\r\n");
-				printf("Server response: %s\r\n", s_msg.rsp);
-				// This is an intermediary response so remain in loop
-				break;
-			}
-
-#if 0
-			// Experiment, sleep 2 sec.
-			usleep(2000*1000);
-#endif
+			break;
 		}
 	}
-
-	// Remove the client message queue
-	rv = msg_remove_client_mq();
-	if( rv == -1 ) {
-		perror("msgctl");
+	if( !response_complete && (pec_cancel( request_corr ) == 0) ) {
+		printf("Request cancelled\r\n");
 		exit_value = EXIT_FAILURE;
-	} else {
-		printf("Client message queue removed\r\n");
 	}
+
+	// Remove the client message queue
+	pec_close();
 	
 	return exit_value;
 }
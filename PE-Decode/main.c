@@ -0,0 +1,720 @@
+//--------------------------------------------------------------------
+// Printer Emulator Offline Decoder
+//     Rebuilds the report, history and logmode files a unit would have
+//     written from captured bus traffic.  Each capture is decoded by
+//     printem's own parser, passively, in a process of its own: the
+//     parser keeps its state in globals, so a process is one parser
+//     instance, and as many run at once as there are cores.
+//
+//     The files for capture <dir>/<name>.txt go to <out>/<name>/Data,
+//     laid out as printem lays out its desktop disk directory, with
+//     what the parser printed in <out>/<name>/decode.log.
+//
+//     With -s a capture larger than the chunk size is split and its
+//     chunks decoded side by side as well (see split.h), in
+//     <out>/<name>/chunk-NNN until they are stitched together.
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>       // EXIT_SUCCESS, realpath()
+#include <string.h>
+#include <unistd.h>       // getopt, fork, chdir
+#include <fcntl.h>        // open()
+#include <errno.h>
+#include <time.h>         // clock_gettime()
+#include <dirent.h>       // opendir()
+#include <libgen.h>       // basename()
+#include <limits.h>       // PATH_MAX
+#include <sys/stat.h>     // mkdir()
+#include <sys/wait.h>
+#include <sys/resource.h> // struct rusage
+
+#include "../Printer-Emulator/parser.h"
+#include "../Printer-Emulator/utils.h"
+#include "../Printer-Emulator/config.h"
+#include "../Printer-Emulator/timing.h"
+#include "../Printer-Emulator/busstat.h"
+#include "../Printer-Emulator/capture.h"
+#include "split.h"
+
+//--------------------------------------------------------------------
+// File scope variables
+//--------------------------------------------------------------------
+// Version String
+const char version_stg[] = {"v1.3.1"};
+
+const char * help_arr[] = {
+	"  Offline decoder for captured 1022 bus traffic",
+	"  Usage: pedecode [options] <capture> ...",
+	"  Captures are printem -c hex dumps or raw serial bytes",
+	"  Optional Arguments",
+	"    -o <dir>   output directory (default: ./decoded)",
+	"    -j <n>     captures decoded at once (default: one per core)",
+	"    -f <file>  printem configuration file for storage and logmode settings",
+	"    -s <kB>    split captures larger than this into chunks of about this size,",
+	"               decoded side by side (default: each capture whole)",
+	"    -v         with -s, also decode split captures whole and compare the files",
+	"    -d         debug dump of parser state machine transitions to decode.log",
+	"    -h         display this help screen",
+	"\n"
+	"  A day of captures",
+	"      pedecode -o /tmp/site-12 captures/*.txt",
+	"  One large capture over every core, checked against a whole decode",
+	"      pedecode -s 65536 -v site-12-week.bin",
+};
+
+#define DIR_PERMS (S_IRWXU | S_IRWXG | S_IRWXO)
+#define DECODE_LOG "decode.log"
+
+// Where a capture's decode has got to
+typedef enum {
+	PHASE_WHOLE,          // one parser over the capture
+	PHASE_CHUNKS,         // split: chunks being decoded
+	PHASE_STITCH,         // split: chunk files being joined
+	PHASE_VERIFY,         // split: one parser over it again, to compare
+	PHASE_DONE,
+} decode_phase;
+
+// One capture and its decode
+typedef struct decode_job
+{
+	const char *path;         // as given
+	char     name[128];       // output directory name
+	int      text;            // 1 hex dump, 0 raw
+	int      phase;           // decode_phase
+	int      running;         // children at work on it
+	int      started;         // the phase's child has been started
+	int      failed;          // a child of it failed
+	double   start;
+	double   wall;            // seconds
+	double   cpu;             // user + system seconds
+	uint64_t bytes;
+	int      ok;
+	int      reports;         // outputs written
+	int      histories;
+	int      logmodes;
+
+	// Split decode (-s)
+	unsigned char *data;      // the capture, while its chunks are decoded
+	uint64_t    size;
+	split_chunk *chunk;
+	int         n_chunks;
+	int         planned;      // chunks first cut
+	int         next_id;      // for merged chunks
+	int         merged;       // cuts that did not hold
+	int         rounds;       // decodes of the chunks
+	double      whole_wall;   // -v: the decode by one parser
+	int         diffs;        // -v: files that differ, -1 not compared
+	char        diff[128];
+} decode_job;
+
+// One child at work
+typedef struct decode_task
+{
+	decode_job *job;
+	int      phase;           // what the child does
+	int      chunk;           // PHASE_CHUNKS: index in job->chunk
+	pid_t    pid;             // 0 slot free
+	int      pipe_fd;         // child reports a split_result on it
+	double   start;
+} decode_task;
+
+// Options the children work to
+static unsigned int options;
+static const char  *out_dir = "./decoded";
+static uint64_t     split_size;       // bytes, 0 no split
+static int          verify;
+
+//--------------------------------------------------------------------
+// now_s()
+//--------------------------------------------------------------------
+static double now_s( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//--------------------------------------------------------------------
+// job_name()
+//     Capture file name without its directory and extension
+//--------------------------------------------------------------------
+static void job_name( decode_job *j )
+{
+	char tmp[PATH_MAX];
+	char *dot;
+
+	snprintf( tmp, sizeof(tmp), "%s", j->path );
+	snprintf( j->name, sizeof(j->name), "%s", basename( tmp ) );
+	dot = strrchr( j->name, '.' );
+	if( (dot != NULL) && (dot != j->name) ) {
+		*dot = '\0';
+	}
+}
+
+//--------------------------------------------------------------------
+// child_enter()
+//     Runs in a child: work in dir, made if need be, with a disk
+//     directory of its own and what is printed going to its log
+//--------------------------------------------------------------------
+static void child_enter( const char *dir )
+{
+	int fd;
+
+	mkdir( dir, DIR_PERMS );
+	if( chdir( dir ) == -1 ) {
+		_exit( EXIT_FAILURE );
+	}
+	mkdir( DESKTOP_DISK_DIR, DIR_PERMS );
+
+	fd = open( DECODE_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd != -1 ) {
+		dup2( fd, STDOUT_FILENO );
+		dup2( fd, STDERR_FILENO );
+		close( fd );
+	}
+}
+
+//--------------------------------------------------------------------
+// child_parse_open()
+//     Passive: the parser follows the 1022 and the printer module it
+//     talked to, and never writes to the (absent) serial port
+//--------------------------------------------------------------------
+static void child_parse_open( void )
+{
+	static unsigned int control;
+	static int port = -1;
+
+	parse_open( &options, &control, &port );
+	tm_open( DESKTOP_DISK_DIR );
+	bus_open();
+}
+
+//--------------------------------------------------------------------
+// child_replay()
+//--------------------------------------------------------------------
+static void child_replay( const char *capture, split_result *r )
+{
+	child_parse_open();
+	if( cap_replay( capture, &r->bytes ) == -1 ) {
+		printf("Unable to read capture %s\n", capture);
+		parse_close();
+		_exit( EXIT_FAILURE );
+	}
+	parse_close();
+}
+
+//--------------------------------------------------------------------
+// decode_child()
+//     Runs in the child: one parser over a capture or a chunk of one,
+//     or the joining of a split capture's chunks.  Never returns.
+//--------------------------------------------------------------------
+static void decode_child( decode_task *t )
+{
+	decode_job *j = t->job;
+	char capture[PATH_MAX];
+	char dir[PATH_MAX];
+	char chunk_dir[PATH_MAX + 16];
+	split_result r;
+
+	memset( &r, 0, sizeof(r) );
+	if( realpath( j->path, capture ) == NULL ) {
+		_exit( EXIT_FAILURE );
+	}
+	snprintf( dir, sizeof(dir), "%s/%s", out_dir, j->name );
+
+	switch( t->phase ) {
+	case PHASE_WHOLE:
+		child_enter( dir );
+		child_replay( capture, &r );
+		break;
+
+	case PHASE_CHUNKS:
+		mkdir( dir, DIR_PERMS );
+		snprintf( chunk_dir, sizeof(chunk_dir), "%s/", dir );
+		split_chunk_dir( &j->chunk[t->chunk], chunk_dir + strlen( chunk_dir ), 16 );
+		child_enter( chunk_dir );
+		child_parse_open();
+		split_parse( j->data, j->size, &j->chunk[t->chunk], &r );
+		parse_close();
+		break;
+
+	case PHASE_STITCH:
+		child_enter( dir );
+		r.outputs = split_stitch( j->chunk, j->n_chunks );
+		if( r.outputs == -1 ) {
+			_exit( EXIT_FAILURE );
+		}
+		break;
+
+	case PHASE_VERIFY:
+		// The stitched files against those of one parser, kept for a
+		// look only when they differ
+		if( chdir( dir ) == -1 ) {
+			_exit( EXIT_FAILURE );
+		}
+		split_remove( SPLIT_VERIFY_DIR );
+		child_enter( SPLIT_VERIFY_DIR );
+		child_replay( capture, &r );
+		r.outputs = split_compare( "../" DESKTOP_DISK_DIR, DESKTOP_DISK_DIR, r.diff, sizeof(r.diff) );
+		if( r.outputs == -1 ) {
+			_exit( EXIT_FAILURE );
+		}
+		if( (r.outputs == 0) && (chdir( ".." ) == 0) ) {
+			split_remove( SPLIT_VERIFY_DIR );
+		}
+		break;
+	}
+	fflush( stdout );
+
+	if( write( t->pipe_fd, &r, sizeof(r) ) != sizeof(r) ) {
+		_exit( EXIT_FAILURE );
+	}
+	_exit( EXIT_SUCCESS );
+}
+
+//--------------------------------------------------------------------
+// task_start()
+//  returns:
+//       0  child started
+//      -1  failure
+//--------------------------------------------------------------------
+static int task_start( decode_task *t )
+{
+	int fds[2];
+
+	++t->job->running;
+	t->pipe_fd = -1;
+	if( pipe( fds ) == -1 ) {
+		perror("pipe");
+		return -1;
+	}
+	fflush( stdout );
+	t->start = now_s();
+	if( t->job->start == 0 ) {
+		t->job->start = t->start;
+	}
+	t->pid = fork();
+	if( t->pid == -1 ) {
+		perror("fork");
+		close( fds[0] );
+		close( fds[1] );
+		t->pid = 0;
+		return -1;
+	}
+	if( t->pid == 0 ) {
+		close( fds[0] );
+		t->pipe_fd = fds[1];
+		decode_child( t );
+	}
+	close( fds[1] );
+	t->pipe_fd = fds[0];
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// job_split()
+//     Load a capture and cut it into chunks.  One too small to cut is
+//     decoded whole.
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+static int job_split( decode_job *j )
+{
+	j->chunk = (split_chunk *)calloc( SPLIT_MAX_CHUNKS, sizeof(split_chunk) );
+	if( j->chunk == NULL ) {
+		printf("Error - out of memory\n");
+		return -1;
+	}
+	if( cap_load( j->path, &j->data, &j->size ) == -1 ) {
+		printf("Error - unable to load %s\n", j->path);
+		return -1;
+	}
+	j->n_chunks = split_plan( j->data, j->size, split_size, j->chunk, SPLIT_MAX_CHUNKS );
+	j->planned = j->n_chunks;
+	j->next_id = j->n_chunks;
+	if( j->n_chunks == 1 ) {
+		free( j->data );
+		j->data = NULL;
+		j->phase = PHASE_WHOLE;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// count_outputs()
+//     Files the parser wrote for the capture
+//--------------------------------------------------------------------
+static void count_outputs( decode_job *j )
+{
+	char dir[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf( dir, sizeof(dir), "%s/%s/%s", out_dir, j->name, DESKTOP_DISK_DIR );
+	d = opendir( dir );
+	if( d == NULL ) {
+		return;
+	}
+	while( (de = readdir( d )) != NULL )
+	{
+		if( !strncmp( de->d_name, "report-", 7 ) ) {
+			++j->reports;
+		} else if( !strncmp( de->d_name, "history-", 8 ) && strcmp( de->d_name, "history-store.txt" ) ) {
+			++j->histories;
+		} else if( !strncmp( de->d_name, "logmode-", 8 ) && !strstr( de->d_name, ".idx" ) ) {
+			++j->logmodes;
+		}
+	}
+	closedir( d );
+}
+
+//--------------------------------------------------------------------
+// job_done()
+//     A capture is finished with: report it
+//--------------------------------------------------------------------
+static void job_done( decode_job *j )
+{
+	if( (j->wall == 0) && (j->start > 0) ) {
+		j->wall = now_s() - j->start;
+	}
+	j->ok = !j->failed && (j->diffs <= 0);
+	j->phase = PHASE_DONE;
+	free( j->data );
+	j->data = NULL;
+	count_outputs( j );
+
+	printf("%-44s %-4s %10llu bytes %7.2f s %8.2f MB/s  %d report %d history %d logmode%s\n",
+		   j->name, j->text ? "text" : "raw", (unsigned long long)j->bytes, j->wall,
+		   (j->wall > 0) ? j->bytes / j->wall / 1e6 : 0.0,
+		   j->reports, j->histories, j->logmodes, j->ok ? "" : "  FAILED");
+	if( j->planned > 1 ) {
+		printf("    %d chunks, %d joined, %d cuts merged, %d rounds", j->planned, j->n_chunks, j->merged, j->rounds);
+		if( j->diffs == 0 ) {
+			printf(", same files as one parser (%.2f s)", j->whole_wall);
+		} else if( j->diffs > 0 ) {
+			printf(", %d differences from one parser, first %s", j->diffs, j->diff);
+		}
+		printf("\n");
+	}
+}
+
+//--------------------------------------------------------------------
+// task_next()
+//     The next child any capture is ready for
+//  returns:
+//       1  t filled in
+//       0  none ready
+//--------------------------------------------------------------------
+static int task_next( decode_job *job, int n_jobs, decode_task *t )
+{
+	for( int i = 0; i < n_jobs; i++ )
+	{
+		decode_job *j = &job[i];
+
+		if( (j->phase == PHASE_CHUNKS) && (j->chunk == NULL) ) {
+			if( job_split( j ) == -1 ) {
+				j->failed = 1;
+				job_done( j );
+				continue;
+			}
+		}
+
+		t->job = j;
+		t->phase = j->phase;
+		switch( j->phase ) {
+		case PHASE_CHUNKS:
+			for( int c = 0; !j->failed && (c < j->n_chunks); c++ ) {
+				if( !j->chunk[c].done && !j->chunk[c].busy ) {
+					j->chunk[c].busy = 1;
+					t->chunk = c;
+					return 1;
+				}
+			}
+			break;
+		case PHASE_WHOLE:
+		case PHASE_STITCH:
+		case PHASE_VERIFY:
+			if( !j->started ) {
+				j->started = 1;
+				return 1;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// task_finish()
+//     A child is done, well (ok) or not: collect its figures and move
+//     its capture on
+//--------------------------------------------------------------------
+static void task_finish( decode_task *t, int ok, const struct rusage *ru )
+{
+	decode_job *j = t->job;
+	split_result r;
+	char dir[PATH_MAX];
+	int merged;
+
+	if( t->pipe_fd != -1 ) {
+		ok = ok && (read( t->pipe_fd, &r, sizeof(r) ) == sizeof(r));
+		close( t->pipe_fd );
+	}
+	t->pid = 0;
+	--j->running;
+	if( !ok ) {
+		j->failed = 1;
+	}
+	if( (ru != NULL) && (t->phase != PHASE_VERIFY) ) {
+		j->cpu += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+				+ ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+	}
+
+	switch( t->phase ) {
+	case PHASE_WHOLE:
+		if( ok ) {
+			j->bytes = r.bytes;
+		}
+		job_done( j );
+		break;
+
+	case PHASE_CHUNKS:
+		j->chunk[t->chunk].busy = 0;
+		if( ok ) {
+			j->chunk[t->chunk].done = 1;
+			j->chunk[t->chunk].reached = r.end;
+			memcpy( j->chunk[t->chunk].exit, r.exit, sizeof(r.exit) );
+			j->chunk[t->chunk].exits = r.exits;
+		}
+		if( j->running > 0 ) {
+			break;
+		}
+		if( j->failed ) {
+			job_done( j );
+			break;
+		}
+		for( int c = 0; c < j->n_chunks; c++ ) {
+			if( !j->chunk[c].done ) {
+				return;
+			}
+		}
+
+		// Every chunk decoded: merge across the cuts that did not
+		// hold, or go on to stitch once they all do
+		++j->rounds;
+		snprintf( dir, sizeof(dir), "%s/%s", out_dir, j->name );
+		merged = split_check( dir, j->chunk, &j->n_chunks, &j->next_id );
+		j->merged += merged;
+		if( merged == 0 ) {
+			free( j->data );
+			j->data = NULL;
+			j->bytes = j->size;
+			j->phase = PHASE_STITCH;
+			j->started = 0;
+		}
+		break;
+
+	case PHASE_STITCH:
+		j->wall = now_s() - j->start;
+		if( !j->failed && verify ) {
+			j->phase = PHASE_VERIFY;
+			j->started = 0;
+		} else {
+			job_done( j );
+		}
+		break;
+
+	case PHASE_VERIFY:
+		j->whole_wall = now_s() - t->start;
+		if( ok ) {
+			j->diffs = r.outputs;
+			snprintf( j->diff, sizeof(j->diff), "%s", r.diff );
+		}
+		job_done( j );
+		break;
+	}
+}
+
+//--------------------------------------------------------------------
+// main()
+//--------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+	char conffile[128] = "";
+	long jobs = sysconf( _SC_NPROCESSORS_ONLN );
+	decode_job *job;
+	decode_task *task;
+	int n_jobs, running, failed = 0;
+	uint64_t total_bytes = 0;
+	double start, wall, cpu = 0;
+	char dir[PATH_MAX];
+	struct stat st;
+	int c;
+
+	while( (c = getopt(argc, argv, "df:hj:o:s:v")) != -1 )
+	{
+		switch( c ) {
+		case 'd':
+			options |= DEBUG_DUMP;
+			break;
+		case 'f':
+			snprintf( conffile, sizeof(conffile), "%s", optarg );
+			break;
+		case 'h':
+			for(int i = 0; i < sizeof(help_arr) / sizeof(char *); ++i) {
+				printf("%s\n", help_arr[i]);
+			}
+			return EXIT_SUCCESS;
+		case 'j':
+			jobs = atoi( optarg );
+			if( jobs <= 0 ) {
+				printf("Error - invalid job count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			out_dir = optarg;
+			break;
+		case 's':
+			split_size = strtoull( optarg, NULL, 10 ) * 1024;
+			if( split_size == 0 ) {
+				printf("Error - invalid chunk size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		default:
+		case '?':
+			printf( "Unrecognized option encountered -%c\n", optopt );
+			return EXIT_FAILURE;
+		}
+	}
+	if( optind >= argc ) {
+		printf("Error - no capture files given\n");
+		return EXIT_FAILURE;
+	}
+	if( verify && (split_size == 0) ) {
+		printf("Error - -v compares split decodes, give a chunk size with -s\n");
+		return EXIT_FAILURE;
+	}
+	if( jobs < 1 ) {
+		jobs = 1;
+	}
+
+	// Storage and logmode settings as printem would have them
+	if( conffile[0] != '\0' ) {
+		if( config_load( conffile ) == -1 ) {
+			printf("Configuration file %s has errors\n", conffile );
+			return EXIT_FAILURE;
+		}
+	} else {
+		config_defaults();
+	}
+	stg_config = config.storage;
+	diag_config = config.diag;
+	if( options & DEBUG_DUMP ) {
+		diag_config.level = DIAG_DEBUG;
+	}
+
+	n_jobs = argc - optind;
+	job = (decode_job *)calloc( n_jobs, sizeof(decode_job) );
+	task = (decode_task *)calloc( jobs, sizeof(decode_task) );
+	if( (job == NULL) || (task == NULL) ) {
+		printf("Error - out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for( int i = 0; i < n_jobs; i++ )
+	{
+		job[i].path = argv[optind + i];
+		job[i].text = cap_is_text( job[i].path );
+		if( job[i].text == -1 ) {
+			printf("Error - unable to read %s: %s\n", job[i].path, strerror( errno ));
+			return EXIT_FAILURE;
+		}
+		job_name( &job[i] );
+		for( int k = 0; k < i; k++ ) {
+			if( !strcmp( job[k].name, job[i].name ) ) {
+				printf("Error - %s and %s would both decode to %s\n", job[k].path, job[i].path, job[i].name);
+				return EXIT_FAILURE;
+			}
+		}
+		job[i].phase = split_size ? PHASE_CHUNKS : PHASE_WHOLE;
+		job[i].diffs = -1;
+
+		// The comparison takes every file in the disk directory
+		snprintf( dir, sizeof(dir), "%s/%s/%s", out_dir, job[i].name, DESKTOP_DISK_DIR );
+		if( verify && (stat( dir, &st ) == 0) ) {
+			printf("Error - %s holds an earlier decode, -v needs it gone\n", dir);
+			return EXIT_FAILURE;
+		}
+	}
+	if( (mkdir( out_dir, DIR_PERMS ) == -1) && (errno != EEXIST) ) {
+		perror( out_dir );
+		return EXIT_FAILURE;
+	}
+
+	printf("Decoding %d captures into %s, %ld at a time\n", n_jobs, out_dir, jobs);
+	start = now_s();
+	running = 0;
+	for( ;; )
+	{
+		decode_task *t = NULL;
+		for( int i = 0; (t == NULL) && (i < jobs); i++ ) {
+			if( task[i].pid == 0 ) {
+				t = &task[i];
+			}
+		}
+		if( (t != NULL) && task_next( job, n_jobs, t ) ) {
+			if( task_start( t ) == 0 ) {
+				++running;
+			} else {
+				task_finish( t, 0, NULL );
+			}
+			continue;
+		}
+		if( running == 0 ) {
+			break;
+		}
+
+		int status;
+		struct rusage ru;
+		pid_t pid = wait4( -1, &status, 0, &ru );
+		if( pid == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			perror("wait4");
+			break;
+		}
+		for( int i = 0; i < jobs; i++ ) {
+			if( task[i].pid == pid ) {
+				task_finish( &task[i], WIFEXITED( status ) && (WEXITSTATUS( status ) == EXIT_SUCCESS), &ru );
+				--running;
+				break;
+			}
+		}
+	}
+	wall = now_s() - start;
+
+	for( int i = 0; i < n_jobs; i++ )
+	{
+		total_bytes += job[i].bytes;
+		cpu += job[i].cpu;
+		if( !job[i].ok ) {
+			++failed;
+		}
+		free( job[i].chunk );
+	}
+	printf("%d captures, %llu bytes in %.2f s: %.2f MB/s, %.2f s CPU (%.1fx parallel), %d failed\n",
+		   n_jobs, (unsigned long long)total_bytes, wall, (wall > 0) ? total_bytes / wall / 1e6 : 0.0,
+		   cpu, (wall > 0) ? cpu / wall : 0.0, failed);
+
+	free( task );
+	free( job );
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,724 @@
+//--------------------------------------------------------------------
+//  split.c
+//      One large capture decoded by several parsers at once
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>       // malloc()
+#include <string.h>
+#include <ctype.h>        // isdigit()
+#include <time.h>         // strptime(), mktime()
+#include <dirent.h>       // scandir()
+#include <ftw.h>          // nftw()
+#include <limits.h>       // PATH_MAX
+#include <unistd.h>       // access()
+#include <sys/stat.h>
+
+#include "../Printer-Emulator/parser.h"
+#include "split.h"
+#include "../Printer-Emulator/utils.h"      // DESKTOP_DISK_DIR, name_in_use()
+#include "../Printer-Emulator/capture.h"    // CAP_READ_SIZE
+#include "../Printer-Emulator/harvest.h"
+#include "../Printer-Emulator/timing.h"     // TIMING_FILE
+#include "../Common/log_stream.h"
+
+// Sequence files, named <kind>YYYYmmddHHMMSS[suffix] by unique_filename()
+static const char *split_kinds[] = { "report-", "history-", "logmode-" };
+#define SPLIT_KINDS    3
+#define SPLIT_HISTORY  1
+#define SPLIT_LOGMODE  2
+#define STAMP_LEN      14
+
+//--------------------------------------------------------------------
+//  split_plan()
+//      Cut the capture at the first 0x91 at or past every chunk_size
+//      bytes.  More than max chunks and they are made larger.
+//  returns:
+//      number of chunks
+//--------------------------------------------------------------------
+int split_plan( const unsigned char *data, uint64_t len, uint64_t chunk_size, split_chunk *c, int max )
+{
+	uint64_t first = 0;
+	uint64_t cut;
+	int n = 0;
+
+	if( len / chunk_size >= (uint64_t)max ) {
+		chunk_size = len / max + 1;
+	}
+
+	while( n < max - 1 )
+	{
+		cut = first + chunk_size;
+		while( (cut < len) && (data[cut] != 0x91) ) {
+			++cut;
+		}
+		if( cut >= len ) {
+			break;
+		}
+		memset( &c[n], 0, sizeof(c[n]) );
+		c[n].first = first;
+		c[n].end = cut;
+		c[n].id = n;
+		++n;
+		first = cut;
+	}
+	memset( &c[n], 0, sizeof(c[n]) );
+	c[n].first = first;
+	c[n].end = len;
+	c[n].id = n;
+	return n + 1;
+}
+
+//--------------------------------------------------------------------
+//  split_chunk_dir()
+//--------------------------------------------------------------------
+void split_chunk_dir( const split_chunk *c, char *out, int size )
+{
+	snprintf( out, size, "chunk-%03d", c->id );
+}
+
+//--------------------------------------------------------------------
+//  split_join()
+//      Where the parsers either side of the cut at pos are compared:
+//      the next 0x91.  A resync and steady state take the cut's own
+//      0x91 differently (SS_DISPLAY against SS_PAUSE) but agree after
+//      the display frame that follows, and no sequence fits inside one
+//      frame.
+//--------------------------------------------------------------------
+static uint64_t split_join( const unsigned char *data, uint64_t len, uint64_t pos )
+{
+	for( ++pos; (pos < len) && (data[pos] != 0x91); pos++ ) {
+	}
+	return pos;
+}
+
+//--------------------------------------------------------------------
+//  split_feed()
+//      Bytes [pos, end) to the parser in CAP_READ_SIZE pieces
+//--------------------------------------------------------------------
+static void split_feed( unsigned char *data, uint64_t pos, uint64_t end )
+{
+	uint64_t n;
+
+	while( pos < end )
+	{
+		n = end - pos;
+		if( n > CAP_READ_SIZE ) {
+			n = CAP_READ_SIZE;
+		}
+		parse_header( (int)n, data + pos );
+		pos += n;
+	}
+}
+
+//--------------------------------------------------------------------
+//  split_sig_hash()
+//      FNV-1a 64 bit hash of the compared part of a signature
+//--------------------------------------------------------------------
+static uint64_t split_sig_hash( const parse_sig *s )
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int v[5] = { s->state, s->status, s->hst_is_first, s->files_open, s->buffer_len };
+
+	for( size_t i = 0; i < sizeof(v); i++ ) {
+		h ^= ((const unsigned char *)v)[i];
+		h *= 0x100000001b3ULL;
+	}
+	for( int i = 0; i < s->buffer_len; i++ ) {
+		h ^= s->buffer[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+//--------------------------------------------------------------------
+//  split_parse()
+//      Runs in the chunk's child, its parser open.  A chunk after the
+//      first starts on a 0x91, resynced, and records its joins while it
+//      has made no file.  Past its end the parser goes on through
+//      SPLIT_EXITS more 0x91 with no file open, each a join offered to
+//      the next chunk's parser.  Those count only if no file is begun
+//      among them: the next parser makes any that follow.
+//--------------------------------------------------------------------
+void split_parse( unsigned char *data, uint64_t len, const split_chunk *c, split_result *r )
+{
+	split_join_rec rec;
+	parse_sig sig;
+	uint64_t pos = c->first;
+	uint64_t join;
+	int made = 0;
+	FILE *fp;
+
+	memset( r, 0, sizeof(*r) );
+
+	if( (c->first > 0) && ((fp = fopen( SPLIT_JOIN_FILE, "w" )) != NULL) )
+	{
+		for( int n = 0; n < SPLIT_JOINS; n++ )
+		{
+			join = split_join( data, len, pos );
+			if( join >= c->end ) {
+				break;
+			}
+			split_feed( data, pos, join + 1 );
+			pos = join + 1;
+			parse_get_sig( &sig );
+			if( sig.files_made > 0 ) {
+				break;
+			}
+			rec.offset = join;
+			rec.hash = split_sig_hash( &sig );
+			fwrite( &rec, sizeof(rec), 1, fp );
+		}
+		fclose( fp );
+	}
+	split_feed( data, pos, c->end );
+
+	// On past the end, as far as the next chunk's parser may be joined
+	pos = c->end;
+	while( r->exits < SPLIT_EXITS )
+	{
+		join = split_join( data, len, pos );
+		if( join >= len ) {
+			split_feed( data, pos, len );
+			pos = len;
+			break;
+		}
+		split_feed( data, pos, join + 1 );
+		pos = join + 1;
+		parse_get_sig( &sig );
+		if( (r->exits > 0) && (sig.files_made != made) ) {
+			r->exits = -1;
+			break;
+		}
+		if( !sig.files_open ) {
+			made = sig.files_made;
+			r->exit[r->exits].offset = join;
+			r->exit[r->exits].hash = split_sig_hash( &sig );
+			++r->exits;
+		}
+	}
+	r->end = pos;
+	r->bytes = pos - c->first;
+}
+
+//--------------------------------------------------------------------
+//  join_find()
+//      The chunk's parser recorded one of the joins p offered
+//--------------------------------------------------------------------
+static int join_find( const char *dir, const split_chunk *c, const split_chunk *p )
+{
+	char path[PATH_MAX];
+	split_join_rec rec;
+	int found = 0;
+	FILE *fp;
+
+	snprintf( path, sizeof(path), "%s/", dir );
+	split_chunk_dir( c, path + strlen( path ), sizeof(path) - strlen( path ) );
+	strncat( path, "/" SPLIT_JOIN_FILE, sizeof(path) - strlen( path ) - 1 );
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		return 0;
+	}
+	// Both lists are in capture order
+	int have = (fread( &rec, sizeof(rec), 1, fp ) == 1);
+	for( int e = 0; have && (e < p->exits) && !found; e++ ) {
+		while( have && (rec.offset < p->exit[e].offset) ) {
+			have = (fread( &rec, sizeof(rec), 1, fp ) == 1);
+		}
+		found = have && (rec.offset == p->exit[e].offset) && (rec.hash == p->exit[e].hash);
+	}
+	fclose( fp );
+	return found;
+}
+
+//--------------------------------------------------------------------
+//  split_check()
+//      Every chunk decoded: join each parser to the next at the first
+//      join both recorded.  A chunk a parser went on past is dropped,
+//      it was outrun.  Where the next parser made a file first, or its guess
+//      had not come right, the two chunks are merged, under a new id,
+//      to be decoded again.  dir is the capture's directory.
+//  returns:
+//      cuts merged (0: every cut holds)
+//--------------------------------------------------------------------
+int split_check( const char *dir, split_chunk *c, int *n, int *next_id )
+{
+	int merged = 0;
+	int k = 0;
+
+	for( int i = 0; i < *n; i++ )
+	{
+		split_chunk *p = (k > 0) ? &c[k - 1] : NULL;
+
+		if( (p == NULL) || !p->done ) {
+			// The first, or after a chunk to be decoded again
+			c[k++] = c[i];
+		} else if(    ((p->exits > 0) && (p->exit[0].offset >= c[i].end))
+		           || ((p->exits == 0) && (p->reached >= c[i].end)) ) {
+			// Outrun, the parser before was in a sequence all through it
+			continue;
+		} else if( join_find( dir, &c[i], p ) ) {
+			c[k++] = c[i];
+		} else {
+			p->end = c[i].end;
+			p->done = 0;
+			p->id = (*next_id)++;
+			++merged;
+		}
+	}
+	*n = k;
+	return merged;
+}
+
+//--------------------------------------------------------------------
+//  output_kind()
+//      Sequence file kind of a directory entry, and its time stamp
+//  returns:
+//      index in split_kinds
+//      -1 not a sequence file
+//--------------------------------------------------------------------
+static int output_kind( const char *name, time_t *t )
+{
+	struct tm tm;
+
+	for( int k = 0; k < SPLIT_KINDS; k++ )
+	{
+		size_t len = strlen( split_kinds[k] );
+		if( strncmp( name, split_kinds[k], len ) ) {
+			continue;
+		}
+		for( int i = 0; i < STAMP_LEN; i++ ) {
+			if( !isdigit( (unsigned char)name[len + i] ) ) {
+				return -1;
+			}
+		}
+		if( t != NULL ) {
+			memset( &tm, 0, sizeof(tm) );
+			strptime( name + len, "%Y%m%d%H%M%S", &tm );
+			tm.tm_isdst = -1;
+			*t = mktime( &tm );
+		}
+		return k;
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  append_file()
+//--------------------------------------------------------------------
+static void append_file( const char *path, FILE *out )
+{
+	char buf[4096];
+	FILE *fp;
+	size_t n;
+
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		return;
+	}
+	while( (n = fread( buf, 1, sizeof(buf), fp )) > 0 ) {
+		fwrite( buf, 1, n, out );
+	}
+	fclose( fp );
+}
+
+//--------------------------------------------------------------------
+//  stitch_harvest()
+//      Feed a stitched history file to the harvest as HST_Data did:
+//      its frames each start with 0x98
+//  returns:
+//      new records, -1 failure
+//--------------------------------------------------------------------
+static int stitch_harvest( const char *path )
+{
+	unsigned char *data;
+	long len;
+	long i, j;
+	FILE *fp;
+
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		return -1;
+	}
+	fseek( fp, 0, SEEK_END );
+	len = ftell( fp );
+	rewind( fp );
+	data = (unsigned char *)malloc( len > 0 ? len : 1 );
+	if( (data == NULL) || (fread( data, 1, len, fp ) != (size_t)len) ) {
+		free( data );
+		fclose( fp );
+		return -1;
+	}
+	fclose( fp );
+
+	hst_harvest_begin();
+	for( i = 0; i < len; i = j )
+	{
+		for( j = i + 1; (j < len) && (data[j] != 0x98); j++ ) {
+		}
+		hst_harvest_record( data + i, (int)(j - i) );
+	}
+	free( data );
+	return hst_harvest_complete();
+}
+
+//--------------------------------------------------------------------
+//  stitch_chunk()
+//      Move one chunk's sequence files into Data.  Each sequence keeps
+//      its time stamp unless an earlier chunk has used it (the chunks
+//      ran at the same time), then takes the next one free, so the
+//      files still sort in capture order.
+//  returns:
+//      files moved, -1 failure
+//--------------------------------------------------------------------
+static int stitch_chunk( const split_chunk *c, time_t *last, FILE *timing )
+{
+	char dir[PATH_MAX];
+	char src[PATH_MAX + 256];
+	char dst[PATH_MAX + 256];
+	char stamp[STAMP_LEN + 1];
+	struct dirent **ent;
+	int cur_kind = -1;
+	char cur_old[STAMP_LEN + 1] = "";
+	struct stat st;
+	int moved = 0;
+	int n;
+
+	split_chunk_dir( c, dir, sizeof(dir) );
+	strcat( dir, "/" DESKTOP_DISK_DIR );
+	n = scandir( dir, &ent, NULL, alphasort );
+	if( n == -1 ) {
+		return -1;
+	}
+
+	for( int i = 0; i < n; i++ )
+	{
+		const char *name = ent[i]->d_name;
+		time_t t;
+		int k = output_kind( name, &t );
+
+		snprintf( src, sizeof(src), "%s/%s", dir, name );
+		if( k >= 0 )
+		{
+			size_t len = strlen( split_kinds[k] );
+
+			// Files of one sequence sort together: the first of them
+			// settles its stamp
+			if( (k != cur_kind) || strncmp( name + len, cur_old, STAMP_LEN ) )
+			{
+				if( t <= last[k] ) {
+					t = last[k] + 1;
+				}
+				for( ;; t++ ) {
+					strftime( stamp, sizeof(stamp), "%Y%m%d%H%M%S", localtime( &t ) );
+					snprintf( dst, sizeof(dst), "%s/%s%s", DESKTOP_DISK_DIR, split_kinds[k], stamp );
+					if( !name_in_use( dst ) ) {
+						break;
+					}
+				}
+				last[k] = t;
+				cur_kind = k;
+				snprintf( cur_old, sizeof(cur_old), "%.*s", STAMP_LEN, name + len );
+			}
+
+			snprintf( dst, sizeof(dst), "%s/%s%s%s", DESKTOP_DISK_DIR, split_kinds[k], stamp, name + len + STAMP_LEN );
+			if( rename( src, dst ) == -1 ) {
+				perror( dst );
+				free( ent[i] );
+				continue;
+			}
+			++moved;
+			if( (k == SPLIT_HISTORY) && (name[len + STAMP_LEN] == '\0') ) {
+				stitch_harvest( dst );
+			}
+		}
+		else if( !strcmp( name, "readings.txt" ) )
+		{
+			// The latest chunk that took readings has the ones to keep
+			snprintf( dst, sizeof(dst), "%s/%s", DESKTOP_DISK_DIR, name );
+			if( (stat( src, &st ) == 0) && ((st.st_size > 0) || (access( dst, F_OK ) == -1)) ) {
+				rename( src, dst );
+			}
+		}
+		else if( !strcmp( name, TIMING_FILE ) )
+		{
+			append_file( src, timing );
+		}
+		// The chunk's history store and index go with it: the store is
+		// rebuilt from the stitched histories
+		free( ent[i] );
+	}
+	free( ent );
+	return moved;
+}
+
+//--------------------------------------------------------------------
+//  split_stitch()
+//      Runs in the capture's directory, chunks all decoded and every
+//      cut held: join their files into Data and their logs to stdout,
+//      then remove the chunk directories (merged ones included)
+//  returns:
+//      files moved, -1 failure
+//--------------------------------------------------------------------
+int split_stitch( const split_chunk *c, int n )
+{
+	time_t last[SPLIT_KINDS] = { 0 };
+	char path[PATH_MAX];
+	struct dirent **ent;
+	FILE *timing;
+	int moved = 0;
+	int rv;
+
+	snprintf( path, sizeof(path), "%s/%s", DESKTOP_DISK_DIR, TIMING_FILE );
+	timing = fopen( path, "a" );
+	if( timing == NULL ) {
+		perror( path );
+		return -1;
+	}
+	hst_harvest_open( DESKTOP_DISK_DIR );
+
+	for( int i = 0; i < n; i++ )
+	{
+		split_chunk_dir( &c[i], path, sizeof(path) );
+		printf("--- %s: bytes %llu to %llu ---\n", path,
+			   (unsigned long long)c[i].first, (unsigned long long)c[i].reached);
+		fflush( stdout );
+		strcat( path, "/decode.log" );
+		append_file( path, stdout );
+
+		rv = stitch_chunk( &c[i], last, timing );
+		if( rv == -1 ) {
+			moved = -1;
+			break;
+		}
+		moved += rv;
+	}
+	hst_harvest_close();
+	fclose( timing );
+
+	if( moved == -1 ) {
+		return -1;
+	}
+	rv = scandir( ".", &ent, NULL, alphasort );
+	for( int i = 0; i < rv; i++ ) {
+		if( !strncmp( ent[i]->d_name, "chunk-", 6 ) ) {
+			split_remove( ent[i]->d_name );
+		}
+		free( ent[i] );
+	}
+	if( rv >= 0 ) {
+		free( ent );
+	}
+	return moved;
+}
+
+// One side of a comparison: the sequences of one kind, oldest first
+typedef struct seq_list
+{
+	char (*name)[32];       // <kind><stamp>
+	int  count;
+} seq_list;
+
+//--------------------------------------------------------------------
+//  seq_list_load()
+//--------------------------------------------------------------------
+static int seq_list_load( const char *dir, int kind, seq_list *l )
+{
+	struct dirent **ent;
+	size_t len = strlen( split_kinds[kind] );
+	int n;
+
+	l->name = NULL;
+	l->count = 0;
+	n = scandir( dir, &ent, NULL, alphasort );
+	if( n == -1 ) {
+		return -1;
+	}
+	l->name = (char (*)[32])calloc( n + 1, sizeof(*l->name) );
+	for( int i = 0; i < n; i++ )
+	{
+		const char *name = ent[i]->d_name;
+		if(    (l->name != NULL) && (output_kind( name, NULL ) == kind)
+			&& ((l->count == 0) || strncmp( l->name[l->count - 1], name, len + STAMP_LEN )) ) {
+			snprintf( l->name[l->count++], sizeof(*l->name), "%.*s", (int)(len + STAMP_LEN), name );
+		}
+		free( ent[i] );
+	}
+	free( ent );
+	return (l->name != NULL) ? 0 : -1;
+}
+
+//--------------------------------------------------------------------
+//  same_file()
+//--------------------------------------------------------------------
+static int same_file( const char *a, const char *b )
+{
+	char buf_a[4096], buf_b[4096];
+	FILE *fa, *fb;
+	size_t na, nb;
+	int same = 1;
+
+	fa = fopen( a, "r" );
+	fb = fopen( b, "r" );
+	if( (fa == NULL) || (fb == NULL) ) {
+		same = (fa == NULL) && (fb == NULL);
+	} else {
+		do {
+			na = fread( buf_a, 1, sizeof(buf_a), fa );
+			nb = fread( buf_b, 1, sizeof(buf_b), fb );
+			if( (na != nb) || memcmp( buf_a, buf_b, na ) ) {
+				same = 0;
+			}
+		} while( same && (na > 0) );
+	}
+	if( fa != NULL ) {
+		fclose( fa );
+	}
+	if( fb != NULL ) {
+		fclose( fb );
+	}
+	return same;
+}
+
+// A logmode session read record by record across its segments
+typedef struct session
+{
+	const char *base;
+	int         segment;
+	int         open;
+	ls_reader   r;
+} session;
+
+//--------------------------------------------------------------------
+//  session_next()
+//  returns:
+//       1  record read
+//       0  end of the session
+//      -1  corrupt segment
+//--------------------------------------------------------------------
+static int session_next( session *s, ls_frame_hdr *fh, unsigned char *buf, int size )
+{
+	char path[LS_SEGMENT_SIZE + 8];
+	int rv;
+
+	for( ;; )
+	{
+		if( !s->open ) {
+			if( ls_segment_find( s->base, s->segment, path, sizeof(path) ) == -1 ) {
+				return 0;
+			}
+			if( ls_reader_open( &s->r, path ) == -1 ) {
+				return -1;
+			}
+			s->open = 1;
+		}
+		rv = ls_next( &s->r, fh, buf, size );
+		if( rv != 0 ) {
+			return rv;
+		}
+		ls_reader_close( &s->r );
+		s->open = 0;
+		++s->segment;
+	}
+}
+
+//--------------------------------------------------------------------
+//  same_session()
+//      Same records in the same order.  Arrival times are those of the
+//      decode, not of the capture, and are left out, as are segment
+//      cuts made by the clock.
+//--------------------------------------------------------------------
+static int same_session( const char *a, const char *b )
+{
+	unsigned char buf_a[LS_MAX_RECORD], buf_b[LS_MAX_RECORD];
+	ls_frame_hdr fa, fb;
+	session sa = { a, 0, 0 };
+	session sb = { b, 0, 0 };
+	int ra, rb;
+	int same = 1;
+
+	do {
+		ra = session_next( &sa, &fa, buf_a, sizeof(buf_a) );
+		rb = session_next( &sb, &fb, buf_b, sizeof(buf_b) );
+		if( (ra != rb) || (ra == -1) ) {
+			same = 0;
+		} else if( ra == 1 ) {
+			same = (fa.seq == fb.seq) && (fa.len == fb.len) && !memcmp( buf_a, buf_b, fa.len );
+		}
+	} while( same && (ra == 1) );
+
+	if( sa.open ) {
+		ls_reader_close( &sa.r );
+	}
+	if( sb.open ) {
+		ls_reader_close( &sb.r );
+	}
+	return same;
+}
+
+//--------------------------------------------------------------------
+//  split_compare()
+//      Sequence files and history store of two disk directories, taken
+//      in order: the n-th report of one against the n-th of the other.
+//      diff gets the first that differs.
+//  returns:
+//      number of differences, -1 failure
+//--------------------------------------------------------------------
+int split_compare( const char *a_dir, const char *b_dir, char *diff, int size )
+{
+	char a[PATH_MAX], b[PATH_MAX];
+	seq_list la, lb;
+	int diffs = 0;
+	int same;
+
+	diff[0] = '\0';
+	for( int k = 0; k < SPLIT_KINDS; k++ )
+	{
+		if( seq_list_load( a_dir, k, &la ) == -1 ) {
+			return -1;
+		}
+		if( seq_list_load( b_dir, k, &lb ) == -1 ) {
+			free( la.name );
+			return -1;
+		}
+		if( la.count != lb.count ) {
+			if( diffs++ == 0 ) {
+				snprintf( diff, size, "%d %sfiles against %d", la.count, split_kinds[k], lb.count );
+			}
+		}
+		for( int i = 0; (i < la.count) && (i < lb.count); i++ )
+		{
+			snprintf( a, sizeof(a), "%s/%s", a_dir, la.name[i] );
+			snprintf( b, sizeof(b), "%s/%s", b_dir, lb.name[i] );
+			same = (k == SPLIT_LOGMODE) ? same_session( a, b ) : same_file( a, b );
+			if( !same && (diffs++ == 0) ) {
+				snprintf( diff, size, "%s", la.name[i] );
+			}
+		}
+		free( la.name );
+		free( lb.name );
+	}
+
+	snprintf( a, sizeof(a), "%s/%s", a_dir, HST_STORE_FILE );
+	snprintf( b, sizeof(b), "%s/%s", b_dir, HST_STORE_FILE );
+	if( !same_file( a, b ) && (diffs++ == 0) ) {
+		snprintf( diff, size, "%s", HST_STORE_FILE );
+	}
+	return diffs;
+}
+
+//--------------------------------------------------------------------
+//  remove_entry()
+//--------------------------------------------------------------------
+static int remove_entry( const char *path, const struct stat *sb, int flag, struct FTW *ftw )
+{
+	return remove( path );
+}
+
+//--------------------------------------------------------------------
+//  split_remove()
+//      A working directory and everything in it
+//--------------------------------------------------------------------
+int split_remove( const char *dir )
+{
+	return nftw( dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+}
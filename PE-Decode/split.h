@@ -0,0 +1,78 @@
+
+//--------------------------------------------------------------------
+//  split.h
+//--------------------------------------------------------------------
+
+// One large capture decoded by several parsers at once.
+//
+// The capture is loaded and cut into chunks at 0x91 bytes near even
+// intervals.  A parser that has lost its place resyncs on 0x91, so each
+// chunk after the first is decoded by a fresh parser started on its
+// 0x91 as if it had just resynced there.  That is a guess: it holds
+// wherever the bus was in steady state at the cut, which is most of it.
+//
+// The guess is checked after the decode.  Near its start each chunk's
+// parser records a hash of its signature (parse_sig) after every 0x91,
+// for as long as it has made no file.  The parser of the chunk before
+// goes on past its end through the next few 0x91 with no file open,
+// and the cut moves to the first of them where the later parser
+// recorded the same signature: from there on it parses as one parser
+// over the whole capture would have, and before there it made no file.
+// A parser still in a sequence after a whole chunk takes that chunk
+// over.  A cut that does not hold (the later parser made a file first,
+// or its guess had not come right within SPLIT_JOINS frames) has the
+// two chunks merged and decoded again as one, until every cut holds.
+//
+// The chunks' files are then stitched into the capture's Data directory
+// in capture order and the history store is rebuilt from the stitched
+// histories.  With -v the capture is also decoded by one parser and the
+// two results compared file by file.
+
+// Needs ../Printer-Emulator/parser.h (parse_sig) included first
+
+#include <stdint.h>
+
+#define SPLIT_MAX_CHUNKS  256
+#define SPLIT_JOINS       65536      // frames a chunk may be joined in
+#define SPLIT_JOIN_FILE   "joins.dat"
+#define SPLIT_EXITS       8          // joins offered past a chunk's end
+#define SPLIT_VERIFY_DIR  "verify"
+
+// A 0x91 where one parser may hand over to another
+typedef struct split_join_rec
+{
+	uint64_t offset;
+	uint64_t hash;          // of the parser's signature after it
+} split_join_rec;
+
+// One chunk of a split capture
+typedef struct split_chunk
+{
+	uint64_t  first;        // capture bytes [first, end)
+	uint64_t  end;
+	int       id;           // works in chunk-<id>
+	int       busy;         // child at work on it
+	int       done;         // decoded, reached and exit are valid
+	uint64_t  reached;      // parsed up to, past end
+	split_join_rec exit[SPLIT_EXITS];   // joins offered past end
+	int       exits;        // -1: a file begun among them, none hold
+} split_chunk;
+
+// What a child reports back to pedecode
+typedef struct split_result
+{
+	uint64_t  bytes;        // parsed
+	uint64_t  end;          // chunk: reached
+	split_join_rec exit[SPLIT_EXITS];
+	int       exits;
+	int       outputs;      // stitch: files moved in.  verify: differences
+	char      diff[128];    // verify: first file that differs
+} split_result;
+
+int split_plan( const unsigned char *data, uint64_t len, uint64_t chunk_size, split_chunk *c, int max );
+void split_chunk_dir( const split_chunk *c, char *out, int size );
+void split_parse( unsigned char *data, uint64_t len, const split_chunk *c, split_result *r );
+int split_check( const char *dir, split_chunk *c, int *n, int *next_id );
+int split_stitch( const split_chunk *c, int n );
+int split_compare( const char *a_dir, const char *b_dir, char *diff, int size );
+int split_remove( const char *dir );
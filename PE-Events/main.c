@@ -0,0 +1,163 @@
+//--------------------------------------------------------------------
+// Printer Emulator Event Reader
+//     Follows printem's shared memory event ring and prints each parser
+//     event with its decoded fields.  Also the reference reader for
+//     Common/ev_ring.h: events are read with no system calls while they
+//     keep coming, the reader sleeps on the ring when they don't, and a
+//     reader too slow for the stream is told how many it missed.
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>   // EXIT_SUCCESS
+#include <string.h>
+#include <unistd.h>   // getopt, sleep
+#include <signal.h>
+#include <time.h>
+
+#include "../Common/ev_ring.h"
+#include "../Common/pe_proto.h"
+#include "../Common/hist_store.h"
+
+//--------------------------------------------------------------------
+// File scope variables
+//--------------------------------------------------------------------
+// Version String
+const char version_stg[] = {"v1.3.1"};
+
+const char * help_arr[] = {
+	"  Live event reader for the Printer Emulator",
+	"  Usage: peevents [options]",
+	"  Optional Arguments",
+	"    -c <classes>  comma separated: readings,log,divert,state (default: all)",
+	"    -r            raw: write event bytes only",
+	"    -h            display this help screen",
+	"  Runs until interrupted and follows printem across restarts",
+};
+
+// Idle time after which the ring is checked for a printem restart
+#define IDLE_CHECK_MS  2000
+
+volatile sig_atomic_t isBreak = 0;
+
+//--------------------------------------------------------------------
+// INThandler()
+//--------------------------------------------------------------------
+void INThandler( int sig )
+{
+	isBreak = 1;
+}
+
+//--------------------------------------------------------------------
+// print_event()
+//--------------------------------------------------------------------
+void print_event( const evr_event *ev, int raw )
+{
+	const evr_slot *s = &ev->slot;
+	char stamp[32];
+	time_t secs;
+	struct tm tm;
+
+	if( raw ) {
+		fwrite( s->data, 1, s->len, stdout );
+		return;
+	}
+
+	secs = s->time_us / 1000000;
+	localtime_r( &secs, &tm );
+	strftime( stamp, sizeof(stamp), "%H:%M:%S", &tm );
+	printf("%8llu %s.%03d %-8s ", (unsigned long long)ev->seq, stamp,
+		   (int)((s->time_us % 1000000) / 1000), pp_event_name( s->event ));
+
+	if( s->reading_a != EVR_NO_READING ) {
+		printf("A %5.1f%% B %5.1f%%  ", s->reading_a / 10.0, s->reading_b / 10.0);
+	}
+	if( s->record_time != 0 ) {
+		printf("[%s] ", hs_event_name( s->kind ));
+	}
+	for( int i = 0; i < s->len; i++ )
+	{
+		if( (s->data[i] >= 0x20) && (s->data[i] < 0x7F) ) {
+			putchar( s->data[i] );
+		} else if( (s->data[i] == 0x0D) || (s->data[i] == 0x0A) ) {
+			// record terminators
+		} else {
+			printf("\\x%02X", s->data[i]);
+		}
+	}
+	putchar('\n');
+}
+
+//--------------------------------------------------------------------
+// main()
+//--------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+	unsigned int events = PP_EV_ALL;
+	int raw = 0;
+	int c;
+	evr_reader r;
+	evr_event ev;
+	struct sigaction sa;
+
+	while( (c = getopt(argc, argv, "c:hr")) != -1 )
+	{
+		switch( c ) {
+		case 'c':
+			if( pp_event_parse( optarg, &events ) == -1 ) {
+				printf("Error - unknown event class in %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			for(int i = 0; i < sizeof(help_arr) / sizeof(char *); ++i) {
+				printf("%s\n", help_arr[i]);
+			}
+			return EXIT_SUCCESS;
+		case 'r':
+			raw = 1;
+			break;
+		default:
+		case '?':
+			printf( "Unrecognized option encountered -%c\n", optopt );
+			return EXIT_FAILURE;
+		}
+	}
+
+	// No SA_RESTART: the wait returns on Ctrl-C
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = INThandler;
+	sigaction( SIGINT, &sa, NULL );
+	sigaction( SIGTERM, &sa, NULL );
+
+	if( evr_open( &r, EVR_NAME ) == -1 ) {
+		printf("Error - no event ring, is printem running?\n");
+		return EXIT_FAILURE;
+	}
+
+	while( !isBreak )
+	{
+		while( evr_next( &r, &ev ) == 1 ) {
+			if( ev.lost && !raw ) {
+				printf("--- %llu events lost ---\n", (unsigned long long)ev.lost);
+			}
+			if( ev.slot.event & events ) {
+				print_event( &ev, raw );
+			}
+		}
+		fflush( stdout );
+
+		if( (evr_wait( &r, IDLE_CHECK_MS ) == 0) && evr_replaced( &r, EVR_NAME ) ) {
+			// printem restarted (or stopped): follow the new ring
+			evr_close( &r );
+			while( !isBreak && (evr_open( &r, EVR_NAME ) == -1) ) {
+				sleep( 1 );
+			}
+			if( !isBreak && !raw ) {
+				printf("--- printem restarted ---\n");
+			}
+		}
+	}
+
+	evr_close( &r );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,224 @@
+//--------------------------------------------------------------------
+// Printer Emulator History Query
+//     Answers "events of type X between T1 and T2" from the indexed
+//     history store that printem builds at the end of each History
+//     harvest.  The store and its indexes are mapped read-only so a
+//     query touches only the index range and the records it prints.
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>   // atoi
+#include <string.h>   // strcpy
+#include <unistd.h>   // getopt
+#include <time.h>     // mktime
+
+#include "../Common/hist_store.h"
+
+//--------------------------------------------------------------------
+// File scope variables
+//--------------------------------------------------------------------
+// Version String
+const char version_stg[] = {"v1.3.1"};
+
+// Default store location (printem disk directory on the target)
+char store_dir[HS_PATH_SIZE] = { "/var/log/lsc" };
+
+const char * help_arr[] = {
+	"  History query for the Printer Emulator history store",
+	"  Optional Arguments",
+	"    -d <dir>   store directory (default: /var/log/lsc)",
+	"    -t <type>  only events of this type (see -l)",
+	"    -s <time>  from time, inclusive",
+	"    -e <time>  to time, inclusive",
+	"    -c         print only the number of matching events",
+	"    -l         list event types and their counts",
+	"    -r         rebuild the indexes from the store",
+	"    -h         display this help screen",
+	"  Times are \"MM/DD/YY[ HH:MM[:SS]]\" as printed by the 1022",
+	"  or \"YYYY-MM-DD[ HH:MM[:SS]]\"",
+	"\n"
+	"  Divert events during March 2025",
+	"      pehist -t DIVERT -s 03/01/25 -e \"03/31/25 23:59:59\"",
+};
+
+//--------------------------------------------------------------------
+// parse_time()
+//     Accepts the 1022 record format or ISO style dates
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int parse_time( const char *s, int64_t *t )
+{
+	struct tm tm;
+	int n;
+
+	memset( &tm, 0, sizeof(tm) );
+	n = sscanf( s, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+				&tm.tm_hour, &tm.tm_min, &tm.tm_sec );
+	if( n >= 3 ) {
+		tm.tm_year -= 1900;
+	} else {
+		memset( &tm, 0, sizeof(tm) );
+		n = sscanf( s, "%d/%d/%d %d:%d:%d", &tm.tm_mon, &tm.tm_mday, &tm.tm_year,
+					&tm.tm_hour, &tm.tm_min, &tm.tm_sec );
+		if( n < 3 ) {
+			return -1;
+		}
+		tm.tm_year += (tm.tm_year < 100) ? 100 : -1900;
+	}
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	*t = mktime( &tm );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// list_types()
+//--------------------------------------------------------------------
+int list_types( void )
+{
+	char path[HS_PATH_SIZE + 32];
+	char name[32];
+	hs_map idx;
+
+	for( int type = 0; type < HS_EVT_LAST; type++ )
+	{
+		snprintf( name, sizeof(name), HS_TYPE_INDEX, type );
+		snprintf( path, sizeof(path), "%s/%s", store_dir, name );
+		if( hs_map_open( &idx, path, HS_INDEX_MAGIC ) == -1 ) {
+			printf("%-12s  (no index)\n", hs_event_name(type));
+			continue;
+		}
+		printf("%-12s  %u\n", hs_event_name(type), idx.hdr->count);
+		hs_map_close( &idx );
+	}
+	return EXIT_SUCCESS;
+}
+
+//--------------------------------------------------------------------
+// main()
+//--------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+	char path[HS_PATH_SIZE + 32];
+	char name[32];
+	int64_t t_start = INT64_MIN, t_end = INT64_MAX;
+	int type = -1;
+	int count_only = 0;
+	int list = 0;
+	int rebuild = 0;
+	int c;
+	hs_map store, idx;
+	const hs_index_entry *e;
+	const hs_record *recs;
+	uint32_t i, matches = 0;
+
+	while( (c = getopt(argc, argv, "cd:e:hlrs:t:")) != -1 )
+	{
+		switch( c ) {
+		case 'c':
+			count_only = 1;
+			break;
+		case 'd':
+			snprintf( store_dir, sizeof(store_dir), "%s", optarg );
+			break;
+		case 'e':
+			if( parse_time( optarg, &t_end ) == -1 ) {
+				printf("Error - invalid time %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			// A date alone means the whole day
+			if( strchr( optarg, ':' ) == NULL ) {
+				t_end += 24*60*60 - 1;
+			}
+			break;
+		case 'h':
+			for(int i = 0; i < sizeof(help_arr) / sizeof(char *); ++i) {
+				printf("%s\n", help_arr[i]);
+			}
+			return EXIT_SUCCESS;
+		case 'l':
+			list = 1;
+			break;
+		case 'r':
+			rebuild = 1;
+			break;
+		case 's':
+			if( parse_time( optarg, &t_start ) == -1 ) {
+				printf("Error - invalid time %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			type = hs_event_lookup( optarg );
+			if( type == -1 ) {
+				printf("Error - unknown event type %s (see -l)\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+		case '?':
+			printf( "Unrecognized option encountered -%c\n", optopt );
+			return EXIT_FAILURE;
+		}
+	}
+
+	// After the loop, so a -d anywhere on the line applies
+	if( list ) {
+		return list_types();
+	}
+	if( rebuild ) {
+		if( hs_rebuild_indexes( store_dir ) == -1 ) {
+			printf("Error - unable to rebuild indexes in %s\n", store_dir);
+			return EXIT_FAILURE;
+		}
+		printf("Indexes rebuilt\n");
+		return EXIT_SUCCESS;
+	}
+
+	// Map the store and the index that narrows the query the most
+	snprintf( path, sizeof(path), "%s/%s", store_dir, HS_STORE_FILE );
+	if( hs_map_open( &store, path, HS_STORE_MAGIC ) == -1 ) {
+		printf("Error - unable to open history store %s\n", path);
+		return EXIT_FAILURE;
+	}
+	if( type == -1 ) {
+		snprintf( name, sizeof(name), HS_TIME_INDEX );
+	} else {
+		snprintf( name, sizeof(name), HS_TYPE_INDEX, type );
+	}
+	snprintf( path, sizeof(path), "%s/%s", store_dir, name );
+	if( hs_map_open( &idx, path, HS_INDEX_MAGIC ) == -1 ) {
+		printf("Error - unable to open index %s (try -r)\n", path);
+		hs_map_close( &store );
+		return EXIT_FAILURE;
+	}
+
+	// Binary search to T1 then walk the index until T2
+	e = (const hs_index_entry *)idx.entries;
+	recs = (const hs_record *)store.entries;
+	for( i = hs_index_lower_bound( &idx, t_start ); i < idx.hdr->count; i++ )
+	{
+		if( e[i].time > t_end ) {
+			break;
+		}
+		if( e[i].rec >= store.hdr->count ) {
+			// Index is ahead of the store mapping.  Entries are in time
+			// order, not record order, so later ones may still be held
+			continue;
+		}
+		++matches;
+		if( !count_only ) {
+			const hs_record *r = &recs[e[i].rec];
+			printf("%.*s\n", (int)r->text_len, r->text);
+		}
+	}
+	if( count_only ) {
+		printf("%u\n", matches);
+	}
+
+	hs_map_close( &idx );
+	hs_map_close( &store );
+	return EXIT_SUCCESS;
+}
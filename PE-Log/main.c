@@ -0,0 +1,288 @@
+//--------------------------------------------------------------------
+// Printer Emulator Logmode Reader
+//     Prints the records of a logmode session with their arrival times.
+//     A session is read across all of its segments, plain or compressed.
+//     A time range is located through the segment indexes so only the
+//     records in range are read, and -f follows a session that is still
+//     being written the way "tail -f" does.
+//--------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>   // EXIT_SUCCESS
+#include <string.h>   // strchr
+#include <unistd.h>   // getopt, read
+#include <time.h>     // mktime
+#include <libgen.h>   // dirname
+#include <sys/inotify.h>
+
+#include "../Common/log_stream.h"
+
+//--------------------------------------------------------------------
+// File scope variables
+//--------------------------------------------------------------------
+// Version String
+const char version_stg[] = {"v1.3.1"};
+
+const char * help_arr[] = {
+	"  Logmode reader for the Printer Emulator record stream",
+	"  Usage: pelog [options] <logmode session>",
+	"  The session is the first segment's name, logmode-YYYYMMDDhhmmss",
+	"  Optional Arguments",
+	"    -s <time>  from time, inclusive",
+	"    -e <time>  to time, inclusive",
+	"    -f         follow: keep printing records as they are written",
+	"    -r         raw: write record bytes only, no times",
+	"    -h         display this help screen",
+	"  Times are \"MM/DD/YY[ HH:MM[:SS]]\" or \"YYYY-MM-DD[ HH:MM[:SS]]\"",
+	"\n"
+	"  Records logged between 2 and 3 PM",
+	"      pelog -s \"2025-03-14 14:00\" -e \"2025-03-14 15:00\" logmode-20250314080000",
+};
+
+//--------------------------------------------------------------------
+// parse_time()
+//     Accepts the 1022 record format or ISO style dates
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int parse_time( const char *s, int64_t *t )
+{
+	struct tm tm;
+	int n;
+
+	memset( &tm, 0, sizeof(tm) );
+	n = sscanf( s, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+				&tm.tm_hour, &tm.tm_min, &tm.tm_sec );
+	if( n >= 3 ) {
+		tm.tm_year -= 1900;
+	} else {
+		memset( &tm, 0, sizeof(tm) );
+		n = sscanf( s, "%d/%d/%d %d:%d:%d", &tm.tm_mon, &tm.tm_mday, &tm.tm_year,
+					&tm.tm_hour, &tm.tm_min, &tm.tm_sec );
+		if( n < 3 ) {
+			return -1;
+		}
+		tm.tm_year += (tm.tm_year < 100) ? 100 : -1900;
+	}
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	*t = (int64_t)mktime( &tm ) * 1000000;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// print_record()
+//     Time stamp followed by the record with control bytes escaped
+//--------------------------------------------------------------------
+void print_record( const ls_frame_hdr *fh, const unsigned char *buf, int raw )
+{
+	char stamp[32];
+	time_t secs;
+	struct tm tm;
+
+	if( raw ) {
+		fwrite( buf, 1, fh->len, stdout );
+		return;
+	}
+
+	secs = fh->time_us / 1000000;
+	localtime_r( &secs, &tm );
+	strftime( stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm );
+	printf("%s.%03d  ", stamp, (int)((fh->time_us % 1000000) / 1000));
+	for( int i = 0; i < fh->len; i++ )
+	{
+		if( (buf[i] >= 0x20) && (buf[i] < 0x7F) ) {
+			putchar( buf[i] );
+		} else if( (buf[i] == 0x0D) || (buf[i] == 0x0A) ) {
+			// record terminators
+		} else {
+			printf("\\x%02X", buf[i]);
+		}
+	}
+	putchar('\n');
+}
+
+//--------------------------------------------------------------------
+// open_segment()
+//  returns:
+//       0  success
+//      -1  no such segment or not a record stream
+//--------------------------------------------------------------------
+int open_segment( ls_reader *r, const char *base, int segment )
+{
+	char path[LS_SEGMENT_SIZE + 8];
+
+	if( ls_segment_find( base, segment, path, sizeof(path) ) == -1 ) {
+		return -1;
+	}
+	if( ls_reader_open( r, path ) == -1 ) {
+		printf("Error - %s is not a logmode record stream\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// main()
+//--------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+	int64_t t_start = INT64_MIN, t_end = INT64_MAX;
+	int64_t t_first;
+	int follow = 0, raw = 0;
+	int c, rv = 0;
+	int segment = 0;
+	int fd_notify = -1;
+	char base[LS_PATH_SIZE];
+	char path[LS_SEGMENT_SIZE + 8];
+	char dir[LS_PATH_SIZE];
+	ls_reader r;
+	ls_frame_hdr fh;
+	unsigned char buf[LS_MAX_RECORD];
+
+	while( (c = getopt(argc, argv, "e:fhrs:")) != -1 )
+	{
+		switch( c ) {
+		case 'e':
+			if( parse_time( optarg, &t_end ) == -1 ) {
+				printf("Error - invalid time %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			// The end is the last microsecond of what was given: a date
+			// alone means the whole day, a time without seconds the
+			// whole minute
+			if( strchr( optarg, ':' ) == NULL ) {
+				t_end += (int64_t)24*60*60 * 1000000 - 1;
+			} else if( strchr( optarg, ':' ) == strrchr( optarg, ':' ) ) {
+				t_end += (int64_t)60 * 1000000 - 1;
+			} else {
+				t_end += 999999;
+			}
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'h':
+			for(int i = 0; i < sizeof(help_arr) / sizeof(char *); ++i) {
+				printf("%s\n", help_arr[i]);
+			}
+			return EXIT_SUCCESS;
+		case 'r':
+			raw = 1;
+			break;
+		case 's':
+			if( parse_time( optarg, &t_start ) == -1 ) {
+				printf("Error - invalid time %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+		case '?':
+			printf( "Unrecognized option encountered -%c\n", optopt );
+			return EXIT_FAILURE;
+		}
+	}
+	if( optind >= argc ) {
+		printf("Error - no logmode session given (see -h)\n");
+		return EXIT_FAILURE;
+	}
+
+	// Accept the session name with or without .gz
+	snprintf( base, sizeof(base), "%s", argv[optind] );
+	c = strlen( base ) - strlen( LS_GZ_EXT );
+	if( (c > 0) && !strcmp( base + c, LS_GZ_EXT ) ) {
+		base[c] = '\0';
+	}
+
+	// The disk budget may have removed the first segments
+	segment = ls_first_segment( base );
+	if( segment == -1 ) {
+		segment = 0;
+	}
+
+	// Skip whole segments that end before the start time: a segment ends
+	// where the next one begins
+	if( t_start != INT64_MIN ) {
+		while(    (ls_segment_find( base, segment + 1, path, sizeof(path) ) == 0)
+			   && (ls_first_time( path, &t_first ) == 0) && (t_first <= t_start) ) {
+			++segment;
+		}
+	}
+	if( open_segment( &r, base, segment ) == -1 ) {
+		printf("Error - no logmode session %s\n", base);
+		return EXIT_FAILURE;
+	}
+	if( (t_start != INT64_MIN) && (ls_seek_time( &r, t_start ) == -1) ) {
+		printf("Error - corrupt record stream %s\n", base);
+		ls_reader_close( &r );
+		return EXIT_FAILURE;
+	}
+
+	// Following waits for the writer to change the directory (new data or
+	// a new segment) rather than polling it
+	if( follow ) {
+		snprintf( dir, sizeof(dir), "%s", base );
+		fd_notify = inotify_init();
+		if( (fd_notify == -1)
+			|| (inotify_add_watch( fd_notify, dirname( dir ),
+								   IN_MODIFY | IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO ) == -1) ) {
+			perror("inotify");
+			ls_reader_close( &r );
+			return EXIT_FAILURE;
+		}
+	}
+
+	for( ;; )
+	{
+		rv = ls_next( &r, &fh, buf, sizeof(buf) );
+		if( rv == 1 ) {
+			if( fh.time_us > t_end ) {
+				break;
+			}
+			print_record( &fh, buf, raw );
+			continue;
+		}
+		if( rv == -1 ) {
+			printf("Error - corrupt record stream %s\n", base);
+			break;
+		}
+
+		// End of this segment's data.  Once the next segment exists this
+		// one is complete; read anything written meanwhile, then move on.
+		if( ls_segment_find( base, segment + 1, path, sizeof(path) ) == 0 ) {
+			while( (rv = ls_next( &r, &fh, buf, sizeof(buf) )) == 1 ) {
+				if( fh.time_us > t_end ) {
+					break;
+				}
+				print_record( &fh, buf, raw );
+			}
+			if( rv != 0 ) {
+				break;
+			}
+			ls_reader_close( &r );
+			++segment;
+			if( open_segment( &r, base, segment ) == -1 ) {
+				rv = -1;
+				break;
+			}
+			continue;
+		}
+
+		// Caught up with the writer
+		if( !follow ) {
+			break;
+		}
+		fflush( stdout );
+		char events[4096];
+		if( read( fd_notify, events, sizeof(events) ) <= 0 ) {
+			break;
+		}
+	}
+
+	if( fd_notify != -1 ) {
+		close( fd_notify );
+	}
+	ls_reader_close( &r );
+	return (rv == -1) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
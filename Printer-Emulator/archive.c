@@ -0,0 +1,534 @@
+
+//--------------------------------------------------------------------
+//  archive.c
+//      Background sync, compression and pruning of logmode segments
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>       // realloc(), qsort()
+#include <string.h>
+#include <fcntl.h>        // open()
+#include <unistd.h>       // fdatasync(), close(), unlink(), gettid()
+#include <dirent.h>       // opendir()
+#include <pthread.h>
+#include <sched.h>        // SCHED_IDLE
+#include <sys/stat.h>
+#include <sys/resource.h> // setpriority()
+#include <zlib.h>
+
+#include "archive.h"
+#include "config.h"
+#include "parser.h"       // DATA_FILENAME_SIZE
+#include "metrics.h"
+#include "../Common/log_stream.h"
+#include "../Common/diag.h"
+
+// Logmode files in the disk directory start with this
+#define ARC_PREFIX "logmode-"
+
+typedef struct arc_item
+{
+	void (*job)( void );    // arc_submit_job(), NULL for a segment
+	char path[LS_SEGMENT_SIZE];
+	int  fd;
+	int  idx_fd;
+} arc_item;
+
+//--------------------------------------------------------------------
+// Archive state
+//--------------------------------------------------------------------
+// Queue shared with the parser.  The parser only ever takes the lock
+// to append; the thread holds it only to remove.
+static arc_item        arc_queue[ARC_QUEUE_SIZE];
+static int             arc_head;
+static int             arc_count;
+static int             arc_stop;
+static int             arc_running;
+static pthread_mutex_t arc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  arc_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       arc_thread;
+
+static char arc_dir[DATA_FILENAME_SIZE];
+
+// Plain segments known to be closed, which the budget may remove: those
+// left uncompressed by arc_process() and those found by arc_open(),
+// before this run had a live one.  The live segment is never here.
+static char **arc_plain;
+static int    arc_n_plain;
+static int    arc_plain_alloc;
+
+//--------------------------------------------------------------------
+//  arc_compress()
+//      path -> path.gz, written to a temporary name and renamed into
+//      place before the plain segment is removed
+//  returns:
+//       0  success
+//      -1  failure (plain segment left alone)
+//--------------------------------------------------------------------
+static int arc_compress( const char *path )
+{
+	char gz_path[LS_SEGMENT_SIZE + 8];
+	char tmp_path[LS_SEGMENT_SIZE + 16];
+	static char chunk[ARC_CHUNK_SIZE];
+	FILE *in;
+	gzFile out;
+	int fd_out;
+	size_t n;
+	int rv = 0;
+
+	snprintf( gz_path, sizeof(gz_path), "%s%s", path, LS_GZ_EXT );
+	snprintf( tmp_path, sizeof(tmp_path), "%s.tmp", gz_path );
+
+	in = fopen( path, "r" );
+	if( in == NULL ) {
+		return -1;
+	}
+	fd_out = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd_out == -1 ) {
+		fclose( in );
+		return -1;
+	}
+	out = gzdopen( dup( fd_out ), "wb6" );
+	if( out == NULL ) {
+		fclose( in );
+		close( fd_out );
+		unlink( tmp_path );
+		return -1;
+	}
+
+	while( (n = fread( chunk, 1, sizeof(chunk), in )) > 0 ) {
+		if( gzwrite( out, chunk, n ) != (int)n ) {
+			rv = -1;
+			break;
+		}
+	}
+	if( gzclose( out ) != Z_OK ) {
+		rv = -1;
+	}
+	fclose( in );
+
+	// The compressed copy must be durable before the original goes
+	if( (rv == 0) && (fdatasync( fd_out ) == -1) ) {
+		rv = -1;
+	}
+	close( fd_out );
+
+	if( (rv == 0) && (rename( tmp_path, gz_path ) == 0) ) {
+		unlink( path );
+	} else {
+		unlink( tmp_path );
+		rv = -1;
+	}
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  arc_segment_of()
+//      Segment number of a segment name (ls_segment_name()), and in
+//      *session_len the length of its session name
+//--------------------------------------------------------------------
+static int arc_segment_of( const char *name, int *session_len )
+{
+	const char *p = name + strlen( ARC_PREFIX );
+	const char *dash = strchr( p, '-' );
+	const char *dot;
+
+	if( dash != NULL ) {
+		*session_len = dash - name;
+		return atoi( dash + 1 );
+	}
+	dot = strchr( p, '.' );
+	*session_len = (dot != NULL) ? (int)(dot - name) : (int)strlen( name );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  arc_same_session()
+//--------------------------------------------------------------------
+static int arc_same_session( const char *a, const char *b )
+{
+	int la, lb;
+
+	arc_segment_of( a, &la );
+	arc_segment_of( b, &lb );
+	return (la == lb) && !strncmp( a, b, la );
+}
+
+//--------------------------------------------------------------------
+//  arc_name_cmp()
+//      Session order, which is age order, then segment number: name
+//      order would put -1000 before -200
+//--------------------------------------------------------------------
+static int arc_name_cmp( const void *a, const void *b )
+{
+	const char *na = *(char * const *)a;
+	const char *nb = *(char * const *)b;
+	int la, lb, rv;
+	int sa = arc_segment_of( na, &la );
+	int sb = arc_segment_of( nb, &lb );
+
+	rv = strncmp( na, nb, (la < lb) ? la : lb );
+	if( rv == 0 )  rv = la - lb;
+	if( rv == 0 )  rv = sa - sb;
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  arc_plain_add()
+//      name (no directory) is a closed plain segment.  Out of memory
+//      it is left off, so the budget does not remove it.
+//--------------------------------------------------------------------
+static void arc_plain_add( const char *name )
+{
+	char *copy;
+
+	for( int i = 0; i < arc_n_plain; i++ ) {
+		if( !strcmp( arc_plain[i], name ) ) {
+			return;
+		}
+	}
+	if( arc_n_plain == arc_plain_alloc ) {
+		int n_alloc = arc_plain_alloc ? 2 * arc_plain_alloc : 64;
+		char **p = (char **)realloc( arc_plain, n_alloc * sizeof(char *) );
+		if( p == NULL ) {
+			DIAG( DIAG_ERROR, "Log budget: out of memory, %s kept", name );
+			return;
+		}
+		arc_plain = p;
+		arc_plain_alloc = n_alloc;
+	}
+	if( (copy = strdup( name )) == NULL ) {
+		DIAG( DIAG_ERROR, "Log budget: out of memory, %s kept", name );
+		return;
+	}
+	arc_plain[arc_n_plain++] = copy;
+}
+
+//--------------------------------------------------------------------
+//  arc_plain_find()
+//  returns:
+//      index in arc_plain, -1 if name is not a closed plain segment
+//--------------------------------------------------------------------
+static int arc_plain_find( const char *name )
+{
+	for( int i = 0; i < arc_n_plain; i++ ) {
+		if( !strcmp( arc_plain[i], name ) ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  arc_is_segment()
+//      A logmode segment, compressed or not, and not its index or a
+//      temporary file
+//--------------------------------------------------------------------
+static int arc_is_segment( const char *name )
+{
+	int len = strlen( name );
+	int idx = strlen( LS_INDEX_EXT );
+
+	if( strncmp( name, ARC_PREFIX, strlen( ARC_PREFIX ) ) ) {
+		return 0;
+	}
+	if( (len > 4) && !strcmp( name + len - 4, ".tmp" ) ) {
+		return 0;
+	}
+	return (len <= idx) || strcmp( name + len - idx, LS_INDEX_EXT );
+}
+
+//--------------------------------------------------------------------
+//  arc_prune()
+//      Remove the oldest closed segments (and their indexes) until the
+//      logmode files fit the budget.  Sessions go oldest first, and
+//      each from its first segment up, stopping at one that may not be
+//      removed, so what is left of a session has no gap for a reader
+//      (pelog starts at ls_first_segment()).  A plain segment is removed
+//      only if it is known closed (arc_plain), never the live one or one
+//      still waiting to be compressed, so the budget holds with
+//      log_compress off or compression failing too.
+//--------------------------------------------------------------------
+static void arc_prune( void )
+{
+	long long budget = (long long)config.log_budget_mb * 1024 * 1024;
+	long long total = 0;
+	char path[DATA_FILENAME_SIZE + LS_PATH_SIZE];
+	char **names = NULL;
+	int n_names = 0, n_alloc = 0;
+	int failed = 0;
+	int gz = strlen( LS_GZ_EXT );
+	DIR *dir;
+	struct dirent *de;
+	struct stat sb;
+
+	if( budget <= 0 ) {
+		return;
+	}
+	dir = opendir( arc_dir );
+	if( dir == NULL ) {
+		return;
+	}
+	while( (de = readdir( dir )) != NULL )
+	{
+		if( strncmp( de->d_name, ARC_PREFIX, strlen( ARC_PREFIX ) ) ) {
+			continue;
+		}
+		snprintf( path, sizeof(path), "%s/%s", arc_dir, de->d_name );
+		if( stat( path, &sb ) == -1 ) {
+			continue;
+		}
+		total += sb.st_size;
+		// Every segment, so a session is only pruned up to one kept
+		if( arc_is_segment( de->d_name ) ) {
+			if( n_names == n_alloc ) {
+				int new_alloc = n_alloc ? 2 * n_alloc : 64;
+				char **p = (char **)realloc( names, new_alloc * sizeof(char *) );
+				if( p == NULL ) {
+					failed = 1;
+					break;
+				}
+				names = p;
+				n_alloc = new_alloc;
+			}
+			if( (names[n_names] = strdup( de->d_name )) == NULL ) {
+				failed = 1;
+				break;
+			}
+			++n_names;
+		}
+	}
+	closedir( dir );
+
+	// Half a list would prune the wrong segments
+	if( failed ) {
+		DIAG( DIAG_ERROR, "Log budget: out of memory, nothing pruned" );
+		while( n_names > 0 ) {
+			free( names[--n_names] );
+		}
+	}
+
+	if( n_names > 1 ) {
+		qsort( names, n_names, sizeof(char *), arc_name_cmp );
+	}
+	for( int i = 0; (i < n_names) && (total > budget); i++ )
+	{
+		int len = strlen( names[i] );
+		int plain = arc_plain_find( names[i] );
+
+		if( (len > gz) && !strcmp( names[i] + len - gz, LS_GZ_EXT ) ) {
+			len -= gz;
+		} else if( plain != -1 ) {
+			free( arc_plain[plain] );
+			arc_plain[plain] = arc_plain[--arc_n_plain];
+		} else {
+			// Live or waiting: keep it and the rest of its session
+			while( (i + 1 < n_names) && arc_same_session( names[i], names[i + 1] ) ) {
+				++i;
+			}
+			continue;
+		}
+
+		snprintf( path, sizeof(path), "%s/%s", arc_dir, names[i] );
+		if( (stat( path, &sb ) == 0) && (unlink( path ) == 0) ) {
+			total -= sb.st_size;
+			DIAG( DIAG_INFO, "Log budget: removed %s", names[i] );
+		}
+		snprintf( path, sizeof(path), "%s/%.*s%s", arc_dir, len, names[i], LS_INDEX_EXT );
+		if( (stat( path, &sb ) == 0) && (unlink( path ) == 0) ) {
+			total -= sb.st_size;
+		}
+	}
+	if( total > budget ) {
+		DIAG( DIAG_WARN, "Log budget: %lld bytes in use exceeds %d MB", total, config.log_budget_mb );
+	}
+
+	for( int i = 0; i < n_names; i++ ) {
+		free( names[i] );
+	}
+	free( names );
+}
+
+//--------------------------------------------------------------------
+//  arc_process()
+//--------------------------------------------------------------------
+static void arc_process( arc_item *item )
+{
+	if( item->job != NULL ) {
+		item->job();
+		return;
+	}
+	if( stg_config.sync_mode != STG_SYNC_NONE ) {
+		if( item->fd != -1 )      fdatasync( item->fd );
+		if( item->idx_fd != -1 )  fdatasync( item->idx_fd );
+	}
+	if( item->fd != -1 )      close( item->fd );
+	if( item->idx_fd != -1 )  close( item->idx_fd );
+
+	const char *name = strrchr( item->path, '/' );
+	name = (name == NULL) ? item->path : name + 1;
+	if( !config.log_compress ) {
+		arc_plain_add( name );
+	} else if( arc_compress( item->path ) == -1 ) {
+		DIAG( DIAG_ERROR, "Unable to compress %s", item->path );
+		met_add( MET_ARC_ERRORS, 1 );
+		arc_plain_add( name );
+	} else {
+		met_add( MET_ARC_SEGMENTS, 1 );
+	}
+	arc_prune();
+}
+
+//--------------------------------------------------------------------
+//  arc_main()
+//      Archive thread.  Runs at the lowest priority the scheduler has so
+//      compression only uses otherwise idle CPU.
+//--------------------------------------------------------------------
+static void *arc_main( void *arg )
+{
+	struct sched_param sp;
+	arc_item item;
+
+	memset( &sp, 0, sizeof(sp) );
+	pthread_setschedparam( pthread_self(), SCHED_IDLE, &sp );
+	setpriority( PRIO_PROCESS, gettid(), 19 );
+	met_thread( MET_SHARD_ARCHIVE );
+
+	pthread_mutex_lock( &arc_lock );
+	for( ;; )
+	{
+		while( (arc_count == 0) && !arc_stop ) {
+			pthread_cond_wait( &arc_cond, &arc_lock );
+		}
+		if( arc_count == 0 ) {
+			break;    // stopping and drained
+		}
+		item = arc_queue[arc_head];
+		arc_head = (arc_head + 1) % ARC_QUEUE_SIZE;
+		--arc_count;
+
+		pthread_mutex_unlock( &arc_lock );
+		arc_process( &item );
+		pthread_mutex_lock( &arc_lock );
+	}
+	pthread_mutex_unlock( &arc_lock );
+	return NULL;
+}
+
+//--------------------------------------------------------------------
+//  arc_open()
+//      dir is the disk directory holding the logmode files
+//  returns:
+//       0  success
+//      -1  thread could not be started
+//--------------------------------------------------------------------
+int arc_open( const char *dir )
+{
+	DIR *d;
+	struct dirent *de;
+	int gz = strlen( LS_GZ_EXT );
+
+	snprintf( arc_dir, sizeof(arc_dir), "%s", dir );
+
+	// Plain segments already here were left by an earlier run
+	arc_n_plain = 0;
+	if( (d = opendir( arc_dir )) != NULL ) {
+		while( (de = readdir( d )) != NULL ) {
+			int len = strlen( de->d_name );
+			if(    arc_is_segment( de->d_name )
+				&& ((len <= gz) || strcmp( de->d_name + len - gz, LS_GZ_EXT )) ) {
+				arc_plain_add( de->d_name );
+			}
+		}
+		closedir( d );
+	}
+	arc_head = 0;
+	arc_count = 0;
+	arc_stop = 0;
+	if( pthread_create( &arc_thread, NULL, arc_main, NULL ) != 0 ) {
+		arc_running = 0;
+		return -1;
+	}
+	arc_running = 1;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  arc_submit()
+//      Queue a closed segment (ls_closed_fn).  Never waits: with the
+//      thread gone or the queue full the descriptors are just closed
+//      and the segment stays uncompressed.
+//--------------------------------------------------------------------
+void arc_submit( const char *path, int fd, int idx_fd )
+{
+	int queued = 0;
+
+	pthread_mutex_lock( &arc_lock );
+	if( arc_running && (arc_count < ARC_QUEUE_SIZE) ) {
+		arc_item *item = &arc_queue[(arc_head + arc_count) % ARC_QUEUE_SIZE];
+		item->job = NULL;
+		snprintf( item->path, sizeof(item->path), "%s", path );
+		item->fd = fd;
+		item->idx_fd = idx_fd;
+		++arc_count;
+		queued = 1;
+		pthread_cond_signal( &arc_cond );
+	}
+	pthread_mutex_unlock( &arc_lock );
+
+	if( !queued ) {
+		DIAG( DIAG_WARN, "Archive queue full, %s left uncompressed", path );
+		if( fd != -1 )      close( fd );
+		if( idx_fd != -1 )  close( idx_fd );
+	}
+}
+
+//--------------------------------------------------------------------
+//  arc_submit_job()
+//      Queue a function to run on the archive thread.  Never waits.
+//  returns:
+//       0  queued
+//      -1  thread gone or queue full
+//--------------------------------------------------------------------
+int arc_submit_job( void (*job)( void ) )
+{
+	int rv = -1;
+
+	pthread_mutex_lock( &arc_lock );
+	if( arc_running && (arc_count < ARC_QUEUE_SIZE) ) {
+		arc_item *item = &arc_queue[(arc_head + arc_count) % ARC_QUEUE_SIZE];
+		item->job = job;
+		item->path[0] = '\0';
+		item->fd = -1;
+		item->idx_fd = -1;
+		++arc_count;
+		rv = 0;
+		pthread_cond_signal( &arc_cond );
+	}
+	pthread_mutex_unlock( &arc_lock );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  arc_close()
+//      Finish the queued work and stop the thread
+//--------------------------------------------------------------------
+void arc_close( void )
+{
+	if( !arc_running ) {
+		return;
+	}
+	pthread_mutex_lock( &arc_lock );
+	arc_stop = 1;
+	pthread_cond_signal( &arc_cond );
+	pthread_mutex_unlock( &arc_lock );
+	pthread_join( arc_thread, NULL );
+	arc_running = 0;
+
+	for( int i = 0; i < arc_n_plain; i++ ) {
+		free( arc_plain[i] );
+	}
+	free( arc_plain );
+	arc_plain = NULL;
+	arc_n_plain = 0;
+	arc_plain_alloc = 0;
+}
@@ -0,0 +1,26 @@
+
+//--------------------------------------------------------------------
+//  archive.h
+//--------------------------------------------------------------------
+
+// Background handling of closed logmode segments.
+//
+// When a logmode segment is rotated out (or the session ends) the parser
+// hands its still open descriptors to arc_submit() and carries on.  A low
+// priority thread then syncs and closes them, compresses the segment to
+// <segment>.gz with zlib and prunes the oldest compressed segments until
+// the logmode files fit the disk budget.  Nothing here runs on the serial
+// reply path except the hand-off, which never blocks.  Other file writes
+// that must stay off the serial thread (the metrics export) are handed
+// to the same thread with arc_submit_job().
+
+// Closed segments waiting for the archive thread
+#define ARC_QUEUE_SIZE  16
+
+// Copy buffer for compression
+#define ARC_CHUNK_SIZE  65536
+
+int arc_open( const char *dir );
+void arc_submit( const char *path, int fd, int idx_fd );
+int arc_submit_job( void (*job)( void ) );
+void arc_close( void );
@@ -0,0 +1,277 @@
+//--------------------------------------------------------------------
+//  busstat.c
+//      1022 poll cadence, slot usage and jitter, with cadence alerts
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // clock_gettime()
+
+#include "busstat.h"
+#include "config.h"
+#include "metrics.h"
+#include "../Common/diag.h"
+
+//--------------------------------------------------------------------
+// Bus statistics state
+//--------------------------------------------------------------------
+typedef enum
+{
+	BUS_IDLE,        // no frame seen yet
+	BUS_DISPLAY,     // 0x91 display frame
+	BUS_PRINTER,     // 0x98 on: poll, status and printer data
+} bus_traffic;
+
+static bus_window bus_w;
+static uint64_t   bus_slot;            // current slot number, 0 none
+static uint64_t   bus_slot_display;    // bytes of each kind in it
+static uint64_t   bus_slot_printer;
+static int        bus_class;           // bus_traffic of the bytes now
+static unsigned char bus_prev;         // last byte read
+static uint64_t   bus_last_rx_us;
+static uint64_t   bus_last_poll_us;
+static uint64_t   bus_last_iv_us;
+static double     bus_jitter_us;
+static double     bus_expected_us;     // learned poll interval, 0 not yet
+static uint64_t   bus_polls;
+static uint64_t   bus_alerts;
+static const char *bus_alert;          // alert raised, NULL none
+static int        bus_windows;         // windows ended since bus_open()
+
+//--------------------------------------------------------------------
+//  bus_now_us()
+//--------------------------------------------------------------------
+static uint64_t bus_now_us( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//--------------------------------------------------------------------
+//  bus_window_reset()
+//--------------------------------------------------------------------
+static void bus_window_reset( uint64_t now )
+{
+	memset( &bus_w, 0, sizeof(bus_w) );
+	bus_w.start_us = now;
+	bus_w.iv_min_us = UINT64_MAX;
+}
+
+//--------------------------------------------------------------------
+//  bus_open()
+//--------------------------------------------------------------------
+void bus_open( void )
+{
+	bus_window_reset( bus_now_us() );
+	bus_slot = 0;
+	bus_class = BUS_IDLE;
+	bus_last_rx_us = 0;
+	bus_last_poll_us = 0;
+	bus_last_iv_us = 0;
+	bus_jitter_us = 0;
+	bus_expected_us = 0;
+	bus_polls = 0;
+	bus_alerts = 0;
+	bus_alert = NULL;
+	bus_windows = 0;
+}
+
+//--------------------------------------------------------------------
+//  bus_slot_to()
+//      Close the slots before the one now is in.  Slots nothing was
+//      read in are idle.
+//--------------------------------------------------------------------
+static void bus_slot_to( uint64_t now )
+{
+	uint64_t s = now / BUS_SLOT_US;
+
+	if( s == bus_slot ) {
+		return;
+	}
+	if( bus_slot != 0 )
+	{
+		++bus_w.slots;
+		if( bus_slot_display ) {
+			++bus_w.display_slots;
+		}
+		if( bus_slot_printer ) {
+			++bus_w.printer_slots;
+		}
+		if( !bus_slot_display && !bus_slot_printer ) {
+			++bus_w.idle_slots;
+		}
+		if( bus_slot_display + bus_slot_printer > bus_w.slot_bytes_max ) {
+			bus_w.slot_bytes_max = bus_slot_display + bus_slot_printer;
+		}
+		bus_w.slots += s - bus_slot - 1;
+		bus_w.idle_slots += s - bus_slot - 1;
+	}
+	bus_slot = s;
+	bus_slot_display = 0;
+	bus_slot_printer = 0;
+}
+
+//--------------------------------------------------------------------
+//  bus_poll_seen()
+//      A printer poll (0x98 0x90) arrived
+//--------------------------------------------------------------------
+static void bus_poll_seen( uint64_t now )
+{
+	uint64_t iv;
+	double d;
+
+	++bus_polls;
+	if( bus_last_poll_us != 0 )
+	{
+		iv = now - bus_last_poll_us;
+		++bus_w.polls;
+		bus_w.iv_sum_us += iv;
+		if( iv < bus_w.iv_min_us )  bus_w.iv_min_us = iv;
+		if( iv > bus_w.iv_max_us )  bus_w.iv_max_us = iv;
+		if( bus_last_iv_us != 0 ) {
+			d = (iv > bus_last_iv_us) ? (double)(iv - bus_last_iv_us) : (double)(bus_last_iv_us - iv);
+			bus_jitter_us += (d - bus_jitter_us) / 16;
+		}
+		bus_last_iv_us = iv;
+	}
+	bus_last_poll_us = now;
+}
+
+//--------------------------------------------------------------------
+//  bus_rx()
+//      Bytes read from the 1022, called as the read returns
+//--------------------------------------------------------------------
+void bus_rx( int len, const unsigned char *data )
+{
+	uint64_t now;
+
+	if( len <= 0 ) {
+		return;
+	}
+	now = bus_now_us();
+	bus_slot_to( now );
+	if( (bus_last_rx_us != 0) && (now - bus_last_rx_us > bus_w.gap_max_us) ) {
+		bus_w.gap_max_us = now - bus_last_rx_us;
+	}
+	bus_last_rx_us = now;
+
+	for( int i = 0; i < len; i++ )
+	{
+		if( data[i] == 0x91 ) {
+			bus_class = BUS_DISPLAY;
+		} else if( data[i] == 0x98 ) {
+			bus_class = BUS_PRINTER;
+		} else if( (data[i] == 0x90) && (bus_prev == 0x98) ) {
+			bus_poll_seen( now );
+		}
+		if( bus_class == BUS_DISPLAY ) {
+			++bus_slot_display;
+		} else {
+			++bus_slot_printer;
+		}
+		bus_prev = data[i];
+	}
+	bus_w.bytes += len;
+}
+
+//--------------------------------------------------------------------
+//  bus_tx()
+//      printem's reply to the 1022, printer traffic in this slot
+//--------------------------------------------------------------------
+void bus_tx( int len )
+{
+	bus_slot_to( bus_now_us() );
+	bus_slot_printer += len;
+	bus_w.bytes += len;
+}
+
+//--------------------------------------------------------------------
+//  bus_check()
+//      Raise or clear the cadence alert for the window just ended.
+//      The learned interval follows the healthy windows only, and not
+//      the first one: it holds what queued on the port before printem
+//      started, read in a burst.
+//--------------------------------------------------------------------
+static void bus_check( double mean_us )
+{
+	double expected = (config.bus_poll_ms > 0) ? config.bus_poll_ms * 1000.0 : bus_expected_us;
+	double limit = expected * config.bus_alert_pct / 100;
+	const char *kind = NULL;
+
+	++bus_windows;
+	if( (config.bus_alert_pct > 0) && (expected > 0) )
+	{
+		if( bus_w.polls == 0 ) {
+			kind = "no polls";
+		} else if( (mean_us > expected + limit) || (mean_us < expected - limit) ) {
+			kind = "poll cadence";
+		} else if( bus_jitter_us > limit ) {
+			kind = "poll jitter";
+		}
+	}
+
+	if( (kind != NULL) && (kind != bus_alert) ) {
+		DIAG( DIAG_WARN, "Bus alert: %s, poll interval %.1f ms (expected %.1f ms), jitter %.1f ms",
+			   kind, mean_us / 1000, expected / 1000, bus_jitter_us / 1000 );
+		++bus_alerts;
+	} else if( (kind == NULL) && (bus_alert != NULL) ) {
+		DIAG( DIAG_INFO, "Bus alert cleared: poll interval %.1f ms, jitter %.1f ms",
+			   mean_us / 1000, bus_jitter_us / 1000 );
+	}
+	bus_alert = kind;
+
+	if( (kind == NULL) && (bus_w.polls >= BUS_MIN_POLLS) && (bus_windows > 1) ) {
+		if( bus_expected_us == 0 ) {
+			bus_expected_us = mean_us;
+		} else {
+			bus_expected_us += (mean_us - bus_expected_us) / 8;
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  bus_run()
+//      End the window when it is due: export its figures and check the
+//      cadence.  Called from the main loop.
+//--------------------------------------------------------------------
+void bus_run( void )
+{
+	uint64_t now = bus_now_us();
+	uint64_t span = now - bus_w.start_us;
+	uint64_t slots;
+	double mean_us = 0;
+
+	if( (config.bus_window <= 0) || (span < (uint64_t)config.bus_window * 1000000) ) {
+		return;
+	}
+	bus_slot_to( now );
+	slots = (bus_w.slots != 0) ? bus_w.slots : 1;
+	if( bus_w.polls != 0 ) {
+		mean_us = (double)bus_w.iv_sum_us / bus_w.polls;
+	}
+	// A bus that went quiet has one gap running to now
+	if( (bus_last_rx_us != 0) && (now - bus_last_rx_us > bus_w.gap_max_us) ) {
+		bus_w.gap_max_us = now - bus_last_rx_us;
+	}
+
+	bus_check( mean_us );
+
+	met_set( MET_BUS_POLLS, bus_polls );
+	met_set( MET_BUS_POLL_MEAN_US, (uint64_t)mean_us );
+	met_set( MET_BUS_POLL_MIN_US, bus_w.polls ? bus_w.iv_min_us : 0 );
+	met_set( MET_BUS_POLL_MAX_US, bus_w.iv_max_us );
+	met_set( MET_BUS_POLL_EXPECTED_US,
+			 (config.bus_poll_ms > 0) ? (uint64_t)config.bus_poll_ms * 1000 : (uint64_t)bus_expected_us );
+	met_set( MET_BUS_JITTER_US, (uint64_t)bus_jitter_us );
+	met_set( MET_BUS_SLOTS_PPM + 0, bus_w.display_slots * 1000000 / slots );
+	met_set( MET_BUS_SLOTS_PPM + 1, bus_w.printer_slots * 1000000 / slots );
+	met_set( MET_BUS_SLOTS_PPM + 2, bus_w.idle_slots * 1000000 / slots );
+	met_set( MET_BUS_SLOT_BYTES_MAX, bus_w.slot_bytes_max );
+	met_set( MET_BUS_LINE_PPM, (uint64_t)(bus_w.bytes * 1e12 / ((double)BUS_BYTES_PER_SEC * span)) );
+	met_set( MET_BUS_GAP_MAX_US, bus_w.gap_max_us );
+	met_set( MET_BUS_ALERT, (bus_alert != NULL) ? 1 : 0 );
+	met_set( MET_BUS_ALERTS, bus_alerts );
+
+	bus_window_reset( now );
+}
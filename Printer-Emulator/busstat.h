@@ -0,0 +1,60 @@
+
+//--------------------------------------------------------------------
+//  busstat.h
+//--------------------------------------------------------------------
+
+// Bus timing analytics.
+//
+// The 1022 runs the bus in 50 ms timeslots: a display frame (0x91 ...)
+// then a printer poll (0x98 0x90) the printer module answers.  printem
+// timestamps the frame boundaries as the serial reads return them and
+// keeps, over windows of config.bus_window seconds:
+//
+//     poll cadence   interval between polls: mean, min, max, and the
+//                    jitter (smoothed change between intervals, as in
+//                    RFC 3550)
+//     slot usage     share of the 50 ms slots carrying display traffic,
+//                    printer traffic (polls, status, data and printem's
+//                    replies) or nothing
+//     line load      largest bytes in one slot against the 48 a slot
+//                    holds at 9600 baud, and bytes over the window
+//                    against the line's 960 per second
+//     idle gaps      longest time with nothing read
+//
+// The figures of the last window are exported as metrics (printem_bus_*).
+// The poll interval the 1022 should keep is config.bus_poll_ms, or when
+// that is 0 it is learned from the windows while the bus is healthy.  A
+// window whose mean interval or jitter is off by more than
+// config.bus_alert_pct percent, or without any poll, raises an alert:
+// printed once, counted and shown in printem_bus_alert until a window is
+// normal again.  A master that loses its cadence is often the first sign
+// of a failing 1022 CPU board.
+
+#include <stdint.h>
+
+#define BUS_SLOT_US        50000   // 1022 timeslot
+#define BUS_SLOT_BYTES     48      // 9600 baud, 10 bits a byte, in a slot
+#define BUS_BYTES_PER_SEC  960
+#define BUS_MIN_POLLS      10      // intervals a window needs to learn from
+
+// One window of figures
+typedef struct bus_window
+{
+	uint64_t start_us;
+	uint64_t polls;           // intervals measured
+	uint64_t iv_sum_us;
+	uint64_t iv_min_us;
+	uint64_t iv_max_us;
+	uint64_t slots;
+	uint64_t display_slots;
+	uint64_t printer_slots;
+	uint64_t idle_slots;
+	uint64_t slot_bytes_max;
+	uint64_t bytes;
+	uint64_t gap_max_us;
+} bus_window;
+
+void bus_open( void );
+void bus_rx( int len, const unsigned char *data );
+void bus_tx( int len );
+void bus_run( void );
@@ -0,0 +1,257 @@
+//--------------------------------------------------------------------
+//  capture.c
+//      Replay of captured bus traffic into the parser
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>     // free()
+#include <string.h>
+
+#include "capture.h"
+#include "parser.h"
+
+// Where the bytes of a capture go: parse_header() for a replay, a
+// memory buffer for cap_load()
+typedef void (*cap_sink)( void *ctx, int len, unsigned char *data );
+
+// Chunk Value is how many bytes in a line causes that line to be chunked
+// with a subsequent line or lines.  This goes on until a line is encountered
+// with less than ChunkVal bytes
+enum ChunkVal {
+	CHUNK_VAL_8 = 8,
+	CHUNK_VAL_10 = 10,
+	CHUNK_VAL_15 = 15,  // no chunking
+};
+
+//--------------------------------------------------------------------
+//  cap_is_text()
+//  returns:
+//       1  text hex dump
+//       0  raw bytes
+//      -1  file cannot be read
+//--------------------------------------------------------------------
+int cap_is_text( const char *path )
+{
+	unsigned char probe[CAP_PROBE_SIZE];
+	FILE *fp;
+	size_t n;
+
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		return -1;
+	}
+	n = fread( probe, 1, sizeof(probe), fp );
+	fclose( fp );
+
+	for( size_t i = 0; i < n; i++ ) {
+		if(    ((probe[i] < ' ') || (probe[i] > '~'))
+			&& (probe[i] != '\n') && (probe[i] != '\r') && (probe[i] != '\t') ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//--------------------------------------------------------------------
+//  cap_replay_text()
+//      DumpHex lines, with lines of 16 bytes chunked into the next
+//      lines until a short one ends the read they came from
+//--------------------------------------------------------------------
+static void cap_replay_text( FILE *in_fp, cap_sink sink, void *ctx )
+{
+	char *in_line = NULL;
+	size_t in_len = 0;
+	ssize_t in_read;
+	unsigned char in_data[16];
+	int in_is_chunked;
+	unsigned char in_chunked_data[16*6];  // assume 6 lines max
+	unsigned char *in_chunked_p;
+
+	in_chunked_p = in_chunked_data;
+	in_is_chunked = 0;
+
+	while ((in_read = getline(&in_line, &in_len, in_fp)) != -1)
+	{
+		if( in_line[0] == '-' )  continue;
+
+		memset(in_data, 0, sizeof(in_data));
+
+		// Apply scanf to line in format based on dump code from Attempt-7
+		// and related files.  Note the extra space between first bank of 8
+		// and second bank of 8.
+		sscanf( in_line, "%2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx  %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx",
+				&in_data[0], &in_data[1], &in_data[2], &in_data[3],
+				&in_data[4], &in_data[5], &in_data[6], &in_data[7],
+				&in_data[8], &in_data[9], &in_data[10], &in_data[11],
+				&in_data[12], &in_data[13], &in_data[14], &in_data[15] );
+
+		for( int i = 0; i < 16; i++ )
+		{
+			if( in_data[i] ) {
+				*in_chunked_p = in_data[i];
+				++in_chunked_p;
+			}
+
+			// Process if we've encountered 00 data somewhere before 16 bytes have
+			// been scanned or if there are 16 bytes of data
+			if( !in_data[i] || ( (i == 15) && in_data[i]) )
+			{
+				// We've reached the end of data for this segment.  Decide
+				// what to do next
+				if( in_is_chunked == 0)
+				{
+					if( i >= CHUNK_VAL_15 )
+					{
+						in_is_chunked = 1;
+						// leave in_chunked_p where it is
+					}
+					else
+					{
+						sink( ctx, i, in_chunked_data );
+
+						in_chunked_p = in_chunked_data;
+					}
+					break;
+				}
+
+				if( in_is_chunked && (i < CHUNK_VAL_15) )
+				{
+					sink( ctx, in_chunked_p - in_chunked_data, in_chunked_data );
+
+					in_is_chunked = 0;
+					in_chunked_p = in_chunked_data;
+				}
+				break;
+			}
+		}
+	}
+	free( in_line );
+}
+
+//--------------------------------------------------------------------
+//  cap_parse()
+//      Replay sink: ctx counts the bytes parsed
+//--------------------------------------------------------------------
+static void cap_parse( void *ctx, int len, unsigned char *data )
+{
+	parse_header( len, data );
+	*(uint64_t *)ctx += len;
+}
+
+//--------------------------------------------------------------------
+//  cap_replay()
+//      Feed a capture to the parser, which the caller has opened.
+//      bytes (may be NULL) gets the bytes parsed.
+//  returns:
+//       0  success
+//      -1  file cannot be read
+//--------------------------------------------------------------------
+int cap_replay( const char *path, uint64_t *bytes )
+{
+	unsigned char buf[CAP_READ_SIZE];
+	uint64_t count = 0;
+	FILE *fp;
+	int text;
+	size_t n;
+
+	text = cap_is_text( path );
+	if( text == -1 ) {
+		return -1;
+	}
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		return -1;
+	}
+
+	if( text ) {
+		cap_replay_text( fp, cap_parse, &count );
+	} else {
+		while( (n = fread( buf, 1, sizeof(buf), fp )) > 0 ) {
+			parse_header( (int)n, buf );
+			count += n;
+		}
+	}
+	fclose( fp );
+
+	if( bytes != NULL ) {
+		*bytes = count;
+	}
+	return 0;
+}
+
+// cap_load() buffer
+typedef struct cap_buf
+{
+	unsigned char *data;
+	uint64_t       len;
+	uint64_t       alloc;
+	int            failed;
+} cap_buf;
+
+//--------------------------------------------------------------------
+//  cap_append()
+//      Load sink: add to a growing buffer
+//--------------------------------------------------------------------
+static void cap_append( void *ctx, int len, unsigned char *data )
+{
+	cap_buf *b = (cap_buf *)ctx;
+
+	if( b->len + len > b->alloc ) {
+		uint64_t new_alloc = b->alloc ? b->alloc * 2 : (1 << 20);
+		while( new_alloc < b->len + len ) {
+			new_alloc *= 2;
+		}
+		unsigned char *p = (unsigned char *)realloc( b->data, new_alloc );
+		if( p == NULL ) {
+			b->failed = 1;
+			return;
+		}
+		b->data = p;
+		b->alloc = new_alloc;
+	}
+	memcpy( b->data + b->len, data, len );
+	b->len += len;
+}
+
+//--------------------------------------------------------------------
+//  cap_load()
+//      The bytes of a capture as the parser would be given them, for a
+//      caller that parses them in pieces of its own.  *data is
+//      malloc()ed, the caller frees it.
+//  returns:
+//       0  success
+//      -1  file cannot be read or out of memory
+//--------------------------------------------------------------------
+int cap_load( const char *path, unsigned char **data, uint64_t *len )
+{
+	unsigned char buf[CAP_READ_SIZE];
+	cap_buf b = { NULL, 0, 0, 0 };
+	FILE *fp;
+	int text;
+	size_t n;
+
+	text = cap_is_text( path );
+	if( text == -1 ) {
+		return -1;
+	}
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		return -1;
+	}
+
+	if( text ) {
+		cap_replay_text( fp, cap_append, &b );
+	} else {
+		while( !b.failed && ((n = fread( buf, 1, sizeof(buf), fp )) > 0) ) {
+			cap_append( &b, (int)n, buf );
+		}
+	}
+	fclose( fp );
+
+	if( b.failed ) {
+		free( b.data );
+		return -1;
+	}
+	*data = b.data;
+	*len = b.len;
+	return 0;
+}
@@ -0,0 +1,28 @@
+
+//--------------------------------------------------------------------
+//  capture.h
+//--------------------------------------------------------------------
+
+// Replay of captured bus traffic into the parser.
+//
+// A capture is either the text hex dump "printem -c" writes (DumpHex,
+// 16 bytes a line, "---" marker lines between reads) or the raw bytes
+// as read off the serial port.  The format is told from the first
+// bytes of the file.  Text captures are handed to parse_header() in
+// the pieces they were dumped in, so a replay parses exactly as the
+// unit tests always have; raw captures go in CAP_READ_SIZE pieces.
+//
+// cap_load() reads the same bytes into memory instead, for pedecode to
+// split a large capture between several parsers.
+//
+// A text dump cannot hold a 0x00 byte: the reader takes 00 as the end
+// of a line's data, as printem -u always has.
+
+#include <stdint.h>
+
+#define CAP_READ_SIZE   256     // raw capture piece, printem's read_buf
+#define CAP_PROBE_SIZE  512     // bytes looked at to tell text from raw
+
+int cap_is_text( const char *path );
+int cap_replay( const char *path, uint64_t *bytes );
+int cap_load( const char *path, unsigned char **data, uint64_t *len );
@@ -0,0 +1,230 @@
+
+//--------------------------------------------------------------------
+//  config.c
+//      Runtime configuration for printem
+//
+//  File format is one setting per line:
+//      # comment
+//      report_ttl = 60
+//  Unknown keys are reported and ignored.
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>   // atoi()
+#include <string.h>
+#include <ctype.h>    // isspace()
+
+#include "config.h"
+
+printem_config config;
+
+//--------------------------------------------------------------------
+//  config_defaults()
+//--------------------------------------------------------------------
+void config_defaults( void )
+{
+	memset( &config, 0, sizeof(config) );
+	config.report_ttl = 60;
+	config.request_timeout = 300;
+	config.sequence_timeout = 60;
+	config.bulk_max_wait = 120;
+	config.job_report_hours = 0;
+	config.job_history_minutes = 0;
+	config.job_quiet_seconds = 30;
+	config.metrics_interval = 15;
+	config.timing_history = 1000;
+	config.bus_window = 10;
+	config.bus_poll_ms = 0;
+	config.bus_alert_pct = 25;
+	config.line_sample_seconds = 10;
+	config.log_index_records = 64;
+	config.log_index_seconds = 60;
+	config.log_rotate_kb = 10240;
+	config.log_rotate_seconds = 0;
+	config.log_compress = 1;
+	config.log_budget_mb = 256;
+	config.storage = stg_config;
+	config.diag = diag_config;
+}
+
+//--------------------------------------------------------------------
+//  config_trim()
+//      Strip leading and trailing white space in place
+//--------------------------------------------------------------------
+static char *config_trim( char *s )
+{
+	char *end;
+
+	while( isspace( (unsigned char)*s ) )  ++s;
+	end = s + strlen( s );
+	while( (end > s) && isspace( (unsigned char)end[-1] ) )  --end;
+	*end = '\0';
+	return s;
+}
+
+//--------------------------------------------------------------------
+//  config_set()
+//  returns:
+//       0  key recognized
+//      -1  unknown key
+//      -2  invalid value
+//--------------------------------------------------------------------
+static int config_set( const char *key, const char *value )
+{
+	if( !strcmp( key, "report_ttl" ) ) {
+		config.report_ttl = atoi( value );
+	}
+	else if( !strcmp( key, "request_timeout" ) ) {
+		config.request_timeout = atoi( value );
+	}
+	else if( !strcmp( key, "sequence_timeout" ) ) {
+		config.sequence_timeout = atoi( value );
+	}
+	else if( !strcmp( key, "bulk_max_wait" ) ) {
+		config.bulk_max_wait = atoi( value );
+	}
+	else if( !strcmp( key, "job_report_hours" ) ) {
+		config.job_report_hours = atoi( value );
+	}
+	else if( !strcmp( key, "job_history_minutes" ) ) {
+		config.job_history_minutes = atoi( value );
+	}
+	else if( !strcmp( key, "job_quiet_seconds" ) ) {
+		config.job_quiet_seconds = atoi( value );
+	}
+	else if( !strcmp( key, "metrics_file" ) ) {
+		snprintf( config.metrics_file, sizeof(config.metrics_file), "%s", value );
+	}
+	else if( !strcmp( key, "metrics_interval" ) ) {
+		config.metrics_interval = atoi( value );
+	}
+	else if( !strcmp( key, "timing_history" ) ) {
+		config.timing_history = atoi( value );
+	}
+	else if( !strcmp( key, "bus_window" ) ) {
+		config.bus_window = atoi( value );
+	}
+	else if( !strcmp( key, "bus_poll_ms" ) ) {
+		config.bus_poll_ms = atoi( value );
+	}
+	else if( !strcmp( key, "bus_alert_pct" ) ) {
+		config.bus_alert_pct = atoi( value );
+	}
+	else if( !strcmp( key, "line_sample_seconds" ) ) {
+		config.line_sample_seconds = atoi( value );
+	}
+	else if( !strcmp( key, "log_index_records" ) ) {
+		config.log_index_records = atoi( value );
+	}
+	else if( !strcmp( key, "log_index_seconds" ) ) {
+		config.log_index_seconds = atoi( value );
+	}
+	else if( !strcmp( key, "log_rotate_kb" ) ) {
+		config.log_rotate_kb = atoi( value );
+	}
+	else if( !strcmp( key, "log_rotate_seconds" ) ) {
+		config.log_rotate_seconds = atoi( value );
+	}
+	else if( !strcmp( key, "log_compress" ) ) {
+		config.log_compress = atoi( value );
+	}
+	else if( !strcmp( key, "log_budget_mb" ) ) {
+		config.log_budget_mb = atoi( value );
+	}
+	else if( !strcmp( key, "storage_batch_bytes" ) ) {
+		config.storage.batch_bytes = atoi( value );
+	}
+	else if( !strcmp( key, "storage_batch_ms" ) ) {
+		config.storage.batch_ms = atoi( value );
+	}
+	else if( !strcmp( key, "storage_prealloc_kb" ) ) {
+		config.storage.prealloc_kb = atoi( value );
+	}
+	else if( !strcmp( key, "storage_sync" ) ) {
+		config.storage.sync_mode = stg_sync_lookup( value );
+		if( config.storage.sync_mode == -1 ) {
+			return -2;
+		}
+	}
+	else if( !strcmp( key, "storage_sync_seconds" ) ) {
+		config.storage.sync_seconds = atoi( value );
+	}
+	else if( !strcmp( key, "diag_level" ) ) {
+		config.diag.level = diag_level_lookup( value );
+		if( config.diag.level == -1 ) {
+			return -2;
+		}
+	}
+	else if( !strcmp( key, "diag_format" ) ) {
+		config.diag.format = diag_format_lookup( value );
+		if( config.diag.format == -1 ) {
+			return -2;
+		}
+	}
+	else if( !strcmp( key, "diag_rate" ) ) {
+		config.diag.rate = atoi( value );
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  config_load()
+//      Apply defaults then override them from file (if present)
+//  returns:
+//       0  success (including no file)
+//      -1  file present but has errors
+//--------------------------------------------------------------------
+int config_load( const char *file )
+{
+	FILE *fp;
+	char line[256];
+	int line_no = 0;
+	int rv = 0;
+
+	config_defaults();
+
+	fp = fopen( file, "r" );
+	if( fp == NULL ) {
+		printf("No configuration file %s, using defaults\n", file);
+		return 0;
+	}
+	printf("Configuration file %s\n", file);
+
+	while( fgets( line, sizeof(line), fp ) != NULL )
+	{
+		char *key, *value, *sep;
+
+		++line_no;
+		// Drop comments and skip blank lines
+		sep = strchr( line, '#' );
+		if( sep != NULL )  *sep = '\0';
+		key = config_trim( line );
+		if( *key == '\0' )  continue;
+
+		sep = strchr( key, '=' );
+		if( sep == NULL ) {
+			printf("%s:%d missing '='\n", file, line_no);
+			rv = -1;
+			continue;
+		}
+		*sep = '\0';
+		value = config_trim( sep + 1 );
+		key = config_trim( key );
+
+		switch( config_set( key, value ) ) {
+		case -1:
+			printf("%s:%d unknown setting %s\n", file, line_no, key);
+			rv = -1;
+			break;
+		case -2:
+			printf("%s:%d invalid value for %s: %s\n", file, line_no, key, value);
+			rv = -1;
+			break;
+		}
+	}
+
+	fclose( fp );
+	return rv;
+}
@@ -0,0 +1,91 @@
+
+//--------------------------------------------------------------------
+//  config.h
+//--------------------------------------------------------------------
+
+#include "../Common/storage.h"
+#include "../Common/diag.h"
+
+// Runtime configuration read from a "key = value" text file at startup.
+// Every setting has a default so a missing file is not an error.
+
+// Default configuration file locations
+#define TARGET_CONFIG_FILE  "/etc/lsc/printem.conf"
+#define DESKTOP_CONFIG_FILE "./printem.conf"
+
+typedef struct printem_config
+{
+	// Report cache: seconds a completed report is handed to new
+	// requesters without running another sequence on the bus (0 = off)
+	int report_ttl;
+
+	// Seconds a client request may wait for its answer before it is
+	// failed (a History sequence takes tens of seconds).  A request may
+	// ask for less.
+	int request_timeout;
+
+	// Seconds a Report or History sequence may go without a data record
+	// before it is aborted and the parser resynchronizes (0 = never)
+	int sequence_timeout;
+
+	// Seconds a bulk request (PP_FLAG_BULK) waits behind interactive ones
+	// before it is served as one of them (see sched.h)
+	int bulk_max_wait;
+
+	// Periodic jobs (see jobs.h): a Report every N hours and a History
+	// every N minutes (0 = off), each started once the bus has been
+	// quiet for job_quiet_seconds
+	int job_report_hours;
+	int job_history_minutes;
+	int job_quiet_seconds;
+
+	// Metrics file in the Prometheus text format (see metrics.h), ""
+	// for printem.prom in the RAM directory, rewritten every
+	// metrics_interval seconds (0 = only when a client asks)
+	char metrics_file[128];
+	int metrics_interval;
+
+	// Lines of sequence timing kept in timing.txt before it rolls over
+	// to timing.old (see timing.h, 0 = none kept)
+	int timing_history;
+
+	// Bus timing (see busstat.h): seconds per statistics window (0 =
+	// off), the poll interval the 1022 keeps (0 = learn it), and how far
+	// off in percent the interval or its jitter may be before an alert
+	// (0 = no alerts)
+	int bus_window;
+	int bus_poll_ms;
+	int bus_alert_pct;
+
+	// Seconds between samples of the serial line error counts (see
+	// linestat.h, 0 = off)
+	int line_sample_seconds;
+
+	// Logmode index: an index entry every N records or whenever this
+	// many seconds have passed, whichever comes first
+	int log_index_records;
+	int log_index_seconds;
+
+	// Logmode rotation: start a new segment at this size or at each
+	// multiple of this many seconds of local time (0 = off)
+	int log_rotate_kb;
+	int log_rotate_seconds;
+
+	// Compress closed segments, and remove the oldest compressed ones
+	// once logmode files use more than the budget (0 = no limit)
+	int log_compress;
+	int log_budget_mb;
+
+	// Batching, preallocation and fdatasync policy for logmode and
+	// history output (see storage.h)
+	stg_policy storage;
+
+	// Diagnostic messages (see diag.h): lowest level written, text or
+	// kv output, and messages per second from one place in the code
+	diag_policy diag;
+} printem_config;
+
+extern printem_config config;
+
+void config_defaults( void );
+int config_load( const char *file );
@@ -0,0 +1,407 @@
+
+//--------------------------------------------------------------------
+//  events.c
+//      Live bus events: shared memory ring and fan-out to subscribed
+//      socket clients
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>       // close()
+#include <errno.h>
+#include <pthread.h>
+
+#include "../Common/message_services.h"
+#include "../Common/log_stream.h"    // ls_now_us()
+#include "../Common/hist_store.h"    // hs_event_classify()
+#include "../Common/ev_ring.h"
+#include "harvest.h"                 // hst_parse_record()
+#include "events.h"
+#include "metrics.h"
+#include "../Common/diag.h"
+
+typedef struct ev_item
+{
+	int           event;             // PP_EV_*
+	int64_t       time_us;
+	int           len;
+	unsigned char data[PP_DATA_SIZE];
+} ev_item;
+
+typedef struct ev_sub
+{
+	int          fd;                 // own descriptor for the connection, -1 unused
+	int          client_id;
+	unsigned int corr_id;            // of the CLIENT_SUBSCRIBE, echoed in events
+	unsigned int events;             // PP_EV_*
+	unsigned int rate_ms;
+	int64_t      last_us[8];         // last event sent, per class bit
+	uint64_t     dropped;            // not sent since the last one that was
+} ev_sub;
+
+//--------------------------------------------------------------------
+// Event state
+//--------------------------------------------------------------------
+// Ring shared with the parser.  The parser takes ev_lock only to append;
+// the thread holds it only to remove.  The subscriptions have their own
+// lock so the parser never waits on a send.
+static ev_item         ev_ring[EV_RING_SIZE];
+static int             ev_head;
+static int             ev_count;
+static uint64_t        ev_lost;      // overwritten before the thread got them
+static int             ev_stop;
+static int             ev_running;
+static pthread_mutex_t ev_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ev_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       ev_thread;
+
+static ev_sub          ev_subs[EV_MAX_SUBS];
+static pthread_mutex_t ev_sub_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Classes anyone is subscribed to, read by the parser without a lock
+static unsigned int    ev_classes;
+
+// Every event also goes to the shared memory ring (parser only)
+static evr_writer      ev_shm;
+static int             ev_shm_open;
+
+//--------------------------------------------------------------------
+//  ev_class_bit()
+//      PP_EV_* (a single bit) to its bit number
+//--------------------------------------------------------------------
+static int ev_class_bit( int event )
+{
+	int bit = 0;
+	while( (event > 1) && (bit < 7) ) {
+		event >>= 1;
+		++bit;
+	}
+	return bit;
+}
+
+//--------------------------------------------------------------------
+//  ev_drop_sub()
+//      ev_sub_lock held
+//--------------------------------------------------------------------
+static void ev_drop_sub( ev_sub *sub )
+{
+	close( sub->fd );
+	sub->fd = -1;
+}
+
+//--------------------------------------------------------------------
+//  ev_update_classes()
+//      ev_sub_lock held
+//--------------------------------------------------------------------
+static void ev_update_classes( void )
+{
+	unsigned int classes = 0;
+
+	for( int i = 0; i < EV_MAX_SUBS; i++ ) {
+		if( ev_subs[i].fd != -1 ) {
+			classes |= ev_subs[i].events;
+		}
+	}
+	__atomic_store_n( &ev_classes, classes, __ATOMIC_RELAXED );
+}
+
+//--------------------------------------------------------------------
+//  ev_deliver()
+//      Send one event to its subscribers.  lost events were overwritten
+//      in the ring; every subscriber may have wanted them.
+//--------------------------------------------------------------------
+static void ev_deliver( const ev_item *item, uint64_t lost )
+{
+	pp_msg m;
+	int bit = ev_class_bit( item->event );
+	int changed = 0;
+
+	pp_init( &m, CLIENT_SUBSCRIBE, SERVER_EVENT );
+	m.event = item->event;
+	m.time_us = item->time_us;
+	m.fields |= PP_F_EVENT | PP_F_TIME;
+	pp_set_data( &m, item->data, item->len );
+
+	pthread_mutex_lock( &ev_sub_lock );
+	for( int i = 0; i < EV_MAX_SUBS; i++ )
+	{
+		ev_sub *sub = &ev_subs[i];
+		if( sub->fd == -1 ) {
+			continue;
+		}
+		sub->dropped += lost;
+		if( !(sub->events & item->event) ) {
+			continue;
+		}
+		if(    (sub->rate_ms != 0) && (item->time_us >= sub->last_us[bit])
+			&& (item->time_us - sub->last_us[bit] < (int64_t)sub->rate_ms * 1000) ) {
+			++sub->dropped;
+			continue;
+		}
+
+		m.corr_id = sub->corr_id;
+		m.n_counters = 0;
+		if( sub->dropped ) {
+			pp_add_counter( &m, PP_C_DROPPED, sub->dropped );
+		}
+		if( msg_send_to_sock( sub->fd, &m ) == 0 ) {
+			met_add( MET_EV_SENT, 1 );
+			sub->dropped = 0;
+			sub->last_us[bit] = item->time_us;
+		} else if( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) {
+			// Client is behind; it hears about this one later
+			met_add( MET_EV_DROPPED, 1 );
+			++sub->dropped;
+		} else {
+			// Client gone
+			ev_drop_sub( sub );
+			changed = 1;
+		}
+	}
+	if( changed ) {
+		ev_update_classes();
+	}
+	pthread_mutex_unlock( &ev_sub_lock );
+}
+
+//--------------------------------------------------------------------
+//  ev_main()
+//      Fan-out thread
+//--------------------------------------------------------------------
+static void *ev_main( void *arg )
+{
+	ev_item item;
+	uint64_t lost;
+
+	met_thread( MET_SHARD_EVENTS );
+	pthread_mutex_lock( &ev_lock );
+	for( ;; )
+	{
+		while( (ev_count == 0) && !ev_stop ) {
+			pthread_cond_wait( &ev_cond, &ev_lock );
+		}
+		if( ev_stop ) {
+			break;
+		}
+		item = ev_ring[ev_head];
+		ev_head = (ev_head + 1) % EV_RING_SIZE;
+		--ev_count;
+		lost = ev_lost;
+		ev_lost = 0;
+
+		pthread_mutex_unlock( &ev_lock );
+		if( lost ) {
+			met_add( MET_EV_DROPPED, lost );    // ring overran
+		}
+		ev_deliver( &item, lost );
+		pthread_mutex_lock( &ev_lock );
+	}
+	pthread_mutex_unlock( &ev_lock );
+	return NULL;
+}
+
+//--------------------------------------------------------------------
+//  ev_open()
+//  returns:
+//       0  success
+//      -1  thread could not be started
+//--------------------------------------------------------------------
+int ev_open( void )
+{
+	for( int i = 0; i < EV_MAX_SUBS; i++ ) {
+		ev_subs[i].fd = -1;
+	}
+	ev_classes = 0;
+	ev_head = 0;
+	ev_count = 0;
+	ev_lost = 0;
+	ev_stop = 0;
+	ev_shm_open = (evw_open( &ev_shm, EVR_NAME ) == 0);
+	if( !ev_shm_open ) {
+		DIAG_ERRNO( DIAG_ERROR, "event ring" );
+	}
+	if( pthread_create( &ev_thread, NULL, ev_main, NULL ) != 0 ) {
+		ev_running = 0;
+		return -1;
+	}
+	ev_running = 1;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  ev_close()
+//      Stop the thread and end every subscription.  Events not yet
+//      sent are discarded.
+//--------------------------------------------------------------------
+void ev_close( void )
+{
+	if( ev_shm_open ) {
+		evw_close( &ev_shm, EVR_NAME );
+		ev_shm_open = 0;
+	}
+	if( !ev_running ) {
+		return;
+	}
+	__atomic_store_n( &ev_classes, 0, __ATOMIC_RELAXED );
+	pthread_mutex_lock( &ev_lock );
+	ev_stop = 1;
+	pthread_cond_signal( &ev_cond );
+	pthread_mutex_unlock( &ev_lock );
+	pthread_join( ev_thread, NULL );
+	ev_running = 0;
+
+	pthread_mutex_lock( &ev_sub_lock );
+	for( int i = 0; i < EV_MAX_SUBS; i++ ) {
+		if( ev_subs[i].fd != -1 ) {
+			ev_drop_sub( &ev_subs[i] );
+		}
+	}
+	pthread_mutex_unlock( &ev_sub_lock );
+}
+
+//--------------------------------------------------------------------
+//  ev_subscribe()
+//      Replace client_id's subscription.  No classes ends it.
+//  returns:
+//       0  success
+//      -1  not a socket client, or no room
+//--------------------------------------------------------------------
+int ev_subscribe( int client_id, unsigned int corr_id, unsigned int events, unsigned int rate_ms )
+{
+	int rv = 0;
+	int free_slot = -1;
+
+	if( !ev_running || (client_id >= 0) ) {
+		return -1;
+	}
+
+	pthread_mutex_lock( &ev_sub_lock );
+	for( int i = 0; i < EV_MAX_SUBS; i++ ) {
+		if( (ev_subs[i].fd != -1) && (ev_subs[i].client_id == client_id) ) {
+			ev_drop_sub( &ev_subs[i] );
+		}
+		if( (ev_subs[i].fd == -1) && (free_slot == -1) ) {
+			free_slot = i;
+		}
+	}
+	if( (events & PP_EV_ALL) != 0 )
+	{
+		ev_sub *sub = &ev_subs[(free_slot == -1) ? 0 : free_slot];
+		if( free_slot == -1 ) {
+			rv = -1;
+		} else if( (sub->fd = msg_sock_dup( client_id )) == -1 ) {
+			rv = -1;
+		} else {
+			sub->client_id = client_id;
+			sub->corr_id = corr_id;
+			sub->events = events & PP_EV_ALL;
+			sub->rate_ms = rate_ms;
+			sub->dropped = 0;
+			memset( sub->last_us, 0, sizeof(sub->last_us) );
+		}
+	}
+	ev_update_classes();
+	pthread_mutex_unlock( &ev_sub_lock );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  ev_unsubscribe_client()
+//      End client_id's subscription, the client has hung up
+//--------------------------------------------------------------------
+void ev_unsubscribe_client( int client_id )
+{
+	if( !ev_running ) {
+		return;
+	}
+	pthread_mutex_lock( &ev_sub_lock );
+	for( int i = 0; i < EV_MAX_SUBS; i++ ) {
+		if( (ev_subs[i].fd != -1) && (ev_subs[i].client_id == client_id) ) {
+			ev_drop_sub( &ev_subs[i] );
+		}
+	}
+	ev_update_classes();
+	pthread_mutex_unlock( &ev_sub_lock );
+}
+
+//--------------------------------------------------------------------
+//  ev_decode()
+//      Fill in the decoded fields of a ring slot from its raw frame
+//--------------------------------------------------------------------
+static void ev_decode( evr_slot *slot )
+{
+	hst_record rec;
+	const char *a;
+	float pct_a, pct_b;
+
+	slot->record_time = 0;
+	slot->kind = 0;
+	slot->reading_a = EVR_NO_READING;
+	slot->reading_b = EVR_NO_READING;
+
+	if( slot->event & (PP_EV_LOG | PP_EV_DIVERT) ) {
+		if( hst_parse_record( slot->data, slot->len, &rec ) == 0 ) {
+			slot->record_time = rec.time;
+			slot->kind = hs_event_classify( rec.text );
+		}
+	}
+	else if( slot->event == PP_EV_READINGS ) {
+		// "A: 66.8%    B: 66.6%" somewhere in the display frame
+		a = (const char *)memmem( slot->data, slot->len, "A:", 2 );
+		if( a != NULL ) {
+			char text[EVR_DATA_SIZE + 1];
+			int n = slot->data + slot->len - (const unsigned char *)a;
+			memcpy( text, a, n );
+			text[n] = '\0';
+			if( sscanf( text, "A:%f%% B:%f%%", &pct_a, &pct_b ) == 2 ) {
+				slot->reading_a = (int16_t)(pct_a * 10 + ((pct_a < 0) ? -0.5f : 0.5f));
+				slot->reading_b = (int16_t)(pct_b * 10 + ((pct_b < 0) ? -0.5f : 0.5f));
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  ev_publish()
+//      Called from the parser.  Never waits on the fan-out thread, a
+//      client or a ring reader.  Past the ring, costs a load and a
+//      compare when nobody is subscribed.
+//--------------------------------------------------------------------
+void ev_publish( int event, const unsigned char *data, int len )
+{
+	ev_item *item;
+	int64_t now = ls_now_us();
+
+	if( len > PP_DATA_SIZE ) {
+		len = PP_DATA_SIZE;
+	}
+
+	if( ev_shm_open ) {
+		evr_slot *slot = evw_begin( &ev_shm );
+		slot->time_us = now;
+		slot->event = event;
+		slot->len = len;
+		memcpy( slot->data, data, len );
+		ev_decode( slot );
+		evw_commit( &ev_shm );
+	}
+
+	if( !(__atomic_load_n( &ev_classes, __ATOMIC_RELAXED ) & event) ) {
+		return;
+	}
+
+	pthread_mutex_lock( &ev_lock );
+	if( ev_count == EV_RING_SIZE ) {
+		// Lose the oldest rather than wait
+		ev_head = (ev_head + 1) % EV_RING_SIZE;
+		--ev_count;
+		++ev_lost;
+	}
+	item = &ev_ring[(ev_head + ev_count) % EV_RING_SIZE];
+	item->event = event;
+	item->time_us = now;
+	item->len = len;
+	memcpy( item->data, data, len );
+	++ev_count;
+	pthread_cond_signal( &ev_cond );
+	pthread_mutex_unlock( &ev_lock );
+}
@@ -0,0 +1,32 @@
+
+//--------------------------------------------------------------------
+//  events.h
+//--------------------------------------------------------------------
+
+// Live bus events for subscribed clients.
+//
+// The parser calls ev_publish() as it sees a display frame (readings), a
+// logmode record (and whether it is a divert) or a change of bus
+// sequence.  The event is copied into a ring and the call returns; a
+// fan-out thread takes it from there and sends it to every socket client
+// subscribed to its class (CLIENT_SUBSCRIBE, pe_proto.h).  The serial
+// thread never waits on a client: when nobody is subscribed to a class
+// ev_publish() returns at once, a full ring loses its oldest event, and
+// a client that stops reading loses events rather than holding up the
+// others.  Losses are reported to the subscriber as PP_C_DROPPED.
+//
+// Before any of that, ev_publish() writes every event, subscribed or
+// not, with its decoded fields into the shared memory ring
+// (Common/ev_ring.h) for local readers that want the whole stream.
+
+// Events waiting for the fan-out thread
+#define EV_RING_SIZE  64
+
+// Subscriptions, at most one per socket client
+#define EV_MAX_SUBS   MSG_SOCK_MAX_CLIENTS
+
+int ev_open( void );
+void ev_close( void );
+int ev_subscribe( int client_id, unsigned int corr_id, unsigned int events, unsigned int rate_ms );
+void ev_unsubscribe_client( int client_id );
+void ev_publish( int event, const unsigned char *data, int len );
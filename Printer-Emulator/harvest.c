@@ -0,0 +1,322 @@
+
+//--------------------------------------------------------------------
+//  harvest.c
+//      Incremental history harvesting with a persistent high-water mark
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>   // realloc(), free()
+#include <string.h>
+#include <time.h>     // mktime()
+
+#include "harvest.h"
+#include "parser.h"   // DATA_FILENAME_SIZE
+#include "../Common/hist_store.h"
+#include "../Common/diag.h"
+
+//--------------------------------------------------------------------
+// Harvest state
+//--------------------------------------------------------------------
+// Records of the sequence in progress.  The high-water mark can only be
+// located once the whole (oldest first) history has been seen, so the
+// records are held until ";end".
+static hst_record *hst_recs;
+static int         hst_count;
+static int         hst_alloc;
+
+static char hst_dir[DATA_FILENAME_SIZE];
+static char hst_store_path[DATA_FILENAME_SIZE];
+static char hst_hwm_path[DATA_FILENAME_SIZE];
+
+//--------------------------------------------------------------------
+//  hst_hash()
+//      FNV-1a 64 bit hash of the record text
+//--------------------------------------------------------------------
+static unsigned long long hst_hash( const char *text )
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	while( *text ) {
+		h ^= (unsigned char)*text++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+//--------------------------------------------------------------------
+//  hst_harvest_open()
+//      dir is the disk directory for the store and high-water mark
+//--------------------------------------------------------------------
+void hst_harvest_open( const char *dir )
+{
+	snprintf( hst_dir, sizeof(hst_dir), "%s", dir );
+	snprintf( hst_store_path, sizeof(hst_store_path), "%s/%s", dir, HST_STORE_FILE );
+	snprintf( hst_hwm_path, sizeof(hst_hwm_path), "%s/%s", dir, HST_HWM_FILE );
+	hst_recs = NULL;
+	hst_count = 0;
+	hst_alloc = 0;
+}
+
+//--------------------------------------------------------------------
+//  hst_harvest_close()
+//--------------------------------------------------------------------
+void hst_harvest_close( void )
+{
+	free( hst_recs );
+	hst_recs = NULL;
+	hst_count = 0;
+	hst_alloc = 0;
+}
+
+//--------------------------------------------------------------------
+//  hst_harvest_begin()
+//      Called when a History sequence starts
+//--------------------------------------------------------------------
+void hst_harvest_begin( void )
+{
+	hst_count = 0;
+}
+
+//--------------------------------------------------------------------
+//  hst_parse_record()
+//      rec is a History data frame as buffered by the parser:
+//          98 "MM/DD/YY HH:MM:SS    event text" 0D
+//  returns:
+//       0  success, out filled in
+//      -1  not an event record (";end", ";wait", the clock header...)
+//--------------------------------------------------------------------
+int hst_parse_record( const unsigned char *rec, int len, hst_record *out )
+{
+	struct tm tm;
+	int n;
+
+	// Drop the leading 0x98 and trailing CR
+	if( (len > 0) && (rec[0] == 0x98) ) {
+		++rec;
+		--len;
+	}
+	while( (len > 0) && ((rec[len - 1] == 0x0D) || (rec[len - 1] == 0x0A)) ) {
+		--len;
+	}
+
+	// The first record of a sequence is the 1022 clock alone (17 chars)
+	// and carries no event
+	if( (len <= 17) || (len >= HST_TEXT_SIZE) ) {
+		return -1;
+	}
+
+	memcpy( out->text, rec, len );
+	out->text[len] = '\0';
+
+	memset( &tm, 0, sizeof(tm) );
+	n = sscanf( out->text, "%2d/%2d/%2d %2d:%2d:%2d",
+				&tm.tm_mon, &tm.tm_mday, &tm.tm_year,
+				&tm.tm_hour, &tm.tm_min, &tm.tm_sec );
+	if( n != 6 ) {
+		return -1;
+	}
+	tm.tm_mon -= 1;        // 1..12 to 0..11
+	tm.tm_year += 100;     // YY is 20YY
+	tm.tm_isdst = -1;
+	out->time = mktime( &tm );
+	out->hash = hst_hash( out->text );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  hst_harvest_record()
+//      Called for every History data frame
+//--------------------------------------------------------------------
+void hst_harvest_record( const unsigned char *rec, int len )
+{
+	hst_record r;
+
+	if( hst_parse_record( rec, len, &r ) == -1 ) {
+		return;
+	}
+
+	if( hst_count == hst_alloc ) {
+		int new_alloc = hst_alloc ? hst_alloc * 2 : 256;
+		hst_record *p = (hst_record *)realloc( hst_recs, new_alloc * sizeof(hst_record) );
+		if( p == NULL ) {
+			DIAG( DIAG_ERROR, "History harvest out of memory" );
+			return;
+		}
+		hst_recs = p;
+		hst_alloc = new_alloc;
+	}
+	hst_recs[hst_count++] = r;
+}
+
+//--------------------------------------------------------------------
+//  hst_hwm_load()
+//      The mark is the newest record harvested: its time, its hash and
+//      its ordinal, the number of records of its second up to and
+//      including it (1 for a mark saved without one)
+//  returns:
+//       0  high-water mark loaded
+//      -1  no high-water mark (first harvest)
+//--------------------------------------------------------------------
+static int hst_hwm_load( time_t *t, unsigned long long *hash, int *ordinal )
+{
+	FILE *fp;
+	long long tt;
+	int n;
+
+	fp = fopen( hst_hwm_path, "r" );
+	if( fp == NULL ) {
+		return -1;
+	}
+	*ordinal = 1;
+	n = fscanf( fp, "%lld %llx %d", &tt, hash, ordinal );
+	fclose( fp );
+	if( n < 2 ) {
+		return -1;
+	}
+	if( *ordinal < 1 ) {
+		*ordinal = 1;
+	}
+	*t = (time_t)tt;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  hst_hwm_save()
+//      Written to a temporary file then renamed so a power loss leaves
+//      either the old or the new mark, never a torn one
+//--------------------------------------------------------------------
+static int hst_hwm_save( const hst_record *r, int ordinal )
+{
+	char tmp_path[DATA_FILENAME_SIZE + 4];
+	FILE *fp;
+
+	snprintf( tmp_path, sizeof(tmp_path), "%s.tmp", hst_hwm_path );
+	fp = fopen( tmp_path, "w" );
+	if( fp == NULL ) {
+		return -1;
+	}
+	fprintf( fp, "%lld %llx %d\n", (long long)r->time, r->hash, ordinal );
+	if( fclose( fp ) != 0 ) {
+		return -1;
+	}
+	return rename( tmp_path, hst_hwm_path );
+}
+
+//--------------------------------------------------------------------
+//  hst_binary_append()
+//      Add records [first, hst_count) to the indexed binary store
+//--------------------------------------------------------------------
+static int hst_binary_append( int first )
+{
+	int n = hst_count - first;
+	hs_record *recs;
+	int rv;
+
+	recs = (hs_record *)malloc( n * sizeof(hs_record) );
+	if( recs == NULL ) {
+		return -1;
+	}
+	for( int i = 0; i < n; i++ ) {
+		const hst_record *r = &hst_recs[first + i];
+		hs_make_record( &recs[i], r->time, r->hash, r->text );
+	}
+	rv = hs_append( hst_dir, recs, n );
+	free( recs );
+	return rv;
+}
+
+//--------------------------------------------------------------------
+//  hst_harvest_complete()
+//      ";end" received.  Append the records past the high-water mark to
+//      the store and advance the mark.
+//  returns:
+//      number of new records
+//      -1 failure
+//--------------------------------------------------------------------
+int hst_harvest_complete( void )
+{
+	time_t hwm_time;
+	unsigned long long hwm_hash;
+	int hwm_ordinal;
+	int first_new = 0;
+	int second = -1;      // first record of the mark's second
+	int ordinal;
+	FILE *fp;
+
+	if( hst_count == 0 ) {
+		return 0;
+	}
+
+	if( hst_hwm_load( &hwm_time, &hwm_hash, &hwm_ordinal ) == 0 )
+	{
+		// Normally the mark record is still in the 1022 history and
+		// everything after it is new.  The same event text can repeat
+		// within a second, and new records can share the mark's second,
+		// so the mark is found by its ordinal in that second, or else
+		// as the first record that matches it.
+		int found = -1;
+		for( int i = 0; (i < hst_count) && (second == -1); i++ ) {
+			if( hst_recs[i].time >= hwm_time ) {
+				second = i;
+			}
+		}
+		if( second != -1 ) {
+			int i = second + hwm_ordinal - 1;
+			if( (i < hst_count) && (hst_recs[i].hash == hwm_hash) && (hst_recs[i].time == hwm_time) ) {
+				found = i;
+			}
+		}
+		for( int i = 0; (i < hst_count) && (found == -1); i++ ) {
+			if( (hst_recs[i].hash == hwm_hash) && (hst_recs[i].time == hwm_time) ) {
+				found = i;
+			}
+		}
+
+		if( found >= 0 ) {
+			first_new = found + 1;
+		} else if( second == -1 ) {
+			first_new = hst_count;
+		} else {
+			// The mark has rolled out of the 1022 history.  Fall back
+			// to time: skip the records before the mark's second, and
+			// of that second no more than the mark's ordinal.
+			first_new = second;
+			for( int n = 0; n < hwm_ordinal; n++ ) {
+				if( (first_new < hst_count) && (hst_recs[first_new].time == hwm_time) ) {
+					++first_new;
+				}
+			}
+		}
+	}
+
+	if( first_new < hst_count )
+	{
+		fp = fopen( hst_store_path, "a" );
+		if( fp == NULL ) {
+			DIAG( DIAG_ERROR, "Unable to open history store %s", hst_store_path );
+			return -1;
+		}
+		for( int i = first_new; i < hst_count; i++ ) {
+			fprintf( fp, "%s\n", hst_recs[i].text );
+		}
+		if( fclose( fp ) != 0 ) {
+			DIAG( DIAG_ERROR, "History store write error" );
+			return -1;
+		}
+
+		// Decoded copy for indexed queries (pehist)
+		if( hst_binary_append( first_new ) == -1 ) {
+			DIAG( DIAG_ERROR, "History binary store write error" );
+		}
+
+		// The new mark's ordinal: the records of its second up to it
+		ordinal = 1;
+		while(    (ordinal < hst_count)
+			   && (hst_recs[hst_count - 1 - ordinal].time == hst_recs[hst_count - 1].time) ) {
+			++ordinal;
+		}
+		if( hst_hwm_save( &hst_recs[hst_count - 1], ordinal ) == -1 ) {
+			DIAG( DIAG_ERROR, "Unable to save history high-water mark" );
+		}
+	}
+
+	return hst_count - first_new;
+}
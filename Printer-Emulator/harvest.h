@@ -0,0 +1,37 @@
+
+//--------------------------------------------------------------------
+//  harvest.h
+//--------------------------------------------------------------------
+
+// Incremental history harvesting.
+//
+// Every History sequence still transfers the whole 1022 history, oldest
+// record first, and only returns to steady state after ";end".  The
+// printer side has no way to cut it short, so the saving is made on our
+// side: records are parsed as they arrive, compared against a persistent
+// high-water mark (timestamp and hash of the newest record already
+// harvested), and only records past it are appended to a consolidated
+// store: history-store.txt as text and the indexed binary store
+// (Common/hist_store.h) for pehist.
+
+// Files kept in the disk directory
+#define HST_STORE_FILE "history-store.txt"
+#define HST_HWM_FILE   "history.hwm"
+
+// Longest history record text we keep (1022 records are ~40 characters)
+#define HST_TEXT_SIZE  64
+
+// One parsed history record
+typedef struct hst_record
+{
+	time_t             time;                // record timestamp
+	unsigned long long hash;                // identity of the record
+	char               text[HST_TEXT_SIZE]; // "MM/DD/YY HH:MM:SS    event"
+} hst_record;
+
+void hst_harvest_open( const char *dir );
+void hst_harvest_close( void );
+void hst_harvest_begin( void );
+void hst_harvest_record( const unsigned char *rec, int len );
+int hst_harvest_complete( void );
+int hst_parse_record( const unsigned char *rec, int len, hst_record *out );
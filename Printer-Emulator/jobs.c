@@ -0,0 +1,195 @@
+//--------------------------------------------------------------------
+//  jobs.c
+//      Periodic Report and History jobs run in quiet bus windows
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // time(), localtime_r(), strftime()
+
+#include "jobs.h"
+#include "sched.h"
+#include "requests.h"   // rpt_cache_pending()
+#include "parser.h"     // parse_bus_op(), status_is_logmode()
+#include "config.h"
+#include "../Common/message_services.h"
+#include "../Common/diag.h"
+
+//--------------------------------------------------------------------
+// Job state
+//--------------------------------------------------------------------
+static job jobs[] =
+{
+	{ "report",  SCHED_REPORT,  CLIENT_REQ_REPORT },
+	{ "history", SCHED_HISTORY, CLIENT_REQ_HISTORY },
+};
+#define JOB_COUNT  (int)(sizeof(jobs) / sizeof(jobs[0]))
+
+static char   jobs_log_path[DATA_FILENAME_SIZE];
+static time_t jobs_last_run;
+static time_t jobs_bus_busy;    // last time the bus was seen busy
+
+//--------------------------------------------------------------------
+//  jobs_slot()
+//      Start of the period of this length in local time that t is in
+//--------------------------------------------------------------------
+static time_t jobs_slot( time_t t, int period )
+{
+	struct tm tm;
+
+	localtime_r( &t, &tm );
+	return t - ((long long)t + tm.tm_gmtoff) % period;
+}
+
+//--------------------------------------------------------------------
+//  jobs_record()
+//      Append an outcome to jobs.txt
+//--------------------------------------------------------------------
+static void jobs_record( job *j, const char *outcome, const char *detail )
+{
+	char stamp[32];
+	struct tm tm;
+	time_t now = time( NULL );
+	int waited;
+	FILE *fp;
+
+	// Time from the start of the period to the bus taking the job
+	waited = (int)difftime( (j->started != 0) ? j->started : now, j->due );
+	DIAG( DIAG_INFO, "Job %s %s %s", j->name, outcome, detail );
+
+	localtime_r( &now, &tm );
+	strftime( stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm );
+	fp = fopen( jobs_log_path, "a" );
+	if( fp == NULL ) {
+		DIAG_ERRNO( DIAG_ERROR, "jobs log" );
+		return;
+	}
+	fprintf( fp, "%s %s %s waited %d s %s\n", stamp, j->name, outcome, waited, detail );
+	fclose( fp );
+}
+
+//--------------------------------------------------------------------
+//  jobs_next()
+//      The current run is over, wait for the next period
+//--------------------------------------------------------------------
+static void jobs_next( job *j )
+{
+	j->state = JOB_IDLE;
+	j->started = 0;
+	j->due = jobs_slot( time( NULL ), j->period ) + j->period;
+}
+
+//--------------------------------------------------------------------
+//  jobs_open()
+//      dir is the disk directory for jobs.txt.  Periods come from
+//      config; the first run of each job is at its next period.
+//--------------------------------------------------------------------
+void jobs_open( const char *dir )
+{
+	snprintf( jobs_log_path, sizeof(jobs_log_path), "%s/%s", dir, JOB_LOG_FILE );
+	jobs[0].period = config.job_report_hours * 3600;
+	jobs[1].period = config.job_history_minutes * 60;
+	jobs_last_run = 0;
+	jobs_bus_busy = time( NULL );
+
+	for( int i = 0; i < JOB_COUNT; i++ ) {
+		if( jobs[i].period > 0 ) {
+			jobs_next( &jobs[i] );
+			DIAG( DIAG_INFO, "Job %s every %d s", jobs[i].name, jobs[i].period );
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  jobs_run()
+//      Start the due jobs the bus has room for.  Called from the main
+//      loop; runs at most once a second.
+//--------------------------------------------------------------------
+void jobs_run( void )
+{
+	time_t now = time( NULL );
+	int quiet;
+
+	if( now == jobs_last_run ) {
+		return;
+	}
+	jobs_last_run = now;
+
+	if( (parse_bus_op() != 0) || status_is_logmode() || sched_waiting( SCHED_ALL ) ) {
+		jobs_bus_busy = now;
+	}
+	quiet = difftime( now, jobs_bus_busy ) >= config.job_quiet_seconds;
+
+	for( int i = 0; i < JOB_COUNT; i++ )
+	{
+		job *j = &jobs[i];
+		if( j->period <= 0 ) {
+			continue;
+		}
+		switch( j->state )
+		{
+		case JOB_IDLE:
+			if( now >= j->due ) {
+				j->state = JOB_DUE;
+			}
+			break;
+		case JOB_RUNNING:
+			// The answer normally comes through jobs_complete()
+			if( difftime( now, j->started ) > config.request_timeout ) {
+				jobs_record( j, "timeout", "no answer" );
+				jobs_next( j );
+			}
+			break;
+		}
+		if( j->state != JOB_DUE ) {
+			continue;
+		}
+
+		if( now >= j->due + j->period ) {
+			jobs_record( j, "skipped", "bus not quiet" );
+			jobs_next( j );
+		}
+		else if( quiet && (sched_add( j->op, SCHED_PRIO_BULK, 0, 0 ) != SCHED_REJECTED) ) {
+			DIAG( DIAG_INFO, "Job %s started", j->name );
+			j->state = JOB_RUNNING;
+			j->started = now;
+			if( j->op == SCHED_REPORT ) {
+				// Clients asking meanwhile share this Report
+				rpt_cache_pending();
+			}
+			// One job at a time, the next waits for a quiet bus again
+			jobs_bus_busy = now;
+			quiet = 0;
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  jobs_complete()
+//      A Report or History sequence has been answered, whoever asked
+//      for it (req_complete()).  A job waiting for one records the
+//      outcome.
+//--------------------------------------------------------------------
+void jobs_complete( int type, const pp_msg *rsp )
+{
+	char detail[PP_PATH_SIZE + 32];
+	uint64_t n;
+
+	for( int i = 0; i < JOB_COUNT; i++ )
+	{
+		job *j = &jobs[i];
+		if( (j->state != JOB_RUNNING) || (j->type != type) ) {
+			continue;
+		}
+		if( rsp->status == SERVER_ACTION_SUCCESS ) {
+			snprintf( detail, sizeof(detail), "%s", rsp->path );
+			if( pp_get_counter( rsp, PP_C_NEW_RECORDS, &n ) == 0 ) {
+				snprintf( detail + strlen( detail ), sizeof(detail) - strlen( detail ),
+						  " %llu new records", (unsigned long long)n );
+			}
+			jobs_record( j, "ok", detail );
+		} else {
+			jobs_record( j, (rsp->status == SERVER_TIMEOUT) ? "timeout" : "failed", rsp->text );
+		}
+		jobs_next( j );
+	}
+}
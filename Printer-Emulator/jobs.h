@@ -0,0 +1,47 @@
+
+//--------------------------------------------------------------------
+//  jobs.h
+//--------------------------------------------------------------------
+
+// Periodic jobs.
+//
+// printem pulls a Report every config.job_report_hours and a History
+// every config.job_history_minutes itself, instead of cron starting
+// "pecontrol r" and "pecontrol h".  Each job is due at the multiples of
+// its period in local time.  A due job waits for a quiet bus: no Report
+// or History sequence, no logmode session and nothing waiting in the
+// scheduler, for config.job_quiet_seconds.  It then goes to the scheduler
+// as bulk work (sched.h).  A job still waiting when its next period comes
+// is skipped for this one.
+//
+// Each outcome is appended to jobs.txt in the disk directory, one line
+// per run: local time, job, ok, failed, timeout or skipped, then how
+// long the job waited for the bus and the result file or the reason.
+// History is harvested incrementally (harvest.h) so a frequent pull only
+// adds the new records to the store.
+
+#define JOB_LOG_FILE  "jobs.txt"
+
+typedef enum
+{
+	JOB_IDLE,       // not due
+	JOB_DUE,        // due, waiting for a quiet bus
+	JOB_RUNNING,    // handed to the scheduler, waiting for its answer
+} job_state;
+
+typedef struct job
+{
+	const char *name;      // as recorded in jobs.txt
+	int         op;        // sched_op
+	int         type;      // CLIENT_REQ_* whose completion ends it
+	int         period;    // seconds, 0 job off
+	int         state;     // job_state
+	time_t      due;       // start of the current period
+	time_t      started;   // handed to the scheduler
+} job;
+
+struct pp_msg;    // pe_proto.h
+
+void jobs_open( const char *dir );
+void jobs_run( void );
+void jobs_complete( int type, const struct pp_msg *rsp );
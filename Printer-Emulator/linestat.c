@@ -0,0 +1,122 @@
+//--------------------------------------------------------------------
+//  linestat.c
+//      UART error counts (TIOCGICOUNT) against parser resyncs
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // time(), difftime()
+#include <errno.h>
+#include <sys/ioctl.h>  // ioctl(), TIOCGICOUNT
+#include <linux/serial.h>    // serial_icounter_struct
+
+#include "linestat.h"
+#include "config.h"
+#include "metrics.h"
+#include "../Common/diag.h"
+
+//--------------------------------------------------------------------
+// Line state
+//--------------------------------------------------------------------
+static int      line_fd = -1;
+static int      line_available;          // driver answers TIOCGICOUNT
+static int      line_base[LINE_COUNTS];  // counts when printem started
+static int      line_last[LINE_COUNTS];  // counts at the last sample
+static uint64_t line_last_resyncs;       // parser counters at the last sample
+static uint64_t line_last_dropped;
+static uint64_t line_last_overflows;
+static uint64_t line_intervals[LINE_KINDS];
+static time_t   line_last_sample;
+
+//--------------------------------------------------------------------
+//  line_read()
+//      Current UART error counts
+//  returns:
+//       0  success
+//      -1  the driver has no counts
+//--------------------------------------------------------------------
+static int line_read( int counts[LINE_COUNTS] )
+{
+	struct serial_icounter_struct ic;
+
+	if( ioctl( line_fd, TIOCGICOUNT, &ic ) == -1 ) {
+		return -1;
+	}
+	counts[LINE_FRAME] = ic.frame;
+	counts[LINE_PARITY] = ic.parity;
+	counts[LINE_OVERRUN] = ic.overrun;
+	counts[LINE_BREAK] = ic.brk;
+	counts[LINE_BUF_OVERRUN] = ic.buf_overrun;
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  line_open()
+//      fd is the 1022 serial port.  The counts are taken from now.
+//--------------------------------------------------------------------
+void line_open( int fd )
+{
+	line_fd = fd;
+	memset( line_intervals, 0, sizeof(line_intervals) );
+	line_available = (line_read( line_base ) == 0);
+	if( !line_available ) {
+		DIAG( DIAG_INFO, "Serial line error counts not available: %s", strerror( errno ) );
+		memset( line_base, 0, sizeof(line_base) );
+	}
+	memcpy( line_last, line_base, sizeof(line_last) );
+	line_last_resyncs = met_counter( MET_RESYNCS );
+	line_last_dropped = met_counter( MET_FRAMES_DROPPED );
+	line_last_overflows = met_counter( MET_BUF_OVERFLOWS );
+	line_last_sample = time( NULL );
+	met_set( MET_LINE_AVAILABLE, line_available );
+}
+
+//--------------------------------------------------------------------
+//  line_run()
+//      Take a sample every config.line_sample_seconds and file the
+//      interval by what went wrong in it.  Called from the main loop.
+//--------------------------------------------------------------------
+void line_run( void )
+{
+	int counts[LINE_COUNTS];
+	int delta[LINE_COUNTS] = { 0 };
+	int errors = 0;
+	uint64_t resyncs, dropped, overflows;
+	int kind;
+
+	if( (line_fd == -1) || (config.line_sample_seconds <= 0) ) {
+		return;
+	}
+	if( difftime( time( NULL ), line_last_sample ) < config.line_sample_seconds ) {
+		return;
+	}
+	line_last_sample = time( NULL );
+
+	if( line_available && (line_read( counts ) == 0) ) {
+		for( int c = 0; c < LINE_COUNTS; c++ ) {
+			delta[c] = counts[c] - line_last[c];
+			errors += delta[c];
+			met_set( MET_LINE_COUNTS + c, (uint64_t)(counts[c] - line_base[c]) );
+		}
+		memcpy( line_last, counts, sizeof(line_last) );
+	}
+
+	resyncs = met_counter( MET_RESYNCS ) - line_last_resyncs;
+	dropped = met_counter( MET_FRAMES_DROPPED ) - line_last_dropped;
+	overflows = met_counter( MET_BUF_OVERFLOWS ) - line_last_overflows;
+	line_last_resyncs += resyncs;
+	line_last_dropped += dropped;
+	line_last_overflows += overflows;
+
+	if( errors > 0 ) {
+		DIAG( DIAG_WARN, "Line errors: frame %d parity %d overrun %d break %d buffer %d,"
+			   " parser %llu resyncs %llu dropped %llu overflows",
+			   delta[LINE_FRAME], delta[LINE_PARITY], delta[LINE_OVERRUN], delta[LINE_BREAK],
+			   delta[LINE_BUF_OVERRUN], (unsigned long long)resyncs, (unsigned long long)dropped,
+			   (unsigned long long)overflows );
+		kind = (resyncs + dropped + overflows) ? LINE_BOTH : LINE_ERRORS_ONLY;
+	} else {
+		kind = (resyncs + dropped + overflows) ? LINE_PARSER_ONLY : LINE_CLEAN;
+	}
+	++line_intervals[kind];
+	met_set( MET_LINE_INTERVALS + kind, line_intervals[kind] );
+}
@@ -0,0 +1,48 @@
+
+//--------------------------------------------------------------------
+//  linestat.h
+//--------------------------------------------------------------------
+
+// Serial line quality.
+//
+// A noisy RS-485 line shows up in the parser as resyncs (SS_UNKNOWN),
+// frames thrown away and "Invalid @" commands.  The UART counts what it
+// saw going wrong: framing and parity errors, overruns, breaks and
+// buffer overruns, read with TIOCGICOUNT.  Every
+// config.line_sample_seconds printem reads those counts and sets them
+// beside the parser's own over the same interval, so each interval is
+// one of: clean, line errors only, parser trouble only (resync, dropped
+// frame or buffer overflow), or both.  A site whose parser trouble comes
+// with line errors has a wiring or noise problem; trouble without them
+// points at the 1022 or at printem.
+//
+// The counts since printem started and the interval table are exported
+// as metrics (printem_line_*).  An interval with line errors is also
+// printed.  Drivers without TIOCGICOUNT (a pty, some USB adapters) leave
+// the line counts out and printem_line_counts_available at 0.
+
+#include <stdint.h>
+
+// Line error counts, in the order exported
+typedef enum
+{
+	LINE_FRAME,
+	LINE_PARITY,
+	LINE_OVERRUN,
+	LINE_BREAK,
+	LINE_BUF_OVERRUN,
+	LINE_COUNTS
+} line_count_id;
+
+// Kinds of sample interval
+typedef enum
+{
+	LINE_CLEAN,          // no line errors, no parser trouble
+	LINE_ERRORS_ONLY,
+	LINE_PARSER_ONLY,
+	LINE_BOTH,
+	LINE_KINDS
+} line_kind;
+
+void line_open( int fd );
+void line_run( void );
@@ -24,14 +24,32 @@
 #include <sys/stat.h>     // stat()
 #include <unistd.h>
 #include <ctype.h>        // isalpha()
+#include <errno.h>
+#include <poll.h>
 
 #include "parser.h"
 #include "utils.h"
+#include "config.h"
+#include "requests.h"
+#include "sched.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "timing.h"
+#include "busstat.h"
+#include "linestat.h"
+#include "capture.h"
 #include "../Common/message_services.h"
+#include "../Common/diag.h"
+#include "../Common/storage.h"
+#include "events.h"
 
 // Version String
 const char version_stg[] = {"v1.3.1"};
 
+// Longest the active loop sleeps with nothing on the serial port or the
+// client socket
+#define MAIN_POLL_MS  1000
+
 //--------------------------------------------------------------------
 // Unit Test Files
 //--------------------------------------------------------------------
@@ -60,6 +78,7 @@ const char * help_arr[] = {
 	"  Optional Arguments",
 	"    -c <file>  capture data on the wire to a file for testing",
 	"    -d  is debug dump of parser state machine transitions (default: off)",
+	"    -f <file>  configuration file (default: " TARGET_CONFIG_FILE " on target, " DESKTOP_CONFIG_FILE " on desktop)",
 	"    -h  display this help screen",
 	"    -p  is passive mode, act as listener between real printer module and 1022 (default: active)",
 	"    -s  is \"slow\" high latency mode for serial port (default: low latency)",
@@ -81,21 +100,13 @@ const char * help_arr[] = {
 // Allocate memory for read buffer, set size according to your needs
 unsigned char read_buf [256];
 
-// Chunk Value is how many bytes in a line causes that line to be chunked
-// with a subsequent line or lines.  This goes on until a line is encountered
-// with less than ChunkVal bytes
-enum ChunkVal {
-	CHUNK_VAL_8 = 8,
-	CHUNK_VAL_10 = 10,
-	CHUNK_VAL_15 = 15,  // no chunking
-};
-
 // Serial Port name
 char default_serial_port[] = "/dev/ttyUSB0";
 
 // Test files
 char capfile[128];      // capture file
 char testfile[128];     // unit test file through -u
+char conffile[128];     // configuration file through -f
 
 // Unit Test file index
 int ut_idx;
@@ -170,7 +181,7 @@ int main( int argc, char *argv[] )
 	printf("(c) 2025 Liquid Solids Control\n\n");
 	
 	// --- Start by processing command line options ---
-	while( (c = getopt(argc, argv, "c:dhpsu:")) != -1 )
+	while( (c = getopt(argc, argv, "c:df:hpsu:")) != -1 )
 	{
 		switch( c ) {
 		case 'c':
@@ -185,6 +196,9 @@ int main( int argc, char *argv[] )
 			printf( "Debug Dump activated\n");
 						printf("options = 0x%x\n", options);
 			break;
+		case 'f':
+			strcpy( conffile, optarg );
+			break;
 		case 'h':
 			for(int i = 0; i < sizeof(help_arr) / sizeof(char *); ++i) {
 				printf("%s\n", help_arr[i]);
@@ -295,6 +309,20 @@ int main( int argc, char *argv[] )
 	}
 	pclose( sys_fp );
 
+	// Load configuration, falling back to the environment's default file
+	if( conffile[0] == '\0' ) {
+		strcpy( conffile, (options & TARGET) ? TARGET_CONFIG_FILE : DESKTOP_CONFIG_FILE );
+	}
+	if( config_load( conffile ) == -1 ) {
+		printf("Configuration file %s has errors\n", conffile );
+		return EXIT_FAILURE;
+	}
+	stg_config = config.storage;
+	diag_config = config.diag;
+	if( options & DEBUG_DUMP ) {
+		diag_config.level = DIAG_DEBUG;
+	}
+
 	// Create disk directory for target or desktop environment.
 	// Test if disk directory already exists, create if not
 	struct stat sb;  // stat buffer
@@ -358,98 +386,20 @@ int main( int argc, char *argv[] )
 	}
 
 	parse_open( &options, &control, &serial_port );
+	rpt_cache_open();
+	req_table_open();
+	sched_open();
+	tm_open( (options & TARGET) ? target_dir : desktop_dir );
+	bus_open();
 
 	// --- Unit Test Mode ---
 	if(      (options & UNIT_TEST) && !(options & CAPTURE)
 		 && (options & DEBUG_DUMP) && !(options & ACTIVE_MODE) )
 	{
-		FILE *in_fp;
-		char *in_line = NULL;
-		size_t in_len = 0;
-		ssize_t in_read;
-		unsigned char in_data[16];
-		int in_is_chunked;
-		unsigned char in_chunked_data[16*6];  // assume 6 lines max
-		unsigned char *in_chunked_p;
-
-		in_fp = fopen( testfile, "r" );
-		if( NULL == in_fp ) {
+		if( cap_replay( testfile, NULL ) == -1 ) {
 			printf("FAILED to open capture file");
 			return EXIT_FAILURE;
 		}
-		
-		in_chunked_p = in_chunked_data;
-		in_is_chunked = 0;
-		
-		while ((in_read = getline(&in_line, &in_len, in_fp)) != -1)
-		{
-			if( in_line[0] == '-' )  continue;
-
-			// Print the line sourcing data
-			//printf("// %s", in_line);
-
-			memset(in_data, 0, sizeof(in_data));
-			
-			// Apply scanf to line in format based on dump code from Attempt-7
-			// and related files.  Note the extra space between first bank of 8
-			// and second bank of 8.
-			sscanf( in_line, "%2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx  %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx %2hhx",
-					&in_data[0], &in_data[1], &in_data[2], &in_data[3],
-					&in_data[4], &in_data[5], &in_data[6], &in_data[7],
-					&in_data[8], &in_data[9], &in_data[10], &in_data[11],
-					&in_data[12], &in_data[13], &in_data[14], &in_data[15] );
-
-			for( int i = 0; i < 16; i++ )
-			{
-				if( in_data[i] ) {
-					//printf("%hhx ", in_data[i] );
-					*in_chunked_p = in_data[i];
-					++in_chunked_p;
-				}
-				
-				// Process if we've encountered 00 data somewhere before 16 bytes have
-				// been scanned or if there are 16 bytes of data
-				if( !in_data[i] || ( (i == 15) && in_data[i]) )
-				{
-					// We've reached the end of data for this segment.  Decide
-					// what to do next
-					if( in_is_chunked == 0)
-					{
-						if( i >= CHUNK_VAL_15 )
-						{
-							in_is_chunked = 1;
-							// leave in_chunked_p where it is
-						}
-						else
-						{
-							// we do stuff with the data here
-							//DumpHexStdout( (const void*)in_chunked_data, i );
-							parse_header(i, in_chunked_data);
-							
-							in_chunked_p = in_chunked_data;
-						}
-						break;
-					}
-					
-					if( in_is_chunked && (i < CHUNK_VAL_15) )
-					{
-						// We do stuff with the data here
-						//DumpHexStdout( (const void*)in_chunked_data, in_chunked_p - in_chunked_data );
-						parse_header(in_chunked_p - in_chunked_data, in_chunked_data);
-	 
-						in_is_chunked = 0;
-						in_chunked_p = in_chunked_data;
-					}
-					break;
-				}
-			}
-		
-			// separate input line and scanned line pairs
-			//printf("\n");  // was two
-		}
-
-		// close the input file
-		fclose(in_fp);
 	}  // END if( options & UNIT_TEST )
 
 	// --- Capture Wireline Data to a File ---
@@ -485,56 +435,112 @@ int main( int argc, char *argv[] )
 	// --- Serial Port Parsing of Live Wireline Data ---
 	if( !(options & UNIT_TEST) && !(options & CAPTURE) && (options & ACTIVE_MODE) )
 	{
+		// From here on messages are queued for a thread to write, so
+		// the serial thread never waits on stdout.  Under -d they stay
+		// in order with the dumps instead.
+		if( diag_open( options & DEBUG_DUMP ) == -1 ) {
+			printf("Unable to start the diagnostics thread, messages written directly\n");
+		}
 		rv = msg_create_server_mq();
 		if( rv == -1 ) {
-			perror("msgget");
+			DIAG_ERRNO( DIAG_ERROR, "msgget" );
 			parse_close();
+			diag_close();
 			close(serial_port);
 			exit(EXIT_FAILURE);
 		}
+		// Socket clients are optional: without the socket SysV still works
+		if( msg_create_server_sock() == -1 ) {
+			DIAG_ERRNO( DIAG_WARN, "printem socket" );
+		}
+		msg_sock_on_hangup( control_client_gone );
+		if( ev_open() == -1 ) {
+			DIAG( DIAG_ERROR, "Unable to start the event thread, no subscriptions" );
+		}
+		// Periodic Report and History pulls, if configured
+		jobs_open( (options & TARGET) ? target_dir : desktop_dir );
+		// Counters for the node exporter and CLIENT_METRICS
+		met_open( (options & TARGET) ? target_ram_dir : desktop_dir );
+		line_open( serial_port );
 		while( isRunning )
 		{
+			struct pollfd fds[1 + 1 + MSG_SOCK_MAX_CLIENTS];
+			int n_fds;
+
 			// Test for trigger of Report or History sequence.
 			// Comes in from USR1 signal
 			if( trigger1 ) {
 				trigger1 = 0;
-				control |= LOGMODE_ON_REQ;
+				sched_add( SCHED_LOG_ON, SCHED_PRIO_INTERACTIVE, 0, 0 );
 			}
 			if( trigger2 ) {
 				trigger2 = 0;
-				control |= LOGMODE_OFF_REQ;
+				sched_add( SCHED_LOG_OFF, SCHED_PRIO_INTERACTIVE, 0, 0 );
 			}
 
 			//printf("* ");  fflush(stdout);
 
-			// Read the control message queue for requests
+			// Sleep until the 1022 sends something or a socket client
+			// connects or sends a request.  The SysV queue cannot be
+			// waited on, so the timeout bounds its latency when the bus
+			// is quiet and also drives request deadlines and the storage
+			// batch timer.  A signal (USR1/USR2) ends the wait early.
+			fds[0].fd = serial_port;
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			n_fds = 1 + msg_server_pollfds( &fds[1], MSG_SOCK_MAX_CLIENTS + 1 );
+			rv = poll( fds, n_fds, MAIN_POLL_MS );
+			if( (rv == -1) && (errno != EINTR) ) {
+				DIAG_ERRNO( DIAG_ERROR, "poll" );
+			}
+
+			// Read the control message queues for requests
 			// This is non-blocking
 			rv = control_receive_msg( &control );
 			if( rv == -1 ) {
 				isRunning = 0;
 			}
-			
-			// Read bytes in blocking mode (see VMIN and VTIME)
-			int n = read(serial_port, &read_buf, sizeof(read_buf));
 
-			parse_header(n, read_buf);
+			// Fail client requests nobody answered in time, abort a
+			// bus sequence that has stalled, and start the periodic jobs
+			// that are due, and export the metrics when it is time
+			req_expire();
+			parse_watchdog();
+			jobs_run();
+			bus_run();
+			line_run();
+			met_run();
+			
+			// Serial data is waiting so this read does not block
+			// (see VMIN and VTIME)
+			if( fds[0].revents & POLLIN ) {
+				int n = read(serial_port, &read_buf, sizeof(read_buf));
+
+				met_add( MET_SERIAL_READS, 1 );
+				if( n > 0 ) {
+					met_add( MET_SERIAL_BYTES, n );
+				}
+				parse_header(n, read_buf);
+			}
 
-			// read() is blocking so no sleep needed
-			// Sleep 10 mS to let other threads run
-			// 1 mS is 1000 uS
-			//usleep(10*1000);
+			// Batched output that has waited long enough goes to disk
+			stg_poll();
 		}
 
+		ev_close();
+		msg_remove_server_sock();
+
 		// Remove the server message queue
 		rv = msg_remove_server_mq();
 		if( rv == -1 ) {
-			perror("msgctl");
+			DIAG_ERRNO( DIAG_ERROR, "msgctl" );
 		} else {
-			printf("Server message queue removed\n");
+			DIAG( DIAG_INFO, "Server message queue removed" );
 		}
 	}
 
 	parse_close();
+	diag_close();
 	
 	// close the port
 	close(serial_port);
@@ -0,0 +1,544 @@
+//--------------------------------------------------------------------
+//  metrics.c
+//      Metrics registry with per thread shards, Prometheus text export
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // clock_gettime(), time()
+
+#include "metrics.h"
+#include "parser.h"     // LAST_STATE, parse_state_name(), status_is_logmode()
+#include "requests.h"   // req_outstanding(), req_add(), req_complete()
+#include "sched.h"      // sched_stats()
+#include "archive.h"    // arc_submit_job()
+#include "linestat.h"   // LINE_COUNTS, LINE_KINDS
+#include "config.h"
+#include "../Common/message_services.h"
+#include "../Common/storage.h"    // stg_counters
+#include "../Common/diag.h"
+
+static_assert( LAST_STATE <= MET_STATES, "MET_STATES too small" );
+static_assert( SCHED_PRIO_COUNT == 3, "MET_SCHED_* sized for 3 priorities" );
+static_assert( (LINE_COUNTS == 5) && (LINE_KINDS == 4), "MET_LINE_* sized for linestat.h" );
+
+//--------------------------------------------------------------------
+// Registry state
+//--------------------------------------------------------------------
+static met_shard  met_shards[MET_SHARDS];
+static __thread met_shard *met_local = &met_shards[MET_SHARD_MAIN];
+static uint64_t   met_values[MET_VALUES];
+static char       met_path[DATA_FILENAME_SIZE];
+static time_t     met_last_export;
+
+// The export is written on the archive thread from a copy taken by the
+// main thread, so neither waits on the other
+typedef enum
+{
+	MET_EXPORT_IDLE,
+	MET_EXPORT_QUEUED,     // copy taken, archive thread to write it
+	MET_EXPORT_WRITTEN,    // met_export_rv set, main thread to answer
+} met_export_state;
+
+static met_shard  met_snap_shards[MET_SHARDS];
+static uint64_t   met_snap_values[MET_VALUES];
+static int        met_export_at;      // met_export_state
+static int        met_export_rv;
+static int        met_again;          // a client asked after the copy
+
+// A metric as exported: the family name, its labels and help text.
+// Consecutive entries of one family share the HELP and TYPE lines.
+typedef struct met_def
+{
+	int         id;
+	const char *name;
+	const char *labels;
+	const char *type;
+	const char *help;
+	double      scale;    // exported value is the value times this, 0 as is
+} met_def;
+
+static const met_def met_counter_defs[] =
+{
+	{ MET_SERIAL_READS,       "printem_serial_reads_total", "", "counter", "Reads from the 1022 serial port." },
+	{ MET_SERIAL_BYTES,       "printem_serial_bytes_total", "", "counter", "Bytes read from the 1022 serial port." },
+	{ MET_TX_BYTES,           "printem_tx_bytes_total", "", "counter", "Bytes sent to the 1022." },
+	{ MET_TX_ERRORS,          "printem_tx_errors_total", "", "counter", "Failed or short writes to the 1022." },
+	{ MET_RESYNCS,            "printem_resyncs_total", "", "counter", "Times the parser lost its place and resynchronized." },
+	{ MET_WRITE_ERR_READINGS, "printem_file_write_errors_total", "file=\"readings\"", "counter", "Failed writes to data files." },
+	{ MET_WRITE_ERR_REPORT,   "printem_file_write_errors_total", "file=\"report\"", "counter", NULL },
+	{ MET_WRITE_ERR_HISTORY,  "printem_file_write_errors_total", "file=\"history\"", "counter", NULL },
+	{ MET_WRITE_ERR_LOG,      "printem_file_write_errors_total", "file=\"logmode\"", "counter", NULL },
+	{ MET_REPLY_ERRORS,       "printem_reply_errors_total", "", "counter", "Responses that could not be sent to a client." },
+	{ MET_REQ_TIMEOUTS,       "printem_request_timeouts_total", "", "counter", "Client requests not answered by their deadline." },
+	{ MET_SEQ_REPORT,         "printem_sequences_total", "type=\"report\"", "counter", "Report and History sequences completed." },
+	{ MET_SEQ_HISTORY,        "printem_sequences_total", "type=\"history\"", "counter", NULL },
+	{ MET_SEQ_ABORT_REPORT,   "printem_sequence_aborts_total", "type=\"report\"", "counter", "Sequences abandoned as stalled." },
+	{ MET_SEQ_ABORT_HISTORY,  "printem_sequence_aborts_total", "type=\"history\"", "counter", NULL },
+	{ MET_EV_SENT,            "printem_events_sent_total", "", "counter", "Bus events pushed to subscribers." },
+	{ MET_EV_DROPPED,         "printem_events_dropped_total", "", "counter", "Bus events subscribers missed." },
+	{ MET_ARC_SEGMENTS,       "printem_archive_segments_total", "", "counter", "Logmode segments compressed." },
+	{ MET_ARC_ERRORS,         "printem_archive_errors_total", "", "counter", "Logmode segments that could not be compressed." },
+	{ MET_FRAMES_DROPPED,     "printem_frames_dropped_total", "", "counter", "Partial frames thrown away while resynchronizing." },
+	{ MET_BUF_OVERFLOWS,      "printem_frame_overflows_total", "", "counter", "Frames too long for the parser buffer, discarded." },
+	{ MET_INVALID_CMDS,       "printem_invalid_commands_total", "", "counter", "@ commands from the 1022 that were not R, H or L." },
+};
+
+static const met_def met_value_defs[] =
+{
+	{ MET_START_TIME,          "printem_start_time_seconds", "", "gauge", "When printem started, seconds since the epoch." },
+	{ MET_LOGMODE,             "printem_logmode", "", "gauge", "1 while a logmode session is on." },
+	{ MET_REQ_OUTSTANDING,     "printem_requests_outstanding", "", "gauge", "Client requests waiting for the bus." },
+	{ MET_SCHED_QUEUED + 0,    "printem_sched_queued_total", "prio=\"unit\"", "counter", "Bus operations queued, by priority." },
+	{ MET_SCHED_QUEUED + 1,    "printem_sched_queued_total", "prio=\"interactive\"", "counter", NULL },
+	{ MET_SCHED_QUEUED + 2,    "printem_sched_queued_total", "prio=\"bulk\"", "counter", NULL },
+	{ MET_SCHED_REJECTED + 0,  "printem_sched_rejected_total", "prio=\"unit\"", "counter", "Bus operations refused at admission." },
+	{ MET_SCHED_REJECTED + 1,  "printem_sched_rejected_total", "prio=\"interactive\"", "counter", NULL },
+	{ MET_SCHED_REJECTED + 2,  "printem_sched_rejected_total", "prio=\"bulk\"", "counter", NULL },
+	{ MET_SCHED_DROPPED + 0,   "printem_sched_dropped_total", "prio=\"unit\"", "counter", "Bus operations dropped before they started." },
+	{ MET_SCHED_DROPPED + 1,   "printem_sched_dropped_total", "prio=\"interactive\"", "counter", NULL },
+	{ MET_SCHED_DROPPED + 2,   "printem_sched_dropped_total", "prio=\"bulk\"", "counter", NULL },
+	{ MET_STG_BYTES,           "printem_storage_bytes_total", "", "counter", "Bytes written to logmode and history files." },
+	{ MET_STG_WRITES,          "printem_storage_writes_total", "", "counter", "Write calls for logmode and history files." },
+	{ MET_STG_SYNCS,           "printem_storage_syncs_total", "", "counter", "fdatasync calls for logmode and history files." },
+	{ MET_STG_ERRORS,          "printem_storage_errors_total", "", "counter", "Failed writes, preallocations and syncs." },
+	{ MET_BUS_POLLS,           "printem_bus_polls_total", "", "counter", "Printer polls from the 1022." },
+	{ MET_BUS_POLL_MEAN_US,    "printem_bus_poll_interval_seconds", "stat=\"mean\"", "gauge", "Time between polls over the last bus window.", 1e-6 },
+	{ MET_BUS_POLL_MIN_US,     "printem_bus_poll_interval_seconds", "stat=\"min\"", "gauge", NULL, 1e-6 },
+	{ MET_BUS_POLL_MAX_US,     "printem_bus_poll_interval_seconds", "stat=\"max\"", "gauge", NULL, 1e-6 },
+	{ MET_BUS_POLL_EXPECTED_US, "printem_bus_poll_interval_seconds", "stat=\"expected\"", "gauge", NULL, 1e-6 },
+	{ MET_BUS_JITTER_US,       "printem_bus_poll_jitter_seconds", "", "gauge", "Smoothed change between poll intervals.", 1e-6 },
+	{ MET_BUS_SLOTS_PPM + 0,   "printem_bus_slot_ratio", "traffic=\"display\"", "gauge", "Share of 50 ms slots carrying each traffic over the last window.", 1e-6 },
+	{ MET_BUS_SLOTS_PPM + 1,   "printem_bus_slot_ratio", "traffic=\"printer\"", "gauge", NULL, 1e-6 },
+	{ MET_BUS_SLOTS_PPM + 2,   "printem_bus_slot_ratio", "traffic=\"idle\"", "gauge", NULL, 1e-6 },
+	{ MET_BUS_SLOT_BYTES_MAX,  "printem_bus_slot_bytes_max", "", "gauge", "Most bytes in one slot over the last window (48 fit at 9600 baud)." },
+	{ MET_BUS_LINE_PPM,        "printem_bus_line_ratio", "", "gauge", "Bytes over the last window against the 9600 baud line.", 1e-6 },
+	{ MET_BUS_GAP_MAX_US,      "printem_bus_idle_gap_max_seconds", "", "gauge", "Longest time nothing was read over the last window.", 1e-6 },
+	{ MET_BUS_ALERT,           "printem_bus_alert", "", "gauge", "1 while the poll cadence is off." },
+	{ MET_BUS_ALERTS,          "printem_bus_alerts_total", "", "counter", "Poll cadence alerts raised." },
+	{ MET_LINE_AVAILABLE,      "printem_line_counts_available", "", "gauge", "1 if the serial driver reports line errors (TIOCGICOUNT)." },
+	{ MET_LINE_COUNTS + LINE_FRAME,       "printem_line_errors_total", "error=\"frame\"", "counter", "Serial line errors since printem started." },
+	{ MET_LINE_COUNTS + LINE_PARITY,      "printem_line_errors_total", "error=\"parity\"", "counter", NULL },
+	{ MET_LINE_COUNTS + LINE_OVERRUN,     "printem_line_errors_total", "error=\"overrun\"", "counter", NULL },
+	{ MET_LINE_COUNTS + LINE_BREAK,       "printem_line_errors_total", "error=\"break\"", "counter", NULL },
+	{ MET_LINE_COUNTS + LINE_BUF_OVERRUN, "printem_line_errors_total", "error=\"buf_overrun\"", "counter", NULL },
+	{ MET_LINE_INTERVALS + LINE_CLEAN,       "printem_line_intervals_total", "line_errors=\"no\",parser_trouble=\"no\"", "counter", "Line samples by line errors and parser trouble (resync, dropped frame, overflow) in them." },
+	{ MET_LINE_INTERVALS + LINE_ERRORS_ONLY, "printem_line_intervals_total", "line_errors=\"yes\",parser_trouble=\"no\"", "counter", NULL },
+	{ MET_LINE_INTERVALS + LINE_PARSER_ONLY, "printem_line_intervals_total", "line_errors=\"no\",parser_trouble=\"yes\"", "counter", NULL },
+	{ MET_LINE_INTERVALS + LINE_BOTH,        "printem_line_intervals_total", "line_errors=\"yes\",parser_trouble=\"yes\"", "counter", NULL },
+	{ MET_DIAG_MESSAGES,       "printem_diag_messages_total", "", "counter", "Diagnostic messages written or queued." },
+	{ MET_DIAG_SUPPRESSED,     "printem_diag_suppressed_total", "", "counter", "Diagnostic messages over the per call site rate." },
+	{ MET_DIAG_DROPPED,        "printem_diag_dropped_total", "", "counter", "Diagnostic messages lost to a full queue." },
+	{ MET_DIAG_WRITE_ERRORS,   "printem_diag_write_errors_total", "", "counter", "Failed writes of diagnostic output." },
+};
+
+#define MET_NUM_COUNTER_DEFS  (int)(sizeof(met_counter_defs) / sizeof(met_counter_defs[0]))
+#define MET_NUM_VALUE_DEFS    (int)(sizeof(met_value_defs) / sizeof(met_value_defs[0]))
+
+// Histogram bucket upper bounds in ms, ascending, 0 ends the list
+static const struct {
+	const char *labels;
+	uint64_t    le_ms[MET_BUCKETS];
+} met_hist_defs[MET_HISTOGRAMS] =
+{
+	{ "type=\"report\"",  { 1000, 2000, 5000, 10000, 20000, 30000, 60000, 120000, 300000, 600000 } },
+	{ "type=\"history\"", { 1000, 2000, 5000, 10000, 20000, 30000, 60000, 120000, 300000, 600000 } },
+};
+
+//--------------------------------------------------------------------
+//  met_open()
+//      dir is where printem.prom goes unless config.metrics_file
+//      names the file
+//--------------------------------------------------------------------
+void met_open( const char *dir )
+{
+	memset( met_shards, 0, sizeof(met_shards) );
+	memset( met_values, 0, sizeof(met_values) );
+	if( config.metrics_file[0] != '\0' ) {
+		snprintf( met_path, sizeof(met_path), "%s", config.metrics_file );
+	} else {
+		snprintf( met_path, sizeof(met_path), "%s/printem.prom", dir );
+	}
+	met_values[MET_START_TIME] = time( NULL );
+	met_last_export = time( NULL );
+}
+
+//--------------------------------------------------------------------
+//  met_thread()
+//      The calling thread counts in this shard from now on.  A thread
+//      that does not call it counts in the main shard, so it must be
+//      the main thread.
+//--------------------------------------------------------------------
+void met_thread( int shard )
+{
+	met_local = &met_shards[shard];
+}
+
+//--------------------------------------------------------------------
+//  met_add()
+//      Only the owning thread writes its shard, so the add needs no
+//      lock.  The store is atomic so an export never reads a torn value.
+//--------------------------------------------------------------------
+void met_add( int id, uint64_t n )
+{
+	uint64_t *c = &met_local->counter[id];
+	__atomic_store_n( c, *c + n, __ATOMIC_RELAXED );
+}
+
+//--------------------------------------------------------------------
+//  met_set()
+//      Main thread only
+//--------------------------------------------------------------------
+void met_set( int id, uint64_t value )
+{
+	met_values[id] = value;
+}
+
+//--------------------------------------------------------------------
+//  met_observe_ms()
+//      Add one observation to a histogram
+//--------------------------------------------------------------------
+void met_observe_ms( int id, uint64_t ms )
+{
+	int b = 0;
+
+	while( (b < MET_BUCKETS) && (met_hist_defs[id].le_ms[b] != 0) && (ms > met_hist_defs[id].le_ms[b]) ) {
+		++b;
+	}
+	if( (b < MET_BUCKETS) && (met_hist_defs[id].le_ms[b] == 0) ) {
+		b = MET_BUCKETS;    // past the last bound, +Inf
+	}
+	__atomic_store_n( &met_local->bucket[id][b], met_local->bucket[id][b] + 1, __ATOMIC_RELAXED );
+	__atomic_store_n( &met_local->sum_ms[id], met_local->sum_ms[id] + ms, __ATOMIC_RELAXED );
+}
+
+//--------------------------------------------------------------------
+//  met_now_ms()
+//      Monotonic clock for durations
+//--------------------------------------------------------------------
+uint64_t met_now_ms( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//--------------------------------------------------------------------
+//  met_counter()
+//      Sum of one counter over the shards
+//--------------------------------------------------------------------
+uint64_t met_counter( int id )
+{
+	uint64_t v = 0;
+
+	for( int s = 0; s < MET_SHARDS; s++ ) {
+		v += __atomic_load_n( &met_shards[s].counter[id], __ATOMIC_RELAXED );
+	}
+	return v;
+}
+
+//--------------------------------------------------------------------
+//  met_snap_counter()
+//      met_counter() over the copy being exported
+//--------------------------------------------------------------------
+static uint64_t met_snap_counter( int id )
+{
+	uint64_t v = 0;
+
+	for( int s = 0; s < MET_SHARDS; s++ ) {
+		v += met_snap_shards[s].counter[id];
+	}
+	return v;
+}
+
+//--------------------------------------------------------------------
+//  met_collect()
+//      Refresh the values other modules keep
+//--------------------------------------------------------------------
+static void met_collect( void )
+{
+	met_values[MET_LOGMODE] = status_is_logmode() ? 1 : 0;
+	met_values[MET_REQ_OUTSTANDING] = req_outstanding( CLIENT_REQ_REPORT )
+		+ req_outstanding( CLIENT_REQ_HISTORY ) + req_outstanding( CLIENT_REQ_LOG );
+	for( int p = 0; p < SCHED_PRIO_COUNT; p++ ) {
+		met_values[MET_SCHED_QUEUED + p] = sched_stats( p )->queued;
+		met_values[MET_SCHED_REJECTED + p] = sched_stats( p )->rejected;
+		met_values[MET_SCHED_DROPPED + p] = sched_stats( p )->dropped;
+	}
+	met_values[MET_STG_BYTES] = stg_counters.bytes_written;
+	met_values[MET_STG_WRITES] = stg_counters.writes;
+	met_values[MET_STG_SYNCS] = stg_counters.syncs;
+	met_values[MET_STG_ERRORS] = stg_counters.errors;
+
+	diag_stats ds;
+	diag_get_stats( &ds );
+	met_values[MET_DIAG_MESSAGES] = ds.messages;
+	met_values[MET_DIAG_SUPPRESSED] = ds.suppressed;
+	met_values[MET_DIAG_DROPPED] = ds.dropped;
+	met_values[MET_DIAG_WRITE_ERRORS] = ds.write_errors;
+}
+
+//--------------------------------------------------------------------
+//  met_header()
+//      HELP and TYPE lines, once per family
+//--------------------------------------------------------------------
+static void met_header( FILE *fp, const met_def *d )
+{
+	if( d->help != NULL ) {
+		fprintf( fp, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, d->type );
+	}
+}
+
+//--------------------------------------------------------------------
+//  met_line()
+//--------------------------------------------------------------------
+static void met_line( FILE *fp, const char *name, const char *labels, uint64_t v )
+{
+	if( labels[0] != '\0' ) {
+		fprintf( fp, "%s{%s} %llu\n", name, labels, (unsigned long long)v );
+	} else {
+		fprintf( fp, "%s %llu\n", name, (unsigned long long)v );
+	}
+}
+
+//--------------------------------------------------------------------
+//  met_write()
+//      Every metric in the Prometheus text format, from the copy
+//--------------------------------------------------------------------
+static void met_write( FILE *fp )
+{
+	char labels[64];
+	uint64_t v, count, sum_ms;
+
+	for( int i = 0; i < MET_NUM_COUNTER_DEFS; i++ ) {
+		met_header( fp, &met_counter_defs[i] );
+		met_line( fp, met_counter_defs[i].name, met_counter_defs[i].labels, met_snap_counter( met_counter_defs[i].id ) );
+	}
+
+	fprintf( fp, "# HELP printem_requests_total Client requests received, by op.\n" );
+	fprintf( fp, "# TYPE printem_requests_total counter\n" );
+	for( int op = 1; op < MET_OPS; op++ ) {
+		v = met_snap_counter( MET_REQUESTS + op );
+		if( v != 0 ) {
+			snprintf( labels, sizeof(labels), "op=\"%s\"", pp_op_name( op ) );
+			met_line( fp, "printem_requests_total", labels, v );
+		}
+	}
+
+	fprintf( fp, "# HELP printem_state_entries_total Parser state transitions, by state entered.\n" );
+	fprintf( fp, "# TYPE printem_state_entries_total counter\n" );
+	for( int st = 0; st < LAST_STATE; st++ ) {
+		snprintf( labels, sizeof(labels), "state=\"%s\"", parse_state_name( st ) );
+		met_line( fp, "printem_state_entries_total", labels, met_snap_counter( MET_STATE_ENTRIES + st ) );
+	}
+
+	fprintf( fp, "# HELP printem_state_seconds_total Time the parser spent in each state.\n" );
+	fprintf( fp, "# TYPE printem_state_seconds_total counter\n" );
+	for( int st = 0; st < LAST_STATE; st++ ) {
+		fprintf( fp, "printem_state_seconds_total{state=\"%s\"} %.6f\n", parse_state_name( st ),
+				 met_snap_counter( MET_STATE_US + st ) / 1e6 );
+	}
+
+	for( int i = 0; i < MET_NUM_VALUE_DEFS; i++ ) {
+		const met_def *d = &met_value_defs[i];
+		met_header( fp, d );
+		if( d->scale == 0 ) {
+			met_line( fp, d->name, d->labels, met_snap_values[d->id] );
+		} else if( d->labels[0] != '\0' ) {
+			fprintf( fp, "%s{%s} %.6f\n", d->name, d->labels, met_snap_values[d->id] * d->scale );
+		} else {
+			fprintf( fp, "%s %.6f\n", d->name, met_snap_values[d->id] * d->scale );
+		}
+	}
+
+	fprintf( fp, "# HELP printem_sequence_duration_seconds Report and History sequences, start to \";end\".\n" );
+	fprintf( fp, "# TYPE printem_sequence_duration_seconds histogram\n" );
+	for( int h = 0; h < MET_HISTOGRAMS; h++ )
+	{
+		count = 0;
+		sum_ms = 0;
+		for( int s = 0; s < MET_SHARDS; s++ ) {
+			sum_ms += met_snap_shards[s].sum_ms[h];
+		}
+		for( int b = 0; b <= MET_BUCKETS; b++ )
+		{
+			for( int s = 0; s < MET_SHARDS; s++ ) {
+				count += met_snap_shards[s].bucket[h][b];
+			}
+			if( b == MET_BUCKETS ) {
+				fprintf( fp, "printem_sequence_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n",
+						 met_hist_defs[h].labels, (unsigned long long)count );
+			} else if( met_hist_defs[h].le_ms[b] != 0 ) {
+				fprintf( fp, "printem_sequence_duration_seconds_bucket{%s,le=\"%g\"} %llu\n",
+						 met_hist_defs[h].labels, met_hist_defs[h].le_ms[b] / 1000.0, (unsigned long long)count );
+			}
+		}
+		fprintf( fp, "printem_sequence_duration_seconds_sum{%s} %.3f\n", met_hist_defs[h].labels, sum_ms / 1000.0 );
+		fprintf( fp, "printem_sequence_duration_seconds_count{%s} %llu\n", met_hist_defs[h].labels, (unsigned long long)count );
+	}
+}
+
+//--------------------------------------------------------------------
+//  met_write_file()
+//      Write the copy to the metrics file
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+static int met_write_file( void )
+{
+	char tmp_path[DATA_FILENAME_SIZE + 8];
+	FILE *fp;
+	int rv = 0;
+
+	snprintf( tmp_path, sizeof(tmp_path), "%s.tmp", met_path );
+	fp = fopen( tmp_path, "w" );
+	if( fp == NULL ) {
+		DIAG_ERRNO( DIAG_ERROR, tmp_path );
+		return -1;
+	}
+	met_write( fp );
+	if( ferror( fp ) ) {
+		rv = -1;
+	}
+	if( (fclose( fp ) != 0) || (rv == -1) ) {
+		remove( tmp_path );
+		return -1;
+	}
+	return rename( tmp_path, met_path );
+}
+
+//--------------------------------------------------------------------
+//  met_write_job()
+//      Archive thread: write the export, met_run() answers for it
+//--------------------------------------------------------------------
+static void met_write_job( void )
+{
+	met_export_rv = met_write_file();
+	__atomic_store_n( &met_export_at, MET_EXPORT_WRITTEN, __ATOMIC_RELEASE );
+}
+
+//--------------------------------------------------------------------
+//  met_snapshot()
+//      Copy the shards and values for met_write().  Main thread only.
+//--------------------------------------------------------------------
+static void met_snapshot( void )
+{
+	met_collect();
+	for( int s = 0; s < MET_SHARDS; s++ )
+	{
+		const uint64_t *from = (const uint64_t *)&met_shards[s];
+		uint64_t *to = (uint64_t *)&met_snap_shards[s];
+		for( size_t w = 0; w < sizeof(met_shard) / sizeof(uint64_t); w++ ) {
+			to[w] = __atomic_load_n( &from[w], __ATOMIC_RELAXED );
+		}
+	}
+	memcpy( met_snap_values, met_values, sizeof(met_values) );
+}
+
+//--------------------------------------------------------------------
+//  met_export()
+//      Take a copy and hand it to the archive thread to write.  Main
+//      thread only, with no export under way.
+//  returns:
+//       0  queued
+//      -1  archive thread gone or busy
+//--------------------------------------------------------------------
+static int met_export( void )
+{
+	met_snapshot();
+	met_last_export = time( NULL );
+
+	__atomic_store_n( &met_export_at, MET_EXPORT_QUEUED, __ATOMIC_RELAXED );
+	if( arc_submit_job( met_write_job ) == -1 ) {
+		met_export_at = MET_EXPORT_IDLE;
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  met_answer()
+//      Answer the clients waiting for an export
+//--------------------------------------------------------------------
+static void met_answer( int rv )
+{
+	pp_msg rsp;
+
+	if( req_outstanding( CLIENT_METRICS ) == 0 ) {
+		return;
+	}
+	if( rv == -1 ) {
+		pp_init( &rsp, CLIENT_METRICS, SERVER_ACTION_FAILURE );
+		pp_set_text( &rsp, "metrics not written" );
+	} else {
+		pp_init( &rsp, CLIENT_METRICS, SERVER_ACTION_SUCCESS );
+		pp_set_path( &rsp, met_path );
+	}
+	req_complete( CLIENT_METRICS, &rsp );
+}
+
+//--------------------------------------------------------------------
+//  met_request()
+//      A client asked for the metrics (CLIENT_METRICS).  It is answered
+//      with the file once an export taken after its request is written;
+//      one already under way is too old, so another follows it.
+//  returns:
+//       0  request held
+//      -1  request table full
+//--------------------------------------------------------------------
+int met_request( int client_id, unsigned int corr_id, unsigned int flags, unsigned int timeout_ms )
+{
+	if( req_add( CLIENT_METRICS, client_id, corr_id, flags, timeout_ms ) == -1 ) {
+		return -1;
+	}
+	if( __atomic_load_n( &met_export_at, __ATOMIC_ACQUIRE ) != MET_EXPORT_IDLE ) {
+		met_again = 1;
+	} else if( met_export() == -1 ) {
+		met_answer( -1 );
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  met_file()
+//      Path of the metrics file
+//--------------------------------------------------------------------
+const char *met_file( void )
+{
+	return met_path;
+}
+
+//--------------------------------------------------------------------
+//  met_run()
+//      Answer for an export the archive thread has written, and start
+//      one every config.metrics_interval seconds (0 = only when a
+//      client asks).  Called from the main loop.
+//--------------------------------------------------------------------
+void met_run( void )
+{
+	if( __atomic_load_n( &met_export_at, __ATOMIC_ACQUIRE ) == MET_EXPORT_WRITTEN )
+	{
+		met_export_at = MET_EXPORT_IDLE;
+		if( met_export_rv == -1 ) {
+			DIAG( DIAG_ERROR, "Unable to write metrics to %s", met_path );
+		}
+		if( met_again ) {
+			met_again = 0;
+			if( met_export() == -1 ) {
+				met_answer( -1 );
+			}
+		} else {
+			met_answer( met_export_rv );
+		}
+	}
+
+	if( (config.metrics_interval <= 0) || (met_export_at != MET_EXPORT_IDLE) ) {
+		return;
+	}
+	if( difftime( time( NULL ), met_last_export ) >= config.metrics_interval ) {
+		if( met_export() == -1 ) {
+			DIAG( DIAG_ERROR, "Unable to queue the metrics export" );
+		}
+	}
+}
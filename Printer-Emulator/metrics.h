@@ -0,0 +1,135 @@
+
+//--------------------------------------------------------------------
+//  metrics.h
+//--------------------------------------------------------------------
+
+// Metrics registry.
+//
+// printem counts what it does (bytes and frames off the bus, parser
+// state changes, file write errors, client requests, sequences and how
+// long they took) so its health can be watched from outside.  Every
+// thread that counts has its own shard of counters and histogram buckets
+// that only it writes, so counting is a plain add with no lock or bus
+// locked instruction; an export sums the shards.  Gauges and values
+// taken from other modules (request table, scheduler, storage) are set
+// by the main loop just before an export.
+//
+// The metrics are written in the Prometheus text format to
+// config.metrics_file, by default printem.prom in the RAM directory,
+// every config.metrics_interval seconds for the node exporter textfile
+// collector, and on demand for a client (CLIENT_METRICS).  The main
+// loop only copies the shards and values; the file is written from the
+// copy on the archive thread (archive.h), so no file I/O comes before
+// the serial read.  It is written under a temporary name and renamed
+// so a reader never sees half of it.
+
+#include <stdint.h>
+
+// Room for the per op and per state counters
+#define MET_OPS     16   // CLIENT_* ops (pe_proto.h)
+#define MET_STATES  24   // state_t (parser.h)
+
+// Shards, one per counting thread
+typedef enum
+{
+	MET_SHARD_MAIN,      // serial, parser and client requests
+	MET_SHARD_EVENTS,    // event fan-out thread (events.c)
+	MET_SHARD_ARCHIVE,   // log archive thread (archive.c)
+	MET_SHARDS
+} met_shard_id;
+
+// Counters, added to by the thread that owns the shard
+typedef enum
+{
+	MET_SERIAL_READS,
+	MET_SERIAL_BYTES,
+	MET_TX_BYTES,             // replies to the 1022
+	MET_TX_ERRORS,
+	MET_RESYNCS,              // parser fell back to SS_UNKNOWN
+	MET_WRITE_ERR_READINGS,   // file write errors, per file
+	MET_WRITE_ERR_REPORT,
+	MET_WRITE_ERR_HISTORY,
+	MET_WRITE_ERR_LOG,
+	MET_REQUESTS,             // client requests, per op (pe_proto.h)
+	MET_REQUESTS_LAST = MET_REQUESTS + MET_OPS - 1,
+	MET_REPLY_ERRORS,         // responses that could not be sent
+	MET_REQ_TIMEOUTS,
+	MET_SEQ_REPORT,           // sequences completed
+	MET_SEQ_HISTORY,
+	MET_SEQ_ABORT_REPORT,     // sequences abandoned by the watchdog
+	MET_SEQ_ABORT_HISTORY,
+	MET_EV_SENT,              // events pushed to subscribers
+	MET_EV_DROPPED,           // events subscribers did not get
+	MET_ARC_SEGMENTS,         // logmode segments compressed
+	MET_ARC_ERRORS,
+	MET_FRAMES_DROPPED,       // partial frames thrown away on a resync
+	MET_BUF_OVERFLOWS,        // frames too long for the parser buffer
+	MET_INVALID_CMDS,         // "Invalid @" from the 1022
+	MET_STATE_ENTRIES,        // parser states entered, per state
+	MET_STATE_US = MET_STATE_ENTRIES + MET_STATES,    // time in each state
+	MET_COUNTERS = MET_STATE_US + MET_STATES
+} met_counter_id;
+
+// Values set outright (gauges, and counters kept by other modules)
+typedef enum
+{
+	MET_START_TIME,
+	MET_LOGMODE,
+	MET_REQ_OUTSTANDING,
+	MET_SCHED_QUEUED,         // per scheduler priority (sched.h)
+	MET_SCHED_REJECTED = MET_SCHED_QUEUED + 3,
+	MET_SCHED_DROPPED = MET_SCHED_REJECTED + 3,
+	MET_STG_BYTES = MET_SCHED_DROPPED + 3,
+	MET_STG_WRITES,
+	MET_STG_SYNCS,
+	MET_STG_ERRORS,
+	MET_BUS_POLLS,            // bus timing, last window (busstat.h)
+	MET_BUS_POLL_MEAN_US,
+	MET_BUS_POLL_MIN_US,
+	MET_BUS_POLL_MAX_US,
+	MET_BUS_POLL_EXPECTED_US,
+	MET_BUS_JITTER_US,
+	MET_BUS_SLOTS_PPM,        // display, printer, idle
+	MET_BUS_SLOT_BYTES_MAX = MET_BUS_SLOTS_PPM + 3,
+	MET_BUS_LINE_PPM,
+	MET_BUS_GAP_MAX_US,
+	MET_BUS_ALERT,
+	MET_BUS_ALERTS,
+	MET_LINE_AVAILABLE,       // serial line (linestat.h)
+	MET_LINE_COUNTS,          // per line_count_id
+	MET_LINE_INTERVALS = MET_LINE_COUNTS + 5,    // per line_kind
+	MET_DIAG_MESSAGES = MET_LINE_INTERVALS + 4,    // diagnostics (diag.h)
+	MET_DIAG_SUPPRESSED,
+	MET_DIAG_DROPPED,
+	MET_DIAG_WRITE_ERRORS,
+	MET_VALUES
+} met_value_id;
+
+// Histograms
+typedef enum
+{
+	MET_H_SEQ_REPORT,         // sequence duration, seconds
+	MET_H_SEQ_HISTORY,
+	MET_HISTOGRAMS
+} met_hist_id;
+
+// Bucket upper bounds are per histogram, at most this many
+#define MET_BUCKETS  12
+
+typedef struct met_shard
+{
+	uint64_t counter[MET_COUNTERS];
+	uint64_t bucket[MET_HISTOGRAMS][MET_BUCKETS + 1];   // last is +Inf
+	uint64_t sum_ms[MET_HISTOGRAMS];
+} met_shard;
+
+void met_open( const char *dir );
+void met_thread( int shard );
+void met_add( int id, uint64_t n );
+void met_set( int id, uint64_t value );
+void met_observe_ms( int id, uint64_t ms );
+uint64_t met_now_ms( void );
+uint64_t met_counter( int id );
+int met_request( int client_id, unsigned int corr_id, unsigned int flags, unsigned int timeout_ms );
+const char *met_file( void );
+void met_run( void );
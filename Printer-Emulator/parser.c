@@ -11,7 +11,20 @@
 
 #include "parser.h"
 #include "utils.h"
+#include "requests.h"
+#include "sched.h"
+#include "harvest.h"
+#include "config.h"
+#include "archive.h"
+#include "../Common/log_stream.h"
 #include "../Common/message_services.h"
+#include "../Common/hist_store.h"    // hs_event_classify()
+#include "events.h"
+#include "metrics.h"
+#include "timing.h"
+#include "busstat.h"
+#include "../Common/pe_probes.h"
+#include "../Common/diag.h"
 
 //--------------------------------------------------------------------
 // State Machine Globals
@@ -25,6 +38,9 @@ unsigned int *p_control;      // dynamic
 state_t       header_state;
 unsigned char status;         // printer module status
 int           hst_is_first;   // History first request
+time_t        seq_progress;   // Report/History start or last data record
+uint64_t      seq_start_ms;   // Report/History start, met_now_ms()
+int           files_made;     // Report, History and logmode files begun
 
 // Refractometer reading snapshot control
 time_t snapshot_now, snapshot_interval;
@@ -33,8 +49,8 @@ int    is_snapshot;
 // File handles
 FILE *        f_out;  // parser output to a file
 FILE *        f_rpt;  // Report data to a file (opened on demand)
-FILE *        f_hst;  // History data to a file (opened on demand)
-FILE *        f_log;  // Log data to a file (opened on demand)
+stg_file      hst_file;  // History data to a file (opened on demand)
+ls_writer     log_stream;  // Log data record stream (opened on demand)
 FILE *        f_rdg;  // Refractometer current readings
 
 char curr_report_file[DATA_FILENAME_SIZE];
@@ -105,6 +121,36 @@ int status_is_logmode()
 	return status & ST_LOGMODE;
 }
 
+//--------------------------------------------------------------------
+// tx_send()
+//     Send the first len bytes of tx_buf to the 1022
+//--------------------------------------------------------------------
+static void tx_send( int len )
+{
+	ssize_t n = write( *p_port, tx_buf, len );
+
+	PE_PROBE3( tx, tx_buf, len, n );
+	if( n != len ) {
+		met_add( MET_TX_ERRORS, 1 );
+		return;
+	}
+	met_add( MET_TX_BYTES, len );
+	tm_reply();
+	bus_tx( len );
+}
+
+//--------------------------------------------------------------------
+// write_error()
+//     A data file write failed: counted always, shown under -d
+//--------------------------------------------------------------------
+static void write_error( int id, const char *what )
+{
+	met_add( id, 1 );
+	if( *p_options & DEBUG_DUMP ) {
+		printf("--- %s Write Error ---\n", what);
+	}
+}
+
 //--------------------------------------------------------------------
 // parse_open()
 //--------------------------------------------------------------------
@@ -126,6 +172,7 @@ void parse_open( unsigned int *options, unsigned int *control, int *port )
 	// State Macine init
 	header_state = SS_UNKNOWN;
 	buffer_len = 0;
+	files_made = 0;
 
 	char path_stg[DATA_FILENAME_SIZE];
 	path_stg[0] = '\0';
@@ -137,12 +184,20 @@ void parse_open( unsigned int *options, unsigned int *control, int *port )
 		strcat( path_stg, "/readings.txt" );
 	}
 	f_rdg = fopen( path_stg, "w");
+
+	// History store and high-water mark live on disk
+	hst_harvest_open( (*p_options & TARGET) ? TARGET_DISK_DIR : DESKTOP_DISK_DIR );
+
+	// Closed logmode segments are compressed and pruned in the background
+	if( arc_open( (*p_options & TARGET) ? TARGET_DISK_DIR : DESKTOP_DISK_DIR ) == -1 ) {
+		DIAG( DIAG_ERROR, "Unable to start the log archive thread" );
+	}
 	
 	//f_out = fopen("logfile.txt", "w");
 	f_out = NULL;
 	f_rpt = NULL;
-	f_hst = NULL;
-	f_log = NULL;
+	memset( &hst_file, 0, sizeof(hst_file) );
+	memset( &log_stream, 0, sizeof(log_stream) );
 
 	// Start the snapshot timer for refractometer readings.  This
 	// limits how often the file "readings.txt" is updated.
@@ -165,12 +220,33 @@ void parse_close()
 	if( NULL != f_rpt ) {
 		fclose( f_rpt);
 	}
-	if( NULL != f_hst ) {
-		fclose( f_hst);
-	}
-	if( NULL != f_log ) {
-		fclose( f_log);
+	stg_close( &hst_file );
+	ls_close( &log_stream );
+	arc_close();
+	hst_harvest_close();
+
+	DIAG( DIAG_DEBUG, "Storage: %llu bytes in %llu writes, %llu syncs (max %llu us, total %llu us), %llu errors",
+		(unsigned long long)stg_counters.bytes_written, (unsigned long long)stg_counters.writes,
+		(unsigned long long)stg_counters.syncs, (unsigned long long)stg_counters.sync_us_max,
+		(unsigned long long)stg_counters.sync_us_total, (unsigned long long)stg_counters.errors );
+}
+
+//--------------------------------------------------------------------
+// parse_get_sig()
+//--------------------------------------------------------------------
+void parse_get_sig( parse_sig *s )
+{
+	memset( s, 0, sizeof(*s) );
+	s->state = header_state;
+	s->status = status;
+	// Set again as each History starts, so only read within one
+	if( (header_state >= HST_START) && (header_state <= HST_DATA) ) {
+		s->hst_is_first = hst_is_first;
 	}
+	s->files_open = (f_rpt != NULL) || stg_is_open( &hst_file ) || ls_is_open( &log_stream );
+	s->files_made = files_made;
+	s->buffer_len = buffer_len;
+	memcpy( s->buffer, buffer, buffer_len );
 }
 
 //--------------------------------------------------------------------
@@ -188,7 +264,13 @@ void SS_Unknown(int i, unsigned char *data)
 			printf("--- SS Unknown ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 			
+		// What came before the display frame is lost
+		if( buffer_len > 0 ) {
+			met_add( MET_FRAMES_DROPPED, 1 );
+		}
+
 		// Now reset to receive the next
 		buffer_len = 0;
 		buffer[buffer_len++] = 0x91;
@@ -215,6 +297,7 @@ void SS_Pause(int i, unsigned char *data)
 			printf("--- SS Pause ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		// Here we check for pending Report or History requests if we are
 		// in Active mode.  If not we just respond with status.  If we're
@@ -250,16 +333,18 @@ void SS_Pause(int i, unsigned char *data)
 			switch( buffer[buffer_len - 1] )
 			{
 			case 0x52:    // @R for Report
-				*p_control |= REPORT_REQ;
+				sched_add( SCHED_REPORT, SCHED_PRIO_UNIT, 0, 0 );
+				rpt_cache_pending();
 				break;
 			case 0x48:    // @H for History
-				*p_control |= HISTORY_REQ;
+				sched_add( SCHED_HISTORY, SCHED_PRIO_UNIT, 0, 0 );
 				break;
 			case 0x4c:    // @l for Log Mode ON
-				*p_control |= LOGMODE_ON_REQ;
+				sched_add( SCHED_LOG_ON, SCHED_PRIO_UNIT, 0, 0 );
 				break;
 			default:
-				printf("--- SS Pause Error Invalid @%c ---\n", buffer[buffer_len - 1]);
+				DIAG( DIAG_WARN, "--- SS Pause Error Invalid @%c ---", buffer[buffer_len - 1] );
+				met_add( MET_INVALID_CMDS, 1 );
 				break;
 			}
 		}
@@ -269,6 +354,7 @@ void SS_Pause(int i, unsigned char *data)
 			buffer[buffer_len++] = data[i];
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 		
 		// Take action and reset buffer.  Remain in SS_PAUSE
 		buffer_len = 0;
@@ -294,16 +380,16 @@ void SS_Pause(int i, unsigned char *data)
 //--------------------------------------------------------------------
 void SS_Pause_Active(int i, unsigned char *data)
 {
-	server_rsp s_msg;
-	
-	if( *p_control & REPORT_REQ )
+	pp_msg rsp;
+	int op;
+
+	// Start the operation the scheduler picks, if any
+	op = sched_next( SCHED_REPORT | SCHED_HISTORY | SCHED_LOG_ON );
+	if( op == SCHED_REPORT )
 	{
-		// Clear the condition then act on it
-		*p_control &= ~REPORT_REQ;
-		
 		tx_buf[0] = status_get();
 		tx_buf[1] = 0x52;  tx_buf[2] = 0x0D;
-		write( *p_port, tx_buf, 3 );
+		tx_send( 3 );
 
 		// Format the buffer accordingly
 		buffer_len = 0;
@@ -317,14 +403,12 @@ void SS_Pause_Active(int i, unsigned char *data)
 			printf("--- To RPT Start ---\n");
 		}
 	}
-	else if( *p_control & HISTORY_REQ )
+	else if( op == SCHED_HISTORY )
 	{
-		// Clear the condition then act on it
-		*p_control &= ~HISTORY_REQ;
-
 		tx_buf[0] = status_get();
 		tx_buf[1] = 0x49;  tx_buf[2] = 0x0D;
-		write( *p_port, tx_buf, 3 );
+		tx_send( 3 );
+		req_activate( CLIENT_REQ_HISTORY );
 		
 		// Format the buffer accordingly
 		buffer_len = 0;
@@ -338,30 +422,20 @@ void SS_Pause_Active(int i, unsigned char *data)
 			printf("--- To HST Start ---\n");
 		}
 	}
-	else if( *p_control & LOGMODE_ON_REQ )
+	else if( op == SCHED_LOG_ON )
 	{
-		// Clear the condition then act on it
-		*p_control &= ~LOGMODE_ON_REQ;
-
 		// Enable logmode status bit
 		status_set_logmode();
 
-		if( *p_control & MESSAGE_SRC ) {
-			*p_control &= ~MESSAGE_SRC;
-
-			// Notify the controlling client of success
-			memset( &s_msg, 0, sizeof(s_msg) );
-			s_msg.mtype = SERVER_ACTION_SUCCESS;
-			sprintf(s_msg.rsp, "logmode 1" );
-			if( msg_send_to_client(&s_msg) == -1 ) {
-				perror("msgsnd");
-			}
-		}
+		// Notify the requesting clients of success
+		pp_init( &rsp, CLIENT_REQ_LOG, SERVER_ACTION_SUCCESS );
+		pp_set_logmode( &rsp, 1 );
+		req_complete( CLIENT_REQ_LOG, &rsp );
 
 		tx_buf[0] = status_get();    // 0x54 printer status
 		tx_buf[1] = 0x54;            // 'T' starts log mode
 		tx_buf[2] = 0x0D;           // CR
-		write( *p_port, tx_buf, 3 );
+		tx_send( 3 );
 		
 		// Format the buffer accordingly
 		buffer_len = 0;
@@ -380,7 +454,7 @@ void SS_Pause_Active(int i, unsigned char *data)
 		// Steady State printer Module Queary Response
 		// Send "printer ready" to 1022
 		tx_buf[0] = status_get();
-		write( *p_port, tx_buf, 1 );
+		tx_send( 1 );
 		
 		// Now reset to receive the next
 		buffer_len = 0;
@@ -412,6 +486,10 @@ void SS_Display(int i, unsigned char *data)
 			printf("--- SS Display ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
+
+		// Subscribers get every frame, not just the snapshots
+		ev_publish( PP_EV_READINGS, buffer, buffer_len );
 
 		if( is_snapshot )
 		{
@@ -420,8 +498,8 @@ void SS_Display(int i, unsigned char *data)
 			//DumpHexStdout( (const void*)buffer, buffer_len );
 			rewind(f_rdg);
 			cnt = fwrite( (void *)buffer, 1, buffer_len, f_rdg );
-			if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-				printf("--- SS Display Data Write Error ---\n");
+			if( cnt != buffer_len ) {
+				write_error( MET_WRITE_ERR_READINGS, "SS Display Data" );
 			}
 		}
 
@@ -451,6 +529,7 @@ void SS_Printer(int i, unsigned char *data)
 			printf("--- SS Printer ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		// Possibly go to SS_REPORT mode if that's in progrss?
 						
@@ -517,6 +596,8 @@ void RPT_Start(int i, unsigned char *data)
 			printf("--- Rpt Start ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
+		++files_made;
 #if 1
 		// Open the Report file for writing
 		char base_stg[DATA_FILENAME_SIZE];
@@ -543,12 +624,13 @@ void RPT_Start(int i, unsigned char *data)
 			if( !rv ) {	
 				f_rpt = fopen(curr_report_file, "w");
 			} else {
-				if( *p_options & DEBUG_DUMP ) {
-					printf("unique_filename call (report) FAILED \n");
-				}
+				DIAG( DIAG_ERROR, "unique_filename call (report) FAILED" );
 			}
 		}
 #endif
+		// Requests arriving from now on join this sequence
+		rpt_cache_begin();
+
 		// Now reset to receive the next
 		buffer_len = 0;
 		buffer[buffer_len++] = data[i];
@@ -570,7 +652,6 @@ void RPT_Start(int i, unsigned char *data)
 void RPT_Data(int i, unsigned char *data)
 {
 	size_t cnt;
-	server_rsp s_msg;
 
 	// Rpt Data keeps going until a 0x91 (VFD record) is encountered
 	if( data[i] == 0x91 )
@@ -587,6 +668,7 @@ void RPT_Data(int i, unsigned char *data)
 				printf("--- Rpt Data Last ---\n");
 				DumpHexStdout( (const void*)buffer, buffer_len );
 			}
+			PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 			// Write this record then close the report file
 			if( NULL != f_rpt ) {
@@ -601,24 +683,18 @@ void RPT_Data(int i, unsigned char *data)
 #endif
 				// Write this record to the file
 				cnt = fwrite( (void *)buffer, 1, buffer_len, f_rpt );
-				if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-					printf("--- Rpt Data Write Error ---\n");
+				if( cnt != buffer_len ) {
+					write_error( MET_WRITE_ERR_REPORT, "Rpt Data" );
 				}
 				fclose( f_rpt );
 				f_rpt = NULL;
 			}
 
-			if( *p_control & MESSAGE_SRC ) {
-				*p_control &= ~MESSAGE_SRC;
-
-				// Notify the controlling client of success
-				memset( &s_msg, 0, sizeof(s_msg) );
-				s_msg.mtype = SERVER_ACTION_SUCCESS;
-				sprintf(s_msg.rsp, "report %s", curr_report_file );
-				if( msg_send_to_client(&s_msg) == -1 ) {
-					perror("msgsnd");
-				}
-			}
+			// Notify every client waiting on this report and cache it
+			tm_end( TM_REPORT, "ok" );
+			rpt_cache_complete( curr_report_file );
+			met_add( MET_SEQ_REPORT, 1 );
+			met_observe_ms( MET_H_SEQ_REPORT, met_now_ms() - seq_start_ms );
 
 			if( status_is_logmode() )
 			{
@@ -646,6 +722,7 @@ void RPT_Data(int i, unsigned char *data)
 				printf("--- Rpt Data ---\n");
 				DumpHexStdout( (const void*)buffer, buffer_len );
 			}
+			PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 			if( NULL != f_rpt ) {
 #if 0
@@ -659,8 +736,8 @@ void RPT_Data(int i, unsigned char *data)
 #endif
 				// Write this record to the file
 				cnt = fwrite( (void *)buffer, 1, buffer_len, f_rpt );
-				if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-					printf("--- Rpt Data Write Error ---\n");
+				if( cnt != buffer_len ) {
+					write_error( MET_WRITE_ERR_REPORT, "Rpt Data" );
 				}
 			}
 			
@@ -694,6 +771,7 @@ void RPT_Display(int i, unsigned char *data)
 			printf("--- Rpt Display ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		if( is_snapshot )
 		{
@@ -702,8 +780,8 @@ void RPT_Display(int i, unsigned char *data)
 			//DumpHexStdout( (const void*)buffer, buffer_len );
 			rewind(f_rdg);
 			cnt = fwrite( (void *)buffer, 1, buffer_len, f_rdg );
-			if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-				printf("--- RPT Display Data Write Error ---\n");
+			if( cnt != buffer_len ) {
+				write_error( MET_WRITE_ERR_READINGS, "RPT Display Data" );
 			}	
 		}
 
@@ -711,7 +789,7 @@ void RPT_Display(int i, unsigned char *data)
 		{
 			// Active mode response: Send "printer ready" to 1022
 			tx_buf[0] = status_get();
-			write( *p_port, tx_buf, 1 );
+			tx_send( 1 );
 
 			// Format the buffer accordingly
 			buffer_len = 0;
@@ -754,6 +832,7 @@ void RPT_Printer(int i, unsigned char *data)
 			printf("--- Rpt Printer ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 						
 		// Now reset to receive the next
 		buffer_len = 0;
@@ -781,6 +860,8 @@ void HST_Start(int i, unsigned char *data)
 			printf("--- Hst Start ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
+		++files_made;
 #if 1
 		// Open the History file for writing
 		char base_stg[DATA_FILENAME_SIZE];
@@ -790,8 +871,7 @@ void HST_Start(int i, unsigned char *data)
 			// Target location for History file
 			strcat( base_stg, TARGET_RAM_DIR );
 			strcat( base_stg, "/history.txt" );
-			f_hst = fopen( base_stg, "w");
-			rewind( f_hst );
+			stg_open( &hst_file, base_stg );
 			// Save path and filename to send to client
 			curr_history_file[0] = '\0';
 			strcpy( curr_history_file, base_stg );
@@ -805,16 +885,15 @@ void HST_Start(int i, unsigned char *data)
 			strcat( base_stg, "/history-" );
 			rv = unique_filename( base_stg, curr_history_file, DATA_FILENAME_SIZE );
 			if( !rv ) {	
-				f_hst = fopen(curr_history_file, "w");
+				stg_open( &hst_file, curr_history_file );
 			} else {
-				if( *p_options & DEBUG_DUMP ) {
-					printf("unique_filename call (history) FAILED \n");
-				}
+				DIAG( DIAG_ERROR, "unique_filename call (history) FAILED" );
 			}
 		}
 #endif
 		// First history request
 		hst_is_first = 1;
+		hst_harvest_begin();
 		
 		// Now reset to receive the next
 		buffer_len = 0;
@@ -844,6 +923,7 @@ void HST_Display(int i, unsigned char *data)
 			printf("--- Hst Display ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		if( is_snapshot )
 		{
@@ -852,8 +932,8 @@ void HST_Display(int i, unsigned char *data)
 			//DumpHexStdout( (const void*)buffer, buffer_len );
 			rewind(f_rdg);
 			cnt = fwrite( (void *)buffer, 1, buffer_len, f_rdg );
-			if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-				printf("--- HST Display Data Write Error ---\n");
+			if( cnt != buffer_len ) {
+				write_error( MET_WRITE_ERR_READINGS, "HST Display Data" );
 			}
 		}
 
@@ -865,7 +945,7 @@ void HST_Display(int i, unsigned char *data)
 				// First Hst data request is 'T'
 				tx_buf[0] = status_get();
 				tx_buf[1] = 0x54;  tx_buf[2] = 0x0D;
-				write( *p_port, tx_buf, 3 );
+				tx_send( 3 );
 				
 				// Format the buffer accordingly
 				buffer_len = 0;
@@ -885,7 +965,7 @@ void HST_Display(int i, unsigned char *data)
 				// All subsequent Hst data requsts are 'H'
 				tx_buf[0] = status_get();
 				tx_buf[1] = 0x48;  tx_buf[2] = 0x0D;
-				write( *p_port, tx_buf, 3 );
+				tx_send( 3 );
 				
 				// Format the buffer accordingly
 				buffer_len = 0;
@@ -931,6 +1011,7 @@ void HST_Printer(int i, unsigned char *data)
 			printf("--- Hst Printer ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 		
 		// Check for 'H' type Printer record which means data follows
 		// look at hist-parse-before-hst-changes.txt
@@ -992,6 +1073,7 @@ void HST_Printer_Active(int i, unsigned char *data)
 			printf("--- Hst Printer ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		// Now reset to move on to Hst Data
 		buffer_len = 0;
@@ -1013,8 +1095,8 @@ void HST_Printer_Active(int i, unsigned char *data)
 //--------------------------------------------------------------------
 void HST_Data(int i, unsigned char *data)
 {
-	size_t cnt;
-	server_rsp s_msg;
+	int hst_new;
+	pp_msg rsp;
 
 #if 0
 	if( (data[i] == 0x90) && (buffer[buffer_len - 1] == 0x98) )
@@ -1023,12 +1105,12 @@ void HST_Data(int i, unsigned char *data)
 			printf("--- Hst Data ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 		
-		if( NULL != f_hst ) {
+		if( stg_is_open( &hst_file ) ) {
 			// Write this record to the file
-			cnt = fwrite( (void *)buffer, 1, buffer_len, f_hst );
-			if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-				printf("--- Hst Data Write Error ---\n");
+			if( stg_write( &hst_file, buffer, buffer_len ) == -1 ) {
+				write_error( MET_WRITE_ERR_HISTORY, "Hst Data" );
 			}
 		}
 
@@ -1038,7 +1120,7 @@ void HST_Data(int i, unsigned char *data)
 			// next via H record and induce printer to return here
 			tx_buf[0] = status_get();
 			tx_buf[1] = 0x48;  tx_buf[2] = 0x0D;
-			write( *p_port, tx_buf, 3 );
+			tx_send( 3 );
 			
 			// Format the buffer accordingly
 			buffer_len = 0;
@@ -1075,14 +1157,15 @@ void HST_Data(int i, unsigned char *data)
 			printf("--- Hst Data ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
-		if( NULL != f_hst ) {
+		if( stg_is_open( &hst_file ) ) {
 			// Write this record to the file
-			cnt = fwrite( (void *)buffer, 1, buffer_len, f_hst );
-			if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-				printf("--- Hst Data Write Error ---\n");
+			if( stg_write( &hst_file, buffer, buffer_len ) == -1 ) {
+				write_error( MET_WRITE_ERR_HISTORY, "Hst Data" );
 			}
 		}
+		hst_harvest_record( buffer, buffer_len );
 
 		// If we have received ";end" then we return to SS operation
 		if(	   (buffer[buffer_len - 5] == 0x3B)
@@ -1092,20 +1175,25 @@ void HST_Data(int i, unsigned char *data)
 			&& (buffer[buffer_len - 1] == 0x0D) )
 		{
 			// We've written the record now close the file
-			fclose( f_hst );
-			f_hst = NULL;
-
-			if( *p_control & MESSAGE_SRC ) {
-				*p_control &= ~MESSAGE_SRC;
-
-				// Notify the controlling client of success
-				memset( &s_msg, 0, sizeof(s_msg) );
-				s_msg.mtype = SERVER_ACTION_SUCCESS;
-				sprintf(s_msg.rsp, "history %s", curr_history_file );
-				if( msg_send_to_client(&s_msg) == -1 ) {
-					perror("msgsnd");
-				}
+			stg_close( &hst_file );
+
+			// Append whatever is new since the last harvest to the store
+			hst_new = hst_harvest_complete();
+			if( hst_new >= 0 ) {
+				DIAG( DIAG_INFO, "History harvest: %d new records", hst_new );
+			}
+
+			// Notify the requesting clients of success
+			pp_init( &rsp, CLIENT_REQ_HISTORY, SERVER_ACTION_SUCCESS );
+			pp_set_path( &rsp, curr_history_file );
+			if( hst_new >= 0 ) {
+				pp_add_counter( &rsp, PP_C_NEW_RECORDS, hst_new );
 			}
+			tm_end( TM_HISTORY, "ok" );
+			tm_summary( TM_HISTORY, &rsp );
+			req_complete( CLIENT_REQ_HISTORY, &rsp );
+			met_add( MET_SEQ_HISTORY, 1 );
+			met_observe_ms( MET_H_SEQ_HISTORY, met_now_ms() - seq_start_ms );
 			
 			if( status_is_logmode() )
 			{
@@ -1158,6 +1246,8 @@ void LOG_Start(int i, unsigned char *data)
 			printf("--- Log Start ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
+		++files_made;
 #if 1
 		// Log file location depends on TARGET or not
 		int rv;
@@ -1173,11 +1263,13 @@ void LOG_Start(int i, unsigned char *data)
 		strcat( base_stg, "/logmode-" );
 		rv = unique_filename( base_stg, curr_log_file, DATA_FILENAME_SIZE );
 		if( !rv ) {	
-			f_log = fopen(curr_log_file, "w");
-		} else {
-			if( *p_options & DEBUG_DUMP ) {
-				printf("unique_filename call (logmode) FAILED \n");
+			if( ls_open( &log_stream, curr_log_file,
+						 config.log_index_records, config.log_index_seconds ) == 0 ) {
+				ls_set_rotation( &log_stream, (uint64_t)config.log_rotate_kb * 1024,
+								 config.log_rotate_seconds, arc_submit );
 			}
+		} else {
+			DIAG( DIAG_ERROR, "unique_filename call (logmode) FAILED" );
 		}
 #endif
 		// Set Log mode bit in status so that Report or History sequences
@@ -1199,12 +1291,28 @@ void LOG_Start(int i, unsigned char *data)
 	}
 }
 
+//--------------------------------------------------------------------
+// ev_log_record()
+//     Publish a logmode record (without its leading 0x98)
+//--------------------------------------------------------------------
+static void ev_log_record( const unsigned char *rec, int len )
+{
+	char text[PP_DATA_SIZE + 1];
+
+	ev_publish( PP_EV_LOG, rec, len );
+
+	snprintf( text, sizeof(text), "%.*s", len, (const char *)rec );
+	if( hs_event_classify( text ) == HS_EVT_DIVERT ) {
+		ev_publish( PP_EV_DIVERT, rec, len );
+	}
+}
+
 //--------------------------------------------------------------------
 // LOG_Data
 //--------------------------------------------------------------------
 void LOG_Data(int i, unsigned char *data)
 {
-	size_t cnt;
+	int rv;
 	int temp_buffer_len;
 	unsigned char *temp_buffer;
 		
@@ -1214,6 +1322,7 @@ void LOG_Data(int i, unsigned char *data)
 			printf("--- Log Data ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 		
 		// If we're in active mode look for '@' signaling from the 1022.
 		// Note that buffer[0] == 0x98
@@ -1223,36 +1332,45 @@ void LOG_Data(int i, unsigned char *data)
 			{
 			case 0x4c:
 				// 1022 sent "@L" to request the end of Log mode
-				*p_control |= LOGMODE_OFF_REQ;
+				sched_add( SCHED_LOG_OFF, SCHED_PRIO_UNIT, 0, 0 );
 				break;
 			case 0x52:
 				// 1022 sent "@R" to initiate a Report while in Log mode
-				*p_control |= REPORT_REQ;
+				sched_add( SCHED_REPORT, SCHED_PRIO_UNIT, 0, 0 );
+				rpt_cache_pending();
 				break;
 			case 0x48:
 				// 1022 sent "@H" to initiate a History sequence while in log mode
-				*p_control |= HISTORY_REQ;
+				sched_add( SCHED_HISTORY, SCHED_PRIO_UNIT, 0, 0 );
 				break;
 			default:
-				printf("--- Log Data Error: Invalid @%c ---\n", buffer[2]);
+				DIAG( DIAG_WARN, "--- Log Data Error: Invalid @%c ---", buffer[2] );
+				met_add( MET_INVALID_CMDS, 1 );
 				break;
 			}
 		}
 
+		// suppress the leading 0x98
+		temp_buffer = buffer;
+		temp_buffer_len = buffer_len;
+		if( buffer[0] == 0x98 ) {
+			temp_buffer += 1;
+			temp_buffer_len -= 1;
+		}
+
+		// Live record for subscribers, divert alarms as their own class.
+		// Neither ";wait" nor the '@' signals are records.
+		if( (temp_buffer_len > 0) && (buffer[1] != 0x3B) && (buffer[1] != 0x40) ) {
+			ev_log_record( temp_buffer, temp_buffer_len );
+		}
+
 		// This is a regular Log data record
 		// Write it to logfile if it is not a ";wait" string
-		if( (NULL != f_log) && (buffer[1] != 0x3B) ) {
-			// suppress the leading 0x98
-			temp_buffer = buffer;
-			temp_buffer_len = buffer_len;
-			if( buffer[0] == 0x98 ) {
-				temp_buffer += 1;
-				temp_buffer_len -= 1;
-			}
-			// Write this record to the file
-			cnt = fwrite( (void *)temp_buffer, 1, temp_buffer_len, f_log );
-			if( (*p_options & DEBUG_DUMP) && (cnt != temp_buffer_len) ) {
-				printf("--- Log Data Write Error ---\n");
+		if( ls_is_open( &log_stream ) && (buffer[1] != 0x3B) ) {
+			// Write this record to the stream stamped with its arrival time
+			rv = ls_write( &log_stream, temp_buffer, temp_buffer_len, ls_now_us() );
+			if( rv == -1 ) {
+				write_error( MET_WRITE_ERR_LOG, "Log Data" );
 			}
 		}
 		
@@ -1277,7 +1395,8 @@ void LOG_Data(int i, unsigned char *data)
 void LOG_Display(int i, unsigned char *data)
 {
 	size_t cnt;
-	server_rsp s_msg;
+	pp_msg rsp;
+	int op;
 	
 	// Display keeps going until a printer status request is received
 	if( (buffer[buffer_len - 1] == 0x98) && (data[i] == 0x90) )
@@ -1286,6 +1405,9 @@ void LOG_Display(int i, unsigned char *data)
 			printf("--- Log Display ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
+
+		ev_publish( PP_EV_READINGS, buffer, buffer_len );
 
 		if( is_snapshot )
 		{
@@ -1294,40 +1416,33 @@ void LOG_Display(int i, unsigned char *data)
 			//DumpHexStdout( (const void*)buffer, buffer_len );
 			rewind(f_rdg);
 			cnt = fwrite( (void *)buffer, 1, buffer_len, f_rdg );
-			if( (*p_options & DEBUG_DUMP) && (cnt != buffer_len) ) {
-				printf("--- LOG Display Data Write Error ---\n");
+			if( cnt != buffer_len ) {
+				write_error( MET_WRITE_ERR_READINGS, "LOG Display Data" );
 			}
 		}
 
 		if( *p_options & ACTIVE_MODE )
 		{
-			if( *p_control & LOGMODE_OFF_REQ )
+			// Start the operation the scheduler picks, if any
+			op = sched_next( SCHED_LOG_OFF | SCHED_REPORT | SCHED_HISTORY );
+			if( op == SCHED_LOG_OFF )
 			{
-				*p_control &= ~LOGMODE_OFF_REQ;
-				
 				// We are exititing log mode
 				status_clr_logmode();
 
-				if( *p_control & MESSAGE_SRC ) {
-					*p_control &= ~MESSAGE_SRC;
-					
-					// Notify the controlling client of success
-					memset( &s_msg, 0, sizeof(s_msg) );
-					s_msg.mtype = SERVER_ACTION_SUCCESS;
-					sprintf(s_msg.rsp, "logmode 0 %s", curr_log_file );
-					if( msg_send_to_client(&s_msg) == -1 ) {
-						perror("msgsnd");
-					}
-				}
+				// Notify the requesting clients of success
+				pp_init( &rsp, CLIENT_REQ_LOG, SERVER_ACTION_SUCCESS );
+				pp_set_logmode( &rsp, 0 );
+				pp_set_path( &rsp, curr_log_file );
+				tm_end( TM_LOGMODE, "ok" );
+				tm_summary( TM_LOGMODE, &rsp );
+				req_complete( CLIENT_REQ_LOG, &rsp );
 				
 				tx_buf[0] = status_get();    // Send regular status (now 0x44 again)
-				write( *p_port, tx_buf, 1 );
+				tx_send( 1 );
 
 				// Close the logmode file
-				if( f_log != NULL ) {
-					fclose( f_log );
-					f_log = NULL;
-				}
+				ls_close( &log_stream );
 
 				// Return to Steady State
 				buffer_len = 0;
@@ -1339,13 +1454,11 @@ void LOG_Display(int i, unsigned char *data)
 					printf("--- To SS Printer ---\n");
 				}
 			}
-			else if( *p_control & REPORT_REQ )
+			else if( op == SCHED_REPORT )
 			{
-				*p_control &= ~REPORT_REQ;
-				
 				tx_buf[0] = status_get();
 				tx_buf[1] = 0x52;  tx_buf[2] = 0x0D;
-				write( *p_port, tx_buf, 3 );
+				tx_send( 3 );
 
 				// Format the buffer accordingly
 				buffer_len = 0;
@@ -1360,13 +1473,11 @@ void LOG_Display(int i, unsigned char *data)
 					printf("--- To RPT Start ---\n");
 				}
 			}
-			else if( *p_control & HISTORY_REQ )
+			else if( op == SCHED_HISTORY )
 			{
-				*p_control &= ~HISTORY_REQ;
-
 				tx_buf[0] = status_get();
 				tx_buf[1] = 0x49;  tx_buf[2] = 0x0D;
-				write( *p_port, tx_buf, 3 );
+				tx_send( 3 );
 				
 				// Format the buffer accordingly
 				buffer_len = 0;
@@ -1387,7 +1498,7 @@ void LOG_Display(int i, unsigned char *data)
 				tx_buf[0] = status_get();
 				tx_buf[1] = 0x4C;             // 'L' request next record
 				tx_buf[2] = 0x0D;            // CR
-				write( *p_port, tx_buf, 3 );
+				tx_send( 3 );
 
 				// Format the buffer accordingly
 				buffer_len = 0;
@@ -1423,6 +1534,7 @@ void LOG_Display(int i, unsigned char *data)
 			printf("--- Log Display ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 		buffer_len = 0;
 		buffer[buffer_len++] = 0x98;
 		buffer[buffer_len++] = data[i];
@@ -1439,6 +1551,7 @@ void LOG_Display(int i, unsigned char *data)
 			printf("--- Log Display ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		// Prepare for log data
 		buffer_len = 0;
@@ -1471,6 +1584,7 @@ void LOG_Printer(int i, unsigned char *data)
 			printf("--- Log Printer ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		// Test if Logmode bit in printer status is de-asserted (1 to 0).  
 		// For Passive parsing this means return to steady state (ss).
@@ -1478,13 +1592,11 @@ void LOG_Printer(int i, unsigned char *data)
 		if( !(buffer[2] & ST_LOGMODE) )
 		{
 			// Close the logmode file
-			if( f_log != NULL ) {
-				fclose( f_log );
-				f_log = NULL;
-			}
+			ls_close( &log_stream );
 
 			// Clear the Log mode status bit in the printer status byte
 			status_clr_logmode();
+			tm_end( TM_LOGMODE, "ok" );
 			
 			// Prepare to return to Steady State
 			buffer_len = 0;
@@ -1518,6 +1630,7 @@ void LOG_Printer(int i, unsigned char *data)
 				printf("--- Log Printer ---\n");
 				DumpHexStdout( (const void*)buffer, buffer_len );
 			}
+			PE_PROBE3( frame, header_state, buffer, buffer_len );
 			// Now reset to prepare for data record
 			buffer_len = 0;
 			header_state = LOG_DATA;
@@ -1566,6 +1679,7 @@ void LOG_Printer_Active(int i, unsigned char *data)
 			printf("--- Log Printer ---\n");
 			DumpHexStdout( (const void*)buffer, buffer_len );
 		}
+		PE_PROBE3( frame, header_state, buffer, buffer_len );
 
 		// I don't think we need to test here for log bit dropping in printer
 		// status since this is always in response to a 54 4C 0D status L
@@ -1587,6 +1701,37 @@ void LOG_Printer_Active(int i, unsigned char *data)
 }
 
 
+//--------------------------------------------------------------------
+// parse_state_name()
+//     Header state as a metrics label
+//--------------------------------------------------------------------
+const char *parse_state_name( int st )
+{
+	static const char *names[LAST_STATE] = {
+		"ss_unknown", "ss_pause", "ss_display", "ss_printer",
+		"rpt_start", "rpt_data", "rpt_display", "rpt_printer",
+		"hst_start", "hst_display", "hst_printer", "hst_printer_active", "hst_data",
+		"log_start", "log_data", "log_display", "log_printer", "log_printer_active",
+	};
+
+	if( (st < 0) || (st >= LAST_STATE) ) {
+		return "unknown";
+	}
+	return names[st];
+}
+
+//--------------------------------------------------------------------
+// ev_sequence_name()
+//     Bus sequence a header state belongs to, for PP_EV_STATE
+//--------------------------------------------------------------------
+static const char *ev_sequence_name( state_t st )
+{
+	if( st < RPT_START )  return "steady";
+	if( st < HST_START )  return "report";
+	if( st < LOG_START )  return "history";
+	return "logmode";
+}
+
 //--------------------------------------------------------------------
 // Parse Header
 //--------------------------------------------------------------------
@@ -1594,6 +1739,10 @@ void parse_header(int len, unsigned char *data)
 {
 	double time_diff;
 
+	// The frames in this read are timed from now
+	tm_rx();
+	bus_rx( len, data );
+
 	// Flag for taking a snapshot of refractometer A and B readings
 	snapshot_now = time( NULL );
 	time_diff = difftime( snapshot_now, snapshot_interval );
@@ -1605,6 +1754,16 @@ void parse_header(int len, unsigned char *data)
 
 	for( int i = 0; i < len; i++ )
 	{
+		state_t before = header_state;
+
+		// Noise that eats a frame's terminator leaves the frame running
+		// on.  Before it runs off the buffer keep its first bytes, which
+		// the handlers look at, and drop the rest.
+		if( buffer_len >= (int)sizeof(buffer) - 2 ) {
+			met_add( MET_BUF_OVERFLOWS, 1 );
+			buffer_len = 8;
+		}
+
 		switch( header_state )
 		{
 		case SS_UNKNOWN:
@@ -1666,5 +1825,108 @@ void parse_header(int len, unsigned char *data)
 		case LAST_STATE:
 			break;
 		}
+
+		if( header_state != before ) {
+			PE_PROBE2( state, before, header_state );
+			tm_state( before, header_state );
+			met_add( MET_STATE_ENTRIES + header_state, 1 );
+			if( header_state == SS_UNKNOWN ) {
+				met_add( MET_RESYNCS, 1 );
+			}
+			if( (header_state == RPT_START) || (header_state == HST_START) ) {
+				seq_start_ms = met_now_ms();
+			}
+		}
+
+		// A data record ended, or a Report or History began: the
+		// sequence is alive (see parse_watchdog())
+		if(    (header_state != before)
+			&& (   (before == RPT_DATA) || (before == HST_DATA)
+				|| (header_state == RPT_START) || (header_state == HST_START)) ) {
+			seq_progress = snapshot_now;
+		}
+
+		if( ev_sequence_name( header_state ) != ev_sequence_name( before ) ) {
+			const char *name = ev_sequence_name( header_state );
+			ev_publish( PP_EV_STATE, (const unsigned char *)name, strlen( name ) );
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+// parse_bus_op()
+//     The Report or History sequence on the bus, for admission to the
+//     scheduler (sched_add())
+//  returns:
+//     SCHED_REPORT or SCHED_HISTORY
+//     0  none
+//--------------------------------------------------------------------
+int parse_bus_op( void )
+{
+	if( (header_state >= RPT_START) && (header_state < HST_START) ) {
+		return SCHED_REPORT;
+	}
+	if( (header_state >= HST_START) && (header_state < LOG_START) ) {
+		return SCHED_HISTORY;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+// parse_watchdog()
+//     Abort a Report or History sequence that has gone
+//     config.sequence_timeout seconds without a data record, as when
+//     the 1022 never sends ";end" or the bus goes quiet.  The file is
+//     closed, its waiting clients get SERVER_TIMEOUT, and the parser
+//     resynchronizes on the next display frame.  Called from the main
+//     loop, which wakes at least once a second.
+//--------------------------------------------------------------------
+void parse_watchdog( void )
+{
+	pp_msg rsp;
+	double age;
+
+	if( (header_state < RPT_START) || (header_state >= LOG_START) || (config.sequence_timeout <= 0) ) {
+		return;
+	}
+	age = difftime( time( NULL ), seq_progress );
+	if( age < 0 ) {
+		seq_progress = time( NULL );    // clock stepped back
+		return;
 	}
+	if( age < config.sequence_timeout ) {
+		return;
+	}
+
+	DIAG( DIAG_WARN, "%s sequence stalled for %.0f s, resynchronizing", ev_sequence_name( header_state ), age );
+	if( header_state < HST_START )
+	{
+		if( NULL != f_rpt ) {
+			fclose( f_rpt );
+			f_rpt = NULL;
+		}
+		tm_end( TM_REPORT, "aborted" );
+		rpt_cache_abort( "bus stalled" );
+		met_add( MET_SEQ_ABORT_REPORT, 1 );
+	}
+	else
+	{
+		stg_close( &hst_file );
+		tm_end( TM_HISTORY, "aborted" );
+		pp_init( &rsp, CLIENT_REQ_HISTORY, SERVER_TIMEOUT );
+		pp_set_text( &rsp, "bus stalled" );
+		req_complete( CLIENT_REQ_HISTORY, &rsp );
+		met_add( MET_SEQ_ABORT_HISTORY, 1 );
+	}
+	// Leave the stalled state as parse_header() would; the stall is
+	// timed to it up to now, not to the next serial read
+	tm_rx();
+	PE_PROBE2( state, header_state, SS_UNKNOWN );
+	tm_state( header_state, SS_UNKNOWN );
+	met_add( MET_STATE_ENTRIES + SS_UNKNOWN, 1 );
+	met_add( MET_RESYNCS, 1 );
+
+	buffer_len = 0;
+	header_state = SS_UNKNOWN;
+	ev_publish( PP_EV_STATE, (const unsigned char *)"steady", 6 );
 }
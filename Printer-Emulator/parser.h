@@ -7,6 +7,9 @@ void parse_open(unsigned int *options, unsigned int *control, int *port);
 int status_is_logmode();
 void parse_close();
 void parse_header(int len, unsigned char *data);
+void parse_watchdog( void );
+int parse_bus_op( void );
+const char *parse_state_name( int st );
 
 void SS_Pause_Active(int i, unsigned char *data);
 
@@ -39,6 +42,22 @@ typedef enum {
 	LAST_STATE
 } state_t;
 
+// Parser state that decides how the bytes that follow are parsed.  Two
+// parsers with equal signatures parse the rest of a stream alike, which
+// is what pedecode checks where it has split a capture between parsers.
+typedef struct parse_sig
+{
+	int           state;          // state_t
+	unsigned char status;
+	int           hst_is_first;
+	int           files_open;     // report, history or logmode file open
+	int           files_made;     // ... begun since parse_open(), not compared
+	int           buffer_len;
+	unsigned char buffer[256];
+} parse_sig;
+
+void parse_get_sig( parse_sig *s );
+
 // --- Status Bits ---
 // "not used" bits are commented out in COMBO.C (1022 code)
 typedef enum
@@ -54,7 +73,7 @@ typedef enum
 } STATUS_BIT;
 
 // File Size for Report, History, and log file names
-// Bear in mind that this has to fit within MSG_MAX_PAYLOAD (message_services.h)
+// Bear in mind that this has to fit within PP_PATH_SIZE (pe_proto.h)
 // when a data sequence is complete
 #define DATA_FILENAME_SIZE 128
 
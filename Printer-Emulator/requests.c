@@ -0,0 +1,439 @@
+
+//--------------------------------------------------------------------
+//  requests.c
+//      Client request table, report result cache with request coalescing
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // time(), difftime()
+#include <fcntl.h>      // open(), F_ADD_SEALS
+#include <unistd.h>     // close()
+#include <libgen.h>     // basename()
+#include <sys/stat.h>   // stat()
+#include <sys/mman.h>   // memfd_create()
+#include <sys/sendfile.h>
+
+#include "requests.h"
+#include "parser.h"     // DATA_FILENAME_SIZE
+#include "config.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "timing.h"
+#include "../Common/message_services.h"
+#include "../Common/diag.h"
+
+//--------------------------------------------------------------------
+// Request table state
+//--------------------------------------------------------------------
+static req_entry req_table[REQ_TABLE_SIZE];
+static time_t    req_last_expire;
+
+//--------------------------------------------------------------------
+//  req_table_open()
+//--------------------------------------------------------------------
+void req_table_open( void )
+{
+	memset( req_table, 0, sizeof(req_table) );
+	req_last_expire = time( NULL );
+}
+
+//--------------------------------------------------------------------
+//  req_reply()
+//      Send one response to a client, tagged with its correlation id
+//  returns:
+//       0  success
+//      -1  failure
+//--------------------------------------------------------------------
+int req_reply( int reply_mq, unsigned int corr_id, pp_msg *rsp )
+{
+	rsp->corr_id = corr_id;
+	if( msg_send_to_client_mq( reply_mq, rsp ) == -1 ) {
+		DIAG_ERRNO( DIAG_ERROR, "msgsnd" );
+		met_add( MET_REPLY_ERRORS, 1 );
+		return -1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  req_content()
+//      Copy a result file into a sealed memfd.  The copy stays in the
+//      kernel (sendfile), and the seals let a client mmap it knowing it
+//      can never change size or content under it.
+//  returns:
+//      memfd, which the caller closes once it is sent
+//      -1  failure
+//--------------------------------------------------------------------
+int req_content( const char *path )
+{
+	char name[DATA_FILENAME_SIZE];
+	struct stat sb;
+	off_t off = 0;
+	int fd_in, fd;
+
+	fd_in = open( path, O_RDONLY | O_CLOEXEC );
+	if( fd_in == -1 ) {
+		return -1;
+	}
+	snprintf( name, sizeof(name), "%s", path );
+	fd = memfd_create( basename( name ), MFD_CLOEXEC | MFD_ALLOW_SEALING );
+	if( (fd == -1) || (fstat( fd_in, &sb ) == -1) ) {
+		close( fd_in );
+		if( fd != -1 )  close( fd );
+		return -1;
+	}
+	while( off < sb.st_size ) {
+		if( sendfile( fd, fd_in, &off, sb.st_size - off ) <= 0 ) {
+			break;
+		}
+	}
+	close( fd_in );
+	if(    (off != sb.st_size)
+		|| (fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL ) == -1) ) {
+		close( fd );
+		return -1;
+	}
+	return fd;
+}
+
+//--------------------------------------------------------------------
+//  req_deadline()
+//      config.request_timeout from now, or a client timeout (ms, 0 none)
+//      if that is shorter, rounded up to the next second
+//--------------------------------------------------------------------
+time_t req_deadline( unsigned int timeout_ms )
+{
+	time_t timeout = config.request_timeout;
+
+	if( (timeout_ms > 0) && ((timeout_ms + 999) / 1000 < timeout) ) {
+		timeout = (timeout_ms + 999) / 1000;
+	}
+	return time( NULL ) + timeout;
+}
+
+//--------------------------------------------------------------------
+//  req_add()
+//      Hold a request until the sequence serving it completes, or its
+//      deadline (req_deadline()).  The same client repeating a
+//      correlation id only needs one answer.
+//  returns:
+//       0  success
+//      -1  request table full
+//--------------------------------------------------------------------
+int req_add( int type, int reply_mq, unsigned int corr_id, unsigned int flags, unsigned int timeout_ms )
+{
+	req_entry *free_slot = NULL;
+
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ )
+	{
+		req_entry *e = &req_table[i];
+		if( e->state == REQ_FREE ) {
+			if( free_slot == NULL )  free_slot = e;
+			continue;
+		}
+		if( (e->type == type) && (e->reply_mq == reply_mq) && (e->corr_id == corr_id) ) {
+			return 0;
+		}
+	}
+	if( free_slot == NULL ) {
+		return -1;
+	}
+	free_slot->state = REQ_QUEUED;
+	free_slot->type = type;
+	free_slot->reply_mq = reply_mq;
+	free_slot->corr_id = corr_id;
+	free_slot->flags = flags;
+	free_slot->deadline = req_deadline( timeout_ms );
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  req_cancel()
+//      The client no longer wants the answer to this request.  The
+//      sequence serving it still runs if it is on the bus.
+//  returns:
+//       0  request forgotten
+//      -1  no such request outstanding
+//--------------------------------------------------------------------
+int req_cancel( int reply_mq, unsigned int corr_id )
+{
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ )
+	{
+		req_entry *e = &req_table[i];
+		if( (e->state != REQ_FREE) && (e->reply_mq == reply_mq) && (e->corr_id == corr_id) ) {
+			DIAG( DIAG_INFO, "Client %s request %u cancelled", pp_op_name( e->type ), e->corr_id );
+			e->state = REQ_FREE;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------------------------
+//  req_drop_client()
+//      A socket client hung up.  Forget its requests unanswered: the
+//      next client on its connection slot gets the same id and must not
+//      be answered for them.  Sequences only it wanted are dropped by
+//      the scheduler once nothing is outstanding.
+//  returns:
+//      number of requests forgotten
+//--------------------------------------------------------------------
+int req_drop_client( int reply_mq )
+{
+	int n = 0;
+
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ )
+	{
+		req_entry *e = &req_table[i];
+		if( (e->state != REQ_FREE) && (e->reply_mq == reply_mq) ) {
+			DIAG( DIAG_INFO, "Client %s request %u dropped, client gone", pp_op_name( e->type ), e->corr_id );
+			e->state = REQ_FREE;
+			++n;
+		}
+	}
+	return n;
+}
+
+//--------------------------------------------------------------------
+//  req_outstanding()
+//  returns:
+//      number of requests of this type not yet answered
+//--------------------------------------------------------------------
+int req_outstanding( int type )
+{
+	int n = 0;
+
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ ) {
+		if( (req_table[i].state != REQ_FREE) && (req_table[i].type == type) ) {
+			++n;
+		}
+	}
+	return n;
+}
+
+//--------------------------------------------------------------------
+//  req_activate()
+//      The sequence serving requests of this type is on the bus
+//--------------------------------------------------------------------
+void req_activate( int type )
+{
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ ) {
+		if( (req_table[i].state == REQ_QUEUED) && (req_table[i].type == type) ) {
+			req_table[i].state = REQ_ACTIVE;
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  req_complete()
+//      Answer every outstanding request of this type and free them.
+//      When rsp names a file, socket clients that want the content get
+//      it in a memfd made on first need.
+//--------------------------------------------------------------------
+void req_complete( int type, pp_msg *rsp )
+{
+	int content = -1, tried = 0;
+
+	rsp->op = type;
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ )
+	{
+		req_entry *e = &req_table[i];
+		if( (e->state == REQ_FREE) || (e->type != type) ) {
+			continue;
+		}
+		rsp->fd = -1;
+		if( (e->flags & PP_FLAG_WANT_FD) && (e->reply_mq < 0) && (rsp->fields & PP_F_PATH) ) {
+			if( !tried ) {
+				content = req_content( rsp->path );
+				tried = 1;
+			}
+			rsp->fd = content;
+		}
+		req_reply( e->reply_mq, e->corr_id, rsp );
+		e->state = REQ_FREE;
+	}
+	rsp->fd = -1;
+	if( content != -1 ) {
+		close( content );
+	}
+	jobs_complete( type, rsp );
+}
+
+//--------------------------------------------------------------------
+//  req_expire()
+//      Fail requests past their deadline.  Called from the main loop;
+//      scans the table at most once a second.
+//--------------------------------------------------------------------
+void req_expire( void )
+{
+	pp_msg rsp;
+	time_t now = time( NULL );
+
+	if( now == req_last_expire ) {
+		return;
+	}
+	req_last_expire = now;
+
+	for( int i = 0; i < REQ_TABLE_SIZE; i++ )
+	{
+		req_entry *e = &req_table[i];
+		if( (e->state != REQ_FREE) && (now >= e->deadline) ) {
+			DIAG( DIAG_WARN, "Client %s request %u timed out", pp_op_name( e->type ), e->corr_id );
+			pp_init( &rsp, e->type, SERVER_TIMEOUT );
+			pp_set_text( &rsp, "timeout" );
+			met_add( MET_REQ_TIMEOUTS, 1 );
+			req_reply( e->reply_mq, e->corr_id, &rsp );
+			e->state = REQ_FREE;
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+// Report cache state
+//--------------------------------------------------------------------
+typedef struct report_cache
+{
+	char   file[DATA_FILENAME_SIZE];  // last completed report
+	time_t completed;                 // when it completed (0 = none)
+	int    pending;                   // REPORT_REQ raised, not yet started
+	int    active;                    // RPT_* sequence on the bus
+} report_cache;
+
+static report_cache rpt;
+
+//--------------------------------------------------------------------
+//  rpt_cache_open()
+//--------------------------------------------------------------------
+void rpt_cache_open( void )
+{
+	memset( &rpt, 0, sizeof(rpt) );
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_is_fresh()
+//      Cached report exists, is within TTL and is still on disk
+//--------------------------------------------------------------------
+static int rpt_cache_is_fresh( void )
+{
+	struct stat sb;
+	double age;
+
+	if( (config.report_ttl <= 0) || (rpt.completed == 0) ) {
+		return 0;
+	}
+	age = difftime( time(NULL), rpt.completed );
+	if( (age < 0) || (age > config.report_ttl) ) {
+		return 0;
+	}
+	return stat( rpt.file, &sb ) == 0;
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_request()
+//      A client has asked for a Report.  Decide whether it can be served
+//      from the cache (see rpt_cache_file()), should join a sequence
+//      already under way, or needs a new sequence.  Waiting requests are
+//      held in the request table.
+//--------------------------------------------------------------------
+rpt_cache_result rpt_cache_request( int client_mq, unsigned int corr_id, unsigned int flags, unsigned int timeout_ms )
+{
+	if( !rpt.pending && !rpt.active && rpt_cache_is_fresh() ) {
+		return RPT_CACHE_HIT;
+	}
+
+	if( req_add( CLIENT_REQ_REPORT, client_mq, corr_id, flags, timeout_ms ) == -1 ) {
+		return RPT_CACHE_FULL;
+	}
+
+	if( rpt.pending || rpt.active ) {
+		return RPT_CACHE_ATTACHED;
+	}
+
+	rpt.pending = 1;
+	return RPT_CACHE_MISS;
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_file()
+//      Path of the cached report
+//--------------------------------------------------------------------
+const char *rpt_cache_file( void )
+{
+	return rpt.file;
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_pending()
+//      A Report was requested by the 1022 (@R).  Clients arriving before
+//      it completes attach to it.
+//--------------------------------------------------------------------
+void rpt_cache_pending( void )
+{
+	rpt.pending = 1;
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_begin()
+//      The RPT_* sequence has started on the bus
+//--------------------------------------------------------------------
+void rpt_cache_begin( void )
+{
+	rpt.pending = 0;
+	rpt.active = 1;
+	req_activate( CLIENT_REQ_REPORT );
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_complete()
+//      ";end" received.  Cache the result and answer every waiter,
+//      with the timing of the sequence.
+//--------------------------------------------------------------------
+void rpt_cache_complete( const char *file )
+{
+	pp_msg rsp;
+
+	strncpy( rpt.file, file, sizeof(rpt.file) - 1 );
+	rpt.file[sizeof(rpt.file) - 1] = '\0';
+	rpt.completed = time( NULL );
+	rpt.pending = 0;
+	rpt.active = 0;
+
+	pp_init( &rsp, CLIENT_REQ_REPORT, SERVER_ACTION_SUCCESS );
+	pp_set_path( &rsp, rpt.file );
+	tm_summary( TM_REPORT, &rsp );
+	req_complete( CLIENT_REQ_REPORT, &rsp );
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_abort()
+//      The RPT_* sequence was abandoned (parse_watchdog()).  Its waiters
+//      time out and the next request starts a new sequence.
+//--------------------------------------------------------------------
+void rpt_cache_abort( const char *reason )
+{
+	pp_msg rsp;
+
+	rpt.pending = 0;
+	rpt.active = 0;
+
+	pp_init( &rsp, CLIENT_REQ_REPORT, SERVER_TIMEOUT );
+	pp_set_text( &rsp, "%s", reason );
+	req_complete( CLIENT_REQ_REPORT, &rsp );
+}
+
+//--------------------------------------------------------------------
+//  rpt_cache_withdraw()
+//      The Report that was pending will not be started: refused at
+//      admission or dropped by the scheduler.  Its waiters are failed
+//      and the next request asks for a new sequence.
+//--------------------------------------------------------------------
+void rpt_cache_withdraw( const char *reason )
+{
+	pp_msg rsp;
+
+	rpt.pending = 0;
+
+	pp_init( &rsp, CLIENT_REQ_REPORT, SERVER_REQUEST_FAILURE );
+	pp_set_text( &rsp, "%s", reason );
+	req_complete( CLIENT_REQ_REPORT, &rsp );
+}
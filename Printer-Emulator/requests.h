@@ -0,0 +1,77 @@
+
+//--------------------------------------------------------------------
+//  requests.h
+//--------------------------------------------------------------------
+
+// Client request table.
+//
+// Every client request that is answered once the 1022 has done its part
+// (Report, History, Log toggle) is held here until the parser completes
+// it.  An entry remembers the client's reply queue and the correlation id
+// the client chose, so any number of clients may have requests in flight
+// and each answer goes to the client that asked, tagged with its id.
+// Requests of one type share the bus sequence that serves them: when it
+// completes, every outstanding request of that type gets the result.
+// A request still unanswered at its deadline, the client's or
+// config.request_timeout whichever is sooner, is answered SERVER_TIMEOUT.
+// The client may cancel it first (CLIENT_CANCEL).
+// Socket clients that asked for it (PP_FLAG_WANT_FD) also get the result
+// file's content as a sealed memfd, built once per completion.
+
+// Maximum number of outstanding client requests
+#define REQ_TABLE_SIZE  32
+
+typedef enum {
+	REQ_FREE,            // slot unused
+	REQ_QUEUED,          // accepted, sequence not yet on the bus
+	REQ_ACTIVE,          // sequence serving it is on the bus
+} req_state;
+
+typedef struct req_entry
+{
+	int          state;      // req_state
+	int          type;       // CLIENT_REQ_*
+	int          reply_mq;   // client queue the answer goes to
+	unsigned int corr_id;    // client's correlation id, echoed back
+	unsigned int flags;      // request PP_FLAG_* (PP_FLAG_WANT_FD)
+	time_t       deadline;   // failed if not answered by then
+} req_entry;
+
+struct pp_msg;    // pe_proto.h
+
+void req_table_open( void );
+time_t req_deadline( unsigned int timeout_ms );
+int req_add( int type, int reply_mq, unsigned int corr_id, unsigned int flags, unsigned int timeout_ms );
+int req_cancel( int reply_mq, unsigned int corr_id );
+int req_drop_client( int reply_mq );
+int req_outstanding( int type );
+void req_activate( int type );
+void req_complete( int type, struct pp_msg *rsp );
+void req_expire( void );
+int req_reply( int reply_mq, unsigned int corr_id, struct pp_msg *rsp );
+int req_content( const char *path );
+
+// Report cache and request coalescing.
+//
+// printem serves a single 1022 (one serial port per process) so the
+// cache below is the cache for that unit.  A completed report is reused
+// for config.report_ttl seconds.  Requests which arrive while a report
+// is pending or in progress wait for that sequence instead of starting
+// another one; all of them are answered with the same file at ";end".
+
+// rpt_cache_request() results
+typedef enum {
+	RPT_CACHE_HIT,       // fresh report on hand (rpt_cache_file())
+	RPT_CACHE_ATTACHED,  // joined a pending or active sequence
+	RPT_CACHE_MISS,      // caller must start a Report sequence
+	RPT_CACHE_FULL,      // request table full, request refused
+} rpt_cache_result;
+
+void rpt_cache_open( void );
+rpt_cache_result rpt_cache_request( int client_mq, unsigned int corr_id, unsigned int flags, unsigned int timeout_ms );
+const char *rpt_cache_file( void );
+void rpt_cache_pending( void );
+void rpt_cache_begin( void );
+void rpt_cache_complete( const char *file );
+void rpt_cache_abort( const char *reason );
+void rpt_cache_withdraw( const char *reason );
@@ -0,0 +1,214 @@
+//--------------------------------------------------------------------
+//  sched.c
+//      Bus operation scheduler: priorities, deadlines and admission
+//      for the sequences printem starts on the bus
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // time(), difftime()
+
+#include "sched.h"
+#include "requests.h"
+#include "parser.h"     // parse_bus_op()
+#include "config.h"
+#include "../Common/message_services.h"
+#include "../Common/diag.h"
+
+//--------------------------------------------------------------------
+// Scheduler state
+//--------------------------------------------------------------------
+static sched_entry    sched_queue[SCHED_QUEUE_SIZE];
+static sched_counters sched_count[SCHED_PRIO_COUNT];
+static unsigned int   sched_seq;
+
+//--------------------------------------------------------------------
+//  sched_open()
+//--------------------------------------------------------------------
+void sched_open( void )
+{
+	memset( sched_queue, 0, sizeof(sched_queue) );
+	memset( sched_count, 0, sizeof(sched_count) );
+	sched_seq = 0;
+}
+
+//--------------------------------------------------------------------
+//  sched_op_name()
+//--------------------------------------------------------------------
+const char *sched_op_name( int op )
+{
+	switch( op )
+	{
+	case SCHED_REPORT:   return "report";
+	case SCHED_HISTORY:  return "history";
+	case SCHED_LOG_ON:   return "logmode on";
+	case SCHED_LOG_OFF:  return "logmode off";
+	}
+	return "none";
+}
+
+//--------------------------------------------------------------------
+//  sched_client_op()
+//      The client request type an operation answers
+//--------------------------------------------------------------------
+static int sched_client_op( int op )
+{
+	switch( op )
+	{
+	case SCHED_REPORT:   return CLIENT_REQ_REPORT;
+	case SCHED_HISTORY:  return CLIENT_REQ_HISTORY;
+	}
+	return CLIENT_REQ_LOG;
+}
+
+//--------------------------------------------------------------------
+//  sched_prio_now()
+//      Priority an entry competes at, a bulk one promoted once it has
+//      waited config.bulk_max_wait
+//--------------------------------------------------------------------
+static int sched_prio_now( sched_entry *e, time_t now )
+{
+	if(    (e->prio == SCHED_PRIO_BULK) && (config.bulk_max_wait > 0)
+		&& (difftime( now, e->queued ) >= config.bulk_max_wait) ) {
+		return SCHED_PRIO_INTERACTIVE;
+	}
+	return e->prio;
+}
+
+//--------------------------------------------------------------------
+//  sched_drop()
+//      Forget a waiting operation that will not be started
+//--------------------------------------------------------------------
+static void sched_drop( sched_entry *e, const char *reason )
+{
+	DIAG( DIAG_WARN, "Bus %s %s, dropped", sched_op_name( e->op ), reason );
+	++sched_count[e->prio].dropped;
+	if( e->op == SCHED_REPORT ) {
+		rpt_cache_withdraw( reason );
+	}
+	e->op = 0;
+}
+
+//--------------------------------------------------------------------
+//  sched_add()
+//      Ask for a bus operation.  client is set when a client request
+//      (held in the request table) is what needs it; timeout_ms is that
+//      request's timeout (0 none), see req_deadline().
+//--------------------------------------------------------------------
+sched_result sched_add( int op, int prio, int client, unsigned int timeout_ms )
+{
+	sched_entry *free_slot = NULL;
+	time_t deadline = req_deadline( timeout_ms );
+	int bus_op;
+
+	for( int i = 0; i < SCHED_QUEUE_SIZE; i++ )
+	{
+		sched_entry *e = &sched_queue[i];
+		if( e->op == 0 ) {
+			if( free_slot == NULL )  free_slot = e;
+			continue;
+		}
+		if( e->op == op ) {
+			if( prio < e->prio )          e->prio = prio;
+			if( deadline < e->deadline )  e->deadline = deadline;
+			e->client = e->client && client;
+			++sched_count[prio].merged;
+			return SCHED_MERGED;
+		}
+	}
+
+	// A History sequence may hold the bus for minutes.  Bulk work is not
+	// piled up behind it, the rest waits for it to end.
+	bus_op = parse_bus_op();
+	if( ((bus_op == SCHED_HISTORY) && (prio == SCHED_PRIO_BULK)) || (free_slot == NULL) ) {
+		DIAG( DIAG_WARN, "Bus %s refused, bus busy", sched_op_name( op ) );
+		++sched_count[prio].rejected;
+		return SCHED_REJECTED;
+	}
+
+	free_slot->op = op;
+	free_slot->prio = prio;
+	free_slot->client = client;
+	free_slot->seq = sched_seq++;
+	free_slot->queued = time( NULL );
+	free_slot->deadline = deadline;
+	++sched_count[prio].queued;
+	return (bus_op == SCHED_HISTORY) ? SCHED_DEFERRED : SCHED_QUEUED;
+}
+
+//--------------------------------------------------------------------
+//  sched_next()
+//      Called at a 1022 poll where the operations in allowed may start.
+//      Drops the operations nobody waits for any more, then takes the
+//      one to start: highest priority, earliest deadline, oldest.
+//  returns:
+//      sched_op to start now, removed from the queue
+//      0  nothing to start, answer the poll with status
+//--------------------------------------------------------------------
+int sched_next( unsigned int allowed )
+{
+	sched_entry *best = NULL;
+	int best_prio = SCHED_PRIO_COUNT;
+	time_t now = time( NULL );
+	int op, prio;
+
+	for( int i = 0; i < SCHED_QUEUE_SIZE; i++ )
+	{
+		sched_entry *e = &sched_queue[i];
+		if( e->op == 0 ) {
+			continue;
+		}
+		if( e->client ) {
+			if( req_outstanding( sched_client_op( e->op ) ) == 0 ) {
+				sched_drop( e, "withdrawn" );
+				continue;
+			}
+		} else if( now >= e->deadline ) {
+			sched_drop( e, "not started in time" );
+			continue;
+		}
+		if( !(e->op & allowed) ) {
+			continue;
+		}
+		prio = sched_prio_now( e, now );
+		if(    (best == NULL) || (prio < best_prio)
+			|| ((prio == best_prio) && (e->deadline < best->deadline))
+			|| ((prio == best_prio) && (e->deadline == best->deadline) && ((int)(e->seq - best->seq) < 0)) ) {
+			best = e;
+			best_prio = prio;
+		}
+	}
+	if( best == NULL ) {
+		return 0;
+	}
+
+	op = best->op;
+	++sched_count[best->prio].started;
+	best->op = 0;
+	return op;
+}
+
+//--------------------------------------------------------------------
+//  sched_waiting()
+//  returns:
+//      1  one of the operations in ops is waiting to be started
+//      0  none is
+//--------------------------------------------------------------------
+int sched_waiting( unsigned int ops )
+{
+	for( int i = 0; i < SCHED_QUEUE_SIZE; i++ ) {
+		if( sched_queue[i].op & ops ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------
+//  sched_stats()
+//  returns:
+//      counters of one priority (sched_prio)
+//--------------------------------------------------------------------
+const sched_counters *sched_stats( int prio )
+{
+	return &sched_count[prio];
+}
@@ -0,0 +1,88 @@
+
+//--------------------------------------------------------------------
+//  sched.h
+//--------------------------------------------------------------------
+
+// Bus operation scheduler.
+//
+// The 1022 lets the printer module start one sequence (Report, History,
+// Log mode on or off) at each of its polls, so work asked for by the
+// 1022 itself (@R, @H, @L), by clients and by signals waits here until
+// the parser reaches a poll where it may start it.  An operation asked
+// for again while it waits is merged into the waiting one, which takes
+// the higher priority and the earlier deadline of the two.
+//
+// At each poll the parser takes the waiting operation of the highest
+// priority that can start there, the earliest deadline first within a
+// priority, then the oldest.  Requests from the 1022 come first, then
+// interactive ones, then bulk ones (PP_FLAG_BULK).  A bulk operation that
+// has waited config.bulk_max_wait seconds competes as interactive, so a
+// steady stream of interactive requests cannot hold it off for ever.
+// printem serves one 1022, so this is the fairness between the requests
+// for that unit.
+//
+// Admission: while a History sequence is on the bus, which may take
+// minutes, bulk work is refused rather than piled up behind it and
+// interactive work is queued to start when it ends.  An operation only
+// clients asked for is dropped when none of their requests is still
+// outstanding (cancelled or timed out), and any operation is dropped at
+// its deadline.
+
+// Maximum number of waiting operations
+#define SCHED_QUEUE_SIZE  8
+
+// Bus operations, one bit each so a poll can name those it may start
+typedef enum
+{
+	SCHED_LOG_OFF = 1 << 3,
+	SCHED_LOG_ON  = 1 << 2,
+	SCHED_HISTORY = 1 << 1,
+	SCHED_REPORT  = 1 << 0,
+} sched_op;
+
+#define SCHED_ALL  (SCHED_REPORT | SCHED_HISTORY | SCHED_LOG_ON | SCHED_LOG_OFF)
+
+// Priorities, highest first
+typedef enum
+{
+	SCHED_PRIO_UNIT,         // the 1022 asked (@R, @H, @L)
+	SCHED_PRIO_INTERACTIVE,  // an operator: client request or signal
+	SCHED_PRIO_BULK,         // background client work (PP_FLAG_BULK)
+	SCHED_PRIO_COUNT
+} sched_prio;
+
+// sched_add() results
+typedef enum
+{
+	SCHED_QUEUED,     // waiting for a poll
+	SCHED_DEFERRED,   // waiting for the History sequence on the bus
+	SCHED_MERGED,     // joined the same operation already waiting
+	SCHED_REJECTED,   // refused, bus busy or queue full
+} sched_result;
+
+typedef struct sched_entry
+{
+	int          op;        // sched_op, 0 slot unused
+	int          prio;      // sched_prio
+	int          client;    // only clients asked, drop when they are gone
+	unsigned int seq;       // arrival order
+	time_t       queued;    // when it was first asked for
+	time_t       deadline;  // dropped if not started by then
+} sched_entry;
+
+// Counters per priority, kept from sched_open()
+typedef struct sched_counters
+{
+	unsigned long long queued;    // operations added to the queue
+	unsigned long long merged;    // asked for again while waiting
+	unsigned long long rejected;  // refused at admission
+	unsigned long long started;   // handed to the parser
+	unsigned long long dropped;   // withdrawn or past the deadline
+} sched_counters;
+
+void sched_open( void );
+sched_result sched_add( int op, int prio, int client, unsigned int timeout_ms );
+int sched_next( unsigned int allowed );
+int sched_waiting( unsigned int ops );
+const char *sched_op_name( int op );
+const sched_counters *sched_stats( int prio );
@@ -0,0 +1,255 @@
+//--------------------------------------------------------------------
+//  timing.c
+//      Per sequence and per state timing with a rolling history
+//--------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // clock_gettime(), localtime_r(), strftime()
+
+#include "timing.h"
+#include "parser.h"     // state_t, parse_state_name(), DATA_FILENAME_SIZE
+#include "config.h"
+#include "metrics.h"
+#include "../Common/message_services.h"
+#include "../Common/diag.h"
+
+static_assert( LAST_STATE <= TM_STATES, "TM_STATES too small" );
+
+//--------------------------------------------------------------------
+// Timing state
+//--------------------------------------------------------------------
+static tm_seq   tm_seqs[TM_SEQS];
+static uint64_t tm_rx_us;       // last serial read returned
+static uint64_t tm_entered_us;  // current parser state entered
+static int      tm_cur = SS_UNKNOWN;
+static char     tm_path[DATA_FILENAME_SIZE];
+static char     tm_old_path[DATA_FILENAME_SIZE];
+static int      tm_lines;       // lines in timing.txt
+
+static const char *tm_names[TM_SEQS] = { "report", "history", "logmode" };
+
+// The state each sequence receives its records in
+static const int tm_data_state[TM_SEQS] = { RPT_DATA, HST_DATA, LOG_DATA };
+
+//--------------------------------------------------------------------
+//  tm_now_us()
+//      Monotonic clock
+//--------------------------------------------------------------------
+static uint64_t tm_now_us( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//--------------------------------------------------------------------
+//  tm_open()
+//      dir is the disk directory for timing.txt.  Lines already in it
+//      count towards the roll over.
+//--------------------------------------------------------------------
+void tm_open( const char *dir )
+{
+	FILE *fp;
+	int c;
+
+	memset( tm_seqs, 0, sizeof(tm_seqs) );
+	tm_rx_us = tm_now_us();
+	tm_entered_us = tm_rx_us;
+	snprintf( tm_path, sizeof(tm_path), "%s/%s", dir, TIMING_FILE );
+	snprintf( tm_old_path, sizeof(tm_old_path), "%s/%s", dir, TIMING_OLD_FILE );
+
+	tm_lines = 0;
+	fp = fopen( tm_path, "r" );
+	if( fp != NULL ) {
+		while( (c = getc( fp )) != EOF ) {
+			if( c == '\n' ) {
+				++tm_lines;
+			}
+		}
+		fclose( fp );
+	}
+}
+
+//--------------------------------------------------------------------
+//  tm_rx()
+//      A serial read returned; the frames in it are timed from now
+//--------------------------------------------------------------------
+void tm_rx( void )
+{
+	tm_rx_us = tm_now_us();
+}
+
+//--------------------------------------------------------------------
+//  tm_reply()
+//      printem answered the 1022
+//--------------------------------------------------------------------
+void tm_reply( void )
+{
+	uint64_t d = tm_now_us() - tm_rx_us;
+
+	for( int s = 0; s < TM_SEQS; s++ )
+	{
+		tm_seq *q = &tm_seqs[s];
+		if( q->active ) {
+			q->reply_us += d;
+			if( d > q->reply_max_us ) {
+				q->reply_max_us = d;
+			}
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  tm_begin()
+//--------------------------------------------------------------------
+static void tm_begin( int seq, uint64_t now )
+{
+	tm_seq *q = &tm_seqs[seq];
+
+	memset( q, 0, sizeof(*q) );
+	q->active = 1;
+	q->start_us = now;
+}
+
+//--------------------------------------------------------------------
+//  tm_record()
+//      Append a finished sequence to timing.txt, rolling it over to
+//      timing.old when it is full
+//--------------------------------------------------------------------
+static void tm_record( int seq )
+{
+	tm_seq *q = &tm_seqs[seq];
+	char stamp[32];
+	struct tm tm;
+	time_t now;
+	FILE *fp;
+
+	if( (tm_path[0] == '\0') || (config.timing_history <= 0) ) {
+		return;
+	}
+	if( tm_lines >= config.timing_history ) {
+		rename( tm_path, tm_old_path );
+		tm_lines = 0;
+	}
+
+	now = time( NULL );
+	localtime_r( &now, &tm );
+	strftime( stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm );
+	fp = fopen( tm_path, "a" );
+	if( fp == NULL ) {
+		DIAG_ERRNO( DIAG_ERROR, "timing history" );
+		return;
+	}
+	fprintf( fp, "%s %s %s %llu %llu %llu %llu %llu %llu %llu", stamp, tm_names[seq], q->outcome,
+			 (unsigned long long)(q->end_us - q->start_us) / 1000,
+			 (unsigned long long)(q->first_data_us ? q->first_data_us - q->start_us : 0) / 1000,
+			 (unsigned long long)q->data_us / 1000,
+			 (unsigned long long)q->rounds,
+			 (unsigned long long)q->gap_max_us / 1000,
+			 (unsigned long long)q->reply_us,
+			 (unsigned long long)q->reply_max_us );
+	for( int st = 0; st < LAST_STATE; st++ ) {
+		if( q->state_us[st] != 0 ) {
+			fprintf( fp, " %s=%llu", parse_state_name( st ), (unsigned long long)q->state_us[st] / 1000 );
+		}
+	}
+	fprintf( fp, "\n" );
+	fclose( fp );
+	++tm_lines;
+}
+
+//--------------------------------------------------------------------
+//  tm_end()
+//      The sequence is over: ok, aborted or resync.  It is recorded
+//      and its summary kept for tm_summary().  Nothing happens if it
+//      was not started.
+//--------------------------------------------------------------------
+void tm_end( int seq, const char *outcome )
+{
+	tm_seq *q = &tm_seqs[seq];
+	uint64_t now = tm_now_us();
+
+	if( !q->active ) {
+		return;
+	}
+	// The state it ends in counts up to now
+	q->state_us[tm_cur] += now - tm_entered_us;
+	if( tm_cur == tm_data_state[seq] ) {
+		q->data_us += now - tm_entered_us;
+	}
+	q->end_us = now;
+	q->outcome = outcome;
+	q->active = 0;
+	q->ended = 1;
+	tm_record( seq );
+}
+
+//--------------------------------------------------------------------
+//  tm_state()
+//      The parser went from state before to state after.  Called by
+//      parse_header() for every change.
+//--------------------------------------------------------------------
+void tm_state( int before, int after )
+{
+	uint64_t now = tm_rx_us;
+	uint64_t d = (now > tm_entered_us) ? now - tm_entered_us : 0;
+
+	met_add( MET_STATE_US + before, d );
+	for( int s = 0; s < TM_SEQS; s++ )
+	{
+		tm_seq *q = &tm_seqs[s];
+		if( !q->active ) {
+			continue;
+		}
+		q->state_us[before] += d;
+		if( before == tm_data_state[s] ) {
+			q->data_us += d;
+			q->data_end_us = now;
+		}
+		if( after == tm_data_state[s] ) {
+			++q->rounds;
+			if( q->first_data_us == 0 ) {
+				q->first_data_us = now;
+			} else if( now - q->data_end_us > q->gap_max_us ) {
+				q->gap_max_us = now - q->data_end_us;
+			}
+		}
+	}
+	tm_entered_us = now;
+	tm_cur = after;
+
+	if( after == RPT_START ) {
+		tm_begin( TM_REPORT, now );
+	} else if( after == HST_START ) {
+		tm_begin( TM_HISTORY, now );
+	} else if( (after == LOG_START) && !tm_seqs[TM_LOGMODE].active ) {
+		tm_begin( TM_LOGMODE, now );
+	} else if( after == SS_UNKNOWN ) {
+		for( int s = 0; s < TM_SEQS; s++ ) {
+			tm_end( s, "resync" );
+		}
+	}
+}
+
+//--------------------------------------------------------------------
+//  tm_summary()
+//      Add the timing of the last finished sequence to its completion
+//      message
+//--------------------------------------------------------------------
+void tm_summary( int seq, pp_msg *rsp )
+{
+	tm_seq *q = &tm_seqs[seq];
+
+	if( !q->ended ) {
+		return;
+	}
+	pp_add_counter( rsp, PP_C_DURATION_MS, (q->end_us - q->start_us) / 1000 );
+	if( q->first_data_us != 0 ) {
+		pp_add_counter( rsp, PP_C_WAIT_MS, (q->first_data_us - q->start_us) / 1000 );
+	}
+	pp_add_counter( rsp, PP_C_DATA_MS, q->data_us / 1000 );
+	pp_add_counter( rsp, PP_C_ROUNDS, q->rounds );
+	pp_add_counter( rsp, PP_C_GAP_MAX_MS, q->gap_max_us / 1000 );
+	pp_add_counter( rsp, PP_C_REPLY_US, q->reply_us );
+}
@@ -0,0 +1,81 @@
+
+//--------------------------------------------------------------------
+//  timing.h
+//--------------------------------------------------------------------
+
+// Sequence timing.
+//
+// A History pull may take tens of seconds.  To tell how much of that is
+// the 1022 getting ready, data on the bus, or printem answering, each
+// Report, History and logmode session is timed from the parser's state
+// changes:
+//
+//     total     start (R, I or T sent) to ";end" or logmode off
+//     wait      start to the first data record, the 1022 preparing
+//     data      time spent receiving data records
+//     rounds    data records, or logmode records
+//     gap max   longest time between the end of one record and the
+//               start of the next (display frame, poll, 1022 think
+//               time); for logmode, the record cadence
+//     reply     time from reading a frame off the serial port to
+//               writing printem's answer, summed and largest
+//
+// plus the time spent in each parser state.  Times are taken when the
+// serial read that carried the frame returned, so they are as fine as
+// the reads.
+//
+// The summary goes back to the clients in the completion message as
+// counters (PP_C_DURATION_MS ... PP_C_REPLY_US, pe_proto.h).  Each
+// sequence is also appended as one line to timing.txt in the disk
+// directory for trend analysis:
+//
+//     date time type outcome total wait data rounds gap_max reply_us
+//         reply_max_us state=ms ...
+//
+// times in ms unless marked.  outcome is ok, aborted (watchdog) or
+// resync (the parser lost its place).  Once timing.txt holds
+// config.timing_history lines it is renamed timing.old and a new one is
+// started, so the history rolls over.  The time in each state also goes
+// to the metrics (printem_state_seconds_total).
+
+#include <stdint.h>
+
+#define TIMING_FILE      "timing.txt"
+#define TIMING_OLD_FILE  "timing.old"
+
+// Room for state_t (parser.h)
+#define TM_STATES  24
+
+typedef enum
+{
+	TM_REPORT,
+	TM_HISTORY,
+	TM_LOGMODE,
+	TM_SEQS
+} tm_seq_id;
+
+typedef struct tm_seq
+{
+	int         active;          // started, not yet ended
+	int         ended;           // a finished one is in here
+	const char *outcome;
+	uint64_t    start_us;
+	uint64_t    end_us;
+	uint64_t    first_data_us;   // 0 no data record yet
+	uint64_t    data_end_us;     // last record ended, 0 none
+	uint64_t    data_us;
+	uint64_t    rounds;
+	uint64_t    gap_max_us;
+	uint64_t    reply_us;
+	uint64_t    reply_max_us;
+	uint64_t    state_us[TM_STATES];
+} tm_seq;
+
+struct pp_msg;    // pe_proto.h
+
+void tm_open( const char *dir );
+void tm_rx( void );
+void tm_reply( void );
+void tm_state( int before, int after );
+void tm_end( int seq, const char *outcome );
+void tm_summary( int seq, struct pp_msg *rsp );
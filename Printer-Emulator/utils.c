@@ -13,7 +13,12 @@
 
 #include "utils.h"
 #include "parser.h"
+#include "requests.h"
+#include "sched.h"
+#include "metrics.h"
 #include "../Common/message_services.h"
+#include "events.h"
+#include "../Common/diag.h"
 
 //--------------------------------------------------------------------
 //  DumpHex()
@@ -168,8 +173,32 @@ int serial_port_open(int *serial_port, char *port_name)
 }
 
 
+//--------------------------------------------------------------------
+// name_in_use()
+//     A data file by this name, or a compressed segment or an index
+//     of one, already exists
+//--------------------------------------------------------------------
+int name_in_use( const char *name )
+{
+	char path[DATA_FILENAME_SIZE + 8];
+
+	if( access( name, F_OK ) == 0 ) {
+		return 1;
+	}
+	snprintf( path, sizeof(path), "%s.gz", name );
+	if( access( path, F_OK ) == 0 ) {
+		return 1;
+	}
+	snprintf( path, sizeof(path), "%s.idx", name );
+	return access( path, F_OK ) == 0;
+}
+
 //--------------------------------------------------------------------
 // unique_filename()
+//     base and the local time to the second.  Sequences on the unit are
+//     seconds apart; an offline decode makes them faster than that, so
+//     a name already taken moves on to the next second instead of
+//     overwriting the earlier file.
 //--------------------------------------------------------------------
 int unique_filename( char *base, char *name_out, int name_sz )
 {
@@ -181,20 +210,24 @@ int unique_filename( char *base, char *name_out, int name_sz )
 	// Get local time in preparation for formatting
 	struct tm *tm;
 	time_t t = time(NULL);
-	tm = localtime( &t );
-	if( tm == NULL ) {
-		printf("localtime call FAILED \n");
-		return 1;
-	}
+	size_t s;
+	do {
+		tm = localtime( &t );
+		if( tm == NULL ) {
+			DIAG( DIAG_ERROR, "localtime call FAILED" );
+			return 1;
+		}
 
-	// date and time encoding is as follows:
-	// 2024-08-19-hh-mm-ss
-	// %Y   %m %d %H %M %S
-	// with dash separators:
-	//s = strftime( name_out + base_len, name_sz - base_len, "%Y-%m-%d-%H-%M-%S", tm );
-	
-	// no dash separators:
-	size_t s = strftime( name_out + base_len, name_sz - base_len, "%Y%m%d%H%M%S", tm );
+		// date and time encoding is as follows:
+		// 2024-08-19-hh-mm-ss
+		// %Y   %m %d %H %M %S
+		// with dash separators:
+		//s = strftime( name_out + base_len, name_sz - base_len, "%Y-%m-%d-%H-%M-%S", tm );
+
+		// no dash separators:
+		s = strftime( name_out + base_len, name_sz - base_len, "%Y%m%d%H%M%S", tm );
+		++t;
+	} while( s && name_in_use( name_out ) );
 	
 	if( s ) {
 		return 0;
@@ -219,8 +252,23 @@ int unique_filename( char *base, char *name_out, int name_sz )
 
 #endif
 
+//--------------------------------------------------------------------
+//  control_client_gone()
+//      msg_sock_on_hangup() hook: a socket client hung up, so nothing
+//      held for it may be answered to the next client given its id
+//--------------------------------------------------------------------
+void control_client_gone( int client_id )
+{
+	req_drop_client( client_id );
+	ev_unsubscribe_client( client_id );
+}
+
 //--------------------------------------------------------------------
 //  control_receive_msg()
+//      Requests answered later are held in the request table (see
+//      requests.h) with the client's reply queue and correlation id,
+//      and the bus sequence they need is queued in the scheduler (see
+//      sched.h).  Immediate responses go straight back to the sender.
 //  returns:
 //       0  continue execution
 //      -1  exit
@@ -228,86 +276,167 @@ int unique_filename( char *base, char *name_out, int name_sz )
 int control_receive_msg( unsigned int *p_control )
 {
 	int rv = 0;
-    client_req c_msg;
-    server_rsp s_msg;
+	rpt_cache_result rpt_rv;
+	sched_result sch_rv;
+	int prio;
+	pp_msg req;
+	pp_msg rsp;
 	ssize_t msg_len;
 
-	memset( &c_msg, 0, sizeof(c_msg) );
-	msg_len = msg_rcv_from_client( &c_msg );
+	msg_len = msg_rcv_from_client( &req );
 	if( msg_len == 0 ) {
 		// no messages in queue, do nothing.  This path most frequently taken
 		return rv;
 	}
 	else if( msg_len == -1 ) {
-		perror("msgrcv");
+		DIAG_ERRNO( DIAG_ERROR, "msgrcv" );
 		return rv;
 	}
 
+	// Every response echoes the request op; status is set per case
+	pp_init( &rsp, req.op, SERVER_REQUEST_SUCCESS );
+	met_add( MET_REQUESTS + ((req.op < MET_OPS) ? req.op : 0), 1 );
+
+	// Bus work a client marks as bulk yields to interactive requests
+	prio = (req.flags & PP_FLAG_BULK) ? SCHED_PRIO_BULK : SCHED_PRIO_INTERACTIVE;
+
 	// Process a received message
-	switch( c_msg.mtype )
+	switch( req.op )
 	{
 	case CLIENT_INIT:
-		printf("Client Init received\n");
-		//client_mq = c_msg.client_id;
-		//printf("msglen %ld\n", msg_len);
-		memset( &s_msg, 0, sizeof(s_msg) );
-		s_msg.mtype = SERVER_ACTION_SUCCESS;
-		sprintf( s_msg.rsp, "logmode %d", status_is_logmode() );
-		if( msg_send_to_client(&s_msg) == -1 ) {
-			perror("msgsnd");
-		}
+		DIAG( DIAG_INFO, "Client Init received" );
+		rsp.status = SERVER_ACTION_SUCCESS;
+		pp_set_logmode( &rsp, status_is_logmode() );
+		req_reply( req.client_id, req.corr_id, &rsp );
 		break;
 	case CLIENT_REQ_HISTORY:
-		printf("Client History Request received\n");
-		*p_control |= HISTORY_REQ;
-		*p_control |= MESSAGE_SRC;
-		memset( &s_msg, 0, sizeof(s_msg) );
-		s_msg.mtype = SERVER_REQUEST_SUCCESS;
-		strcpy( s_msg.rsp, "history");
-		if( msg_send_to_client(&s_msg) == -1 ) {
-			perror("msgsnd");
+		DIAG( DIAG_INFO, "Client History Request %u received", req.corr_id );
+		// Requests arriving while one is outstanding share its sequence,
+		// and raise its priority while it waits
+		sch_rv = SCHED_MERGED;
+		if( (req_outstanding( CLIENT_REQ_HISTORY ) == 0) || sched_waiting( SCHED_HISTORY ) ) {
+			sch_rv = sched_add( SCHED_HISTORY, prio, 1, req.timeout_ms );
 		}
+		if( sch_rv == SCHED_REJECTED ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "bus busy" );
+		}
+		else if( req_add( CLIENT_REQ_HISTORY, req.client_id, req.corr_id, req.flags, req.timeout_ms ) == -1 ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "busy" );
+		}
+		else if( sch_rv == SCHED_DEFERRED ) {
+			pp_set_text( &rsp, "waiting for history" );
+		}
+		req_reply( req.client_id, req.corr_id, &rsp );
 		break;
 	case CLIENT_REQ_LOG:
-		printf("Client Log Toggle Request received\n");
-		if( status_is_logmode() ) {
-			*p_control |= LOGMODE_OFF_REQ;
-		} else {
-			*p_control |= LOGMODE_ON_REQ;
+		DIAG( DIAG_INFO, "Client Log Toggle Request %u received", req.corr_id );
+		sch_rv = sched_add( status_is_logmode() ? SCHED_LOG_OFF : SCHED_LOG_ON, prio, 1, req.timeout_ms );
+		if( sch_rv == SCHED_REJECTED ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "bus busy" );
+			req_reply( req.client_id, req.corr_id, &rsp );
+			break;
+		}
+		if( req_add( CLIENT_REQ_LOG, req.client_id, req.corr_id, req.flags, req.timeout_ms ) == -1 ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "busy" );
+			req_reply( req.client_id, req.corr_id, &rsp );
+			break;
 		}
-		*p_control |= MESSAGE_SRC;		
-
-		// When LOGMODE_OFF_REQ or LOGMODE_ON_REQ are accepted and
-		// acted upon then SERVER_ACTION_SUCCESS response will reply to
-		// the client with the new value
-		memset( &s_msg, 0, sizeof(s_msg) );
-		s_msg.mtype = SERVER_REQUEST_SUCCESS;
-		s_msg.rsp[0] = '\0';
-		if(msg_send_to_client(&s_msg) == -1 ) {
-			perror("msgsnd");
+		if( sch_rv == SCHED_DEFERRED ) {
+			pp_set_text( &rsp, "waiting for history" );
 		}
+
+		// When the logmode change is made on the bus the
+		// SERVER_ACTION_SUCCESS response gives the client the new value
+		req_reply( req.client_id, req.corr_id, &rsp );
 		break;
 	case CLIENT_REQ_REPORT:
-		printf("Client Report Request received\n");
-		*p_control |= REPORT_REQ;
-		*p_control |= MESSAGE_SRC;
-		memset( &s_msg, 0, sizeof(s_msg) );
-		s_msg.mtype = SERVER_REQUEST_SUCCESS;
-		strcpy( s_msg.rsp, "report");
-		if( msg_send_to_client(&s_msg) == -1 ) {
-			perror("msgsnd");
+		DIAG( DIAG_INFO, "Client Report Request %u received", req.corr_id );
+		rpt_rv = rpt_cache_request( req.client_id, req.corr_id, req.flags, req.timeout_ms );
+		if( rpt_rv == RPT_CACHE_FULL ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "busy" );
+			req_reply( req.client_id, req.corr_id, &rsp );
+			break;
+		}
+		// A new sequence needs its place on the bus, and one still
+		// waiting to start takes this request's priority if higher
+		if( (rpt_rv == RPT_CACHE_MISS) || ((rpt_rv == RPT_CACHE_ATTACHED) && sched_waiting( SCHED_REPORT )) ) {
+			sch_rv = sched_add( SCHED_REPORT, prio, 1, req.timeout_ms );
+			if( sch_rv == SCHED_REJECTED ) {
+				// Fails the request, the only one waiting on this Report
+				rpt_cache_withdraw( "bus busy" );
+				break;
+			}
+			if( sch_rv == SCHED_DEFERRED ) {
+				pp_set_text( &rsp, "waiting for history" );
+			}
+		}
+		req_reply( req.client_id, req.corr_id, &rsp );
+
+		if( rpt_rv == RPT_CACHE_HIT ) {
+			// Fresh report on hand, no need to go to the bus
+			DIAG( DIAG_INFO, "Report served from cache" );
+			rsp.status = SERVER_ACTION_SUCCESS;
+			pp_set_path( &rsp, rpt_cache_file() );
+			if( (req.flags & PP_FLAG_WANT_FD) && (req.client_id < 0) ) {
+				rsp.fd = req_content( rsp.path );
+			}
+			req_reply( req.client_id, req.corr_id, &rsp );
+			if( rsp.fd != -1 ) {
+				close( rsp.fd );
+			}
+		}
+		else if( rpt_rv == RPT_CACHE_ATTACHED ) {
+			DIAG( DIAG_INFO, "Report request joined sequence in progress" );
 		}
 		break;
-	case CLIENT_REQ_EXIT:
-		printf("Client Exit Request received\n");
-		memset( &s_msg, 0, sizeof(s_msg) );
-		s_msg.mtype = SERVER_REQUEST_SUCCESS;
-		strcpy( s_msg.rsp, "exit");
-		if(msg_send_to_client(&s_msg) == -1 ) {
-			perror("msgsnd");
+	case CLIENT_SUBSCRIBE:
+		DIAG( DIAG_INFO, "Client Subscribe %u received, events 0x%X", req.corr_id, req.events );
+		// Events are pushed, which only a socket connection allows
+		if( req.client_id >= 0 ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "needs the socket" );
+		} else if( ev_subscribe( req.client_id, req.corr_id, req.events, req.rate_ms ) == -1 ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "busy" );
+		} else {
+			rsp.events = req.events & PP_EV_ALL;
+			rsp.fields |= PP_F_EVENTS;
+		}
+		req_reply( req.client_id, req.corr_id, &rsp );
+		break;
+	case CLIENT_METRICS:
+		DIAG( DIAG_INFO, "Client Metrics Request %u received", req.corr_id );
+		// Fresh figures without the bus, answered by met_run() once the
+		// archive thread has written them
+		if( met_request( req.client_id, req.corr_id, req.flags, req.timeout_ms ) == -1 ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "busy" );
+			req_reply( req.client_id, req.corr_id, &rsp );
 		}
+		break;
+	case CLIENT_CANCEL:
+		DIAG( DIAG_INFO, "Client Cancel %u received", req.corr_id );
+		if( req_cancel( req.client_id, req.corr_id ) == -1 ) {
+			rsp.status = SERVER_REQUEST_FAILURE;
+			pp_set_text( &rsp, "not pending" );
+		}
+		req_reply( req.client_id, req.corr_id, &rsp );
+		break;
+	case CLIENT_REQ_EXIT:
+		DIAG( DIAG_INFO, "Client Exit Request received" );
+		req_reply( req.client_id, req.corr_id, &rsp );
 		rv = -1;
 		break;
+	default:
+		rsp.status = SERVER_REQUEST_FAILURE;
+		pp_set_text( &rsp, "unknown op %d", req.op );
+		req_reply( req.client_id, req.corr_id, &rsp );
+		break;
 	}
 	return rv;
 }
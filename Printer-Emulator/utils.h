@@ -5,7 +5,9 @@
 
 void DumpHex(const void* data, size_t size, FILE *f_out);
 int serial_port_open(int *serial_port, char *port_name);
+int name_in_use( const char *name );
 int unique_filename( char *base, char *name_out, int name_sz );
+void control_client_gone( int client_id );
 int control_receive_msg( unsigned int *p_control );
 
 // --- Option Bit Fields ---
@@ -24,17 +26,19 @@ typedef enum
 } OPTION_BIT;
 
 // --- Control Bit Fields ---
-// Control bits are set and reset dynamically as the program runs
+// Control bits are set and reset dynamically as the program runs.
+// Report, History and Log mode requests are queued in the bus operation
+// scheduler (sched.h), not here.
 typedef enum
 {
-	MESSAGE_SRC     = 1 << 7,  // Control through message IPC
+	CONTROL7        = 1 << 7,
 	CONTROL6        = 1 << 6,
 	CONTROL5        = 1 << 5,
 	CONTROL4        = 1 << 4,
-	LOGMODE_OFF_REQ = 1 << 3,
-	LOGMODE_ON_REQ  = 1 << 2,
-	HISTORY_REQ     = 1 << 1,
-	REPORT_REQ      = 1 << 0,
+	CONTROL3        = 1 << 3,
+	CONTROL2        = 1 << 2,
+	CONTROL1        = 1 << 1,
+	CONTROL0        = 1 << 0,
 } CONTROL_BIT;
 
 
@@ -14,7 +14,38 @@ make
 cd -
 
 # The Printer Emulator protocol engine runs as a service under systemd
+# (printem, pelog and pedecode link zlib: apt install zlib1g-dev)
 cd ../Printer-Emulator
 make clean
 make
 cd -
+
+# History query tool for the indexed history store
+cd ../PE-History
+make clean
+make
+cd -
+
+# Logmode record stream reader
+cd ../PE-Log
+make clean
+make
+cd -
+
+# Live event reader for the shared memory event ring
+cd ../PE-Events
+make clean
+make
+cd -
+
+# Message format benchmark (development tool, not installed)
+cd ../PE-Bench
+make clean
+make
+cd -
+
+# Offline decoder for captured bus traffic (development tool, not installed)
+cd ../PE-Decode
+make clean
+make
+cd -
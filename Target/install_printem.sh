@@ -33,10 +33,26 @@ make clean
 make
 cd -
 
+# History query tool for the indexed history store
+cd ../PE-History
+make clean
+make
+cd -
+
+# Logmode record stream reader
+cd ../PE-Log
+make clean
+make
+cd -
+
 # Copy the Printer Emulator protocol service to systemd
 run_with_sudo cp ../Printer-Emulator/printem /usr/local/bin
 run_with_sudo cp ./printem.service /etc/systemd/system/
 
+# Install the default configuration, keeping any site changes
+run_with_sudo mkdir -p /etc/lsc
+[ -f "/etc/lsc/printem.conf" ] || run_with_sudo cp ./printem.conf /etc/lsc/
+
 # Reload systemd
 run_with_sudo systemctl daemon-reload
 